@@ -0,0 +1,221 @@
+#include "util.h"
+#include "arena.h"
+
+#ifndef MPOL_PREFERRED
+#define MPOL_PREFERRED 1
+#endif
+
+/* Header before each block, it takes a whole cache line, so that
+ * the block itself is aligned. */
+struct arena_block {
+	/* Link in the free list */
+	struct arena_block *next;
+	/* Usable size of the block */
+	size_t size;
+	/* Node of the arena */
+	uint32_t node;
+} __attribute__((aligned(CACHELINE_SIZE)));
+
+struct arena_region {
+	struct arena_region *next;
+	size_t size;
+	size_t used;
+	bool huge;
+} __attribute__((aligned(CACHELINE_SIZE)));
+
+struct arena {
+	uint8_t lock;
+	struct arena_region *regions;
+	struct arena_block *free_list;
+	struct arena_stats stats;
+} __attribute__((aligned(CACHELINE_SIZE)));
+
+static struct arena arenas[ARENA_NODE_MAX];
+
+static inline void __arena_lock(struct arena *arena)
+{
+	while (__atomic_test_and_set(&arena->lock, __ATOMIC_ACQUIRE))
+		__builtin_ia32_pause();
+}
+
+static inline void __arena_unlock(struct arena *arena)
+{
+	__atomic_clear(&arena->lock, __ATOMIC_RELEASE);
+}
+
+static inline size_t __align(size_t size, size_t align)
+{
+	return (size + align - 1) & ~(align - 1);
+}
+
+/* Get the NUMA node the current thread is running on */
+static unsigned __arena_node(void)
+{
+	unsigned cpu = 0, node = 0;
+
+	if (syscall(SYS_getcpu, &cpu, &node, NULL) < 0)
+		return 0;
+	return node % ARENA_NODE_MAX;
+}
+
+/* Map a new region of at least 'size' bytes for 'node' */
+static struct arena_region *__arena_map(struct arena *arena,
+				unsigned node, size_t size)
+{
+	struct arena_region *region = NULL;
+	unsigned long mask = 1UL << node;
+	bool huge = false;
+	void *ptr = MAP_FAILED;
+
+	size = __align(size, ARENA_REGION_SIZE);
+
+#ifdef PROBE_USE_HUGEPAGE
+	ptr = mmap(NULL, size, PROT_READ | PROT_WRITE,
+					MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+	huge = (ptr != MAP_FAILED);
+#endif
+	if (ptr == MAP_FAILED) {
+		ptr = mmap(NULL, size, PROT_READ | PROT_WRITE,
+						MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+		if (ptr == MAP_FAILED)
+			return NULL;
+#ifdef PROBE_USE_HUGEPAGE
+		/* fall back to transparent huge pages */
+		madvise(ptr, size, MADV_HUGEPAGE);
+#endif
+	}
+
+	/* Prefer the local node. The pages are also first touched by
+	 * the local thread, so it rarely matters if mbind fails. */
+	if (syscall(SYS_mbind, ptr, size, MPOL_PREFERRED, &mask,
+							sizeof(mask) * 8, 0) < 0)
+		arena->stats.nb_unbound++;
+
+	region = (struct arena_region *)ptr;
+	region->size = size;
+	region->used = sizeof(struct arena_region);
+	region->huge = huge;
+	region->next = arena->regions;
+	arena->regions = region;
+
+	arena->stats.nb_region++;
+	arena->stats.mapped += size;
+	if (huge)
+		arena->stats.nb_huge++;
+	return region;
+}
+
+/* Find a released block with enough space (first fit) */
+static struct arena_block *__arena_reuse(struct arena *arena, size_t size)
+{
+	struct arena_block **pprev = &arena->free_list, *block = NULL;
+
+	for (block = arena->free_list; block; block = block->next) {
+		if (block->size >= size) {
+			*pprev = block->next;
+			block->next = NULL;
+			arena->stats.nb_reuse++;
+			return block;
+		}
+		pprev = &block->next;
+	}
+	return NULL;
+}
+
+void *arena_alloc(size_t size)
+{
+	unsigned node = __arena_node();
+	struct arena *arena = &arenas[node];
+	struct arena_region *region = NULL;
+	struct arena_block *block = NULL;
+	size_t total;
+
+	size = __align(size, CACHELINE_SIZE);
+	total = size + sizeof(struct arena_block);
+
+	__arena_lock(arena);
+
+	block = __arena_reuse(arena, size);
+	if (block == NULL) {
+		region = arena->regions;
+		if (region == NULL || region->size - region->used < total) {
+			region = __arena_map(arena, node,
+							total + sizeof(struct arena_region));
+			if (region == NULL) {
+				__arena_unlock(arena);
+				return NULL;
+			}
+		}
+
+		block = (struct arena_block *)((char *)region + region->used);
+		region->used += total;
+		block->size = size;
+		block->node = node;
+		block->next = NULL;
+	}
+
+	arena->stats.nb_alloc++;
+	arena->stats.allocated += block->size + sizeof(struct arena_block);
+	if (arena->stats.allocated > arena->stats.peak)
+		arena->stats.peak = arena->stats.allocated;
+
+	__arena_unlock(arena);
+
+	memset(block + 1, 0, block->size);
+	return block + 1;
+}
+
+void arena_free(void *ptr)
+{
+	struct arena_block *block = NULL;
+	struct arena *arena = NULL;
+
+	if (ptr == NULL)
+		return;
+
+	block = (struct arena_block *)ptr - 1;
+	arena = &arenas[block->node];
+
+	__arena_lock(arena);
+	block->next = arena->free_list;
+	arena->free_list = block;
+	arena->stats.nb_free++;
+	arena->stats.allocated -= block->size + sizeof(struct arena_block);
+	__arena_unlock(arena);
+}
+
+void arena_dump_stats(int pid)
+{
+	struct arena_stats *stats = NULL;
+	unsigned node;
+
+	for (node = 0; node < ARENA_NODE_MAX; node++) {
+		stats = &arenas[node].stats;
+		if (stats->nb_region == 0)
+			continue;
+
+		LOG_INFO(pid, "Arena node %u: %lu regions (%lu huge), "
+						"mapped %lu bytes, allocated %lu bytes, "
+						"peak %lu bytes",
+						node, stats->nb_region, stats->nb_huge,
+						stats->mapped, stats->allocated, stats->peak);
+		LOG_INFO(pid, "Arena node %u: %lu alloc, %lu free, "
+						"%lu reused, %lu unbound",
+						node, stats->nb_alloc, stats->nb_free,
+						stats->nb_reuse, stats->nb_unbound);
+	}
+}
+
+void arena_global_exit(void)
+{
+	struct arena_region *region = NULL, *next = NULL;
+	unsigned node;
+
+	for (node = 0; node < ARENA_NODE_MAX; node++) {
+		for (region = arenas[node].regions; region; region = next) {
+			next = region->next;
+			munmap(region, region->size);
+		}
+		memset(&arenas[node], 0, sizeof(struct arena));
+	}
+}
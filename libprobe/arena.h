@@ -0,0 +1,58 @@
+#ifndef _LIBPROBE_ARENA_H_
+#define _LIBPROBE_ARENA_H_
+
+#include "util.h"
+
+/* Arena allocator for thread-local probe data
+ * Memory is taken from large mmap regions, each region belongs to
+ * one NUMA node and is bound to it. A thread allocates from the
+ * arena of the node it is running on, and every block starts on
+ * a cache line, so the data of different threads never shares a
+ * cache line. Released blocks are kept in the arena and reused by
+ * later threads, the regions are only unmapped at exit.
+ *
+ * With PROBE_USE_HUGEPAGE, regions are backed by huge pages when
+ * possible, to reduce the TLB misses caused by the probe.
+ */
+
+/* Size of one region, a 2MB huge page */
+#define ARENA_REGION_SIZE (2UL << 20)
+#define ARENA_NODE_MAX 16
+
+struct arena_stats {
+	/* Number of mapped regions */
+	uint64_t nb_region;
+	/* Number of regions backed by huge pages */
+	uint64_t nb_huge;
+	/* Bytes mapped by regions */
+	uint64_t mapped;
+	/* Bytes currently allocated (headers included) */
+	uint64_t allocated;
+	/* Peak of 'allocated' */
+	uint64_t peak;
+	/* Number of allocations and releases */
+	uint64_t nb_alloc;
+	uint64_t nb_free;
+	/* Number of allocations served by released blocks. The first
+	 * large enough block is reused whole, it is never split. */
+	uint64_t nb_reuse;
+	/* Number of regions whose preferred node could not be set by
+	 * mbind, their pages are placed by the first touch instead */
+	uint64_t nb_unbound;
+};
+
+/* Allocate 'size' bytes of zeroed memory on the local NUMA node.
+ * The returned pointer is aligned to CACHELINE_SIZE.
+ */
+void *arena_alloc(size_t size);
+
+/* Return a block to the arena it is allocated from */
+void arena_free(void *ptr);
+
+/* Print the allocation statistics of all arenas */
+void arena_dump_stats(int pid);
+
+/* Unmap all the regions. No block may be used after it. */
+void arena_global_exit(void);
+
+#endif /* _LIBPROBE_ARENA_H_ */
@@ -0,0 +1,71 @@
+#ifndef _LIBPROBE_DUMP_H_
+#define _LIBPROBE_DUMP_H_
+
+/* Layout of the counter dump of funccnt
+ * The file is named PROBE_DUMP_NAME. It starts with a header and
+ * the function-index table, written at initialization. Then each
+ * thread appends one block when it exits, with a single write on
+ * the O_APPEND descriptor, so blocks of concurrent threads never
+ * interleave. All blocks have the same size, and a reader can mmap
+ * the file and walk the blocks directly. A block is complete if
+ * the file is long enough to hold it.
+ */
+
+#include <stdint.h>
+
+#include "shm.h"
+
+#define PROBE_DUMP_NAME "funcc_%d.dump"
+#define PROBE_DUMP_NAME_MAX 32
+#define PROBE_DUMP_MAGIC 0x53504443U
+#define PROBE_DUMP_BLOCK_MAGIC 0x424c4b53U
+#define PROBE_DUMP_VERSION 1
+
+/* 'tid' of the block of the inline mode, shared by all threads */
+#define PROBE_DUMP_TID_SHARED UINT32_MAX
+
+struct probe_dump_header {
+	uint32_t magic;
+	uint32_t version;
+	/* process ID */
+	int32_t pid;
+	/* Number of counters in each block */
+	uint32_t nb_counter;
+	/* Counters are raw, readers multiply them by 'sample_freq'
+	 * if it's more than 1 */
+	uint32_t sample_freq;
+	uint32_t reserved;
+	/* Offset of the first block, after the function-index table */
+	uint64_t block_offset;
+	/* Size of each block, in bytes */
+	uint64_t block_size;
+	/* Function-index table: function ID of each counter */
+	uint32_t func_ids[];
+};
+
+/* Per-thread block, followed by 'nb_counter' counters */
+struct probe_dump_block {
+	uint32_t magic;
+	/* system thread ID */
+	int32_t pid;
+	/* slot index in the thread registry */
+	uint32_t tid;
+	uint32_t nb_counter;
+	struct funcc_counter counters[];
+};
+
+static inline uint64_t probe_dump_block_offset(uint32_t nb_counter)
+{
+	uint64_t size = sizeof(struct probe_dump_header)
+			+ (uint64_t)nb_counter * sizeof(uint32_t);
+
+	return (size + 7) & ~7UL;
+}
+
+static inline uint64_t probe_dump_block_size(uint32_t nb_counter)
+{
+	return sizeof(struct probe_dump_block)
+			+ (uint64_t)nb_counter * sizeof(struct funcc_counter);
+}
+
+#endif /* _LIBPROBE_DUMP_H_ */
@@ -1,129 +1,864 @@
+#include <fcntl.h>
+#include <pthread.h>
+#include <sys/uio.h>
+#include <sched.h>
+
 #include "thread.h"
 #include "funccnt.h"
 #include "util.h"
+#include "arena.h"
+#include "hist.h"
+#include "dump.h"
+#include "funcid.h"
+#include "probe.h"
+#include "prof.h"
 
 static struct range idx_range = {
 	.min = 0,
-	.max = UINT16_MAX,
+	.max = UINT32_MAX,
 };
 
 #define FUNC_IDX(x) ((x)-idx_range.min)
 
-void funcc_count_pre(unsigned int func)
+/* Global ID of each counter, NULL if there is no ID table */
+static uint32_t *func_ids = NULL;
+
+static inline uint32_t __funcc_gid(unsigned idx)
 {
-	struct thread_info *thread = probe_get_thread();
+	return func_ids ? func_ids[idx] : idx + idx_range.min;
+}
+
+/* Shared-memory segment, NULL if it is not used */
+static struct probe_shm_header *shm_hdr = NULL;
+static char shm_name[PROBE_SHM_NAME_MAX] = {'\0'};
+
+/* Counter dump, -1 if it is not opened */
+static int dump_fd = -1;
+
+/* The seqlock of a block. Between them, the counters of the block
+ * may be inconsistent. No syscall and no locked instruction is
+ * needed, as a block is only written by its owner. */
+static inline void __funcc_write_begin(struct funcc_thread *info)
+{
+	__atomic_store_n(&info->seq, info->seq + 1, __ATOMIC_RELAXED);
+	__atomic_thread_fence(__ATOMIC_RELEASE);
+}
+
+static inline void __funcc_write_end(struct funcc_thread *info)
+{
+	__atomic_store_n(&info->seq, info->seq + 1, __ATOMIC_RELEASE);
+}
+
+/* Sampling (PROBE_MODE_SAMPLE)
+ * With a sample frequency N > 1, only one call in N of each function
+ * is counted. Each thread counts the calls of a function down, and
+ * pushes whether a call is sampled on a bit stack, which the exit of
+ * the call pops. So the exit is counted if and only if the entry was,
+ * whatever the other functions called between them. The counters are
+ * multiplied by N in reports.
+ */
+static uint32_t sample_freq = 0;
+
+/* Latency mode (PROBE_MODE_TIME)
+ * The entry of a call pushes a TSC timestamp on a per-thread shadow
+ * stack, and its exit records the elapsed cycles into the histogram
+ * of the function. Histograms are allocated on the first call of
+ * the function in each thread, merged into 'lat_merged' when the
+ * thread exits, and reported in nanoseconds at exit.
+ */
+/* Whether the threads allocate the shadow stack and histograms */
+static bool latency_mode = false;
+/* TSC cycles per nanosecond */
+static double tsc_per_ns = 1.0;
+/* Per-function histograms merged from the exited threads */
+static struct probe_hist **lat_merged = NULL;
+static pthread_mutex_t lat_lock = PTHREAD_MUTEX_INITIALIZER;
+
+struct funcc_frame {
+	uint64_t tsc;
+	uint32_t func;
+};
+
+/* Private per-thread data */
+struct funcc_local {
+	/* counters, may be in the shared-memory segment */
+	struct funcc_thread *block;
+	/* depth of the call stack, and whether each call is sampled */
+	uint32_t depth;
+	uint64_t sampled[FUNCC_SAMPLE_STACK_MAX / 64];
+	/* latency mode: shadow stack, and timed calls beyond it */
+	struct funcc_frame *frames;
+	uint32_t lat_depth;
+	uint32_t lat_overflow;
+	/* latency mode: per-function histograms */
+	struct probe_hist **hists;
+	/* per-function calls to skip before the next sampled one */
+	uint32_t countdown[];
+};
+
+/* Decide if this entry of 'idx' is sampled, and push the decision */
+static inline bool __funcc_sample_push(struct funcc_local *local,
+				unsigned idx)
+{
+	uint32_t depth = local->depth++;
+	bool sampled = false;
+
+	if (local->countdown[idx] == 0) {
+		local->countdown[idx] = sample_freq - 1;
+		sampled = true;
+	} else
+		local->countdown[idx]--;
+
+	/* too deep calls are never sampled */
+	if (depth >= FUNCC_SAMPLE_STACK_MAX)
+		return false;
+	if (sampled)
+		local->sampled[depth / 64] |= (1UL << (depth % 64));
+	else
+		local->sampled[depth / 64] &= ~(1UL << (depth % 64));
+	return sampled;
+}
+
+/* Pop the decision of the matching entry */
+static inline bool __funcc_sample_pop(struct funcc_local *local)
+{
+	uint32_t depth;
+
+	/* exit without entry, e.g. the function was running when
+	 * the process was instrumented */
+	if (local->depth == 0)
+		return false;
+
+	depth = --local->depth;
+	if (depth >= FUNCC_SAMPLE_STACK_MAX)
+		return false;
+	return (local->sampled[depth / 64] >> (depth % 64)) & 1;
+}
+
+/* Push the entry of 'idx', the timestamp is taken at last to
+ * exclude the probe itself */
+static inline void __funcc_latency_push(struct funcc_local *local,
+				unsigned idx)
+{
+	struct funcc_frame *frame = NULL;
+
+	if (local->lat_depth >= FUNCC_LATENCY_STACK_MAX) {
+		local->lat_overflow++;
+		return;
+	}
+
+	frame = &local->frames[local->lat_depth++];
+	frame->func = idx;
+	frame->tsc = rdtsc();
+}
+
+/* Pop the entry of 'idx', and record the latency of the call.
+ * Frames above it are the calls whose exits are skipped, e.g. by
+ * longjmp() or exceptions, they are dropped. */
+static inline void __funcc_latency_pop(struct funcc_local *local,
+				unsigned idx, uint64_t now)
+{
+	struct funcc_frame *frame = NULL;
+	struct probe_hist *hist = NULL;
+
+	if (local->lat_overflow) {
+		local->lat_overflow--;
+		return;
+	}
+
+	while (local->lat_depth > 0) {
+		frame = &local->frames[--local->lat_depth];
+		if (frame->func != idx)
+			continue;
+
+		hist = local->hists[idx];
+		if (unlikely(hist == NULL)) {
+			hist = (struct probe_hist *)arena_alloc(
+							sizeof(struct probe_hist));
+			if (!hist)
+				return;
+			local->hists[idx] = hist;
+		}
+		hist_record(hist, now - frame->tsc);
+		return;
+	}
+}
+
+/* Entry probe of 'mode'
+ * It is always inlined with a constant 'mode', so that each of the
+ * specialized probes only contains the steps of its mode.
+ */
+static __attribute__((always_inline)) inline void
+__funcc_pre(unsigned int func, const unsigned mode)
+{
+	struct thread_info *thread = NULL;
+	struct funcc_local *local = NULL;
 	struct funcc_thread *info = NULL;
 
-	if (thread->state == PROBE_STATE_UNINIT)
-		probe_thread_init();
-	else if (thread->state != PROBE_STATE_IDLE)
+	/* libprofile keeps its own per-thread state */
+	if (!(mode & (PROBE_MODE_COUNT | PROBE_MODE_TIME))) {
+		prof_count_pre(func);
 		return;
+	}
+
+	thread = probe_get_thread();
+	if (unlikely(thread->state != PROBE_STATE_IDLE)) {
+		if (thread->state != PROBE_STATE_UNINIT)
+			return;
+		probe_thread_init();
+		if (thread->state != PROBE_STATE_IDLE)
+			return;
+	}
 
 	thread->state = PROBE_STATE_RUNNING;
-	info = (struct funcc_thread *)thread->data;
-	info->counters[FUNC_IDX(func)].pre_count++;
+	local = (struct funcc_local *)thread->data;
+	if ((mode & PROBE_MODE_SAMPLE) &&
+			!__funcc_sample_push(local, FUNC_IDX(func)))
+		goto out;
+
+	if (mode & PROBE_MODE_COUNT) {
+		info = local->block;
+		__funcc_write_begin(info);
+		info->counters[FUNC_IDX(func)].pre_count++;
+		__funcc_write_end(info);
+	}
+
+	if (mode & PROBE_MODE_PMU)
+		prof_count_pre(func);
+
+	if (mode & PROBE_MODE_TIME)
+		__funcc_latency_push(local, FUNC_IDX(func));
+out:
 	thread->state = PROBE_STATE_IDLE;
 }
 
-void funcc_count_post(unsigned int func)
+/* Exit probe of 'mode', the steps are in the reverse order */
+static __attribute__((always_inline)) inline void
+__funcc_post(unsigned int func, const unsigned mode)
 {
-	struct thread_info *thread = probe_get_thread();
+	/* the timestamp is taken at first to exclude the probe itself */
+	uint64_t now = ((mode & PROBE_MODE_TIME) ? rdtsc() : 0);
+	struct thread_info *thread = NULL;
+	struct funcc_local *local = NULL;
 	struct funcc_thread *info = NULL;
 
-	if (thread->state == PROBE_STATE_UNINIT)
-		probe_thread_init();
-	else if (thread->state != PROBE_STATE_IDLE)
+	if (!(mode & (PROBE_MODE_COUNT | PROBE_MODE_TIME))) {
+		prof_count_post(func);
 		return;
+	}
+
+	thread = probe_get_thread();
+	if (unlikely(thread->state != PROBE_STATE_IDLE)) {
+		if (thread->state != PROBE_STATE_UNINIT)
+			return;
+		probe_thread_init();
+		if (thread->state != PROBE_STATE_IDLE)
+			return;
+	}
 
 	thread->state = PROBE_STATE_RUNNING;
-	info = (struct funcc_thread *)thread->data;
-	info->counters[FUNC_IDX(func)].post_count++;
+	local = (struct funcc_local *)thread->data;
+	if ((mode & PROBE_MODE_SAMPLE) && !__funcc_sample_pop(local))
+		goto out;
+
+	if (mode & PROBE_MODE_PMU)
+		prof_count_post(func);
+
+	if (mode & PROBE_MODE_COUNT) {
+		info = local->block;
+		__funcc_write_begin(info);
+		info->counters[FUNC_IDX(func)].post_count++;
+		__funcc_write_end(info);
+	}
+
+	if (mode & PROBE_MODE_TIME)
+		__funcc_latency_pop(local, FUNC_IDX(func), now);
+out:
 	thread->state = PROBE_STATE_IDLE;
 }
 
-/* Initialize the funcc-specified thread-local data */
-void funcc_data_init(void)
+#define FUNCC_DEFINE(sfx, mode) \
+void probe_pre_##sfx(unsigned int func) \
+{ \
+	__funcc_pre(func, mode); \
+} \
+void probe_post_##sfx(unsigned int func) \
+{ \
+	__funcc_post(func, mode); \
+}
+PROBE_MODE_LIST(FUNCC_DEFINE)
+
+static inline unsigned __funcc_block_size(void)
 {
-	struct global_ctl *ctl = &global_ctl;
-	struct thread_info *thread = probe_get_thread();
-	struct funcc_thread *data = NULL;
-	unsigned size = 0, nb_counter = 0;
+	return sizeof(struct funcc_thread)
+			+ (idx_range.max - idx_range.min + 1)
+				* sizeof(struct funcc_counter);
+}
 
+/* Check whether 'data' is a block of the shared-memory segment */
+static inline bool __funcc_in_shm(struct funcc_thread *data)
+{
+	return shm_hdr && (char *)data > (char *)shm_hdr
+			&& (char *)data < (char *)shm_hdr + shm_hdr->size;
+}
 
-	/* Check whether the global configuration is initialized */
-	if (ctl->state != PROBE_STATE_RUNNING)
-		return;
+/* Create the shared-memory segment
+ * Blocks are page-aligned, so that the pages of a block are first
+ * touched, and placed, by the node of its owner thread. The file
+ * is sparse, the blocks never used take no memory.
+ */
+static int __funcc_shm_init(void)
+{
+	struct probe_shm_header *hdr = NULL;
+	struct funcc_thread *retired = NULL;
+	uint32_t i, nb = idx_range.max - idx_range.min + 1;
+	uint64_t block_size, table_offset, retired_offset, offset, size;
+	int fd = -1;
+
+	block_size = (__funcc_block_size() + PAGE_SIZE - 1)
+			& ~((uint64_t)PAGE_SIZE - 1);
+	table_offset = (sizeof(struct probe_shm_header) + 7) & ~7UL;
+	retired_offset = (table_offset + nb * sizeof(uint32_t) + PAGE_SIZE - 1)
+			& ~((uint64_t)PAGE_SIZE - 1);
+	offset = retired_offset + block_size;
+	size = offset + block_size * PROBE_SHM_BLOCK_MAX;
+
+	snprintf(shm_name, PROBE_SHM_NAME_MAX, PROBE_SHM_NAME,
+					global_ctl.pid);
+	fd = shm_open(shm_name, O_RDWR | O_CREAT | O_TRUNC, 0600);
+	if (fd < 0) {
+		LOG_ERROR(global_ctl.pid, "Failed to create shm %s, err %d",
+						shm_name, errno);
+		return -1;
+	}
 
-	/* Check whether this thread is already initialized */
-	if (thread->state != PROBE_STATE_UNINIT)
+	if (ftruncate(fd, size) < 0) {
+		LOG_ERROR(global_ctl.pid, "Failed to resize shm %s, err %d",
+						shm_name, errno);
+		goto fail_unlink;
+	}
+
+	hdr = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+	if (hdr == MAP_FAILED) {
+		LOG_ERROR(global_ctl.pid, "Failed to mmap shm %s, err %d",
+						shm_name, errno);
+		goto fail_unlink;
+	}
+	close(fd);
+
+	hdr->version = PROBE_SHM_VERSION;
+	hdr->pid = global_ctl.pid;
+	hdr->nb_counter = nb;
+	hdr->table_offset = table_offset;
+	for (i = 0; i < nb; i++)
+		probe_shm_table(hdr)[i] = __funcc_gid(i);
+	hdr->block_size = block_size;
+	hdr->nb_block_max = PROBE_SHM_BLOCK_MAX;
+	hdr->nb_block = 0;
+	hdr->block_offset = offset;
+	hdr->size = size;
+	hdr->sample_freq = sample_freq;
+	hdr->retired_lock = 0;
+	hdr->retired_offset = retired_offset;
+	hdr->nb_private = 0;
+	/* the retired block is never free */
+	retired = probe_shm_retired(hdr);
+	retired->pid = global_ctl.pid;
+	retired->tid = PROBE_TID_INVALID;
+	/* the magic number tells readers the header is complete */
+	__atomic_store_n(&hdr->magic, PROBE_SHM_MAGIC, __ATOMIC_RELEASE);
+
+	shm_hdr = hdr;
+	LOG_INFO(global_ctl.pid, "Create shm %s, %lu bytes",
+					shm_name, (unsigned long)size);
+	return 0;
+
+fail_unlink:
+	close(fd);
+	shm_unlink(shm_name);
+	shm_name[0] = '\0';
+	return -1;
+}
+
+static void __funcc_shm_exit(void)
+{
+	if (!shm_hdr)
 		return;
 
+	munmap(shm_hdr, shm_hdr->size);
+	shm_hdr = NULL;
+	shm_unlink(shm_name);
+	LOG_INFO(global_ctl.pid, "Remove shm %s", shm_name);
+}
+
+/* Add the counters of the exiting thread to the retired block, and
+ * free its block, or count it out of the private threads, see shm.h */
+static void __funcc_shm_retire(struct funcc_thread *data)
+{
+	struct funcc_thread *retired = probe_shm_retired(shm_hdr);
+	uint32_t i;
+
+	while (__atomic_exchange_n(&shm_hdr->retired_lock, 1,
+							__ATOMIC_ACQUIRE))
+		sched_yield();
+
+	__funcc_write_begin(retired);
+	for (i = 0; i < shm_hdr->nb_counter; i++) {
+		retired->counters[i].pre_count += data->counters[i].pre_count;
+		retired->counters[i].post_count += data->counters[i].post_count;
+	}
+	if (__funcc_in_shm(data))
+		__atomic_store_n(&data->pid, 0, __ATOMIC_RELEASE);
+	else
+		__atomic_store_n(&shm_hdr->nb_private, shm_hdr->nb_private - 1,
+						__ATOMIC_RELAXED);
+	__funcc_write_end(retired);
+
+	__atomic_store_n(&shm_hdr->retired_lock, 0, __ATOMIC_RELEASE);
+}
+
+/* Count the current thread, without block, in the private ones */
+static void __funcc_shm_private(struct thread_info *thread)
+{
+	struct funcc_thread *retired = probe_shm_retired(shm_hdr);
+
+	while (__atomic_exchange_n(&shm_hdr->retired_lock, 1,
+							__ATOMIC_ACQUIRE))
+		sched_yield();
+
+	__funcc_write_begin(retired);
+	__atomic_store_n(&shm_hdr->nb_private, shm_hdr->nb_private + 1,
+					__ATOMIC_RELAXED);
+	__funcc_write_end(retired);
+
+	__atomic_store_n(&shm_hdr->retired_lock, 0, __ATOMIC_RELEASE);
+	LOG_WARN(thread->pid, "No shm block for thread %u, its counters "
+					"are only shared at its exit", thread->tid);
+}
+
+/* Take the block of the current thread from the segment */
+static struct funcc_thread *__funcc_shm_alloc(struct thread_info *thread)
+{
+	struct funcc_thread *data = NULL;
+	uint32_t nb_block;
+
+	if (!shm_hdr || thread->tid >= shm_hdr->nb_block_max)
+		return NULL;
+
+	/* The block may be left by an exited thread. Keep its 'seq',
+	 * so that a concurrent reader notices the reset. */
+	data = probe_shm_block(shm_hdr, thread->tid);
+	__funcc_write_begin(data);
+	memset(data->counters, 0, shm_hdr->block_size
+					- offsetof(struct funcc_thread, counters));
+	data->tid = thread->tid;
+	__atomic_store_n(&data->pid, thread->pid, __ATOMIC_RELAXED);
+	__funcc_write_end(data);
+
+	nb_block = __atomic_load_n(&shm_hdr->nb_block, __ATOMIC_RELAXED);
+	while (nb_block <= thread->tid &&
+			!__atomic_compare_exchange_n(&shm_hdr->nb_block,
+							&nb_block, thread->tid + 1, true,
+							__ATOMIC_RELEASE, __ATOMIC_RELAXED))
+		;
+	return data;
+}
+
+/* Initialize the funcc-specified thread-local data
+ * It is called by 'probe_thread_init()', which already checked the
+ * global and per-thread states.
+ */
+void *funcc_data_init(void)
+{
+	struct thread_info *thread = probe_get_thread();
+	struct funcc_local *local = NULL;
+	unsigned nb = idx_range.max - idx_range.min + 1;
+	unsigned size = 0;
+
 	/* Check if the global configuration is valid */
-	if (idx_range.max == UINT16_MAX)
+	if (idx_range.max == UINT32_MAX)
+		return NULL;
+
+	local = (struct funcc_local *)arena_alloc(sizeof(struct funcc_local)
+					+ (sample_freq > 1 ? nb * sizeof(uint32_t) : 0));
+	if (!local) {
+		LOG_ERROR(thread->pid,
+				"Failed to allocate memory for thread data\n");
+		return NULL;
+	}
+
+	if (latency_mode) {
+		local->frames = (struct funcc_frame *)arena_alloc(
+				FUNCC_LATENCY_STACK_MAX * sizeof(struct funcc_frame));
+		local->hists = (struct probe_hist **)arena_alloc(
+				nb * sizeof(struct probe_hist *));
+		if (!local->frames || !local->hists) {
+			LOG_ERROR(thread->pid,
+					"Failed to allocate memory for latency\n");
+			goto fail_free;
+		}
+	}
+
+	size = __funcc_block_size();
+
+	local->block = __funcc_shm_alloc(thread);
+	if (!local->block) {
+		local->block = (struct funcc_thread *)arena_alloc(size);
+		if (!local->block) {
+			LOG_ERROR(thread->pid,
+					"Failed to allocate memory for counters\n");
+			goto fail_free;
+		}
+		if (shm_hdr)
+			__funcc_shm_private(thread);
+	}
+
+	LOG_INFO(thread->pid, "Initialize thread %u, with %u counters%s",
+				   thread->tid, size,
+				   __funcc_in_shm(local->block) ? " (shared)" : "");
+	return local;
+
+fail_free:
+	if (local->frames)
+		arena_free(local->frames);
+	if (local->hists)
+		arena_free(local->hists);
+	arena_free(local);
+	return NULL;
+}
+
+/* Create the dump file, and write its header and the
+ * function-index table */
+static int __funcc_dump_init(void)
+{
+	struct probe_dump_header *hdr = NULL;
+	char name[PROBE_DUMP_NAME_MAX] = {'\0'};
+	uint32_t i, nb = idx_range.max - idx_range.min + 1;
+	uint64_t size = probe_dump_block_offset(nb);
+	ssize_t ret;
+
+	hdr = (struct probe_dump_header *)zalloc(size);
+	if (!hdr) {
+		LOG_ERROR(global_ctl.pid, "Failed to allocate dump header");
+		return -1;
+	}
+
+	hdr->magic = PROBE_DUMP_MAGIC;
+	hdr->version = PROBE_DUMP_VERSION;
+	hdr->pid = global_ctl.pid;
+	hdr->nb_counter = nb;
+	hdr->sample_freq = sample_freq;
+	hdr->block_offset = size;
+	hdr->block_size = probe_dump_block_size(nb);
+	for (i = 0; i < nb; i++)
+		hdr->func_ids[i] = __funcc_gid(i);
+
+	snprintf(name, PROBE_DUMP_NAME_MAX, PROBE_DUMP_NAME, global_ctl.pid);
+	dump_fd = open(name, O_WRONLY | O_CREAT | O_TRUNC | O_APPEND, 0644);
+	if (dump_fd < 0) {
+		LOG_ERROR(global_ctl.pid, "Failed to create dump %s, err %d",
+						name, errno);
+		free(hdr);
+		return -1;
+	}
+
+	ret = write(dump_fd, hdr, size);
+	free(hdr);
+	if (ret != (ssize_t)size) {
+		LOG_ERROR(global_ctl.pid, "Failed to write dump %s, err %d",
+						name, errno);
+		close(dump_fd);
+		dump_fd = -1;
+		return -1;
+	}
+
+	LOG_INFO(global_ctl.pid, "Dump counters into %s", name);
+	return 0;
+}
+
+/* Append the block of a thread with a single write. O_APPEND keeps
+ * the blocks of concurrently exiting threads apart. */
+static void __funcc_dump_block(int pid, uint32_t tid,
+				struct funcc_counter *counters)
+{
+	struct probe_dump_block block = {
+		.magic = PROBE_DUMP_BLOCK_MAGIC,
+		.pid = pid,
+		.tid = tid,
+		.nb_counter = idx_range.max - idx_range.min + 1,
+	};
+	struct iovec iov[2] = {
+		{
+			.iov_base = &block,
+			.iov_len = sizeof(block),
+		},
+		{
+			.iov_base = counters,
+			.iov_len = block.nb_counter * sizeof(struct funcc_counter),
+		},
+	};
+	ssize_t ret;
+
+	if (dump_fd < 0)
 		return;
 
-	nb_counter = idx_range.max - idx_range.min + 1;
-	size = sizeof(struct funcc_thread)
-			+ nb_counter * sizeof(struct funcc_counter);
+	ret = writev(dump_fd, iov, 2);
+	if (ret != (ssize_t)(iov[0].iov_len + iov[1].iov_len))
+		LOG_ERROR(pid, "Failed to dump thread %u, err %d", tid, errno);
+}
 
-	data = (struct funcc_thread *)malloc(size);
-	if (!data) {
-		LOG_ERROR(thread->pid,
-				"Failed to allocate memory for counters\n");
-		thread->state = PROBE_STATE_ERROR;
+static void __funcc_dump_exit(void)
+{
+	if (dump_fd < 0)
 		return;
+
+	close(dump_fd);
+	dump_fd = -1;
+}
+
+/* Load the global IDs of the counters from the ID table. Without
+ * a table, the indices are used as IDs. */
+static int __funcc_load_ids(const char *path)
+{
+	uint32_t nb = idx_range.max - idx_range.min + 1;
+	uint32_t idx, gid, nb_load = 0;
+	char line[FUNCID_LINE_MAX];
+	FILE *file = NULL;
+
+	if (path == NULL || path[0] == '\0')
+		return 0;
+
+	file = fopen(path, "r");
+	if (!file) {
+		LOG_ERROR(global_ctl.pid, "Failed to open ID table %s, err %d",
+						path, errno);
+		return -1;
 	}
 
-	memset(data, 0, size);
+	if (!fgets(line, FUNCID_LINE_MAX, file) ||
+			strncmp(line, FUNCID_TABLE_HEADER,
+					strlen(FUNCID_TABLE_HEADER))) {
+		LOG_ERROR(global_ctl.pid, "Wrong ID table %s", path);
+		goto fail_close;
+	}
 
-	thread->data = data;
-	thread->state = PROBE_STATE_IDLE;
+	func_ids = (uint32_t *)zalloc(nb * sizeof(uint32_t));
+	if (!func_ids) {
+		LOG_ERROR(global_ctl.pid, "Failed to allocate ID table");
+		goto fail_close;
+	}
+	for (idx = 0; idx < nb; idx++)
+		func_ids[idx] = idx + idx_range.min;
+
+	while (fgets(line, FUNCID_LINE_MAX, file)) {
+		if (sscanf(line, "func %u %x", &idx, &gid) != 2)
+			continue;
+		if (idx < idx_range.min || idx > idx_range.max)
+			continue;
+		func_ids[FUNC_IDX(idx)] = gid;
+		nb_load++;
+	}
+	fclose(file);
 
-	LOG_INFO(thread->pid, "Initialize thread %u, with %u counters",
-				   thread->tid, size);
+	LOG_INFO(global_ctl.pid, "Load %u global IDs from %s", nb_load, path);
+	return 0;
+
+fail_close:
+	fclose(file);
+	return -1;
 }
 
-/* This function must be called manually after the global
- * initialization and before the initialization of each thread.
- * It configures the range of the indices of target functions.
- */
-void funcc_init(unsigned min, unsigned max)
+/* Measure the TSC frequency against CLOCK_MONOTONIC_RAW */
+static void __funcc_tsc_calibrate(void)
 {
-	if (global_ctl.state != PROBE_STATE_UNINIT)
+	uint64_t hz = tsc_measure_hz();
+
+	if (hz)
+		tsc_per_ns = hz / 1e9;
+
+	LOG_INFO(global_ctl.pid, "TSC frequency %.3f GHz", tsc_per_ns);
+}
+
+/* Merge the histograms of an exiting thread */
+static void __funcc_latency_merge(struct funcc_local *local)
+{
+	unsigned i, nb = idx_range.max - idx_range.min + 1;
+
+	pthread_mutex_lock(&lat_lock);
+	for (i = 0; i < nb; i++) {
+		if (!local->hists[i])
+			continue;
+
+		if (lat_merged && !lat_merged[i])
+			lat_merged[i] = (struct probe_hist *)arena_alloc(
+							sizeof(struct probe_hist));
+		if (lat_merged && lat_merged[i])
+			hist_merge(lat_merged[i], local->hists[i]);
+		arena_free(local->hists[i]);
+		local->hists[i] = NULL;
+	}
+	pthread_mutex_unlock(&lat_lock);
+}
+
+#define TSC_TO_NS(x) ((unsigned long)((x) / tsc_per_ns))
+
+/* Report the percentiles of the merged histograms */
+static void __funcc_latency_exit(void)
+{
+	unsigned i, nb = idx_range.max - idx_range.min + 1;
+	uint64_t scale = (sample_freq > 1 ? sample_freq : 1);
+	struct probe_hist *hist = NULL;
+
+	if (!lat_merged)
 		return;
 
+	LOG_INFO(global_ctl.pid, "Latency of functions, in ns:");
+	for (i = 0; i < nb; i++) {
+		hist = lat_merged[i];
+		if (!hist)
+			continue;
+
+		LOG_INFO(global_ctl.pid,
+				"func[0x%x]: calls %lu, min %lu, avg %lu, "
+				"p50 %lu, p99 %lu, p999 %lu, max %lu",
+				__funcc_gid(i),
+				(unsigned long)(hist->count * scale),
+				TSC_TO_NS(hist->min),
+				TSC_TO_NS(hist->sum / hist->count),
+				TSC_TO_NS(hist_percentile(hist, 50.0)),
+				TSC_TO_NS(hist_percentile(hist, 99.0)),
+				TSC_TO_NS(hist_percentile(hist, 99.9)),
+				TSC_TO_NS(hist->max));
+		arena_free(hist);
+	}
+
+	arena_free(lat_merged);
+	lat_merged = NULL;
+}
+
+void funcc_global_exit(void)
+{
+	__funcc_latency_exit();
+	__funcc_dump_exit();
+	__funcc_shm_exit();
+	zfree(func_ids);
+}
+
+/* Set up the counting and timing of 'probe_init()'
+ * It configures the range of the indices of target functions, and
+ * the sample frequency. 0 or 1 means that every call is probed.
+ * The thread hooks and the global state are set by the caller.
+ */
+int funcc_setup(unsigned min, unsigned max, unsigned freq, unsigned flags,
+				const char *id_table)
+{
 	idx_range.min = min;
 	idx_range.max = max;
+	sample_freq = freq;
 
-	global_ctl.state = PROBE_STATE_RUNNING;
+	if (__funcc_load_ids(id_table) < 0)
+		LOG_WARN(global_ctl.pid, "Report function indices as IDs");
 
-	LOG_INFO(global_ctl.pid, "Initialize funcc, min %u, max %u",
-					idx_range.min, idx_range.max);
+	/* the timing probes need the histograms, so it fails first */
+	if (flags & FUNCC_FLAG_LATENCY) {
+		lat_merged = (struct probe_hist **)arena_alloc(
+				(max - min + 1) * sizeof(struct probe_hist *));
+		if (!lat_merged) {
+			LOG_ERROR(global_ctl.pid,
+					"Failed to allocate latency histograms");
+			zfree(func_ids);
+			idx_range.max = UINT32_MAX;
+			return -1;
+		}
+		__funcc_tsc_calibrate();
+		latency_mode = true;
+	}
+
+	if ((flags & FUNCC_FLAG_SHM) && __funcc_shm_init() < 0)
+		LOG_WARN(global_ctl.pid,
+				"Live snapshots are disabled");
 
-	probe_thread_init();
+	if (__funcc_dump_init() < 0)
+		LOG_WARN(global_ctl.pid, "Counters are not dumped");
+
+	LOG_INFO(global_ctl.pid, "Initialize funcc, min %u, max %u, freq %u",
+					idx_range.min, idx_range.max, sample_freq);
+	return 0;
 }
 
-static void dump_counters(int pid, struct funcc_counter *cnt)
+/* Counters of the inline mode, NULL if it is not used */
+static struct funcc_counter *inline_counters = NULL;
+
+static void __funcc_inline_exit(void)
 {
-	unsigned int i = 0, len = idx_range.max - idx_range.min + 1;
+	if (!inline_counters)
+		return;
+
+	LOG_INFO(global_ctl.pid, "Dump inline counters");
+	__funcc_dump_block(global_ctl.pid, PROBE_DUMP_TID_SHARED,
+					inline_counters);
+	__funcc_dump_exit();
+	inline_counters = NULL;
+	zfree(func_ids);
+}
+
+void funcc_inline_init(struct funcc_counter *counters,
+				unsigned min, unsigned max, const char *id_table)
+{
+	if (global_ctl.state != PROBE_STATE_UNINIT)
+		return;
 
-	for (i = 0; i < len; i++) {
-		LOG_INFO(pid, "func[%u]: pre %lu, post %lu",
-						i + idx_range.min,
-						cnt->pre_count, cnt->post_count);
+	if (counters == NULL || min > max || max == UINT32_MAX) {
+		LOG_ERROR(global_ctl.pid, "Wrong inline counters %p [%u-%u]",
+						counters, min, max);
+		return;
 	}
+
+	idx_range.min = min;
+	idx_range.max = max;
+	/* the snippets count every call, and are not timed */
+	sample_freq = 0;
+	latency_mode = false;
+	inline_counters = counters;
+
+	if (__funcc_load_ids(id_table) < 0)
+		LOG_WARN(global_ctl.pid, "Report function indices as IDs");
+
+	if (__funcc_dump_init() < 0)
+		LOG_WARN(global_ctl.pid, "Counters are not dumped");
+
+	/* no thread-local data */
+	global_ctl.thread_data_init = NULL;
+	global_ctl.thread_data_free = NULL;
+	global_ctl.global_exit = __funcc_inline_exit;
+
+	global_ctl.state = PROBE_STATE_RUNNING;
+
+	LOG_INFO(global_ctl.pid, "Initialize inline funcc, min %u, max %u",
+					idx_range.min, idx_range.max);
 }
 
-void funcc_data_free(void)
+void funcc_data_free(struct thread_info *thread)
 {
-	struct thread_info *thread = probe_get_thread();
-	struct funcc_thread *data =
-			(struct funcc_thread *)thread->data;
+	struct funcc_local *local =
+			(struct funcc_local *)thread->data;
+	struct funcc_thread *data = NULL;
 
 	LOG_INFO(thread->pid, "Release thread-local data");
-	if (data) {
-		dump_counters(thread->pid, data->counters);
-		free(data);
+	if (local) {
+		data = local->block;
+		__funcc_dump_block(thread->pid, thread->tid, data->counters);
+		if (shm_hdr)
+			__funcc_shm_retire(data);
+		if (!__funcc_in_shm(data))
+			arena_free(data);
+		if (local->hists) {
+			__funcc_latency_merge(local);
+			arena_free(local->hists);
+		}
+		if (local->frames)
+			arena_free(local->frames);
+		arena_free(local);
 		thread->data = NULL;
 	}
 }
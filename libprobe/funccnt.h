@@ -2,22 +2,43 @@
 #define __LIBPROBE_FUNCC_H__
 
 #include "util.h"
+/* struct funcc_counter and struct funcc_thread */
+#include "shm.h"
 
-struct funcc_counter {
-	uint64_t pre_count;
-	uint64_t post_count;
+/* Flags of funcc_setup() */
+enum {
+	/* Place the counters in a shared-memory segment */
+	FUNCC_FLAG_SHM = 1U << 0,
+	/* Record the latency of each call into per-function histograms,
+	 * and report their percentiles at exit. */
+	FUNCC_FLAG_LATENCY = 1U << 1,
 };
 
-struct funcc_thread {
-	unsigned state;
-	struct funcc_counter counters[];
-};
+/* Max depth of sampled calls. Deeper calls are never sampled. */
+#define FUNCC_SAMPLE_STACK_MAX 256
+/* Max depth of timed calls in the latency mode */
+#define FUNCC_LATENCY_STACK_MAX 256
+
+/* Set up the counting and timing modes for 'probe_init()'.
+ * 'id_table' is the path of the ID table written by the tool, which
+ * maps the function indices to global IDs (see funcid.h). If it is
+ * empty, the indices are reported as IDs. */
+int funcc_setup(unsigned min, unsigned max, unsigned freq,
+				unsigned flags, const char *id_table);
+void funcc_global_exit(void);
+
+/* Initialization of the inline mode
+ * In the inline mode, the instrumentation tool increases the
+ * counters with snippets directly. 'counters' is the array it
+ * allocates in the mutatee, with the layout of funcc_counter. The
+ * library only dumps it at exit.
+ */
+LIB_EXPORT void funcc_inline_init(struct funcc_counter *counters,
+				unsigned min, unsigned max, const char *id_table);
 
-LIB_EXPORT void funcc_count_pre(unsigned int func);
-LIB_EXPORT void funcc_count_post(unsigned int func);
-LIB_EXPORT void funcc_init(unsigned min, unsigned max);
+struct thread_info;
 
-void funcc_data_free(void);
-void funcc_data_init(void);
+void funcc_data_free(struct thread_info *thread);
+void *funcc_data_init(void);
 
 #endif // __LIBPROBE_FUNCC_H__
@@ -0,0 +1,48 @@
+#ifndef _LIBPROBE_FUNCID_H_
+#define _LIBPROBE_FUNCID_H_
+
+/* Global function IDs
+ * A global ID identifies a function among all instrumented objects
+ * (the executable and its shared libraries). It packs the object ID,
+ * given by the instrumentation tool, and the local ID of the
+ * function in the function map of its object.
+ *
+ * The probes are not called with global IDs. The tool gives each
+ * instrumented function a dense index from 0, so the per-thread
+ * counters only cover the instrumented functions. The ID table maps
+ * the indices back to global IDs and names. It is a text file named
+ * '<instrumented ELF>' FUNCID_TABLE_SUFFIX:
+ *
+ *   # stubprofile function IDs v1
+ *   object <object ID> <path>
+ *   ...
+ *   func <index> <global ID, hex> <name>
+ *   ...
+ *   range <index> <start, hex> <end, hex>
+ *   ...
+ *
+ * The paths and names take the rest of the line, they may contain
+ * spaces, e.g. demangled C++ names. The optional ranges are the
+ * link-time addresses of the functions in their object, used by the
+ * sampler of libprofile.
+ */
+
+#include <stdint.h>
+
+#define FUNCID_OBJ_SHIFT 20
+#define FUNCID_LOCAL_MASK ((1U << FUNCID_OBJ_SHIFT) - 1)
+/* Max number of objects, and of functions in each object */
+#define FUNCID_OBJ_MAX (1U << (32 - FUNCID_OBJ_SHIFT))
+#define FUNCID_LOCAL_MAX (1U << FUNCID_OBJ_SHIFT)
+
+#define FUNCID_MAKE(obj, local) \
+		(((uint32_t)(obj) << FUNCID_OBJ_SHIFT) | ((local) & FUNCID_LOCAL_MASK))
+#define FUNCID_OBJ(id) ((uint32_t)(id) >> FUNCID_OBJ_SHIFT)
+#define FUNCID_LOCAL(id) ((uint32_t)(id) & FUNCID_LOCAL_MASK)
+
+#define FUNCID_TABLE_SUFFIX ".funcid"
+#define FUNCID_TABLE_HEADER "# stubprofile function IDs v1"
+/* Max length of a line of the ID table */
+#define FUNCID_LINE_MAX 4096
+
+#endif /* _LIBPROBE_FUNCID_H_ */
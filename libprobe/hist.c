@@ -0,0 +1,66 @@
+#include "hist.h"
+
+/* Highest value of bucket 'idx' */
+static uint64_t __hist_bucket_high(unsigned idx)
+{
+	unsigned shift;
+	uint64_t mantissa;
+
+	if (idx < HIST_SUB_COUNT)
+		return idx;
+
+	idx -= HIST_SUB_COUNT;
+	shift = idx / HIST_SUB_HALF + 1;
+	mantissa = idx % HIST_SUB_HALF + HIST_SUB_HALF;
+	return ((mantissa + 1) << shift) - 1;
+}
+
+void hist_merge(struct probe_hist *dst, const struct probe_hist *src)
+{
+	unsigned i;
+
+	if (src->count == 0)
+		return;
+
+	if (dst->count == 0 || src->min < dst->min)
+		dst->min = src->min;
+	if (src->max > dst->max)
+		dst->max = src->max;
+	dst->count += src->count;
+	dst->sum += src->sum;
+
+	for (i = 0; i < HIST_NB_BUCKET; i++)
+		dst->buckets[i] += src->buckets[i];
+}
+
+uint64_t hist_percentile(const struct probe_hist *h, double percentile)
+{
+	uint64_t target, total = 0, value;
+	unsigned i;
+
+	if (h->count == 0)
+		return 0;
+
+	/* rank of the value, from 1 */
+	target = (uint64_t)(percentile / 100.0 * h->count + 0.5);
+	if (target < 1)
+		target = 1;
+	if (target > h->count)
+		target = h->count;
+
+	for (i = 0; i < HIST_NB_BUCKET; i++) {
+		total += h->buckets[i];
+		if (total >= target)
+			break;
+	}
+
+	if (i >= HIST_NB_BUCKET - 1)
+		return h->max;
+
+	value = __hist_bucket_high(i);
+	if (value < h->min)
+		value = h->min;
+	if (value > h->max)
+		value = h->max;
+	return value;
+}
@@ -0,0 +1,62 @@
+#ifndef _LIBPROBE_HIST_H_
+#define _LIBPROBE_HIST_H_
+
+#include "util.h"
+
+/* Log-linear histogram with fixed memory, as HdrHistogram
+ * Values below HIST_SUB_COUNT have their own bucket. Above, each
+ * power of two is split into HIST_SUB_COUNT/2 linear buckets, so
+ * the relative error of a bucket is at most 2/HIST_SUB_COUNT. Values
+ * from 2^HIST_MAX_BITS fall into the last bucket, and are only
+ * accounted by 'max'.
+ */
+#define HIST_SUB_BITS 5
+#define HIST_SUB_COUNT (1U << HIST_SUB_BITS)
+#define HIST_SUB_HALF (HIST_SUB_COUNT / 2)
+#define HIST_MAX_BITS 44
+#define HIST_NB_BUCKET \
+		(HIST_SUB_COUNT + (HIST_MAX_BITS - HIST_SUB_BITS) * HIST_SUB_HALF)
+
+struct probe_hist {
+	uint64_t count;
+	uint64_t min;
+	uint64_t max;
+	uint64_t sum;
+	uint64_t buckets[HIST_NB_BUCKET];
+};
+
+static inline unsigned hist_bucket(uint64_t value)
+{
+	unsigned shift;
+
+	if (value < HIST_SUB_COUNT)
+		return value;
+	if (value >> HIST_MAX_BITS)
+		return HIST_NB_BUCKET - 1;
+
+	/* keep the HIST_SUB_BITS most significant bits */
+	shift = 63 - __builtin_clzll(value) - (HIST_SUB_BITS - 1);
+	return HIST_SUB_COUNT + (shift - 1) * HIST_SUB_HALF
+			+ (value >> shift) - HIST_SUB_HALF;
+}
+
+/* Record a value. A zeroed histogram is empty. */
+static inline void hist_record(struct probe_hist *h, uint64_t value)
+{
+	if (h->count == 0 || value < h->min)
+		h->min = value;
+	if (value > h->max)
+		h->max = value;
+	h->count++;
+	h->sum += value;
+	h->buckets[hist_bucket(value)]++;
+}
+
+/* Add 'src' into 'dst' */
+void hist_merge(struct probe_hist *dst, const struct probe_hist *src);
+
+/* Get the value at 'percentile' (0-100), it is the highest value
+ * of the bucket, bounded by 'min' and 'max'. */
+uint64_t hist_percentile(const struct probe_hist *h, double percentile);
+
+#endif /* _LIBPROBE_HIST_H_ */
@@ -0,0 +1,43 @@
+#include "log.h"
+
+/* Format a timestamp, once per second */
+static const char *__log_time(time_t sec)
+{
+	static time_t last = 0;
+	static char time_str[16] = {'\0'};
+	struct tm tm;
+
+	if (sec != last || time_str[0] == '\0') {
+		last = sec;
+		localtime_r(&last, &tm);
+		strftime(time_str, 16, "%D %R", &tm);
+	}
+	return time_str;
+}
+
+static void __log_write(const struct prof_log_record *rec)
+{
+	probe_log_write(__log_time(rec->ts.tv_sec), rec->pid, rec->level,
+					rec->msg);
+}
+
+static struct prof_logger logger = {
+	.write = __log_write,
+	.flush = probe_log_flush,
+	.warn_level = PROBE_LOG_WARN,
+};
+
+int probe_log_start(void)
+{
+	return prof_logger_start(&logger);
+}
+
+void probe_log_stop(void)
+{
+	prof_logger_stop(&logger);
+}
+
+bool probe_log_push(int pid, uint8_t level, const char *format, va_list va)
+{
+	return prof_logger_push(&logger, pid, level, format, va);
+}
@@ -0,0 +1,33 @@
+#ifndef _LIBPROBE_LOG_H_
+#define _LIBPROBE_LOG_H_
+
+#include <stdarg.h>
+
+#include "util.h"
+/* the rings and the flusher are shared with libprofile */
+#include "../libprofile/logring.h"
+
+/* Asynchronous logging of 'probe_log()', see logring.h
+ * The records keep a coarse timestamp, the flusher formats it and
+ * writes them to the log file.
+ * Before 'probe_log_start()' and after 'probe_log_stop()', and in the
+ * child of a fork, logs are written synchronously.
+ */
+
+/* Max length of a message, longer ones are truncated */
+#define PROBE_LOG_MSG_MAX PROF_LOG_MSG_MAX
+
+/* Start the flusher. Return 0 on success. */
+int probe_log_start(void);
+/* Drain all rings and stop the flusher */
+void probe_log_stop(void);
+/* Push a record into the ring of the current thread. Return false
+ * if the logger is not running, then the caller writes it. */
+bool probe_log_push(int pid, uint8_t level, const char *format, va_list va);
+
+/* Write a log line to the log file, or stdout/stderr */
+void probe_log_write(const char *time_str, int pid,
+				uint8_t level, const char *msg);
+void probe_log_flush(void);
+
+#endif /* _LIBPROBE_LOG_H_ */
@@ -0,0 +1,88 @@
+#ifndef _LIBPROBE_MODE_H_
+#define _LIBPROBE_MODE_H_
+
+/* Probe modes
+ * Counting, PMU reads and timing can be enabled together. For each
+ * combination, libprobe exports a specialized pair of entry/exit
+ * functions, named by PROBE_PRE_PREFIX/PROBE_POST_PREFIX and the
+ * suffix of the mode, e.g. 'probe_pre_ct' for counting and timing.
+ * The instrumentation tool calls them directly, so the probe never
+ * checks the mode per call. 'probe_pre'/'probe_post' dispatch to
+ * the same functions through the table chosen by 'probe_init()'.
+ */
+
+enum {
+	/* Count entries and exits */
+	PROBE_MODE_COUNT = 1U << 0,
+	/* Read the PMU events of libprofile */
+	PROBE_MODE_PMU = 1U << 1,
+	/* Record latency histograms */
+	PROBE_MODE_TIME = 1U << 2,
+	/* Only probe one call in N. It is set from the sample
+	 * frequency by 'probe_mode_sampled()', not by the tool. */
+	PROBE_MODE_SAMPLE = 1U << 3,
+	PROBE_MODE_MASK = (1U << 4) - 1,
+	PROBE_MODE_NUM,
+};
+
+/* Options of 'probe_init()', above the modes */
+enum {
+	/* Place the counters in a shared-memory segment, so that they
+	 * can be read by 'stubprofile snapshot' while running. */
+	PROBE_FLAG_SHM = 1U << 8,
+	/* Write the PMU records of each thread into a segmented mmap
+	 * log, which survives a crash, instead of streaming them */
+	PROBE_FLAG_MMAP = 1U << 9,
+	/* Read the PMU events as one perf group */
+	PROBE_FLAG_GROUP = 1U << 10,
+	/* Aggregate the PMU events per function in the process, and
+	 * only write a table per thread */
+	PROBE_FLAG_AGGR = 1U << 11,
+	/* Sample the process with the first PMU event, instead of
+	 * reading the events in the probes. The sample frequency is
+	 * in Hz, the samples are mapped to the functions by the address
+	 * ranges of the ID table. */
+	PROBE_FLAG_SAMPLING = 1U << 12,
+};
+
+#define PROBE_PRE_PREFIX "probe_pre_"
+#define PROBE_POST_PREFIX "probe_post_"
+#define PROBE_SUFFIX_MAX 8
+
+/* Build the suffix of 'mode', one letter per mode */
+static inline void probe_mode_suffix(unsigned mode, char *buf)
+{
+	int len = 0;
+
+	if (mode & PROBE_MODE_COUNT)
+		buf[len++] = 'c';
+	if (mode & PROBE_MODE_PMU)
+		buf[len++] = 'p';
+	if (mode & PROBE_MODE_TIME)
+		buf[len++] = 't';
+	if (mode & PROBE_MODE_SAMPLE)
+		buf[len++] = 's';
+	buf[len] = '\0';
+}
+
+/* A valid mode probes something. Sampling alone probes nothing. */
+static inline int probe_mode_valid(unsigned mode)
+{
+	return (mode & ~PROBE_MODE_MASK) == 0 &&
+			(mode & (PROBE_MODE_COUNT | PROBE_MODE_PMU | PROBE_MODE_TIME));
+}
+
+/* Mode of the probes of 'probe_init()' with 'freq' and 'flags'.
+ * libprobe samples the calls when it counts or times them, and the
+ * PMU reads follow its decision. With PROBE_FLAG_SAMPLING, 'freq' is
+ * the frequency of the sampler instead. */
+static inline unsigned probe_mode_sampled(unsigned mode, unsigned freq,
+				unsigned flags)
+{
+	if (freq > 1 && (mode & (PROBE_MODE_COUNT | PROBE_MODE_TIME))
+			&& !(flags & PROBE_FLAG_SAMPLING))
+		mode |= PROBE_MODE_SAMPLE;
+	return mode;
+}
+
+#endif /* _LIBPROBE_MODE_H_ */
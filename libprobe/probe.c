@@ -1,16 +1,180 @@
 #include "util.h"
+#include "thread.h"
 #include "probe.h"
+#include "funccnt.h"
+#include "prof.h"
 
-/* Check the corectness of argument 'event list'
- */
-int probe_check_args(const char *evlist)
+static void __probe_nop(unsigned int func __maybe_unused)
 {
+}
+
+struct global_info global_info = {
+	.flags = 0,
+	.idx_range = {
+		.min = 0,
+		.max = UINT32_MAX,
+	},
+	.freq = 0,
+	.ops = {
+		.pre = __probe_nop,
+		.post = __probe_nop,
+	},
+};
+
+/* Dispatch table, indexed by mode. The modes without specialized
+ * probes are NULL. */
+#define PROBE_OPS(sfx, mode) \
+	[mode] = { \
+		.pre = probe_pre_##sfx, \
+		.post = probe_post_##sfx, \
+	},
+static const struct probe_ops probe_ops[PROBE_MODE_NUM] = {
+	PROBE_MODE_LIST(PROBE_OPS)
+};
+
+/* Check the corectness of argument 'event list' */
+int probe_check_evlist(const char *evlist)
+{
+	if (evlist == NULL || evlist[0] == '\0')
+		return -1;
+	return prof_check_evlist(evlist);
+}
 
+static inline bool __probe_use_funcc(unsigned mode)
+{
+	return mode & (PROBE_MODE_COUNT | PROBE_MODE_TIME);
+}
+
+/* PROF_FLAG_* of the PROBE_FLAG_* */
+static inline unsigned __probe_prof_flags(unsigned flags)
+{
+	unsigned prof_flags = 0;
+
+	if (flags & PROBE_FLAG_MMAP)
+		prof_flags |= PROF_FLAG_MMAP;
+	if (flags & PROBE_FLAG_GROUP)
+		prof_flags |= PROF_FLAG_GROUP;
+	if (flags & PROBE_FLAG_AGGR)
+		prof_flags |= PROF_FLAG_AGGR;
+	if (flags & PROBE_FLAG_SAMPLING)
+		prof_flags |= PROF_FLAG_SAMPLING;
+	return prof_flags;
+}
+
+static void __probe_global_exit(void)
+{
+	if (__probe_use_funcc(global_info.flags))
+		funcc_global_exit();
+	if (global_info.flags & PROBE_MODE_PMU)
+		prof_exit();
 }
 
 /* Global configuration */
-void probe_init(const char *evlist, unsigned min, unsigned max,
-				unsigned freq /* Only valid for pmu events */)
+void probe_init(unsigned min, unsigned max, unsigned freq, unsigned flags,
+				const char *evlist, const char *id_table)
+{
+	struct global_info *info = &global_info;
+	unsigned mode = flags & PROBE_MODE_MASK;
+	unsigned funcc_flags = 0, prof_flags, ops_mode;
+	bool sampling = false;
+	char suffix[PROBE_SUFFIX_MAX] = {'\0'};
+
+	if (global_ctl.state != PROBE_STATE_UNINIT)
+		return;
+
+	if (!probe_mode_valid(mode) || (mode & PROBE_MODE_SAMPLE)) {
+		LOG_ERROR(global_ctl.pid, "Wrong probe flags 0x%x", flags);
+		return;
+	}
+
+	if (min > max || max == UINT32_MAX) {
+		LOG_ERROR(global_ctl.pid, "Wrong function range [%u-%u]",
+						min, max);
+		return;
+	}
+
+	/* The sampler of libprofile replaces the PMU reads of the
+	 * probes, and 'freq' is its frequency in Hz */
+	if (flags & PROBE_FLAG_SAMPLING) {
+		if (!(mode & PROBE_MODE_PMU)) {
+			LOG_ERROR(global_ctl.pid, "Sampling without PMU events");
+			return;
+		}
+		sampling = true;
+	}
+
+	/* the tool links the probes of the same mode */
+	mode = probe_mode_sampled(mode, freq, flags);
+
+	if ((mode & PROBE_MODE_PMU) && probe_check_evlist(evlist) < 0) {
+		LOG_ERROR(global_ctl.pid, "Wrong event list %s",
+						evlist ? evlist : "");
+		return;
+	}
+
+	if (__probe_use_funcc(mode)) {
+		if (flags & PROBE_FLAG_SHM)
+			funcc_flags |= FUNCC_FLAG_SHM;
+		if (mode & PROBE_MODE_TIME)
+			funcc_flags |= FUNCC_FLAG_LATENCY;
+		if (funcc_setup(min, max,
+						(mode & PROBE_MODE_SAMPLE) ? freq : 0,
+						funcc_flags, id_table) < 0)
+			return;
+
+		global_ctl.thread_data_init = funcc_data_init;
+		global_ctl.thread_data_free = funcc_data_free;
+	}
+
+	/* With the counters, the entry probe decides the sampled calls
+	 * and only reads the PMU events for those */
+	prof_flags = __probe_prof_flags(flags);
+	if (__probe_use_funcc(mode) && (mode & PROBE_MODE_SAMPLE))
+		prof_flags |= PROF_FLAG_PRESAMPLED;
+
+	if ((mode & PROBE_MODE_PMU) &&
+			prof_init((char *)evlist, "", min, max, freq,
+					prof_flags, id_table) != NULL) {
+		LOG_ERROR(global_ctl.pid, "Failed to init PMU events %s",
+						evlist);
+		if (__probe_use_funcc(mode))
+			funcc_global_exit();
+		global_ctl.thread_data_init = NULL;
+		global_ctl.thread_data_free = NULL;
+		return;
+	}
+
+	info->flags = mode | (flags & ~PROBE_MODE_MASK);
+	info->idx_range.min = min;
+	info->idx_range.max = max;
+	info->freq = freq;
+	/* the probes only count or time while sampling, if at all */
+	ops_mode = sampling ? (mode & ~PROBE_MODE_PMU) : mode;
+	if (ops_mode)
+		info->ops = probe_ops[ops_mode];
+
+	global_ctl.global_exit = __probe_global_exit;
+	global_ctl.state = PROBE_STATE_RUNNING;
+
+	probe_mode_suffix(mode, suffix);
+	LOG_INFO(global_ctl.pid, "Initialize probe, mode %s, min %u, "
+					"max %u, freq %u", suffix, min, max, freq);
+
+	probe_thread_init();
+}
+
+void probe_pre(unsigned int func)
+{
+	global_info.ops.pre(func);
+}
+
+void probe_post(unsigned int func)
+{
+	global_info.ops.post(func);
+}
+
+void probe_thread_exit(void)
 {
-	
+	if (global_info.flags & PROBE_MODE_PMU)
+		prof_thread_exit();
 }
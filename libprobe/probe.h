@@ -2,28 +2,24 @@
 #define _LIBPROBE_H_
 
 #include "util.h"
+#include "mode.h"
+
+/* Entry and exit probes of a mode */
+struct probe_ops {
+	void (*pre)(unsigned int func);
+	void (*post)(unsigned int func);
+};
 
 struct global_info {
-	/* process ID */
-	int pid;
-	/* File pointer to output log file
-	 * If it is NULL, the standard stdout and stderr will be used
-	 */
-	FILE *flog;
+	/* PROBE_MODE_* and PROBE_FLAG_* given to 'probe_init()',
+	 * including PROBE_MODE_SAMPLE if it is set */
+	unsigned flags;
 	/* The range of target functions' indices */
 	struct range idx_range;
-	/* Flags */
-	union {
-		struct {
-			/* Whether the funccnt is used */
-			uint8_t use_funcct	: 1;
-			/* Whether the pmu is used */
-			uint8_t use_pmu		: 1;
-			uint8_t reserved	: 6;
-		};
-		uint8_t flags;
-	};
-	/* */
+	/* Sample frequency */
+	unsigned freq;
+	/* Probes of the mode, called by 'probe_pre()'/'probe_post()' */
+	struct probe_ops ops;
 };
 
 extern struct global_info global_info;
@@ -34,8 +30,53 @@ extern struct global_info global_info;
  */
 LIB_EXPORT int probe_check_evlist(const char *evlist);
 
-/* Global initialization */
-LIB_EXPORT void probe_init();
+/* The specialized modes, X(suffix, mode)
+ * Sampling is only specialized for counting and timing, since
+ * libprofile samples the PMU reads itself in the PMU-only mode.
+ */
+#define PROBE_MODE_LIST(X) \
+	X(c, PROBE_MODE_COUNT) \
+	X(cs, PROBE_MODE_COUNT | PROBE_MODE_SAMPLE) \
+	X(p, PROBE_MODE_PMU) \
+	X(t, PROBE_MODE_TIME) \
+	X(ts, PROBE_MODE_TIME | PROBE_MODE_SAMPLE) \
+	X(cp, PROBE_MODE_COUNT | PROBE_MODE_PMU) \
+	X(cps, PROBE_MODE_COUNT | PROBE_MODE_PMU | PROBE_MODE_SAMPLE) \
+	X(ct, PROBE_MODE_COUNT | PROBE_MODE_TIME) \
+	X(cts, PROBE_MODE_COUNT | PROBE_MODE_TIME | PROBE_MODE_SAMPLE) \
+	X(pt, PROBE_MODE_PMU | PROBE_MODE_TIME) \
+	X(pts, PROBE_MODE_PMU | PROBE_MODE_TIME | PROBE_MODE_SAMPLE) \
+	X(cpt, PROBE_MODE_COUNT | PROBE_MODE_PMU | PROBE_MODE_TIME) \
+	X(cpts, PROBE_MODE_COUNT | PROBE_MODE_PMU | PROBE_MODE_TIME \
+					| PROBE_MODE_SAMPLE)
+
+/* Specialized probes, e.g. 'probe_pre_ct()', defined in funccnt.c */
+#define PROBE_DECLARE(sfx, mode) \
+	LIB_EXPORT void probe_pre_##sfx(unsigned int func); \
+	LIB_EXPORT void probe_post_##sfx(unsigned int func);
+PROBE_MODE_LIST(PROBE_DECLARE)
+
+/* Global initialization
+ * 'flags' is the PROBE_MODE_* to enable, and the PROBE_FLAG_*.
+ * With a sample frequency 'freq' > 1, one call in 'freq' of each
+ * function is probed. 'evlist' is the event list of the PMU mode,
+ * and 'id_table' the ID table written by the tool, both may be
+ * empty. It must be called before the initialization of threads.
+ */
+LIB_EXPORT void probe_init(unsigned min, unsigned max, unsigned freq,
+				unsigned flags, const char *evlist, const char *id_table);
+
+/* Generic probes
+ * They call the probes of the mode through 'global_info.ops'. The
+ * tool should call the specialized ones, which save an indirect
+ * call.
+ */
+LIB_EXPORT void probe_pre(unsigned int func);
+LIB_EXPORT void probe_post(unsigned int func);
+
+/* Called by each exiting thread, to release its PMU data. The
+ * other thread-local data is released automatically. */
+LIB_EXPORT void probe_thread_exit(void);
 
 /* Destroy all idle threads. If all threads in use are idle and
  * destroyed, it returns 0. Otherwise, it returns 1. The 'nb_exit'
@@ -62,8 +103,4 @@ LIB_EXPORT unsigned probe_exit(void);
  */
 LIB_EXPORT void probe_thread_init(void);
 
-
-
-
-
 #endif /* _LIBPROBE_H */
@@ -0,0 +1,22 @@
+#ifndef __LIBPROBE_PROF_H__
+#define __LIBPROBE_PROF_H__
+
+/* PROF_FLAG_* */
+#include "../libprofile/data.h"
+
+/* Entry points of libprofile, which reads the PMU events in the
+ * PROBE_MODE_PMU. Its other headers are not included, since their
+ * log macros clash with ours.
+ */
+void *prof_init(char *evlist_str, char *logfile,
+				unsigned min_id, unsigned max_id, unsigned freq,
+				unsigned flags, const char *id_table);
+int prof_check_evlist(const char *evlist_str);
+
+void prof_exit(void);
+void prof_thread_exit(void);
+
+void prof_count_pre(unsigned int func_index);
+void prof_count_post(unsigned int func_index);
+
+#endif // __LIBPROBE_PROF_H__
@@ -0,0 +1,100 @@
+#ifndef _LIBPROBE_SHM_H_
+#define _LIBPROBE_SHM_H_
+
+/* Layout of the shared-memory segment of funccnt
+ * The segment is named PROBE_SHM_NAME, and consists of a header,
+ * the global ID of each counter (see funcid.h), the retired block,
+ * and 'nb_block_max' per-thread blocks. The block of a
+ * thread is selected by its slot index in the thread registry.
+ * Each block is protected by a seqlock: its owner increases 'seq'
+ * to an odd value before updating a counter, and back to an even
+ * value after. A reader copies the counters, and retries if 'seq'
+ * was odd or changed during the copy.
+ * The retired block holds the totals of the exited threads. An
+ * exiting thread takes 'retired_lock', adds its counters to the
+ * retired block and frees its own block, all under the seqlock of
+ * the retired block. So a reader retrying until that 'seq' is the
+ * same before and after reading all blocks never counts a thread
+ * twice or misses it.
+ * A thread without a block counts privately, and only adds its
+ * counters to the retired block when it exits. 'nb_private' counts
+ * those alive, it's updated under the seqlock of the retired block,
+ * and the totals miss their counters while it's not 0.
+ */
+
+#include <stdint.h>
+
+#define PROBE_SHM_NAME "/stubprofile.%d"
+#define PROBE_SHM_NAME_MAX 32
+#define PROBE_SHM_MAGIC 0x53505246U
+#define PROBE_SHM_VERSION 5
+
+/* Default number of blocks in the segment. Threads whose slot
+ * index exceeds it keep their counters private until they exit. */
+#define PROBE_SHM_BLOCK_MAX 1024
+
+struct funcc_counter {
+	uint64_t pre_count;
+	uint64_t post_count;
+};
+
+/* Per-thread counter block */
+struct funcc_thread {
+	/* seqlock generation */
+	uint64_t seq;
+	/* system thread ID of the owner, 0 if the block is free */
+	int32_t pid;
+	uint32_t tid;
+	struct funcc_counter counters[] __attribute__((aligned(64)));
+};
+
+struct probe_shm_header {
+	uint32_t magic;
+	uint32_t version;
+	/* process ID */
+	int32_t pid;
+	/* Number of counters in each block */
+	uint32_t nb_counter;
+	/* Offset of the table of global function IDs */
+	uint32_t table_offset;
+	/* Size of each block, in bytes */
+	uint32_t block_size;
+	/* Capacity of the segment, in blocks */
+	uint32_t nb_block_max;
+	/* Blocks ever used. The blocks after it are never touched. */
+	uint32_t nb_block;
+	/* Offset of the first block */
+	uint64_t block_offset;
+	/* Total size of the segment */
+	uint64_t size;
+	/* One call in 'sample_freq' is counted, 0 or 1 if all are.
+	 * Readers multiply the counters by it. */
+	uint32_t sample_freq;
+	/* Taken by the thread adding its counters to the retired block */
+	uint32_t retired_lock;
+	/* Offset of the retired block */
+	uint64_t retired_offset;
+	/* Threads alive without a block */
+	uint32_t nb_private;
+};
+
+static inline uint32_t *
+probe_shm_table(struct probe_shm_header *hdr)
+{
+	return (uint32_t *)((char *)hdr + hdr->table_offset);
+}
+
+static inline struct funcc_thread *
+probe_shm_retired(struct probe_shm_header *hdr)
+{
+	return (struct funcc_thread *)((char *)hdr + hdr->retired_offset);
+}
+
+static inline struct funcc_thread *
+probe_shm_block(struct probe_shm_header *hdr, uint32_t idx)
+{
+	return (struct funcc_thread *)((char *)hdr + hdr->block_offset
+					+ (uint64_t)idx * hdr->block_size);
+}
+
+#endif /* _LIBPROBE_SHM_H_ */
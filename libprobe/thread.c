@@ -1,29 +1,177 @@
 #include "util.h"
 #include "thread.h"
+#include "probe.h"
+#include "arena.h"
+#include "log.h"
 
 struct global_ctl global_ctl = {
 	.state = PROBE_STATE_UNINIT,
+	.nb_slot = 0,
 	.nb_thread = 0,
-//	.thread = {{
-//		.tid = UINT8_MAX,
-//		.pid = 0,
-//		.state = 0,
-//		.data = NULL,
-//	}},
-	.threads = {NULL},
+	.nb_exit = 0,
+	.free_slots = 0,
+	.chunks = {NULL},
 	.thread_data_init = NULL,
 	.thread_data_free = NULL,
 	.global_exit = NULL,
 	.flog = NULL,
 };
 
-static __thread struct thread_info localinfo = {
-	.tid = UINT8_MAX,
+__thread struct thread_info probe_localinfo = {
+	.tid = PROBE_TID_INVALID,
 	.pid = -1,
 	.state = PROBE_STATE_UNINIT,
 	.data = NULL,
 };
 
+/* Get the chunk with index 'cid'. If it doesn't exist, allocate
+ * it. Several threads may allocate the same chunk at the same
+ * time, only one of them wins, the others free their copies.
+ */
+static struct thread_chunk *__thread_chunk_get(uint32_t cid)
+{
+	struct thread_chunk *chunk = NULL, *expected = NULL;
+
+	chunk = __atomic_load_n(&global_ctl.chunks[cid], __ATOMIC_ACQUIRE);
+	if (chunk)
+		return chunk;
+
+	chunk = (struct thread_chunk *)zalloc(sizeof(struct thread_chunk));
+	if (chunk == NULL)
+		return NULL;
+
+	if (!__atomic_compare_exchange_n(&global_ctl.chunks[cid],
+							&expected, chunk, false,
+							__ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE)) {
+		free(chunk);
+		chunk = expected;
+	}
+	return chunk;
+}
+
+static inline uint32_t *__thread_next_free(uint32_t tid)
+{
+	struct thread_chunk *chunk =
+			global_ctl.chunks[tid >> PROBE_THREAD_CHUNK_SHIFT];
+
+	return &chunk->next_free[tid & PROBE_THREAD_CHUNK_MASK];
+}
+
+/* Pop a recycled slot. Return PROBE_TID_INVALID if there is none. */
+static uint32_t __thread_slot_pop(void)
+{
+	struct global_ctl *ctl = &global_ctl;
+	uint64_t head, next;
+	uint32_t tid;
+
+	head = __atomic_load_n(&ctl->free_slots, __ATOMIC_ACQUIRE);
+	do {
+		if ((uint32_t)head == 0)
+			return PROBE_TID_INVALID;
+
+		tid = FREE_SLOT_TID(head);
+		next = FREE_SLOT_PACK(FREE_SLOT_TAG(head),
+						__atomic_load_n(__thread_next_free(tid),
+								__ATOMIC_RELAXED) - 1);
+	} while (!__atomic_compare_exchange_n(&ctl->free_slots, &head, next,
+							true, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE));
+
+	return tid;
+}
+
+/* Push slot 'tid' into the stack of recycled slots */
+static void __thread_slot_push(uint32_t tid)
+{
+	struct global_ctl *ctl = &global_ctl;
+	uint64_t head, next;
+
+	head = __atomic_load_n(&ctl->free_slots, __ATOMIC_ACQUIRE);
+	do {
+		/* the link keeps (tid + 1) of the next free slot */
+		__atomic_store_n(__thread_next_free(tid), (uint32_t)head,
+						__ATOMIC_RELAXED);
+		next = FREE_SLOT_PACK(FREE_SLOT_TAG(head) + 1, tid);
+	} while (!__atomic_compare_exchange_n(&ctl->free_slots, &head, next,
+							true, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE));
+}
+
+/* Get a slot for 'thread'. A recycled slot is preferred, otherwise
+ * a new slot is taken from the end of the registry.
+ */
+static uint32_t __thread_slot_alloc(struct thread_info *thread)
+{
+	struct global_ctl *ctl = &global_ctl;
+	struct thread_chunk *chunk = NULL;
+	uint32_t tid;
+
+	tid = __thread_slot_pop();
+	if (tid == PROBE_TID_INVALID) {
+		tid = __atomic_load_n(&ctl->nb_slot, __ATOMIC_RELAXED);
+		do {
+			if (tid >= PROBE_THREAD_NB_MAX)
+				return PROBE_TID_INVALID;
+			/* the chunk must exist before the slot is visible */
+			if (!__thread_chunk_get(tid >> PROBE_THREAD_CHUNK_SHIFT))
+				return PROBE_TID_INVALID;
+		} while (!__atomic_compare_exchange_n(&ctl->nb_slot, &tid,
+								tid + 1, true,
+								__ATOMIC_ACQ_REL, __ATOMIC_RELAXED));
+	}
+
+	chunk = ctl->chunks[tid >> PROBE_THREAD_CHUNK_SHIFT];
+	__atomic_store_n(&chunk->slots[tid & PROBE_THREAD_CHUNK_MASK],
+					thread, __ATOMIC_RELEASE);
+	return tid;
+}
+
+/* Release the slot of 'thread', and put it into recycling */
+static void __thread_slot_free(struct thread_info *thread)
+{
+	struct thread_chunk *chunk = NULL;
+	uint32_t tid = thread->tid;
+
+	if (tid == PROBE_TID_INVALID)
+		return;
+
+	chunk = global_ctl.chunks[tid >> PROBE_THREAD_CHUNK_SHIFT];
+	__atomic_store_n(&chunk->slots[tid & PROBE_THREAD_CHUNK_MASK],
+					NULL, __ATOMIC_RELEASE);
+	thread->tid = PROBE_TID_INVALID;
+	__thread_slot_push(tid);
+}
+
+/* Destroy the thread-local data of 'thread' and release its slot */
+static void __thread_destroy(struct thread_info *thread)
+{
+	struct global_ctl *ctl = &global_ctl;
+
+	if (ctl->thread_data_free && thread->data)
+		ctl->thread_data_free(thread);
+	thread->data = NULL;
+	thread->state = PROBE_STATE_UNINIT;
+
+	LOG_INFO(ctl->pid, "Thread %u (%d) exits.",
+					thread->tid, thread->pid);
+
+	__thread_slot_free(thread);
+	__atomic_fetch_add(&ctl->nb_exit, 1, __ATOMIC_RELAXED);
+}
+
+/* Destructor of the per-thread key
+ * It is called by the exiting thread itself, after the thread
+ * leaves all probes. If 'probe_exit()' already destroyed this
+ * thread, its slot is invalid, and nothing is done.
+ */
+static void __thread_key_destructor(void *arg)
+{
+	struct thread_info *thread = (struct thread_info *)arg;
+
+	if (thread == NULL || thread->tid == PROBE_TID_INVALID)
+		return;
+
+	__thread_destroy(thread);
+}
+
 /* Constructor
  * The global state will not be updated to PROBE_STATE_IDLE. It
  * should be updated after the initialization of specified probe
@@ -44,14 +192,17 @@ void thread_global_init(void)
 				"Failed to open log file, use stdout/stderr");
 	}
 
-	LOG_INFO(ctl->pid, "Global initialization");
+	if (pthread_key_create(&ctl->key, __thread_key_destructor) != 0) {
+		LOG_ERROR(ctl->pid, "Failed to create thread key");
+		ctl->state = PROBE_STATE_ERROR;
+		return;
+	}
+
+	if (probe_log_start() < 0)
+		LOG_WARN(ctl->pid, "Failed to start the log flusher, "
+				"log synchronously");
 
-#ifdef USE_FUNCCNT	
-	global_ctl.thread_data_init = funcc_data_init;
-	global_ctl.thread_data_free = funcc_data_free;
-	global_ctl.global_exit = NULL;
-#else
-#endif /* ifdef USE_FUNCCNT */
+	LOG_INFO(ctl->pid, "Global initialization");
 }
 
 /* Destructor
@@ -67,7 +218,8 @@ void thread_global_init(void)
  */
 void thread_global_exit(void)
 {
-	if (global_ctl.state != PROBE_STATE_UNINIT) {
+	if (global_ctl.state != PROBE_STATE_UNINIT &&
+			global_ctl.state != PROBE_STATE_ERROR) {
 		probe_exit();
 		LOG_INFO(0, "Destroy %u(%u) threads",
 						global_ctl.nb_exit,
@@ -93,32 +245,23 @@ void thread_global_exit(void)
  */
 unsigned probe_exit(void)
 {
-	uint8_t i = 0, nb_thread, nb_exit;
+	uint32_t i = 0, nb_slot;
 	struct global_ctl *ctl = &global_ctl;
 	struct thread_info *thread = NULL;
 
 	/* The global state is set to EXIT, to inform all threads that
 	 * don't use its thread-local data anymore. */
 	ctl->state = PROBE_STATE_EXIT;
-	if (ctl->nb_exit == ctl->nb_thread)
-		return 0;
 
 	/* destroy thread-local data */
-	for (i = 0; i < ctl->nb_thread; i++) {
-		thread = ctl->threads[i];
+	nb_slot = __atomic_load_n(&ctl->nb_slot, __ATOMIC_ACQUIRE);
+	for (i = 0; i < nb_slot; i++) {
+		thread = probe_thread_lookup(i);
 
-		if (thread == NULL || thread->state == PROBE_STATE_IDLE)
+		if (thread == NULL || thread->state == PROBE_STATE_RUNNING)
 			continue;
 
-		if (ctl->thread_data_free) {
-			ctl->thread_data_free();
-			thread->data = NULL;
-		}
-		thread->state = PROBE_STATE_UNINIT;
-		ctl->threads[i] = NULL;
-		ctl->nb_exit++;
-		LOG_INFO(ctl->pid, "Thread %u (%d) exits.",
-						thread->tid, thread->pid);
+		__thread_destroy(thread);
 	}
 
 	/* check whether all threads are destroyed. */
@@ -126,7 +269,12 @@ unsigned probe_exit(void)
 		if (ctl->global_exit)
 			ctl->global_exit();
 
+		/* all thread-local data is released */
+		arena_dump_stats(ctl->pid);
+		arena_global_exit();
+
 		LOG_INFO(ctl->pid, "Finished.");
+		probe_log_stop();
 
 		/* close log file */
 		if (ctl->flog) {
@@ -153,7 +301,7 @@ unsigned probe_exit(void)
 void probe_thread_init(void)
 {
 	struct global_ctl *ctl = &global_ctl;
-	struct thread_info *thread = &localinfo;
+	struct thread_info *thread = probe_get_thread();
 
 	/* check global state */
 	if (ctl->state != PROBE_STATE_RUNNING)
@@ -163,17 +311,23 @@ void probe_thread_init(void)
 	if (thread->state != PROBE_STATE_UNINIT)
 		return;
 
-	/* check tid. If tid is invalid, generate it safely */
-	if (thread->tid > ctl->nb_thread) {
-		/* if tid is invalid, generate it safely. */
-		thread->tid = __atomic_fetch_add(&ctl->nb_thread, 1,
-						__ATOMIC_SEQ_CST);
-		ctl->threads[thread->tid] = thread;
-	}
-
 	/* get pid */
 	thread->pid = syscall(SYS_gettid);
 
+	/* get a slot in the registry */
+	if (thread->tid == PROBE_TID_INVALID) {
+		thread->tid = __thread_slot_alloc(thread);
+		if (thread->tid == PROBE_TID_INVALID) {
+			LOG_ERROR(thread->pid, "No free slot for thread");
+			thread->state = PROBE_STATE_ERROR;
+			return;
+		}
+	}
+	__atomic_fetch_add(&ctl->nb_thread, 1, __ATOMIC_RELAXED);
+
+	/* release the slot automatically when the thread exits */
+	pthread_setspecific(ctl->key, thread);
+
 	LOG_INFO(thread->pid, "This is thread %u", thread->tid);
 
 	/* create thread-local data */
@@ -183,7 +337,8 @@ void probe_thread_init(void)
 			LOG_ERROR(thread->pid, "Failed to init thread-local"
 							"data, nb_exit++");
 			thread->state = PROBE_STATE_ERROR;
-			ctl->nb_exit ++;
+			__thread_slot_free(thread);
+			__atomic_fetch_add(&ctl->nb_exit, 1, __ATOMIC_RELAXED);
 			return;
 		}
 	}
@@ -191,8 +346,3 @@ void probe_thread_init(void)
 	thread->state = PROBE_STATE_IDLE;
 	LOG_INFO(thread->pid, "Finish initialization");
 }
-
-struct thread_info *probe_get_thread(void)
-{
-	return &localinfo;
-}
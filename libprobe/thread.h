@@ -1,6 +1,8 @@
 #ifndef _LIBPROBE_THREAD_H_
 #define _LIBPROBE_THREAD_H_
 
+#include <pthread.h>
+
 #include "util.h"
 
 enum {
@@ -11,8 +13,13 @@ enum {
 	PROBE_STATE_EXIT,
 };
 
+/* Invalid thread index, the thread owns no slot in the registry */
+#define PROBE_TID_INVALID UINT32_MAX
+
 struct thread_info {
-	uint8_t tid;
+	/* Index of the slot in the thread registry. Slots are
+	 * recycled, so it is only unique among living threads. */
+	uint32_t tid;
 	int pid;
 
 	uint8_t state;
@@ -21,27 +28,75 @@ struct thread_info {
 	void *data;
 };
 
-#define PROBE_THREAD_NB_MAX 64
+/* Thread registry
+ * The registry is a two-level table. The directory 'chunks' is
+ * statically allocated, and each chunk holds the slots of
+ * PROBE_THREAD_CHUNK_SIZE threads. A chunk is allocated when the
+ * first slot inside it is handed out, and never released until
+ * the process exits. So the registry grows without any lock, and
+ * the pointer of a slot never moves.
+ */
+#define PROBE_THREAD_CHUNK_SHIFT 6
+#define PROBE_THREAD_CHUNK_SIZE (1U << PROBE_THREAD_CHUNK_SHIFT)
+#define PROBE_THREAD_CHUNK_MASK (PROBE_THREAD_CHUNK_SIZE - 1)
+#define PROBE_THREAD_CHUNK_MAX 1024
+#define PROBE_THREAD_NB_MAX \
+		(PROBE_THREAD_CHUNK_SIZE * PROBE_THREAD_CHUNK_MAX)
+
+struct thread_chunk {
+	/* Threads using the slots, NULL if the slot is free */
+	struct thread_info *slots[PROBE_THREAD_CHUNK_SIZE];
+	/* Links of the free-slot stack */
+	uint32_t next_free[PROBE_THREAD_CHUNK_SIZE];
+};
+
+/* The head of the free-slot stack is packed into 64 bits, the
+ * higher 32 bits are an ABA tag increased by every push, and the
+ * lower 32 bits are (tid + 1). Zero means the stack is empty. */
+#define FREE_SLOT_TAG(x) ((uint32_t)((x) >> 32))
+#define FREE_SLOT_TID(x) ((uint32_t)(x) - 1)
+#define FREE_SLOT_PACK(tag, tid) \
+		(((uint64_t)(tag) << 32) | (uint64_t)((tid) + 1))
+
+struct global_ctl {
+	/* process ID */
+	int pid;
+	/* File pointer to output log file
+	 * If it is NULL, the standard stdout and stderr will be used
+	 */
+	FILE *flog;
 
-struct thread_ctl {
 	/* global state */
 	uint8_t state;
 
 	/* thread infomations */
-	uint8_t nb_thread;
-	uint8_t nb_exit;
-	struct thread_info *threads[PROBE_THREAD_NB_MAX];
+	/* Number of slots ever handed out. All the valid tids are
+	 * smaller than it. */
+	uint32_t nb_slot;
+	/* Number of initialized threads */
+	uint32_t nb_thread;
+	/* Number of destroyed threads */
+	uint32_t nb_exit;
+	/* Stack of recycled slots */
+	uint64_t free_slots;
+	struct thread_chunk *chunks[PROBE_THREAD_CHUNK_MAX];
+
+	/* The key whose destructor releases the slot and the
+	 * thread-local data when a thread exits */
+	pthread_key_t key;
 
 	/* Pointor to thread-local data initialization function */
 	void* (*thread_data_init)(void);
 	/* Pointor to thread-local data destructor */
-	void (*thread_data_free)(void);
+	void (*thread_data_free)(struct thread_info *thread);
 	/* Pointer to global destructor */
 	void (*global_exit)(void);
 };
 
 extern struct global_ctl global_ctl;
 
+extern __thread struct thread_info probe_localinfo;
+
 /* Constructor
  * This function will be called automatically during the program
  * loading.
@@ -62,7 +117,34 @@ void __attribute__((constructor)) thread_global_init(void);
  */
 void __attribute__((destructor)) thread_global_exit(void);
 
-/* Get thread-local structure */
-struct thread_info *probe_get_thread(void);
+/* Per-thread initialization, see probe.h */
+void probe_thread_init(void);
+
+/* Get thread-local structure
+ * It is on the hot path of every probe, so it is kept as a single
+ * TLS access.
+ */
+static inline struct thread_info *probe_get_thread(void)
+{
+	return &probe_localinfo;
+}
+
+/* Get the thread using slot 'tid', NULL if the slot is free */
+static inline struct thread_info *probe_thread_lookup(uint32_t tid)
+{
+	struct thread_chunk *chunk = NULL;
+
+	if (tid >= __atomic_load_n(&global_ctl.nb_slot, __ATOMIC_ACQUIRE))
+		return NULL;
+
+	chunk = __atomic_load_n(
+					&global_ctl.chunks[tid >> PROBE_THREAD_CHUNK_SHIFT],
+					__ATOMIC_ACQUIRE);
+	if (chunk == NULL)
+		return NULL;
+
+	return __atomic_load_n(&chunk->slots[tid & PROBE_THREAD_CHUNK_MASK],
+					__ATOMIC_ACQUIRE);
+}
 
 #endif /* _LIBPROBE_THREAD_H_  */
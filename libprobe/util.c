@@ -3,6 +3,7 @@
 
 #include "util.h"
 #include "thread.h"
+#include "log.h"
 
 static char *log_tag[PROBE_LOG_NUM] = {
 	[PROBE_LOG_ERROR] = "ERROR",
@@ -11,28 +12,55 @@ static char *log_tag[PROBE_LOG_NUM] = {
 	[PROBE_LOG_DEBUG] = "DEBUG",
 };
 
+static FILE *__probe_log_file(uint8_t level)
+{
+	if (global_ctl.flog)
+		return global_ctl.flog;
+	else if (level != PROBE_LOG_INFO)
+		return stderr;
+	else
+		return stdout;
+}
+
+void probe_log_write(const char *time_str, int pid,
+				uint8_t level, const char *msg)
+{
+	fprintf(__probe_log_file(level), "[%s][%s][T%d]: %s\n",
+					time_str, log_tag[level], pid, msg);
+}
+
+void probe_log_flush(void)
+{
+	if (global_ctl.flog)
+		fflush(global_ctl.flog);
+	else {
+		fflush(stdout);
+		fflush(stderr);
+	}
+}
+
 void probe_log(int pid, uint8_t level, const char *format, ...)
 {
 	va_list va;
-	FILE *fout = NULL;
 	time_t timer;
-	struct tm *timeinfo;
+	struct tm timeinfo;
 	char buf[16] = {'\0'};
+	char msg[PROBE_LOG_MSG_MAX] = {'\0'};
+	bool pushed;
 
-	if (global_ctl.flog)
-		fout = global_ctl.flog;
-	else if (level != PROBE_LOG_INFO)
-		fout = stderr;
-	else
-		fout = stdout;
+	/* hand the record over to the flusher */
+	va_start(va, format);
+	pushed = probe_log_push(pid, level, format, va);
+	va_end(va);
+	if (pushed)
+		return;
 
 	timer = time(NULL);
-	timeinfo = localtime(&timer);
-	strftime(buf, 16, "%D %R", timeinfo);
-	fprintf(fout, "[%s][%s][T%d]: ", buf, log_tag[level], pid);
+	localtime_r(&timer, &timeinfo);
+	strftime(buf, 16, "%D %R", &timeinfo);
 	va_start(va, format);
-	vfprintf(fout, format, va);
+	vsnprintf(msg, PROBE_LOG_MSG_MAX, format, va);
 	va_end(va);
-	fprintf(fout, "\n");
-	fflush(fout);
+	probe_log_write(buf, pid, level, msg);
+	probe_log_flush();
 }
@@ -18,7 +18,11 @@
 #include <sys/syscall.h>
 #include <sys/resource.h>
 
+/* rdtsc(), shared with libprofile */
+#include "../libprofile/inst.h"
+
 #define PAGE_SIZE 4096
+#define CACHELINE_SIZE 64
 
 #ifndef __maybe_unused
 #define __maybe_unused __attribute__((unused))
@@ -135,8 +139,8 @@ void probe_log(int pid, uint8_t level,
 #endif /* ifdef PROBE_DEBUG */
 
 struct range {
-	uint16_t min;
-	uint16_t max;
+	uint32_t min;
+	uint32_t max;
 };
 
 #endif /* _LIBPROBE_UTIL_H_ */
@@ -0,0 +1,208 @@
+#include "aggr.h"
+#include "profile.h"
+
+static inline struct prof_data_aggr *__aggr_entry(struct prof_aggr *aggr,
+				uint32_t idx)
+{
+	return (struct prof_data_aggr *)(aggr->table
+					+ (uint64_t)idx * aggr->entry_size);
+}
+
+static void __aggr_free(struct prof_aggr *aggr)
+{
+	free(aggr->hdr);
+	free(aggr->active);
+	free(aggr->table);
+	free(aggr);
+}
+
+struct prof_aggr *prof_aggr_open(int fd, const struct prof_data_header *hdr)
+{
+	struct prof_aggr *aggr = NULL;
+	uint32_t i;
+
+	aggr = (struct prof_aggr *)zalloc(sizeof(struct prof_aggr));
+	if (!aggr)
+		return NULL;
+
+	aggr->fd = fd;
+	aggr->nb_func = hdr->max_index - hdr->min_index + 1;
+	aggr->nb_event = hdr->nb_event;
+	aggr->entry_size = PROF_DATA_AGGR_SIZE(hdr->nb_event);
+
+	aggr->hdr = (struct prof_data_header *)malloc(hdr->data_offset);
+	aggr->active = (uint32_t *)calloc(aggr->nb_func, sizeof(uint32_t));
+	aggr->table = (uint8_t *)calloc(aggr->nb_func, aggr->entry_size);
+	if (!aggr->hdr || !aggr->active || !aggr->table) {
+		LOG_ERROR("Failed to allocate the table of %u functions",
+						aggr->nb_func);
+		goto fail_free;
+	}
+	memcpy(aggr->hdr, hdr, hdr->data_offset);
+	aggr->hdr->committed = 0;
+
+	// an empty table until the thread exits
+	if (pwrite(fd, aggr->hdr, hdr->data_offset, 0)
+					!= (ssize_t)hdr->data_offset) {
+		LOG_ERROR("Failed to write data header, err %d", errno);
+		goto fail_free;
+	}
+
+	for (i = 0; i < aggr->nb_func; i++)
+		__aggr_entry(aggr, i)->index = hdr->min_index + i;
+	return aggr;
+
+fail_free:
+	__aggr_free(aggr);
+	return NULL;
+}
+
+void prof_aggr_enter(struct prof_aggr *aggr, uint32_t idx,
+				const uint64_t *counts)
+{
+	struct prof_aggr_frame *frame = NULL;
+
+	__aggr_entry(aggr, idx)->calls++;
+
+	if (unlikely(aggr->depth >= PROF_AGGR_STACK_MAX || aggr->lost)) {
+		aggr->lost++;
+		return;
+	}
+
+	frame = &aggr->stack[aggr->depth++];
+	frame->idx = idx;
+	memcpy(frame->start, counts, aggr->nb_event * sizeof(uint64_t));
+	memset(frame->child, 0, aggr->nb_event * sizeof(uint64_t));
+	frame->callees = 0;
+	frame->below = 0;
+	aggr->active[idx]++;
+}
+
+/* Pop the top frame at 'counts' */
+static void __aggr_pop(struct prof_aggr *aggr, const uint64_t *counts)
+{
+	struct prof_aggr_frame *frame = &aggr->stack[--aggr->depth];
+	struct prof_aggr_frame *parent = NULL;
+	struct prof_data_aggr *entry = __aggr_entry(aggr, frame->idx);
+	uint64_t *incl = entry->counts, *excl = entry->counts + aggr->nb_event;
+	uint64_t total;
+	uint32_t i;
+
+	if (aggr->depth)
+		parent = &aggr->stack[aggr->depth - 1];
+
+	// only the outermost instance of a recursion is inclusive
+	aggr->active[frame->idx]--;
+	if (!aggr->active[frame->idx]) {
+		entry->incl_calls++;
+		entry->below += frame->below;
+	}
+	entry->callees += frame->callees;
+	if (parent) {
+		parent->callees++;
+		parent->below += 1 + frame->below;
+	}
+
+	for (i = 0; i < aggr->nb_event; i++) {
+		total = counts[i] - frame->start[i];
+		if (!aggr->active[frame->idx])
+			incl[i] += total;
+		excl[i] += total - frame->child[i];
+		if (parent)
+			parent->child[i] += total;
+	}
+}
+
+void prof_aggr_exit(struct prof_aggr *aggr, uint32_t idx,
+				const uint64_t *counts)
+{
+	uint32_t depth;
+
+	if (unlikely(aggr->lost)) {
+		aggr->lost--;
+		return;
+	}
+
+	// the frame of 'idx', from the top
+	for (depth = aggr->depth; depth > 0; depth--) {
+		if (aggr->stack[depth - 1].idx == idx)
+			break;
+	}
+	// exit without entry
+	if (depth == 0)
+		return;
+
+	// the frames above were left without exit
+	aggr->unwound += aggr->depth - depth;
+	while (aggr->depth >= depth)
+		__aggr_pop(aggr, counts);
+}
+
+void prof_aggr_sample(struct prof_aggr *aggr, const uint32_t *stack,
+				uint32_t depth, bool self, uint64_t period)
+{
+	struct prof_data_aggr *entry = NULL;
+	uint32_t i;
+
+	if (depth == 0)
+		return;
+	if (self)
+		__aggr_entry(aggr, stack[0])->counts[aggr->nb_event] += period;
+
+	// 'active' marks the functions already counted by the sample
+	for (i = 0; i < depth; i++) {
+		if (aggr->active[stack[i]])
+			continue;
+		aggr->active[stack[i]] = 1;
+		entry = __aggr_entry(aggr, stack[i]);
+		entry->calls++;
+		entry->counts[0] += period;
+	}
+	for (i = 0; i < depth; i++)
+		aggr->active[stack[i]] = 0;
+}
+
+void prof_aggr_close(struct prof_aggr *aggr, const uint64_t *counts)
+{
+	struct prof_data_header *hdr = aggr->hdr;
+	struct prof_data_aggr *entry = NULL;
+	uint64_t size = 0;
+	uint32_t i, nb = 0;
+
+	// the functions still running, e.g. main()
+	aggr->lost = 0;
+	while (aggr->depth && counts)
+		__aggr_pop(aggr, counts);
+
+	// pack the called functions at the head of the table
+	for (i = 0; i < aggr->nb_func; i++) {
+		entry = __aggr_entry(aggr, i);
+		if (!entry->calls)
+			continue;
+		if (nb != i)
+			memcpy(__aggr_entry(aggr, nb), entry, aggr->entry_size);
+		nb++;
+	}
+	size = (uint64_t)nb * aggr->entry_size;
+
+	// the table is committed after it's written
+	if (pwrite(aggr->fd, aggr->table, size, hdr->data_offset)
+					!= (ssize_t)size) {
+		LOG_ERROR("Failed to write the table of thread %d, err %d",
+						hdr->tid, errno);
+		goto out;
+	}
+	hdr->committed = size;
+	if (pwrite(aggr->fd, &hdr->committed, sizeof(uint64_t),
+					offsetof(struct prof_data_header, committed))
+			!= sizeof(uint64_t))
+		LOG_WARN("Failed to commit the table of thread %d, err %d",
+						hdr->tid, errno);
+
+	LOG_INFO("Thread %d: %u functions aggregated, %lu frames unwound",
+					hdr->tid, nb, (unsigned long)aggr->unwound);
+
+out:
+	close(aggr->fd);
+	__aggr_free(aggr);
+}
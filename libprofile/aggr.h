@@ -0,0 +1,80 @@
+#ifndef _PROFILE_AGGR_H_
+#define _PROFILE_AGGR_H_
+
+#include "util.h"
+#include "data.h"
+
+/* Per-function aggregation
+ * It replaces the records with PROF_FLAG_AGGR. Each thread keeps a
+ * shadow call stack, whose frames hold the counts at the entry and
+ * the inclusive counts of the callees. At the exit, the delta since
+ * the entry is added to the inclusive counts of the function, and
+ * the delta minus the callees to its exclusive counts.
+ * A recursive function is only added to its inclusive counts by its
+ * outermost instance, so that they are not counted twice.
+ * An exit whose frame is not on the top unwinds the frames above it,
+ * as left by longjmp or exceptions, as if they exited now. An exit
+ * without entry is ignored. Calls deeper than PROF_AGGR_STACK_MAX are
+ * counted but not attributed, their counts go to their caller.
+ * The table is written into the data file when the thread exits,
+ * or by 'prof_exit()' for the threads still alive, without their
+ * frames still running, see 'struct prof_data_aggr'.
+ */
+
+/* Max depth of the shadow stack */
+#define PROF_AGGR_STACK_MAX 256
+
+struct prof_aggr_frame {
+	uint32_t idx;
+	/* counts at the entry */
+	uint64_t start[PROF_EVENT_MAX];
+	/* inclusive counts of the callees */
+	uint64_t child[PROF_EVENT_MAX];
+	/* calls made by the frame, and all calls below it */
+	uint64_t callees;
+	uint64_t below;
+};
+
+struct prof_aggr {
+	/* data file, and its header */
+	int fd;
+	struct prof_data_header *hdr;
+	uint32_t nb_func;
+	uint32_t nb_event;
+	/* bytes of an entry of 'table', PROF_DATA_AGGR_SIZE */
+	uint32_t entry_size;
+	/* depth of the stack, and of the calls beyond it */
+	uint32_t depth;
+	uint32_t lost;
+	/* frames unwound without their exit */
+	uint64_t unwound;
+	/* instances of each function on the stack */
+	uint32_t *active;
+	/* one 'struct prof_data_aggr' per function */
+	uint8_t *table;
+	struct prof_aggr_frame stack[PROF_AGGR_STACK_MAX];
+};
+
+/* Create the aggregation of the functions and events of 'hdr' into
+ * 'fd', which has no table until it's closed. The aggregation owns
+ * 'fd' from now on. Return NULL on failure. */
+struct prof_aggr *prof_aggr_open(int fd, const struct prof_data_header *hdr);
+/* Unwind the frames left at 'counts', or drop them if it's NULL,
+ * write the table of the called functions, and close the file */
+void prof_aggr_close(struct prof_aggr *aggr, const uint64_t *counts);
+
+/* Entry and exit of the function 'idx' (from 0), with the counts of
+ * the events at that time */
+void prof_aggr_enter(struct prof_aggr *aggr, uint32_t idx,
+				const uint64_t *counts);
+void prof_aggr_exit(struct prof_aggr *aggr, uint32_t idx,
+				const uint64_t *counts);
+
+/* Add a sample of 'period' to the 'depth' functions (from 0) of
+ * 'stack', from the innermost. The first one is exclusive if 'self',
+ * i.e. the IP was in it. A function on the stack more than once is
+ * counted once. */
+void prof_aggr_sample(struct prof_aggr *aggr, const uint32_t *stack,
+				uint32_t depth, bool self, uint64_t period);
+
+#endif /* _PROFILE_AGGR_H_ */
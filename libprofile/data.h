@@ -0,0 +1,244 @@
+#ifndef _PROFILE_DATA_H_
+#define _PROFILE_DATA_H_
+
+/* Layout of the per-thread data file of libprofile
+ * This header, logring.h, and funcid.h, mode.h, dump.h and shm.h of
+ * libprobe are shared between libprofile, libprobe and stubprofile.
+ * They only depend on the standard headers, so that each side
+ * includes them without the internals of the others.
+ *
+ * The file is named PROF_DATA_NAME with the system thread ID. It
+ * starts with a header describing the records: the events in the
+ * order they are read, the range of function indices, the sample
+ * frequency and the TSC frequency. The records start at the page-
+ * aligned 'data_offset'. Only the first 'committed' bytes of them
+ * are complete. It is advanced after the records are written, so
+ * a reader can trust them even if the process was killed, and
+ * ignore the bytes beyond.
+ *
+ * Each probe hit is one record of varints (LEB128):
+ *   tag		PROF_HIT_TAG(index - min_index, exit)
+ *   count[i]	zigzag of the delta of event i since the previous
+ *			hit of the thread, for each of the 'nb_event' events
+ * The counts of a thread start from 0. A tag is never 0, and zero
+ * bytes between records are padding, e.g. at the end of the
+ * segments of the mmap log, which readers skip.
+ *
+ * The counts of a call include the part of its probes between the
+ * reads of its entry and exit, and the counts of its caller the
+ * rest. 'prof_init()' measures both on an empty function into the
+ * 'overhead' and 'outer' of each event, which readers subtract, see
+ * 'prof_data_correct()'.
+ *
+ * With PROF_FLAG_AGGR, the data is instead a table written when the
+ * thread exits, with one 'struct prof_data_aggr' of
+ * PROF_DATA_AGGR_SIZE(nb_event) bytes per function called.
+ * With PROF_FLAG_SAMPLING too, the file is named with the process
+ * ID, the table covers all threads, and 'nb_event' is 1. The calls
+ * are the samples with the function on the call chain, and the
+ * counts the sum of their periods.
+ */
+
+#include <stdint.h>
+
+#define PROF_DATA_NAME "profile_%d.data"
+#define PROF_DATA_NAME_MAX 32
+#define PROF_DATA_MAGIC 0x46525053U
+#define PROF_DATA_VERSION 4
+#define PROF_DATA_EVENT_NAME_MAX 48
+#define PROF_DATA_ALIGN 4096
+
+/* Flags of 'prof_init()', saved in the header */
+enum {
+	/* Records are written into a segmented mmap log, instead of
+	 * being streamed by the writer thread */
+	PROF_FLAG_MMAP = 1U << 0,
+	/* Events are read as one perf group, and the counts are scaled
+	 * to the enabled time if the group was multiplexed */
+	PROF_FLAG_GROUP = 1U << 1,
+	/* Events are aggregated per function in the process, and only
+	 * the table is written */
+	PROF_FLAG_AGGR = 1U << 2,
+	/* The first event samples the process from the perf ring
+	 * buffers instead of being read by the probes. One table of
+	 * the process is written, as with PROF_FLAG_AGGR. */
+	PROF_FLAG_SAMPLING = 1U << 3,
+	/* The caller already decides the sampled calls, one in
+	 * 'sample_freq', and only probes those. The frequency is saved
+	 * for the readers, but not applied again. */
+	PROF_FLAG_PRESAMPLED = 1U << 4,
+};
+
+/* Type of the pseudo-events, read in user space without perf. The
+ * readers use them as timestamps. */
+#define PROF_PMU_TYPE_PSEUDO 0xffff0000U
+
+/* Config of the pseudo-events */
+enum {
+	/* Ticks of the TSC */
+	PROF_PSEUDO_TSC = 0,
+	/* Nanoseconds of CLOCK_MONOTONIC_RAW */
+	PROF_PSEUDO_MONOTONIC_RAW,
+};
+
+/* Max bytes of a varint of 32 and 64 bits */
+#define PROF_VARINT32_MAX 5
+#define PROF_VARINT64_MAX 10
+
+#define PROF_HIT_TAG(idx, exit) ((((uint64_t)(idx)) << 1 | ((exit) & 1)) + 1)
+#define PROF_HIT_IDX(tag) (((tag) - 1) >> 1)
+#define PROF_HIT_EXIT(tag) (((tag) - 1) & 1)
+
+/* Max bytes of a hit */
+#define PROF_HIT_MAX(nb_event) \
+	(PROF_VARINT32_MAX + (nb_event) * PROF_VARINT64_MAX)
+
+struct prof_data_event {
+	/* perf_event_attr type and config */
+	uint32_t type;
+	uint32_t reserved;
+	uint64_t config;
+	/* Median count of a probed call of an empty function between
+	 * its entry and exit, the rest of its probes counted by the
+	 * caller, and the median absolute deviation of the first. They
+	 * are 0 if unknown. */
+	uint64_t overhead;
+	uint64_t outer;
+	uint64_t noise;
+	char name[PROF_DATA_EVENT_NAME_MAX];
+};
+
+struct prof_data_header {
+	uint32_t magic;
+	uint32_t version;
+	/* process ID, and system thread ID of the writer */
+	int32_t pid;
+	int32_t tid;
+	/* Range of function indices */
+	uint32_t min_index;
+	uint32_t max_index;
+	/* Counts are raw, readers multiply them by 'sample_freq' if
+	 * it's more than 1 */
+	uint32_t sample_freq;
+	/* PROF_FLAG_* */
+	uint32_t flags;
+	/* TSC ticks per second, 0 if unknown */
+	uint64_t tsc_hz;
+	/* TSC conversion of the perf mmap page, if 'time_mult' is not
+	 * 0, see 'prof_data_tsc_to_ns()' */
+	uint64_t time_zero;
+	uint32_t time_mult;
+	uint16_t time_shift;
+	uint16_t reserved;
+	/* Max bytes of a hit */
+	uint32_t hit_max;
+	uint32_t nb_event;
+	/* Offset of the first record */
+	uint64_t data_offset;
+	/* Bytes of complete records after 'data_offset' */
+	uint64_t committed;
+	struct prof_data_event events[];
+};
+
+struct prof_data_aggr {
+	/* function index */
+	uint32_t index;
+	uint32_t reserved;
+	/* calls counted, readers multiply them and the counts by
+	 * 'sample_freq' if it's more than 1 */
+	uint64_t calls;
+	/* calls of the inclusive counts, i.e. the outermost instances
+	 * of a recursion, the calls below them, and the calls made by
+	 * all calls, to subtract the probe overhead */
+	uint64_t incl_calls;
+	uint64_t below;
+	uint64_t callees;
+	/* inclusive counts of the 'nb_event' events, then exclusive */
+	uint64_t counts[];
+};
+
+#define PROF_DATA_AGGR_SIZE(nb_event) \
+	(sizeof(struct prof_data_aggr) + 2 * (nb_event) * sizeof(uint64_t))
+
+static inline uint64_t prof_data_offset(uint32_t nb_event)
+{
+	uint64_t size = sizeof(struct prof_data_header)
+			+ (uint64_t)nb_event * sizeof(struct prof_data_event);
+
+	return (size + PROF_DATA_ALIGN - 1) & ~((uint64_t)PROF_DATA_ALIGN - 1);
+}
+
+/* Nanoseconds of a TSC value, in the clock of perf (sched_clock) if
+ * the kernel gave the conversion, or since the TSC reset */
+static inline uint64_t prof_data_tsc_to_ns(const struct prof_data_header *hdr,
+				uint64_t tsc)
+{
+	uint64_t quot, rem;
+
+	if (hdr->time_mult) {
+		quot = tsc >> hdr->time_shift;
+		rem = tsc & (((uint64_t)1 << hdr->time_shift) - 1);
+		return hdr->time_zero + quot * hdr->time_mult
+				+ ((rem * hdr->time_mult) >> hdr->time_shift);
+	}
+	if (hdr->tsc_hz)
+		return tsc / hdr->tsc_hz * 1000000000ULL
+				+ tsc % hdr->tsc_hz * 1000000000ULL / hdr->tsc_hz;
+	return 0;
+}
+
+/* Count of an event without the probe overhead of 'calls' calls,
+ * and of the rest of the probes of 'callees' calls made by them, or
+ * deeper. The counts within the noise of the overhead are 0. */
+static inline uint64_t prof_data_correct(const struct prof_data_event *ev,
+				uint64_t val, uint64_t calls, uint64_t callees)
+{
+	uint64_t overhead = ev->overhead * calls + ev->outer * callees;
+
+	if (val <= overhead)
+		return 0;
+	val -= overhead;
+	return (val > ev->noise * (calls + callees) ? val : 0);
+}
+
+static inline uint8_t *prof_varint_put(uint8_t *ptr, uint64_t val)
+{
+	while (val >= 0x80) {
+		*ptr++ = (uint8_t)val | 0x80;
+		val >>= 7;
+	}
+	*ptr++ = (uint8_t)val;
+	return ptr;
+}
+
+/* Decode a varint before 'end'. Return the next byte, or NULL if it
+ * is truncated. */
+static inline const uint8_t *prof_varint_get(const uint8_t *ptr,
+				const uint8_t *end, uint64_t *val)
+{
+	uint64_t res = 0;
+	unsigned shift = 0;
+
+	while (ptr < end && shift < 64) {
+		res |= (uint64_t)(*ptr & 0x7f) << shift;
+		if (!(*ptr++ & 0x80)) {
+			*val = res;
+			return ptr;
+		}
+		shift += 7;
+	}
+	return NULL;
+}
+
+/* Map signed deltas to small unsigned values */
+static inline uint64_t prof_zigzag(int64_t val)
+{
+	return ((uint64_t)val << 1) ^ (uint64_t)(val >> 63);
+}
+
+static inline int64_t prof_unzigzag(uint64_t val)
+{
+	return (int64_t)(val >> 1) ^ -(int64_t)(val & 1);
+}
+
+#endif /* _PROFILE_DATA_H_ */
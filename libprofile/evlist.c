@@ -3,6 +3,7 @@
 #include "evlist.h"
 #include "evsel.h"
 #include "threadmap.h"
+#include "pmu.h"
 
 struct prof_evlist *prof_evlist__new(void)
 {
@@ -53,12 +54,18 @@ __prof_evlist__add(struct prof_evlist *evlist, char *str)
 	name = prof_evsel__parse(str, &attr);
 	if (name == NULL) {
 		LOG_ERROR("Failed to parse event %s", str);
+	} else if (!prof_pmu__is_supported(&attr)) {
+		// e.g. hardware events in a VM without virtual PMU
+		LOG_WARN("Event %s is not supported, dropped", name);
+		free(name);
 	} else {
 		evsel = prof_evsel__new(NULL, name);
 		if (evsel == NULL) {
 			LOG_ERROR("Failed to create prof_evsel for %s",
 							name);
+			free(name);
 		} else {
+			free(name);
 			prof_evsel__init(evsel, &attr, evlist->nr_entries);
 			evsel->evlist = evlist;
 			list_add_tail(&evsel->node, &evlist->entries);
@@ -70,6 +77,21 @@ __prof_evlist__add(struct prof_evlist *evlist, char *str)
 }
 
 /* Usage: <event1>:<opt_list1>,<event2>:<opt_list2>,...*/
+/* Find the ',' ending the event at 'str', skipping the ones in the
+ * terms "<pmu>/.../" */
+static char *__next_event(char *str)
+{
+	bool in_terms = false;
+
+	for (; *str != '\0'; str++) {
+		if (*str == '/')
+			in_terms = !in_terms;
+		else if (*str == ',' && !in_terms)
+			return str;
+	}
+	return NULL;
+}
+
 int prof_evlist__add_from_str(struct prof_evlist *evlist,
 				const char *str)
 {
@@ -82,7 +104,7 @@ int prof_evlist__add_from_str(struct prof_evlist *evlist,
 	len = strlen(str);
 	tmp = strdup(str);
 	pcur = tmp;
-	while ((pnext = strchr(pcur, ',')) != NULL) {
+	while ((pnext = __next_event(pcur)) != NULL) {
 		*pnext = '\0';
 
 		added += __prof_evlist__add(evlist, pcur);
@@ -170,6 +192,234 @@ int prof_evlist__counter_nr(struct prof_evlist *evlist)
 	return evlist->nr_entries;
 }
 
+int prof_evlist__set_group(struct prof_evlist *evlist)
+{
+	struct prof_evsel *evsel = NULL, *leader = NULL;
+	int counters = 0, used = 0;
+
+	if (evlist->nr_entries == 0)
+		return -1;
+
+	evlist__for_each(evlist, evsel) {
+		if (evsel->is_open) {
+			LOG_ERROR("Events are already open, cannot group them");
+			return -1;
+		}
+	}
+
+	// a new group starts when the counters of the PMU are used up,
+	// pseudo-events have no fd to join a group
+	counters = prof_pmu__nr_counters();
+	evlist->nr_groups = 0;
+	evlist__for_each(evlist, evsel) {
+		if (prof_evsel__is_pseudo(evsel))
+			continue;
+
+		if (!leader || (prof_pmu__use_counter(&evsel->attr) &&
+						used == counters)) {
+			leader = evsel;
+			leader->attr.read_format = PROF_GROUP_READ_FORMAT;
+			evlist->nr_groups++;
+			used = 0;
+		}
+		if (prof_pmu__use_counter(&evsel->attr))
+			used++;
+
+		// members are enabled and disabled with the leader
+		evsel->leader = leader;
+		evsel->attr.disabled = (evsel == leader);
+	}
+
+	if (evlist->nr_groups == 0) {
+		LOG_INFO("No perf event to group");
+		return 0;
+	}
+
+	evlist->group = true;
+	LOG_INFO("Group %d events into %d groups of at most %d counters",
+					evlist->nr_entries, evlist->nr_groups, counters);
+	return 0;
+}
+
+int prof_evlist__nr_counters(struct prof_evlist *evlist)
+{
+	struct prof_evsel *evsel = NULL;
+	int nr = 0;
+
+	evlist__for_each(evlist, evsel) {
+		if (prof_pmu__use_counter(&evsel->attr))
+			nr++;
+	}
+	return nr;
+}
+
+/* Scale a count of a multiplexed event to its enabled time */
+static inline uint64_t __scale(uint64_t count, uint64_t enabled,
+				uint64_t running)
+{
+	if (running == 0)
+		return 0;
+	if (running >= enabled)
+		return count;
+	return (uint64_t)((double)count * enabled / running);
+}
+
+/* Data of the 'i'th event 'evsel' for the calling thread */
+static inline struct thread_data *__evlist__data(struct prof_evsel *evsel,
+				struct thread_data *data, int i, int thread)
+{
+	return data ? &data[i] : &evsel->per_thread[thread];
+}
+
+/* Read the group of 'leader', the 'first' event of the evlist. Its
+ * members follow it, between the pseudo-events. */
+static int __evlist__read_group(struct prof_evlist *evlist,
+				struct prof_evsel *leader, int first,
+				struct thread_data *data, int thread, uint64_t *counts)
+{
+	struct prof_evsel *evsel = NULL;
+	union {
+		struct prof_group_read data;
+		uint64_t buf[3 + PROF_EVENT_MAX];
+	} group;
+	uint64_t enabled = 0, running = 0;
+	uint32_t seq;
+	int i = 0, member = 0, last = first;
+
+	// one rdpmc sweep while the group is on the PMU, or while it's
+	// multiplexed out, the members are scheduled with the leader,
+	// so the times of the leader apply to all of them. Each member
+	// is only consistent by itself, so the sweep is retried with
+	// read() if the group was scheduled in or out meanwhile.
+	seq = prof_evsel__rdpmc_seq(__evlist__data(leader, data, first, thread));
+	i = first;
+	for (evsel = leader; &evsel->node != &evlist->entries;
+			evsel = list_next_entry(evsel, node), i++) {
+		if (prof_evsel__is_pseudo(evsel))
+			continue;
+		if (evsel->leader != leader)
+			break;
+		if (!prof_evsel__rdpmc_times(
+						__evlist__data(evsel, data, i, thread),
+						&counts[i], evsel == leader ? &enabled : NULL,
+						&running))
+			goto read_group;
+		last = i;
+	}
+	if (prof_evsel__rdpmc_seq(__evlist__data(leader, data, first, thread))
+					!= seq)
+		goto read_group;
+
+	for (i = first, evsel = leader; i <= last;
+			evsel = list_next_entry(evsel, node), i++) {
+		if (!prof_evsel__is_pseudo(evsel))
+			counts[i] = __scale(counts[i], enabled, running);
+	}
+	return 0;
+
+read_group:
+	if (prof_evsel__read_group(leader,
+					__evlist__data(leader, data, first, thread),
+					&group.data, sizeof(group)) < 0)
+		return -1;
+
+	// the values are in the order of the members
+	i = first;
+	for (evsel = leader; &evsel->node != &evlist->entries;
+			evsel = list_next_entry(evsel, node), i++) {
+		if (prof_evsel__is_pseudo(evsel))
+			continue;
+		if (evsel->leader != leader)
+			break;
+		if (member < (int)group.data.nr)
+			counts[i] = __scale(group.data.values[member++],
+							group.data.time_enabled,
+							group.data.time_running);
+		else
+			counts[i] = 0;
+	}
+	return 0;
+}
+
+static int __evlist__read_groups(struct prof_evlist *evlist,
+				struct thread_data *data, int thread, uint64_t *counts)
+{
+	struct prof_evsel *evsel = NULL;
+	int i = 0;
+
+	evlist__for_each(evlist, evsel) {
+		if (prof_evsel__is_pseudo(evsel))
+			counts[i] = prof_evsel__rdpmc(evsel, NULL);
+		else if (evsel->leader == evsel &&
+				__evlist__read_group(evlist, evsel, i, data, thread,
+								counts) < 0)
+			return -1;
+		i++;
+	}
+	return 0;
+}
+
+int prof_evlist__read(struct prof_evlist *evlist, struct thread_data *data,
+				int thread, uint64_t *counts)
+{
+	struct prof_evsel *evsel = NULL;
+	int i = 0;
+
+	if (evlist->group)
+		return __evlist__read_groups(evlist, data, thread, counts);
+
+	evlist__for_each(evlist, evsel) {
+		counts[i] = prof_evsel__rdpmc(evsel,
+						__evlist__data(evsel, data, i, thread));
+		i++;
+	}
+	return 0;
+}
+
+int prof_evlist__open_self(struct prof_evlist *evlist,
+				struct thread_data *data)
+{
+	struct prof_evsel *evsel = NULL;
+	int i = 0, group_fd = -1;
+
+	evlist__for_each(evlist, evsel) {
+		// the leader is opened first
+		group_fd = -1;
+		if (evsel->leader && evsel->leader != evsel)
+			group_fd = data[evsel->leader->idx].fd;
+		if (prof_evsel__open_self(evsel, &data[i], group_fd) < 0)
+			goto fail_close;
+		i++;
+	}
+
+	// a member joining an active group only counts from its next
+	// schedule, so each group is enabled once all members joined
+	i = 0;
+	evlist__for_each(evlist, evsel) {
+		if (evlist->group && evsel->leader == evsel)
+			ioctl(data[i].fd, PERF_EVENT_IOC_ENABLE, PERF_IOC_FLAG_GROUP);
+		else if (!evlist->group && data[i].fd >= 0)
+			ioctl(data[i].fd, PERF_EVENT_IOC_ENABLE, 0);
+		i++;
+	}
+	return 0;
+
+fail_close:
+	// members before their leader
+	while (--i >= 0)
+		prof_evsel__close_self(&data[i]);
+	return -1;
+}
+
+void prof_evlist__close_self(struct prof_evlist *evlist,
+				struct thread_data *data)
+{
+	int i;
+
+	for (i = evlist->nr_entries - 1; i >= 0; i--)
+		prof_evsel__close_self(&data[i]);
+}
+
 /* pid == 0 => current process */
 int
 prof_evlist__create_threadmap(struct prof_evlist *evlist,
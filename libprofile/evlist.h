@@ -6,6 +6,7 @@
 #include "list.h"
 
 struct thread_map;
+struct thread_data;
 struct prof_evsel;
 struct list_head;
 
@@ -14,6 +15,10 @@ struct prof_evlist {
 
 	int nr_entries;
 //	bool enabled;
+	/* The events are opened as perf groups, see
+	 * 'prof_evlist__set_group()' */
+	bool group;
+	int nr_groups;
 
 	struct thread_map *threads;
 	struct prof_evsel *selected;
@@ -44,6 +49,33 @@ int prof_evlist__counter_nr(struct prof_evlist *evlist);
 
 int prof_evlist__create_threadmap(struct prof_evlist *evlist, int pid);
 
+/* Open the events as perf groups, so that the events of a group are
+ * scheduled together. The events are split in order into groups that
+ * fit the counters of the PMU, see 'prof_pmu__nr_counters()'. The
+ * kernel rotates the groups when they don't fit together, and the
+ * counts of each group are scaled by its enabled and running times.
+ * It must be called before the events are opened. */
+int prof_evlist__set_group(struct prof_evlist *evlist);
+/* Number of events using a counter of the PMU */
+int prof_evlist__nr_counters(struct prof_evlist *evlist);
+
+/* Open all events for the calling thread only, into 'data' of
+ * 'nr_entries' entries. It needs no threadmap, so that threads
+ * created at any time can monitor themselves. Return 0 on success. */
+int prof_evlist__open_self(struct prof_evlist *evlist,
+				struct thread_data *data);
+void prof_evlist__close_self(struct prof_evlist *evlist,
+				struct thread_data *data);
+
+/* Read the counters of all events for the calling thread into
+ * 'counts', in the order of the evlist. 'data' is from
+ * 'prof_evlist__open_self()', or NULL for the threadmap entry
+ * 'thread' opened by 'prof_evlist__start()'. A group is read in one
+ * rdpmc sweep, or one read() when it's not on the PMU, and the counts
+ * are scaled by the enabled and running times. Return 0 on success. */
+int prof_evlist__read(struct prof_evlist *evlist, struct thread_data *data,
+				int thread, uint64_t *counts);
+
 static inline struct
 prof_evsel *prof_evlist__first(struct prof_evlist *evlist)
 {
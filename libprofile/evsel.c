@@ -6,6 +6,8 @@
 #include "threadmap.h"
 #include "inst.h"
 
+#include <ctype.h>
+
 struct prof_evsel *
 prof_evsel__new(struct perf_event_attr *attr,
 				const char *name)
@@ -99,13 +101,14 @@ prof_evsel__enable(struct prof_evsel *evsel, int nthreads)
 			goto out_failed;
 		}
 
-		// get hardware counter index
+		// the index may change at each schedule, it's only logged
 		pc = (struct perf_event_mmap_page *)data->mm_page;
-		data->hwc_index = pc->index;
-
 		LOG_INFO("Enable event %s for thread %d, hwc_index %u, cap_user_rdpmc %u",
-						evsel->name, thread, data->hwc_index,
+						evsel->name, thread, pc->index,
 						pc->cap_user_rdpmc);
+		if (!pc->cap_user_rdpmc)
+			LOG_WARN("No user rdpmc for event %s, read() is used",
+							evsel->name);
 	}
 	evsel->is_enable = 1;
 
@@ -170,7 +173,7 @@ int
 prof_evsel__open(struct prof_evsel *evsel,
 				struct thread_map *threads)
 {
-	int nthread = 0, thread, pid = 0, err = 0;
+	int nthread = 0, thread, pid = 0, err = 0, group_fd = -1;
 	struct thread_data *info = NULL;
 	enum {
 		NO_CHANGE, SET_TO_MAX, INCREASED_MAX,
@@ -201,15 +204,23 @@ prof_evsel__open(struct prof_evsel *evsel,
 	for (thread = 0; thread < nthread; thread++) {
 		pid = PID(threads, thread);
 		info = &(evsel->per_thread[thread]);
+		if (prof_evsel__is_pseudo(evsel)) {
+			info->fd = -1;
+			continue;
+		}
 
 		LOG_INFO("Open event %s %u %lu for pid %d",
 						evsel->name,
 						(unsigned int)evsel->attr.type,
 						(unsigned long)evsel->attr.config,
 						pid);
+		// members join the group of the leader, opened before
+		group_fd = -1;
+		if (evsel->leader && evsel->leader != evsel)
+			group_fd = FD(evsel->leader, thread);
 retry_open:
 		info->fd = syscall(__NR_perf_event_open,
-						&evsel->attr, pid, -1, -1, 0);
+						&evsel->attr, pid, -1, group_fd, 0);
 		if (info->fd < 0) {
 			err = -errno;
 			if (errno != 2)
@@ -260,11 +271,58 @@ try_fallback:
 	return err;
 }
 
+int
+prof_evsel__open_self(struct prof_evsel *evsel, struct thread_data *data,
+				int group_fd)
+{
+	data->mm_page = NULL;
+	data->fd = -1;
+	if (prof_evsel__is_pseudo(evsel))
+		return 0;
+
+	data->fd = syscall(__NR_perf_event_open, &evsel->attr, 0, -1,
+					group_fd, 0);
+	if (data->fd < 0) {
+		LOG_ERROR("Failed to open event %s for thread %ld, errno %d",
+						evsel->name, syscall(__NR_gettid), errno);
+		return -1;
+	}
+
+	// software events are never on the PMU, they are read()
+	if (evsel->attr.type == PERF_TYPE_SOFTWARE)
+		return 0;
+
+	// a missing page only costs the rdpmc fast path
+	data->mm_page = mmap(NULL, PAGE_SIZE, PROT_READ, MAP_SHARED,
+					data->fd, 0);
+	if (data->mm_page == MAP_FAILED) {
+		LOG_WARN("Failed to mmap event %s, err %d, read() is used",
+						evsel->name, errno);
+		data->mm_page = NULL;
+	}
+	return 0;
+}
+
+void
+prof_evsel__close_self(struct thread_data *data)
+{
+	if (data->mm_page) {
+		munmap(data->mm_page, PAGE_SIZE);
+		data->mm_page = NULL;
+	}
+	if (data->fd >= 0) {
+		ioctl(data->fd, PERF_EVENT_IOC_DISABLE, 0);
+		close(data->fd);
+		data->fd = -1;
+	}
+}
+
 /* Options:
  * - u: count in user space
  * - k: count in kernel space
+ * - p: ask for more precise IP, up to 'ppp'
  */
-static void
+static int
 __evsel__parse_opt(char *opt,
 				struct perf_event_attr *attr)
 {
@@ -280,8 +338,16 @@ __evsel__parse_opt(char *opt,
 		case 'k':
 			kernel = true;
 			break;
+		case 'p':
+			if (attr->precise_ip >= 3) {
+				LOG_ERROR("Too many precise modifiers in %s", opt);
+				return -1;
+			}
+			attr->precise_ip++;
+			break;
 		default:
 			LOG_ERROR("Unknown argument %c", opt[i]);
+			return -1;
 		}
 	}
 
@@ -289,86 +355,250 @@ __evsel__parse_opt(char *opt,
 		attr->exclude_kernel = 1;
 	else if (!user && kernel)
 		attr->exclude_user = 1;
+	return 0;
+}
+
+/* Raw event "r<hex>" */
+static int
+__evsel__parse_raw(const char *name, struct perf_event_attr *attr)
+{
+	char *end = NULL;
+
+	if (name[0] != 'r' || !isxdigit(name[1]))
+		return -1;
+
+	attr->config = strtoull(name + 1, &end, 16);
+	if (*end != '\0')
+		return -1;
+	attr->type = PERF_TYPE_RAW;
+	return 0;
 }
 
-/* Usage: <event_name>:<opt1><opt2>... */
+/* Usage:
+ *   <event_name>[:<opt1><opt2>...]
+ *     a generic event of 'pmu_list', a raw event 'r<hex>', or an
+ *     alias in the 'events' of a sysfs PMU
+ *   <pmu>/<term>[=<value>],.../[<opt1><opt2>...]
+ *     terms of a sysfs PMU, see 'prof_pmu__parse_terms()'
+ * Return the name without the modifiers.
+ */
 char *
 prof_evsel__parse(const char *str, struct perf_event_attr *attr)
 {
-	char *s = NULL, *p = NULL;
+	char *s = NULL, *p = NULL, *terms = NULL;
 	char *name = NULL, *opt = NULL;
 	struct prof_pmu *pmu = NULL;
 
+	memset(attr, 0, sizeof(*attr));
+	attr->size = sizeof(*attr);
+	attr->disabled = 1;
+
 	s = strdup(str);
-	p = strchr(s, ':');
+	if (s == NULL)
+		return NULL;
+
+	p = strchr(s, '/');
 	if (p != NULL) {
-		if (strlen(p) > 1) {
-			opt = p + 1;
+		terms = p + 1;
+		p = strchr(terms, '/');
+		if (p == NULL) {
+			LOG_ERROR("No ending '/' in event %s", str);
+			goto fail;
+		}
+		// options follow the '/', or a ':'
+		opt = strdup(p[1] == ':' ? p + 2 : p + 1);
+		p[1] = '\0';
+	} else {
+		p = strchr(s, ':');
+		if (p != NULL) {
+			opt = strdup(p + 1);
+			*p = '\0';
 		}
-		*p = '\0';
 	}
 
-	name = s;
-	pmu = prof_pmu__find(name);
-	if (pmu == NULL) {
-		free(s);
-		LOG_ERROR("No event named %s", name);
-		return NULL;
+	name = strdup(s);
+	if (name == NULL)
+		goto fail;
+
+	if (terms != NULL) {
+		// "<pmu>/<terms>/" split into "<pmu>" and "<terms>"
+		terms[-1] = '\0';
+		terms[strlen(terms) - 1] = '\0';
+		if (prof_pmu__parse_terms(s, terms, attr) < 0)
+			goto fail_name;
+	} else if ((pmu = prof_pmu__find(s)) != NULL) {
+		attr->type = pmu->type;
+		attr->config = pmu->config;
+	} else if (__evsel__parse_raw(s, attr) < 0 &&
+			prof_pmu__parse_alias(s, attr) < 0) {
+		LOG_ERROR("No event named %s", s);
+		goto fail_name;
 	}
 
-	memset(attr, 0, sizeof(*attr));
-	attr->type = pmu->type;
-	attr->config = pmu->config;
-	attr->size = sizeof(*attr);
-	attr->disabled = 1;
+	if (opt != NULL && __evsel__parse_opt(opt, attr) < 0)
+		goto fail_name;
 
-	if (opt != NULL)
-		__evsel__parse_opt(opt, attr);
+	free(opt);
+	free(s);
 	return name;
+
+fail_name:
+	free(name);
+fail:
+	free(opt);
+	free(s);
+	return NULL;
+}
+
+/* Pseudo-events, see 'prof_pmu__is_supported()' for their support */
+static inline uint64_t
+__evsel__read_pseudo(struct prof_evsel *evsel)
+{
+	struct timespec ts;
+
+	if (evsel->attr.config == PROF_PSEUDO_TSC)
+		return rdtsc();
+
+	// the vDSO reads it without a syscall
+	clock_gettime(CLOCK_MONOTONIC_RAW, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
 }
 
 #if 1
 uint64_t
-prof_evsel__read(struct prof_evsel *evsel, int thread)
+prof_evsel__read(struct prof_evsel *evsel, struct thread_data *data)
 {
-	uint64_t data;
-	int fd = -1;
+	uint64_t count;
 
-	if (!evsel->is_enable)
-		return 0;
+	if (prof_evsel__is_pseudo(evsel))
+		return __evsel__read_pseudo(evsel);
 
-	fd = FD(evsel, thread);
-	if (fd < 0) {
-		LOG_ERROR("Wrong fd value %d", fd);
+	if (data->fd < 0) {
+		LOG_ERROR("Wrong fd value %d of event %s", data->fd, evsel->name);
 		return UINT64_MAX;
 	}
 
-	if (readn(fd, &data, sizeof(uint64_t)) < 0) {
+	if (readn(data->fd, &count, sizeof(uint64_t)) < 0) {
 		LOG_ERROR("Failed to read counter");
 		return UINT64_MAX;
 	}
 
-	return data;
+	return count;
 }
 #endif
 
+/* Self-monitoring read, see 'struct perf_event_mmap_page'
+ * The kernel updates the page under the seqlock 'lock' when the
+ * event is scheduled. 'index' is the counter + 1 while the event is
+ * on the PMU, and 0 otherwise. The count is 'offset' plus the
+ * 'pmc_width'-bit value of the counter, sign-extended. The times
+ * of the page are as of the last schedule, the time since then is
+ * converted from the TSC with 'cap_user_time'.
+ * An event multiplexed out does not count, its count is 'offset'
+ * and only its enabled time goes on. With the times, it is only read
+ * so if 'cap_user_time' tells the enabled time.
+ */
+static inline bool
+__evsel__rdpmc(struct perf_event_mmap_page *pc, uint64_t *count,
+				uint64_t *enabled, uint64_t *running)
+{
+	uint32_t seq, index;
+	uint64_t width, cyc, quot, rem, delta;
+	int64_t pmc;
+
+	do {
+		seq = pc->lock;
+		barrier();
+
+		index = pc->index;
+		if (unlikely(!pc->cap_user_rdpmc))
+			return false;
+
+		*count = pc->offset;
+		if (likely(index)) {
+			width = pc->pmc_width;
+			rdpmcl(index - 1, pmc);
+			pmc <<= 64 - width;
+			pmc >>= 64 - width;
+			*count += pmc;
+		} else if (enabled && !pc->cap_user_time)
+			return false;
+
+		if (enabled) {
+			*enabled = pc->time_enabled;
+			*running = pc->time_running;
+			if (pc->cap_user_time) {
+				cyc = rdtsc();
+				quot = cyc >> pc->time_shift;
+				rem = cyc & (((uint64_t)1 << pc->time_shift) - 1);
+				delta = pc->time_offset + quot * pc->time_mult
+						+ ((rem * pc->time_mult) >> pc->time_shift);
+				*enabled += delta;
+				if (index)
+					*running += delta;
+			}
+		}
+
+		barrier();
+	} while (pc->lock != seq);
+
+	return true;
+}
+
 uint64_t
-prof_evsel__rdpmc(struct prof_evsel *evsel, int thread)
+prof_evsel__rdpmc(struct prof_evsel *evsel, struct thread_data *data)
 {
-	uint64_t value;
-	uint32_t index;
-//	struct perf_event_mmap_page *pc = NULL;
+	struct perf_event_mmap_page *pc = NULL;
+	uint64_t count;
 
-	if (!evsel->is_enable) {
-		return 0;
-	}
+	if (prof_evsel__is_pseudo(evsel))
+		return __evsel__read_pseudo(evsel);
+
+	pc = (struct perf_event_mmap_page *)data->mm_page;
+	if (unlikely(!pc || !__evsel__rdpmc(pc, &count, NULL, NULL)))
+		return prof_evsel__read(evsel, data);
+	return count;
+}
 
-//	pc = (struct perf_event_mmap_page *)evsel->per_thread[thread].mm_page;
-	index = evsel->per_thread[thread].hwc_index;
+bool
+prof_evsel__rdpmc_times(struct thread_data *data, uint64_t *count,
+				uint64_t *enabled, uint64_t *running)
+{
+	struct perf_event_mmap_page *pc = NULL;
 
-//	rdpmcl(index - 1, value);
-	rdpmcl(index - 1, value);
-//	fprintf(stdout, "hwc %u, value %lu\n", index, value);
+	pc = (struct perf_event_mmap_page *)data->mm_page;
+	return pc && __evsel__rdpmc(pc, count, enabled, running);
+}
+
+uint32_t
+prof_evsel__rdpmc_seq(struct thread_data *data)
+{
+	struct perf_event_mmap_page *pc = NULL;
+	uint32_t seq;
 
-	return value;
+	pc = (struct perf_event_mmap_page *)data->mm_page;
+	if (!pc)
+		return 0;
+	seq = pc->lock;
+	barrier();
+	return seq;
+}
+
+int
+prof_evsel__read_group(struct prof_evsel *leader, struct thread_data *data,
+				struct prof_group_read *buf, size_t size)
+{
+	if (data->fd < 0) {
+		LOG_ERROR("Wrong fd value %d of group %s", data->fd,
+						leader->name);
+		return -1;
+	}
+
+	// the size is checked by the kernel against the members
+	if (read(data->fd, buf, size) < 0) {
+		LOG_ERROR("Failed to read group %s, err %d",
+						leader->name, errno);
+		return -1;
+	}
+	return 0;
 }
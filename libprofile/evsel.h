@@ -3,24 +3,32 @@
 
 #include "util.h"
 #include "list.h"
+#include "pmu.h"
 
 struct prof_evlist;
 struct prof_evsel;
 struct thread_map;
 
-/* thread private data */
+/* thread private data
+ * It's in 'per_thread' of the evsel for the threads of its threadmap,
+ * or owned by a thread monitoring itself, see 'prof_evsel__open_self()'.
+ */
 struct thread_data {
 	/* file descriptor of the perf event */
 	int fd;
-	/* hardware counter index */
-	uint32_t hwc_index;
-	/* pointer to the MMAP oage of each perf event */
+	/* pointer to the MMAP page of each perf event
+	 * It tells whether and where the counter can be read with
+	 * rdpmc, see 'prof_evsel__rdpmc()'.
+	 */
 	void *mm_page;
 };
 
 struct prof_evsel {
 	struct list_head node;
 	struct prof_evlist *evlist;
+	/* Leader of the perf group, the first event of the evlist, or
+	 * NULL if the events are not grouped */
+	struct prof_evsel *leader;
 	struct perf_event_attr attr;
 	struct thread_map *threads;
 	struct thread_data *per_thread;
@@ -41,6 +49,26 @@ struct prof_evsel {
 #define FD(evsel, thread) \
 		((evsel->per_thread[thread]).fd)
 
+/* Pseudo-events are read in user space, they have no perf fd and
+ * are never in the perf group */
+static inline bool prof_evsel__is_pseudo(struct prof_evsel *evsel)
+{
+	return evsel->attr.type == PROF_PMU_TYPE_PSEUDO;
+}
+
+/* read_format of a group leader. A read of the leader returns
+ * 'struct prof_group_read', with one value per member. */
+#define PROF_GROUP_READ_FORMAT (PERF_FORMAT_GROUP | \
+				PERF_FORMAT_TOTAL_TIME_ENABLED | \
+				PERF_FORMAT_TOTAL_TIME_RUNNING)
+
+struct prof_group_read {
+	uint64_t nr;
+	uint64_t time_enabled;
+	uint64_t time_running;
+	uint64_t values[];
+};
+
 struct prof_evsel *prof_evsel__new(struct perf_event_attr *attr,
 				const char *name);
 
@@ -60,6 +88,34 @@ void prof_evsel__close(struct prof_evsel *evsel);
 char *prof_evsel__parse(const char *str,
 				struct perf_event_attr *attr);
 
-uint64_t prof_evsel__read(struct prof_evsel *evsel, int thread);
-uint64_t prof_evsel__rdpmc(struct prof_evsel *evsel, int thread);
+/* Open and map the event for the calling thread only, into 'data'.
+ * 'group_fd' is the fd of the leader for a member, or -1. It's left
+ * disabled, if 'attr.disabled', for the caller to enable it. Return
+ * 0 on success. */
+int prof_evsel__open_self(struct prof_evsel *evsel,
+				struct thread_data *data, int group_fd);
+void prof_evsel__close_self(struct thread_data *data);
+
+/* The reads take the 'thread_data' of the thread, either
+ * '&evsel->per_thread[thread]' or the one opened by the thread */
+uint64_t prof_evsel__read(struct prof_evsel *evsel,
+				struct thread_data *data);
+/* Read the counter of the calling thread with rdpmc, or from the
+ * page while it's multiplexed out. It falls back to
+ * 'prof_evsel__read()' if user rdpmc is disabled. Pseudo-events are
+ * read directly. */
+uint64_t prof_evsel__rdpmc(struct prof_evsel *evsel,
+				struct thread_data *data);
+/* Same without fallback, also giving the enabled and running times
+ * of the event. Return false if rdpmc cannot be used. */
+bool prof_evsel__rdpmc_times(struct thread_data *data, uint64_t *count,
+				uint64_t *enabled, uint64_t *running);
+/* Sequence of the page of the event, it changes each time the event
+ * is scheduled in or out, 0 without page */
+uint32_t prof_evsel__rdpmc_seq(struct thread_data *data);
+/* Read all counters of the group of 'leader' at once into 'buf' of
+ * 'size' bytes */
+int prof_evsel__read_group(struct prof_evsel *leader,
+				struct thread_data *data,
+				struct prof_group_read *buf, size_t size);
 #endif /* _PROFILE_EVSEL_H_ */
@@ -3,6 +3,9 @@
 
 #define _GNU_SOURCE
 
+#include <stdint.h>
+#include <time.h>
+
 /*
  * both i386 and x86_64 returns 64-bit value in edx:eax, but gcc's "A"
  * constraint has different meanings. For i386, "A" means exactly
@@ -38,6 +41,29 @@ static __always_inline unsigned long long rdtsc(void)
 	return EAX_EDX_VAL(val, low, high);
 }
 
+/* TSC ticks per second, measured against CLOCK_MONOTONIC_RAW over
+ * 10ms. Return 0 if the TSC did not advance. */
+static inline uint64_t tsc_measure_hz(void)
+{
+	struct timespec t0, t1, delay = {
+		.tv_sec = 0,
+		.tv_nsec = 10000000,
+	};
+	uint64_t c0, c1, ns;
+
+	clock_gettime(CLOCK_MONOTONIC_RAW, &t0);
+	c0 = rdtsc();
+	nanosleep(&delay, NULL);
+	clock_gettime(CLOCK_MONOTONIC_RAW, &t1);
+	c1 = rdtsc();
+
+	ns = (t1.tv_sec - t0.tv_sec) * 1000000000UL
+			+ t1.tv_nsec - t0.tv_nsec;
+	if (!ns || c1 <= c0)
+		return 0;
+	return (c1 - c0) * 1000000000UL / ns;
+}
+
 static inline unsigned long long native_read_pmc(int counter)
 {
 	DECLARE_ARGS(val, low, high);
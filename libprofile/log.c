@@ -0,0 +1,28 @@
+#include "log.h"
+#include "profile.h"
+
+static void __log_write(const struct prof_log_record *rec)
+{
+	prof_log_write(rec->pid, rec->level, rec->msg);
+}
+
+static struct prof_logger logger = {
+	.write = __log_write,
+	.flush = prof_log_flush,
+	.warn_level = PROF_LOG_WARN,
+};
+
+int prof_log_start(void)
+{
+	return prof_logger_start(&logger);
+}
+
+void prof_log_stop(void)
+{
+	prof_logger_stop(&logger);
+}
+
+bool prof_log_push(int pid, uint8_t level, const char *format, va_list va)
+{
+	return prof_logger_push(&logger, pid, level, format, va);
+}
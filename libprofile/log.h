@@ -0,0 +1,26 @@
+#ifndef _PROFILE_LOG_H_
+#define _PROFILE_LOG_H_
+
+#include <stdarg.h>
+
+#include "util.h"
+#include "logring.h"
+
+/* Asynchronous logging of 'prof_log()', see logring.h
+ * Before 'prof_log_start()' and after 'prof_log_stop()', and in the
+ * child of a fork, logs are written synchronously.
+ */
+
+/* Start the flusher. Return 0 on success. */
+int prof_log_start(void);
+/* Drain all rings and stop the flusher */
+void prof_log_stop(void);
+/* Push a record into the ring of the current thread. Return false
+ * if the logger is not running, then the caller writes it. */
+bool prof_log_push(int pid, uint8_t level, const char *format, va_list va);
+
+/* Write a log line to the log file, or stdout/stderr */
+void prof_log_write(int pid, uint8_t level, const char *msg);
+void prof_log_flush(void);
+
+#endif /* _PROFILE_LOG_H_ */
@@ -0,0 +1,229 @@
+#include <sched.h>
+
+#include "util.h"
+#include "logring.h"
+
+/* Loggers ever started, a lock-free list only growing at the head */
+static struct prof_logger *loggers = NULL;
+static pthread_once_t fork_once = PTHREAD_ONCE_INIT;
+
+static void __log_key_destructor(void *arg)
+{
+	struct prof_log_ring *ring = (struct prof_log_ring *)arg;
+
+	/* Later logs of this thread take a ring again */
+	if (ring)
+		__atomic_store_n(&ring->active, 0, __ATOMIC_RELEASE);
+}
+
+/* Take a ring released by an exited thread, or create one */
+static struct prof_log_ring *__log_ring_get(struct prof_logger *logger,
+				int pid)
+{
+	struct prof_log_ring *ring = NULL;
+	uint32_t inactive;
+
+	for (ring = __atomic_load_n(&logger->rings, __ATOMIC_ACQUIRE);
+			ring; ring = ring->next) {
+		inactive = 0;
+		if (__atomic_compare_exchange_n(&ring->active, &inactive, 1,
+						false, __ATOMIC_ACQUIRE, __ATOMIC_RELAXED))
+			goto out;
+	}
+
+	ring = (struct prof_log_ring *)zalloc(sizeof(struct prof_log_ring));
+	if (!ring)
+		return NULL;
+	ring->active = 1;
+
+	ring->next = __atomic_load_n(&logger->rings, __ATOMIC_RELAXED);
+	while (!__atomic_compare_exchange_n(&logger->rings, &ring->next, ring,
+						true, __ATOMIC_RELEASE, __ATOMIC_RELAXED))
+		;
+
+out:
+	ring->pid = pid;
+	pthread_setspecific(logger->key, ring);
+	return ring;
+}
+
+bool prof_logger_push(struct prof_logger *logger, int pid, uint8_t level,
+				const char *format, va_list va)
+{
+	struct prof_log_ring *ring = NULL;
+	struct prof_log_record *rec = NULL;
+	uint64_t head, tail;
+	int len;
+
+	/* Once the stop sees no push in progress, the running state is
+	 * false for all of them, and no record is pushed after the last
+	 * drain */
+	__atomic_fetch_add(&logger->pushing, 1, __ATOMIC_SEQ_CST);
+	if (!__atomic_load_n(&logger->running, __ATOMIC_SEQ_CST))
+		goto fail;
+
+	ring = (struct prof_log_ring *)pthread_getspecific(logger->key);
+	if (unlikely(ring == NULL)) {
+		ring = __log_ring_get(logger, pid);
+		if (!ring)
+			goto fail;
+	}
+
+	head = ring->head;
+	tail = __atomic_load_n(&ring->tail, __ATOMIC_ACQUIRE);
+	if (head - tail >= PROF_LOG_RING_SIZE) {
+		__atomic_store_n(&ring->dropped, ring->dropped + 1,
+						__ATOMIC_RELAXED);
+		goto out;
+	}
+
+	rec = &ring->records[head & PROF_LOG_RING_MASK];
+	clock_gettime(CLOCK_REALTIME_COARSE, &rec->ts);
+	rec->pid = pid;
+	rec->level = level;
+	len = vsnprintf(rec->msg, PROF_LOG_MSG_MAX, format, va);
+	if (len < 0)
+		len = 0;
+	else if (len >= PROF_LOG_MSG_MAX)
+		len = PROF_LOG_MSG_MAX - 1;
+	rec->len = len;
+
+	__atomic_store_n(&ring->head, head + 1, __ATOMIC_RELEASE);
+out:
+	__atomic_fetch_sub(&logger->pushing, 1, __ATOMIC_RELEASE);
+	return true;
+
+fail:
+	__atomic_fetch_sub(&logger->pushing, 1, __ATOMIC_RELEASE);
+	return false;
+}
+
+/* Drain all rings of 'logger' */
+static void __log_drain(struct prof_logger *logger)
+{
+	struct prof_log_ring *ring = NULL;
+	struct prof_log_record drop;
+	uint64_t head, tail, dropped;
+	bool written = false;
+
+	for (ring = __atomic_load_n(&logger->rings, __ATOMIC_ACQUIRE);
+			ring; ring = ring->next) {
+		head = __atomic_load_n(&ring->head, __ATOMIC_ACQUIRE);
+
+		for (tail = ring->tail; tail != head; tail++) {
+			logger->write(&ring->records[tail & PROF_LOG_RING_MASK]);
+			written = true;
+		}
+		__atomic_store_n(&ring->tail, head, __ATOMIC_RELEASE);
+
+		dropped = __atomic_load_n(&ring->dropped, __ATOMIC_RELAXED);
+		if (dropped != ring->reported) {
+			clock_gettime(CLOCK_REALTIME_COARSE, &drop.ts);
+			drop.pid = ring->pid;
+			drop.level = logger->warn_level;
+			drop.len = snprintf(drop.msg, PROF_LOG_MSG_MAX,
+							"%lu log records dropped",
+							(unsigned long)(dropped - ring->reported));
+			logger->write(&drop);
+			ring->reported = dropped;
+			written = true;
+		}
+	}
+
+	if (written)
+		logger->flush();
+}
+
+static void *__log_flusher(void *arg)
+{
+	struct prof_logger *logger = (struct prof_logger *)arg;
+	struct timespec delay = {
+		.tv_sec = 0,
+		.tv_nsec = PROF_LOG_FLUSH_INTERVAL * 1000000L,
+	};
+
+	while (!__atomic_load_n(&logger->stop, __ATOMIC_ACQUIRE)) {
+		__log_drain(logger);
+		nanosleep(&delay, NULL);
+	}
+
+	/* records pushed before the stop */
+	__log_drain(logger);
+	return NULL;
+}
+
+/* Child of a fork
+ * Only the forking thread is left, without the flushers. The records
+ * pushed before the fork are left to the parent, the rings of the
+ * other threads are released, and the child logs synchronously.
+ */
+static void __log_fork_child(void)
+{
+	struct prof_logger *logger = NULL;
+	struct prof_log_ring *ring = NULL, *self = NULL;
+
+	for (logger = loggers; logger; logger = logger->next) {
+		if (!logger->running)
+			continue;
+		logger->running = false;
+		logger->pushing = 0;
+
+		self = (struct prof_log_ring *)pthread_getspecific(logger->key);
+		for (ring = logger->rings; ring; ring = ring->next) {
+			ring->tail = ring->head;
+			ring->reported = ring->dropped;
+			if (ring != self)
+				ring->active = 0;
+		}
+	}
+}
+
+static void __log_fork_init(void)
+{
+	pthread_atfork(NULL, NULL, __log_fork_child);
+}
+
+int prof_logger_start(struct prof_logger *logger)
+{
+	if (logger->running)
+		return 0;
+
+	if (!logger->key_created) {
+		if (pthread_key_create(&logger->key, __log_key_destructor) != 0)
+			return -1;
+		logger->key_created = true;
+	}
+
+	if (pthread_once(&fork_once, __log_fork_init) != 0)
+		return -1;
+	if (!logger->registered) {
+		logger->next = __atomic_load_n(&loggers, __ATOMIC_RELAXED);
+		while (!__atomic_compare_exchange_n(&loggers, &logger->next,
+						logger, true, __ATOMIC_RELEASE, __ATOMIC_RELAXED))
+			;
+		logger->registered = true;
+	}
+
+	logger->stop = false;
+	if (pthread_create(&logger->flusher, NULL, __log_flusher, logger) != 0)
+		return -1;
+
+	__atomic_store_n(&logger->running, true, __ATOMIC_RELEASE);
+	return 0;
+}
+
+void prof_logger_stop(struct prof_logger *logger)
+{
+	if (!logger->running)
+		return;
+
+	/* New logs are written synchronously from now on. The logs
+	 * being pushed are waited for, and written by the last drain. */
+	__atomic_store_n(&logger->running, false, __ATOMIC_SEQ_CST);
+	while (__atomic_load_n(&logger->pushing, __ATOMIC_SEQ_CST))
+		sched_yield();
+
+	__atomic_store_n(&logger->stop, true, __ATOMIC_RELEASE);
+	pthread_join(logger->flusher, NULL);
+	__log_drain(logger);
+}
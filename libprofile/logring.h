@@ -0,0 +1,95 @@
+#ifndef _PROFILE_LOGRING_H_
+#define _PROFILE_LOGRING_H_
+
+/* Asynchronous logging of libprofile and libprobe, wrapped by the
+ * log.h of each
+ *
+ * Each logging thread owns a lock-free single-producer ring of
+ * binary records per logger. Pushing a record only formats the
+ * message into it, with a coarse timestamp. A background flusher
+ * drains the rings and hands the records to the 'write' callback of
+ * the logger, so that the application never waits for the file.
+ * When a ring is full, the record is dropped and counted, and the
+ * flusher reports the drops. Rings of exited threads are reused by
+ * new threads.
+ * Before 'prof_logger_start()' and after 'prof_logger_stop()', the
+ * push fails, and the caller writes the log synchronously. The stop
+ * waits for the pushes in progress, so each pushed record is written
+ * by the last drain. The child of a fork has no flusher, it logs
+ * synchronously until the logger is started again, and leaves the
+ * records pushed before the fork to the parent.
+ */
+
+#include <stdarg.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <time.h>
+#include <pthread.h>
+
+/* Records per ring, a power of 2 */
+#define PROF_LOG_RING_SIZE 128
+#define PROF_LOG_RING_MASK (PROF_LOG_RING_SIZE - 1)
+/* Max length of a message, longer ones are truncated */
+#define PROF_LOG_MSG_MAX 232
+/* Period of the flusher, in milliseconds */
+#define PROF_LOG_FLUSH_INTERVAL 10
+/* The producer and the flusher indices are on their own lines */
+#define PROF_LOG_CACHELINE 64
+
+struct prof_log_record {
+	struct timespec ts;
+	int32_t pid;
+	uint8_t level;
+	uint16_t len;
+	char msg[PROF_LOG_MSG_MAX];
+};
+
+struct prof_log_ring {
+	/* Next ring in the registry, rings are never removed */
+	struct prof_log_ring *next;
+	/* 1 if a thread owns the ring */
+	uint32_t active;
+	/* system thread ID of the owner */
+	int32_t pid;
+	/* Records dropped by the producer, and reported by the flusher */
+	uint64_t dropped;
+	uint64_t reported;
+	/* Written by the producer */
+	uint64_t head __attribute__((aligned(PROF_LOG_CACHELINE)));
+	/* Written by the flusher */
+	uint64_t tail __attribute__((aligned(PROF_LOG_CACHELINE)));
+	struct prof_log_record records[PROF_LOG_RING_SIZE];
+};
+
+struct prof_logger {
+	/* Write a drained record, and flush the log after a drain */
+	void (*write)(const struct prof_log_record *rec);
+	void (*flush)(void);
+	/* Level of the reports of the dropped records */
+	uint8_t warn_level;
+
+	/* Registry of rings, a lock-free list only growing at the head */
+	struct prof_log_ring *rings;
+	/* Holds the ring of each thread, and releases it at the exit */
+	pthread_key_t key;
+	bool key_created;
+	pthread_t flusher;
+	bool running;
+	bool stop;
+	/* Threads pushing a record, the stop waits for them */
+	uint32_t pushing;
+	/* Next logger ever started, see the fork handler */
+	struct prof_logger *next;
+	bool registered;
+};
+
+/* Start the flusher of 'logger'. Return 0 on success. */
+int prof_logger_start(struct prof_logger *logger);
+/* Drain all rings and stop the flusher */
+void prof_logger_stop(struct prof_logger *logger);
+/* Push a record into the ring of the current thread. Return false
+ * if the logger is not running, then the caller writes it. */
+bool prof_logger_push(struct prof_logger *logger, int pid, uint8_t level,
+				const char *format, va_list va);
+
+#endif /* _PROFILE_LOGRING_H_ */
@@ -2,6 +2,11 @@
 #include "evsel.h"
 #include "threadmap.h"
 #include "pmu.h"
+#include "inst.h"
+
+#include <cpuid.h>
+#include <dirent.h>
+#include <limits.h>
 
 enum {
 	PROF_PMU_CPU_CYCLES = 0,
@@ -41,6 +46,12 @@ enum {
 	PROF_PMU_ITLB_WRITE_MISSES,
 	PROF_PMU_ITLB_PREFETCH_REFERENCES,
 	PROF_PMU_ITLB_PREFETCH_MISSES,
+	PROF_PMU_TASK_CLOCK,
+	PROF_PMU_PAGE_FAULTS,
+	PROF_PMU_CONTEXT_SWITCHES,
+	PROF_PMU_CPU_MIGRATIONS,
+	PROF_PMU_TSC,
+	PROF_PMU_MONOTONIC_RAW,
 	PROF_PMU_MAX,
 };
 
@@ -290,60 +301,86 @@ static struct prof_pmu pmu_list[PROF_PMU_MAX] = {
 					(PERF_COUNT_HW_CACHE_OP_PREFETCH << 8) |
 				 	(PERF_COUNT_HW_CACHE_RESULT_MISS << 16),
 	},
+	[PROF_PMU_TASK_CLOCK] = {
+		.name = "task-clock",
+		.type = PERF_TYPE_SOFTWARE,
+		.config = PERF_COUNT_SW_TASK_CLOCK,
+	},
+	[PROF_PMU_PAGE_FAULTS] = {
+		.name = "page-faults",
+		.type = PERF_TYPE_SOFTWARE,
+		.config = PERF_COUNT_SW_PAGE_FAULTS,
+	},
+	[PROF_PMU_CONTEXT_SWITCHES] = {
+		.name = "context-switches",
+		.type = PERF_TYPE_SOFTWARE,
+		.config = PERF_COUNT_SW_CONTEXT_SWITCHES,
+	},
+	[PROF_PMU_CPU_MIGRATIONS] = {
+		.name = "cpu-migrations",
+		.type = PERF_TYPE_SOFTWARE,
+		.config = PERF_COUNT_SW_CPU_MIGRATIONS,
+	},
+	[PROF_PMU_TSC] = {
+		.name = "tsc",
+		.type = PROF_PMU_TYPE_PSEUDO,
+		.config = PROF_PSEUDO_TSC,
+	},
+	[PROF_PMU_MONOTONIC_RAW] = {
+		.name = "monotonic-raw",
+		.type = PROF_PMU_TYPE_PSEUDO,
+		.config = PROF_PSEUDO_MONOTONIC_RAW,
+	},
 };
 
 static bool pmu_is_init = false;
 
-#if 0
-static bool __pmu__is_supported(int event)
+static int __pmu__open(struct perf_event_attr *attr)
 {
-	bool ret = true;
-	int open_ret = 0;
-	struct prof_evsel *evsel = NULL;
-	struct perf_event_attr attr;
-	struct prof_pmu *pmu = NULL;
-	struct {
-		struct thread_map map;
-		int threads[1];
-	} tmap = {
-		.map.nr = 1,
-		.threads = {0},
-	};
-
-	if (event >= PROF_PMU_MAX) {
-		return false;
-	}
-
-	pmu = &pmu_list[event];
-	memset(&attr, 0, sizeof(attr));
-	attr.type = pmu->type;
-	attr.config = pmu->config;
-	attr.disabled = 1;
-	attr.size = sizeof(attr);
+	return syscall(__NR_perf_event_open, attr, 0, -1, -1, 0);
+}
 
-	evsel = prof_evsel__new(&attr, pmu->name);
-	if (evsel) {
-		open_ret = prof_evsel__open(evsel, &tmap.map);
-		ret = open_ret >= 0;
+bool prof_pmu__is_supported(struct perf_event_attr *attr)
+{
+	struct perf_event_attr probe = *attr;
+	struct timespec ts;
+	int fd = -1;
 
-		if (open_ret == -EACCES) {
-			evsel->attr.exclude_kernel = 1;
-			ret = prof_evsel__open(evsel, &tmap.map) >= 0;
+	if (attr->type == PROF_PMU_TYPE_PSEUDO) {
+		switch (attr->config) {
+		case PROF_PSEUDO_TSC:
+#if defined(__x86_64__) || defined(__i386__)
+			return true;
+#else
+			return false;
+#endif
+		case PROF_PSEUDO_MONOTONIC_RAW:
+			return clock_gettime(CLOCK_MONOTONIC_RAW, &ts) == 0;
+		default:
+			return false;
 		}
-		prof_evsel__delete(evsel);
 	}
 
-	return ret;
+	// open it disabled for the calling thread, as the probes do
+	probe.disabled = 1;
+	probe.read_format = 0;
+	fd = __pmu__open(&probe);
+	if (fd < 0 && errno == EACCES && !attr->exclude_kernel) {
+		// perf_event_paranoid forbids the kernel space
+		probe.exclude_kernel = 1;
+		fd = __pmu__open(&probe);
+		if (fd >= 0)
+			attr->exclude_kernel = 1;
+	}
+	if (fd < 0)
+		return false;
+
+	close(fd);
+	return true;
 }
-#endif
 
 static void __pmu__init(void)
 {
-//	int i = 0;
-//
-//	for (i = 0; i < PROF_PMU_MAX; i++) {
-//		pmu_list[i].is_support = __pmu__is_supported(i);
-//	}
 	pmu_is_init = true;
 }
 
@@ -367,25 +404,274 @@ struct prof_pmu *prof_pmu__find(char *str)
 		}
 	}
 
-	LOG_ERROR("No event named %s", str);
 	return NULL;
 }
 
+/* Read the first line of a sysfs file into 'buf'. Return its length,
+ * or -1 on failure. */
+static int __sysfs_read(const char *path, char *buf, size_t size)
+{
+	FILE *fp = NULL;
+	size_t len;
+
+	fp = fopen(path, "r");
+	if (!fp)
+		return -1;
+	if (!fgets(buf, size, fp)) {
+		fclose(fp);
+		return -1;
+	}
+	fclose(fp);
+
+	len = strlen(buf);
+	while (len && (buf[len - 1] == '\n' || buf[len - 1] == ' '))
+		buf[--len] = '\0';
+	return len;
+}
+
+static int __pmu__type(const char *pmu, uint32_t *type)
+{
+	char path[PATH_MAX], buf[32];
+
+	snprintf(path, sizeof(path), "%s/%s/type", PROF_PMU_SYSFS, pmu);
+	if (__sysfs_read(path, buf, sizeof(buf)) <= 0)
+		return -1;
+	*type = strtoul(buf, NULL, 0);
+	return 0;
+}
+
+/* Deposit the bits of 'val' into the bits of 'mask', from the lowest */
+static uint64_t __pmu__deposit(uint64_t val, uint64_t mask)
+{
+	uint64_t res = 0;
+	int bit;
+
+	for (bit = 0; bit < 64 && val; bit++) {
+		if (!(mask & (1ULL << bit)))
+			continue;
+		if (val & 1)
+			res |= (1ULL << bit);
+		val >>= 1;
+	}
+	return res;
+}
+
+/* Set the field 'term' of 'format', e.g. "config:0-7,21", to 'val' */
+static int __pmu__set_format(const char *format, uint64_t val,
+				struct perf_event_attr *attr)
+{
+	char buf[256], *ranges = NULL, *range = NULL, *save = NULL;
+	uint64_t mask = 0, *config = NULL;
+	unsigned long lo, hi;
+
+	snprintf(buf, sizeof(buf), "%s", format);
+	ranges = strchr(buf, ':');
+	if (!ranges)
+		return -1;
+	*ranges++ = '\0';
+
+	if (!strcmp(buf, "config"))
+		config = (uint64_t *)&attr->config;
+	else if (!strcmp(buf, "config1"))
+		config = (uint64_t *)&attr->config1;
+	else if (!strcmp(buf, "config2"))
+		config = (uint64_t *)&attr->config2;
+	else
+		return -1;
+
+	for (range = strtok_r(ranges, ",", &save); range;
+			range = strtok_r(NULL, ",", &save)) {
+		lo = strtoul(range, &range, 10);
+		hi = (*range == '-') ? strtoul(range + 1, NULL, 10) : lo;
+		if (hi > 63 || lo > hi)
+			return -1;
+		mask |= (hi - lo == 63) ? ~0ULL
+				: (((1ULL << (hi - lo + 1)) - 1) << lo);
+	}
+
+	*config = (*config & ~mask) | __pmu__deposit(val, mask);
+	return 0;
+}
+
+/* Parse the terms with the aliases at most 'depth' levels deep */
+static int __pmu__parse_terms(const char *pmu, char *terms,
+				struct perf_event_attr *attr, int depth)
+{
+	char path[PATH_MAX], buf[256];
+	char *term = NULL, *value = NULL, *save = NULL;
+	uint64_t val;
+
+	for (term = strtok_r(terms, ",", &save); term;
+			term = strtok_r(NULL, ",", &save)) {
+		value = strchr(term, '=');
+		if (value)
+			*value++ = '\0';
+		val = value ? strtoull(value, NULL, 0) : 1;
+
+		if (!strcmp(term, "config"))
+			attr->config = val;
+		else if (!strcmp(term, "config1"))
+			attr->config1 = val;
+		else if (!strcmp(term, "config2"))
+			attr->config2 = val;
+		else if (!strcmp(term, "period")) {
+			attr->sample_period = val;
+			attr->freq = 0;
+		} else {
+			snprintf(path, sizeof(path), "%s/%s/format/%s",
+							PROF_PMU_SYSFS, pmu, term);
+			if (__sysfs_read(path, buf, sizeof(buf)) > 0) {
+				if (__pmu__set_format(buf, val, attr) < 0) {
+					LOG_ERROR("Wrong format %s of %s/%s", buf, pmu, term);
+					return -1;
+				}
+				continue;
+			}
+
+			// an alias is a list of terms
+			snprintf(path, sizeof(path), "%s/%s/events/%s",
+							PROF_PMU_SYSFS, pmu, term);
+			if (depth > 0 && !value &&
+					__sysfs_read(path, buf, sizeof(buf)) > 0) {
+				if (__pmu__parse_terms(pmu, buf, attr, depth - 1) < 0)
+					return -1;
+				continue;
+			}
+
+			LOG_ERROR("Unknown term %s of PMU %s", term, pmu);
+			return -1;
+		}
+	}
+	return 0;
+}
+
+int prof_pmu__parse_terms(const char *pmu, char *terms,
+				struct perf_event_attr *attr)
+{
+	if (__pmu__type(pmu, &attr->type) < 0) {
+		LOG_ERROR("No PMU named %s", pmu);
+		return -1;
+	}
+	return __pmu__parse_terms(pmu, terms, attr, 1);
+}
+
+int prof_pmu__parse_alias(const char *name, struct perf_event_attr *attr)
+{
+	char path[PATH_MAX], buf[256];
+	struct dirent *ent = NULL;
+	DIR *dir = NULL;
+	int ret = -1;
+
+	dir = opendir(PROF_PMU_SYSFS);
+	if (!dir)
+		return -1;
+
+	while ((ent = readdir(dir)) != NULL) {
+		if (ent->d_name[0] == '.')
+			continue;
+
+		snprintf(path, sizeof(path), "%s/%s/events/%s",
+						PROF_PMU_SYSFS, ent->d_name, name);
+		if (__sysfs_read(path, buf, sizeof(buf)) <= 0)
+			continue;
+
+		if (__pmu__type(ent->d_name, &attr->type) == 0)
+			ret = __pmu__parse_terms(ent->d_name, buf, attr, 0);
+		break;
+	}
+
+	closedir(dir);
+	return ret;
+}
+
+int prof_pmu__nr_counters(void)
+{
+	static int nr_counters = 0;
+	unsigned int eax = 0, ebx, ecx, edx;
+
+	if (nr_counters > 0)
+		return nr_counters;
+
+	// architectural performance monitoring leaf of Intel, its
+	// counters are per logical CPU
+	if (__get_cpuid(0xa, &eax, &ebx, &ecx, &edx) && (eax & 0xff) > 0)
+		nr_counters = (eax >> 8) & 0xff;
+	if (nr_counters <= 0)
+		nr_counters = PROF_PMU_COUNTERS_DEFAULT;
+
+	LOG_INFO("PMU has %d counters", nr_counters);
+	return nr_counters;
+}
+
+bool prof_pmu__time_conv(uint64_t *zero, uint32_t *mult, uint16_t *shift)
+{
+	struct perf_event_attr attr;
+	struct perf_event_mmap_page *pc = NULL;
+	uint32_t seq;
+	bool ret = false;
+	void *ptr = NULL;
+	int fd = -1;
+
+	// any event has the page, the dummy one counts nothing
+	memset(&attr, 0, sizeof(attr));
+	attr.size = sizeof(attr);
+	attr.type = PERF_TYPE_SOFTWARE;
+	attr.config = PERF_COUNT_SW_DUMMY;
+	attr.disabled = 1;
+	attr.exclude_kernel = 1;
+	fd = __pmu__open(&attr);
+	if (fd < 0)
+		return false;
+
+	ptr = mmap(NULL, PAGE_SIZE, PROT_READ, MAP_SHARED, fd, 0);
+	if (ptr == MAP_FAILED) {
+		close(fd);
+		return false;
+	}
+	pc = (struct perf_event_mmap_page *)ptr;
+
+	do {
+		seq = pc->lock;
+		barrier();
+
+		ret = pc->cap_user_time_zero;
+		*zero = pc->time_zero;
+		*mult = pc->time_mult;
+		*shift = pc->time_shift;
+
+		barrier();
+	} while (pc->lock != seq);
+
+	munmap(ptr, PAGE_SIZE);
+	close(fd);
+	return ret;
+}
+
 void prof_pmu__dump(void)
 {
 	int i = 0;
 	struct prof_pmu *pmu = NULL;
+	struct perf_event_attr attr;
 
 	if (!pmu_is_init)
 		__pmu__init();
 
 	for (i = 0; i < PROF_PMU_MAX; i++) {
 		pmu = &pmu_list[i];
+		memset(&attr, 0, sizeof(attr));
+		attr.size = sizeof(attr);
+		attr.type = pmu->type;
+		attr.config = pmu->config;
+		pmu->is_support = prof_pmu__is_supported(&attr);
 		if (pmu->is_support) {
 			if (pmu->type == PERF_TYPE_HARDWARE) {
 				LOG_INFO("Event %s\t[HARDWARE]", pmu->name);
 			} else if (pmu->type == PERF_TYPE_HW_CACHE) {
 				LOG_INFO("Event %s\t[HARDWARE CACHE]", pmu->name);
+			} else if (pmu->type == PERF_TYPE_SOFTWARE) {
+				LOG_INFO("Event %s\t[SOFTWARE]", pmu->name);
+			} else if (pmu->type == PROF_PMU_TYPE_PSEUDO) {
+				LOG_INFO("Event %s\t[PSEUDO]", pmu->name);
 			}
 		}
 	}
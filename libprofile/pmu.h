@@ -2,6 +2,7 @@
 #define _PROFILE_PMU_H_
 
 #include <stdint.h>
+#include <stdbool.h>
 #include <linux/perf_event.h>
 
 #define PROFILE_PMU_NAME_MAX 30
@@ -15,6 +16,48 @@ struct prof_pmu {
 
 struct prof_pmu *prof_pmu__find(char *str);
 
+/* PROF_PMU_TYPE_PSEUDO and PROF_PSEUDO_*, shared with the readers */
+#include "data.h"
+
+/* Check that the event of 'attr' can be opened by the calling thread.
+ * If only the kernel space is forbidden, 'attr' is changed to
+ * exclude it. */
+bool prof_pmu__is_supported(struct perf_event_attr *attr);
+
+/* PMUs of the kernel, with their 'type', and their 'format' and
+ * 'events' directories */
+#define PROF_PMU_SYSFS "/sys/bus/event_source/devices"
+
+/* Set 'attr' for the sysfs PMU 'pmu' from its comma-separated terms
+ * "<term>[=<value>]". A term is 'config', 'config1', 'config2',
+ * 'period', a field of 'format', or an alias of 'events'. A field
+ * without value is set to 1. Return 0 on success. */
+int prof_pmu__parse_terms(const char *pmu, char *terms,
+				struct perf_event_attr *attr);
+
+/* Set 'attr' from the alias 'name' of the first sysfs PMU having
+ * it. Return 0 on success. */
+int prof_pmu__parse_alias(const char *name, struct perf_event_attr *attr);
+
+/* Counters of the PMU when it's unknown */
+#define PROF_PMU_COUNTERS_DEFAULT 4
+
+/* Number of general-purpose counters of the PMU for each thread */
+int prof_pmu__nr_counters(void);
+
+/* Conversion of the TSC into the time of perf, from the mmap page
+ * of an event. Return false if the kernel doesn't give it, e.g. the
+ * TSC is not stable. */
+bool prof_pmu__time_conv(uint64_t *zero, uint32_t *mult, uint16_t *shift);
+
+/* Whether the event of 'attr' takes a counter of the PMU */
+static inline bool prof_pmu__use_counter(const struct perf_event_attr *attr)
+{
+	return attr->type == PERF_TYPE_HARDWARE ||
+			attr->type == PERF_TYPE_HW_CACHE ||
+			attr->type == PERF_TYPE_RAW;
+}
+
 void prof_pmu__dump(void);
 
 #endif /* _PROFILE_PMU_H_ */
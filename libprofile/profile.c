@@ -11,8 +11,13 @@
 #include "util.h"
 #include "list.h"
 #include "evlist.h"
-#include "threadmap.h"
 #include "profile.h"
+#include "log.h"
+#include "writer.h"
+#include "seglog.h"
+#include "aggr.h"
+#include "sampler.h"
+#include "inst.h"
 
 struct prof_info globalinfo = {
 	.evlist = NULL,
@@ -20,15 +25,24 @@ struct prof_info globalinfo = {
 	.max_index = 0,
 	.sample_freq = 0,
 	.flog = NULL,
+	.thread_data = LIST_HEAD_INIT(globalinfo.thread_data),
+	.lock = PTHREAD_MUTEX_INITIALIZER,
+	.has_key = false,
+	.nb_init = 0,
+	.stopped = false,
 };
 
 __thread struct prof_tinfo tinfo = {
 	.pid = -1,
-	.tid = -1,
 	.state = PROF_STATE_UNINIT,
 	.func_counters = NULL,
-	.nb_record = 0,
-//	.records = NULL,
+	.countdown = NULL,
+	.depth = 0,
+	.writer = NULL,
+	.seglog = NULL,
+	.aggr = NULL,
+	.calib = NULL,
+	.nb_calib = 0,
 };
 
 static char *log_tag[PROF_LOG_NUM] = {
@@ -38,25 +52,50 @@ static char *log_tag[PROF_LOG_NUM] = {
 	[PROF_LOG_DEBUG] = "DEBUG",
 };
 
-void prof_log(uint8_t level, const char *format, ...)
+static FILE *__prof_log_file(uint8_t level)
 {
-	va_list va;
-	FILE *fout = NULL;
-
 	if (globalinfo.flog)
-		fout = globalinfo.flog;
+		return globalinfo.flog;
 	else if (level == PROF_LOG_ERROR)
-		fout = stderr;
+		return stderr;
 	else
-		fout = stdout;
+		return stdout;
+}
+
+void prof_log_write(int pid, uint8_t level, const char *msg)
+{
+	fprintf(__prof_log_file(level), "[%s][%d]: %s\n",
+					log_tag[level], pid, msg);
+}
 
-	fprintf(fout, "[%s][%d]: ", log_tag[level], tinfo.pid);
+void prof_log_flush(void)
+{
+	if (globalinfo.flog)
+		fflush(globalinfo.flog);
+	else {
+		fflush(stdout);
+		fflush(stderr);
+	}
+}
+
+void prof_log(uint8_t level, const char *format, ...)
+{
+	va_list va;
+	char msg[PROF_LOG_MSG_MAX] = {'\0'};
+	bool pushed;
+
+	// hand the record over to the flusher
 	va_start(va, format);
-	vfprintf(fout, format, va);
+	pushed = prof_log_push(tinfo.pid, level, format, va);
 	va_end(va);
-	fprintf(fout, "\n");
+	if (pushed)
+		return;
 
-	fflush(fout);
+	va_start(va, format);
+	vsnprintf(msg, PROF_LOG_MSG_MAX, format, va);
+	va_end(va);
+	prof_log_write(tinfo.pid, level, msg);
+	prof_log_flush();
 }
 
 static int __create_evlist(struct prof_info *info,
@@ -72,26 +111,43 @@ static int __create_evlist(struct prof_info *info,
 	}
 
 	// parse and add events
-	if (prof_evlist__add_from_str(evlist, evlist_str) < 0) {
+	if (prof_evlist__add_from_str(evlist, evlist_str) <= 0) {
 		LOG_ERROR("Wrong event list %s", evlist_str);
 		goto fail_destroy_evlist;
 	}
 	LOG_INFO("Add %d events", evlist->nr_entries);
-
-	// create threadmap
-	if (prof_evlist__create_threadmap(evlist, pid) < 0) {
-		LOG_ERROR("Failed to create thread map");
+	if (evlist->nr_entries > PROF_EVENT_MAX) {
+		LOG_ERROR("Too many events %d, max %d",
+						evlist->nr_entries, PROF_EVENT_MAX);
 		goto fail_destroy_evlist;
 	}
-	LOG_INFO("%d threads detected.",
-					thread_map__nr(evlist->threads));
 
-	// start all events
-	if (prof_evlist__start(evlist) < 0) {
-		LOG_ERROR("Failed to start events");
+	// the sampler only samples with the first event
+	if (info->flags & PROF_FLAG_SAMPLING) {
+		if (evlist->nr_entries > 1)
+			LOG_WARN("Only the first event of %s samples", evlist_str);
+		info->evlist = evlist;
+		return 0;
+	}
+
+	// more events than counters are multiplexed by the kernel, it
+	// rotates groups that fit, whose counts are scaled
+	if (!(info->flags & PROF_FLAG_GROUP) &&
+			prof_evlist__nr_counters(evlist) > prof_pmu__nr_counters()) {
+		LOG_INFO("%d events for %d counters, group them",
+						prof_evlist__nr_counters(evlist),
+						prof_pmu__nr_counters());
+		info->flags |= PROF_FLAG_GROUP;
+	}
+
+	// schedule the events together
+	if ((info->flags & PROF_FLAG_GROUP) && evlist->nr_entries > 1 &&
+			prof_evlist__set_group(evlist) < 0) {
+		LOG_ERROR("Failed to group events %s", evlist_str);
 		goto fail_destroy_evlist;
 	}
 
+	// the events are opened by each thread, see __init_thread()
 	info->evlist = evlist;
 	return 0;
 
@@ -100,60 +156,189 @@ fail_destroy_evlist:
 	return -1;
 }
 
-#if 0
-static int __init_record(struct prof_tinfo *local)
+/* Build the header of the data file of the current thread */
+static struct prof_data_header *__data_header(struct prof_info *global,
+				int tid)
 {
-	int fd = -1, ret = 0;
-	char buf[32] = {'\0'};
-	size_t size;
-	void *ptr = NULL;
+	struct prof_evlist *evlist = global->evlist;
+	struct prof_data_header *hdr = NULL;
+	struct prof_evsel *evsel = NULL;
+	uint32_t i = 0, nb = evlist->nr_entries;
+
+	// the sampler only counts the periods of the first event
+	if (global->flags & PROF_FLAG_SAMPLING)
+		nb = 1;
+
+	hdr = (struct prof_data_header *)zalloc(prof_data_offset(nb));
+	if (!hdr)
+		return NULL;
+
+	hdr->magic = PROF_DATA_MAGIC;
+	hdr->version = PROF_DATA_VERSION;
+	hdr->pid = getpid();
+	hdr->tid = tid;
+	hdr->min_index = global->min_index;
+	hdr->max_index = global->max_index;
+	hdr->sample_freq = global->sample_freq;
+	hdr->flags = global->flags;
+	hdr->tsc_hz = global->tsc_hz;
+	hdr->time_zero = global->time_zero;
+	hdr->time_mult = global->time_mult;
+	hdr->time_shift = global->time_shift;
+	hdr->hit_max = PROF_HIT_MAX(nb);
+	hdr->nb_event = nb;
+	hdr->data_offset = prof_data_offset(nb);
+	hdr->committed = 0;
 
-	snprintf(buf, 32, "prof_%d.data", local->pid);
+	evlist__for_each(evlist, evsel) {
+		if (i >= nb)
+			break;
+		hdr->events[i].type = evsel->attr.type;
+		hdr->events[i].config = evsel->attr.config;
+		hdr->events[i].overhead = global->overhead[i];
+		hdr->events[i].outer = global->outer[i];
+		hdr->events[i].noise = global->noise[i];
+		snprintf(hdr->events[i].name, PROF_DATA_EVENT_NAME_MAX,
+						"%s", evsel->name);
+		i++;
+	}
+	return hdr;
+}
 
-	size = sizeof(struct prof_record) * PROF_RECORD_MAX;
+/* Start the segmented mmap log, the aggregation or the record writer
+ * of the current thread into 'fd', which it owns on success */
+static int __open_backend(struct prof_tinfo *local, int fd)
+{
+	struct prof_data_header *hdr = NULL;
+	int ret = -1;
 
-	fd = open(buf, O_RDWR | O_CREAT, 0666);
-	if (fd < 0) {
-		LOG_ERROR("Failed to create record file %s, err %d",
-						buf, errno);
+	hdr = __data_header(&globalinfo, local->pid);
+	if (!hdr) {
+		LOG_ERROR("Failed to allocate data header");
 		return -1;
 	}
 
-	ret = ftruncate(fd, size);
-	if (ret < 0) {
-		LOG_ERROR("Failed to resize the record file %s, err %d",
-						buf, errno);
-		close(fd);
+	if (globalinfo.flags & PROF_FLAG_AGGR) {
+		local->aggr = prof_aggr_open(fd, hdr);
+		if (!local->aggr)
+			goto out;
+	} else if (globalinfo.flags & PROF_FLAG_MMAP) {
+		local->seglog = prof_seglog_open(fd, hdr);
+		if (!local->seglog)
+			goto out;
+	} else {
+		// the records are appended after the header
+		if (pwrite(fd, hdr, hdr->data_offset, 0)
+						!= (ssize_t)hdr->data_offset ||
+				lseek(fd, hdr->data_offset, SEEK_SET) < 0) {
+			LOG_ERROR("Failed to write data header, err %d", errno);
+			goto out;
+		}
+		local->writer = prof_writer_get(local->pid, fd);
+		if (!local->writer)
+			goto out;
+	}
+	ret = 0;
+out:
+	free(hdr);
+	return ret;
+}
+
+/* Open the data file of the current thread, with its backend */
+static int __init_data(struct prof_tinfo *local)
+{
+	char buf[PROF_DATA_NAME_MAX] = {'\0'};
+	int fd = -1;
+
+	snprintf(buf, PROF_DATA_NAME_MAX, PROF_DATA_NAME, local->pid);
+	fd = open(buf, O_RDWR | O_CREAT | O_TRUNC, 0644);
+	if (fd < 0) {
+		LOG_ERROR("Failed to open data file %s, err %d", buf, errno);
 		return -1;
 	}
 
-	ptr = mmap(0, size, PROT_WRITE | PROT_READ, MAP_SHARED, fd, 0);
-	if (ptr == MAP_FAILED) {
-		LOG_ERROR("Failed to mmap record file %s, err %d",
-						buf, errno);
+	if (__open_backend(local, fd) < 0) {
 		close(fd);
 		return -1;
 	}
-	memset(ptr, 0, size);
 
-	local->records = ptr;
+	LOG_INFO("Data file %s%s", buf,
+				local->aggr ? " (aggregated)" :
+				local->seglog ? " (mmap)" : "");
 	return 0;
 }
-#endif
 
-static void __init_thread(void)
+/* Start sampling the process into its data file */
+static int __init_sampler(struct prof_info *global, const char *id_table)
+{
+	struct prof_data_header *hdr = NULL;
+	char buf[PROF_DATA_NAME_MAX] = {'\0'};
+	int fd = -1, pid = getpid(), ret = -1;
+
+	hdr = __data_header(global, pid);
+	if (!hdr) {
+		LOG_ERROR("Failed to allocate data header");
+		return -1;
+	}
+
+	snprintf(buf, PROF_DATA_NAME_MAX, PROF_DATA_NAME, pid);
+	fd = open(buf, O_RDWR | O_CREAT | O_TRUNC, 0644);
+	if (fd < 0) {
+		LOG_ERROR("Failed to open data file %s, err %d", buf, errno);
+		goto out;
+	}
+
+	ret = prof_sampler_start(prof_evlist__first(global->evlist),
+					global->sample_hz, id_table, fd, hdr);
+	if (ret == 0)
+		LOG_INFO("Data file %s (sampled)", buf);
+out:
+	free(hdr);
+	return ret;
+}
+
+static void __calibrate(struct prof_tinfo *local);
+static void __destroy_thread(struct prof_tinfo *local);
+
+/* True if libprofile itself samples one call in 'sample_freq' */
+static inline bool __sample_self(struct prof_info *global)
+{
+	return global->sample_freq > 1
+			&& !(global->flags & PROF_FLAG_PRESAMPLED);
+}
+
+/* Init the current thread, and measure the probe overhead first if
+ * 'calibrate' */
+static void __init_thread(int calibrate)
 {
 	struct prof_evlist *evlist = globalinfo.evlist;
 	struct prof_tinfo *info = &tinfo;
 	unsigned int nb_funcs = globalinfo.max_index - globalinfo.min_index + 1;
 
 	info->pid = syscall(__NR_gettid);
-	info->tid = thread_map__getindex(evlist->threads, info->pid);
-	if (info->tid == -1) {
-		LOG_ERROR("No thread %d found in threadmap", info->pid);
-		info->state = PROF_STATE_ERROR;
+
+	// the probes count nothing, the sampler covers all threads
+	if (globalinfo.flags & PROF_FLAG_SAMPLING) {
+		info->state = PROF_STATE_STOP;
+		return;
+	}
+
+	// nothing is counted after 'prof_exit()', which keeps the event
+	// list while a thread is initializing
+	pthread_mutex_lock(&globalinfo.lock);
+	if (globalinfo.stopped) {
+		pthread_mutex_unlock(&globalinfo.lock);
+		info->state = PROF_STATE_STOP;
 		return;
 	}
+	globalinfo.nb_init++;
+	pthread_mutex_unlock(&globalinfo.lock);
+
+	// the thread monitors itself, whenever it was created
+	if (prof_evlist__open_self(evlist, info->events) < 0) {
+		LOG_ERROR("Failed to open events for thread %d", info->pid);
+		goto fail;
+	}
 
 	// allocate counter
 	info->func_counters = (struct prof_func *)malloc(
@@ -162,49 +347,106 @@ static void __init_thread(void)
 		LOG_ERROR("Failed to allocate memory for function counters,"
 				  "its desired length is %u",
 				  nb_funcs);
-		info->state = PROF_STATE_ERROR;
-		return;
+		goto fail_close_events;
 	}
 	LOG_INFO("Create %u function counters [%u-%u]",
 					nb_funcs,
 					globalinfo.min_index,
 					globalinfo.max_index);
 
+	// allocate sampling countdowns
+	if (__sample_self(&globalinfo)) {
+		info->countdown = (uint32_t *)calloc(nb_funcs, sizeof(uint32_t));
+		if (!info->countdown) {
+			LOG_ERROR("Failed to allocate memory for sampling");
+			goto fail_free_counters;
+		}
+		LOG_INFO("Sample one call in %u", globalinfo.sample_freq);
+	}
+
+	// the probes are measured before the data file exists
+	if (calibrate)
+		__calibrate(info);
+
 	// open data file
-	char buf[32] = {'\0'};
+	if (__init_data(info) < 0)
+		goto fail_free_countdown;
 
-	sprintf(buf, "profile_%d.data", info->pid);
-	info->output_file = fopen(buf, "w");
-	if (!info->output_file) {
-		free(info->func_counters);
-		info->func_counters = NULL;
-		info->state = PROF_STATE_ERROR;
-		LOG_ERROR("Failed to open data file %s", buf);
-		return;
+	memset(info->func_counters, 0, sizeof(struct prof_func) * nb_funcs);
+	memset(info->last, 0, sizeof(info->last));
+
+	// destroyed by the key destructor when the thread exits, or by
+	// 'prof_exit()' if it's still alive, or now if it already ran
+	pthread_mutex_lock(&globalinfo.lock);
+	globalinfo.nb_init--;
+	if (globalinfo.stopped) {
+		info->state = PROF_STATE_STOP;
+		__destroy_thread(info);
+	} else {
+		list_add_tail(&info->node, &globalinfo.thread_data);
+		if (globalinfo.has_key)
+			pthread_setspecific(globalinfo.key, info);
+		__atomic_store_n(&info->state, PROF_STATE_RUNNING,
+						__ATOMIC_RELEASE);
 	}
-	LOG_INFO("Data file %s", buf);
+	pthread_mutex_unlock(&globalinfo.lock);
 
-	memset(info->func_counters, 0, sizeof(struct prof_func) * nb_funcs);
+	LOG_INFO("Thread %d, address %p", tinfo.pid, info);
+	return;
 
-	memset(info->records, 0, sizeof(struct prof_record) * PROF_RECORD_CACHE);
-//	// allocate record storage
-//	if (__init_record(info) < 0) {
-//		LOG_ERROR("Failed to init record storage");
-//		free(info->func_counters);
-//		info->func_counters = NULL;
-//		info->state = PROF_STATE_ERROR;
-//		return;
-//	}
+fail_free_countdown:
+	free(info->countdown);
+	info->countdown = NULL;
+fail_free_counters:
+	free(info->func_counters);
+	info->func_counters = NULL;
+fail_close_events:
+	prof_evlist__close_self(evlist, info->events);
+fail:
+	pthread_mutex_lock(&globalinfo.lock);
+	globalinfo.nb_init--;
+	pthread_mutex_unlock(&globalinfo.lock);
+	info->state = PROF_STATE_ERROR;
+}
 
+static void __thread_key_destructor(void *arg);
 
-	tinfo.state = PROF_STATE_RUNNING;
-	LOG_INFO("Thread %d index %d, address %p",
-					tinfo.pid, tinfo.tid, info);
-	return;
+/* Check the event list, without opening its events */
+int prof_check_evlist(const char *evlist_str)
+{
+	struct prof_evlist *evlist = NULL;
+	int added = 0;
+
+	evlist = prof_evlist__new();
+	if (!evlist)
+		return -1;
+
+	added = prof_evlist__add_from_str(evlist, evlist_str);
+	prof_evlist__delete(evlist);
+
+	return (added > 0 ? 0 : -1);
+}
+
+/* Measure the TSC frequency against CLOCK_MONOTONIC_RAW */
+static void __tsc_calibrate(struct prof_info *info)
+{
+	info->tsc_hz = tsc_measure_hz();
+	LOG_INFO("TSC frequency %lu Hz", (unsigned long)info->tsc_hz);
+
+	// the readers convert the TSC like perf, if it can
+	if (prof_pmu__time_conv(&info->time_zero, &info->time_mult,
+					&info->time_shift))
+		LOG_INFO("TSC conversion of perf: mult %u, shift %u",
+						info->time_mult, info->time_shift);
+	else {
+		info->time_mult = 0;
+		LOG_INFO("No TSC conversion of perf, use the frequency");
+	}
 }
 
 void *prof_init(char *evlist_str, char *logfile,
-				unsigned min_id, unsigned max_id, unsigned freq)
+				unsigned min_id, unsigned max_id, unsigned freq,
+				unsigned flags, const char *id_table)
 {
 	int pid;
 	struct prof_info *info = &globalinfo;
@@ -213,10 +455,17 @@ void *prof_init(char *evlist_str, char *logfile,
 
 	pid = getpid();
 	tinfo.pid = syscall(__NR_gettid);
-//	INIT_LIST_HEAD(&info->thread_data);
+	info->stopped = false;
 	info->max_index = max_id;
 	info->min_index = min_id;
-	info->sample_freq = freq;
+	info->flags = flags;
+	// 'freq' is the sampling frequency of the sampler, in Hz
+	if (flags & PROF_FLAG_SAMPLING) {
+		info->sample_hz = freq;
+		info->sample_freq = 0;
+		info->flags |= PROF_FLAG_AGGR;
+	} else
+		info->sample_freq = freq;
 
 	if (strlen(logfile) == 0)
 		snprintf(buf, 32, "prof_%d.log", pid);
@@ -232,18 +481,58 @@ void *prof_init(char *evlist_str, char *logfile,
 	LOG_INFO("Create log file %s", buf);
 	info->flog = fp;
 
+	if (prof_log_start() < 0)
+		LOG_WARN("Failed to start the log flusher, log synchronously");
+
+	if (pthread_key_create(&info->key, __thread_key_destructor) == 0)
+		info->has_key = true;
+	else
+		LOG_WARN("Failed to create thread key, the threads are "
+				"destroyed at the exit");
+
+	__tsc_calibrate(info);
+
+	if (!(flags & (PROF_FLAG_MMAP | PROF_FLAG_AGGR | PROF_FLAG_SAMPLING))
+			&& prof_writer_start() < 0)
+		LOG_WARN("Failed to start the record writer, "
+				"write records synchronously");
+
 	LOG_INFO("Create event list %s", evlist_str);
 	if (__create_evlist(info, evlist_str, pid) < 0) {
 		LOG_ERROR("Failed to create event list %s", evlist_str);
 		goto fail_close_log;
 	}
 
-//	// init current thread
-//	__init_thread();
+	if (flags & PROF_FLAG_SAMPLING) {
+		if (__init_sampler(info, id_table) < 0) {
+			LOG_ERROR("Failed to start the sampler");
+			goto fail_destroy_evlist;
+		}
+		tinfo.state = PROF_STATE_STOP;
+		return (void *)0;
+	}
+
+	// init current thread, which checks that the events can be
+	// opened, other threads are initialized at their first probe
+	__init_thread(1);
+	if (tinfo.state != PROF_STATE_RUNNING) {
+		LOG_ERROR("Failed to init thread %d", tinfo.pid);
+		goto fail_destroy_evlist;
+	}
 
 	return (void *)0;
 
+fail_destroy_evlist:
+	prof_evlist__delete(info->evlist);
+	info->evlist = NULL;
+	tinfo.state = PROF_STATE_UNINIT;
 fail_close_log:
+	if (info->has_key) {
+		pthread_key_delete(info->key);
+		info->has_key = false;
+	}
+	prof_writer_stop();
+	prof_log_stop();
 	fclose(info->flog);
 	info->flog = NULL;
 
@@ -255,57 +544,153 @@ static void __test_print(struct prof_info *global, struct prof_tinfo *thread)
 {
 	struct prof_func *func = NULL;
 	unsigned int i = 0, nb_func = global->max_index - global->min_index + 1;
+	uint64_t scale = (global->sample_freq > 1 ? global->sample_freq : 1);
 
 	if (!thread->func_counters)
 		return;
 
+	// the counters only count sampled calls
 	for (i = 0; i < nb_func; i++) {
 		func = &thread->func_counters[i];
 		if (func->counter == 0)
 			continue;
 
-		LOG_INFO("func %u: %u", global->min_index + i, func->counter);
+		LOG_INFO("func %u: %lu", global->min_index + i,
+						func->counter * scale);
 	}
 }
 #endif
 
-void prof_thread_exit(void)
+/* Write the table of the thread at the current counts. The counts
+ * are only read by the thread itself, rdpmc reads the counters of the
+ * current CPU, so the frames of another thread still running are
+ * dropped. */
+static void __close_aggr(struct prof_evlist *evlist, struct prof_tinfo *local)
 {
-	struct prof_tinfo *local = &tinfo;
+	uint64_t counts[PROF_EVENT_MAX];
+
+	if (local != &tinfo ||
+			prof_evlist__read(evlist, local->events, -1, counts) < 0)
+		prof_aggr_close(local->aggr, NULL);
+	else
+		prof_aggr_close(local->aggr, counts);
+}
 
-	LOG_INFO("Destroy per-thread data");
+/* Destroy the per-thread data of 'local', which is out of the list
+ * of per-thread data. It's called with the lock held. */
+static void __destroy_thread(struct prof_tinfo *local)
+{
+	LOG_INFO("Destroy per-thread data of thread %d", local->pid);
 	if (local->func_counters) {
 		__test_print(&globalinfo, local);
 		free(local->func_counters);
 		local->func_counters = NULL;
 	}
+	if (local->countdown) {
+		free(local->countdown);
+		local->countdown = NULL;
+	}
 
-	// write data to file
-	LOG_INFO("%u records", local->nb_record);
-	if (local->nb_record && local->output_file) {
-		fwrite(local->records, sizeof(struct prof_record), local->nb_record,
-						local->output_file);
-		local->nb_record = 0;
+	// write the remaining records
+	if (local->writer) {
+		prof_writer_put(local->writer);
+		local->writer = NULL;
+	}
+	if (local->seglog) {
+		prof_seglog_close(local->seglog);
+		local->seglog = NULL;
+	}
+	if (local->aggr) {
+		__close_aggr(globalinfo.evlist, local);
+		local->aggr = NULL;
 	}
 
-	// close output file
-	if (local->output_file)
-		fclose(local->output_file);
-//	if (local->records) {
-//		munmap(local->records, PROF_RECORD_MAX * sizeof(struct prof_record));
-//		local->records = NULL;
-//	}
+	prof_evlist__close_self(globalinfo.evlist, local->events);
 }
 
-static void __destroy_evlist(void)
+/* Destroy the per-thread data of 'local', unless it's already done
+ * by 'prof_exit()' */
+static void __thread_release(struct prof_tinfo *local)
 {
-	struct prof_evlist *evlist = globalinfo.evlist;
+	uint8_t running = PROF_STATE_RUNNING;
+
+	pthread_mutex_lock(&globalinfo.lock);
+	if (__atomic_compare_exchange_n(&local->state, &running,
+					PROF_STATE_STOP, false,
+					__ATOMIC_SEQ_CST, __ATOMIC_RELAXED)) {
+		list_del(&local->node);
+		__destroy_thread(local);
+	}
+	pthread_mutex_unlock(&globalinfo.lock);
+}
 
-	if (!evlist)
-		return;
+/* Destructor of the per-thread key
+ * It is called by the exiting thread itself, after the thread
+ * leaves all probes, its TLS is still valid.
+ */
+static void __thread_key_destructor(void *arg)
+{
+	if (arg)
+		__thread_release((struct prof_tinfo *)arg);
+}
 
-	prof_evlist__delete(evlist);
-	globalinfo.evlist = NULL;
+void prof_thread_exit(void)
+{
+	__thread_release(&tinfo);
+}
+
+/* Destroy the threads still alive. The ones in a probe are waited
+ * for PROF_EXIT_WAIT_MAX, and kept with the event list after it, the
+ * probes find the global state stopped and count nothing. */
+static void __destroy_threads(void)
+{
+	struct prof_tinfo *local = NULL, *next = NULL;
+	uint8_t running;
+	unsigned int nb_busy = 0, waited = 0;
+
+	pthread_mutex_lock(&globalinfo.lock);
+	__atomic_store_n(&globalinfo.stopped, true, __ATOMIC_SEQ_CST);
+	do {
+		if (nb_busy) {
+			pthread_mutex_unlock(&globalinfo.lock);
+			usleep(PROF_EXIT_WAIT);
+			waited += PROF_EXIT_WAIT;
+			pthread_mutex_lock(&globalinfo.lock);
+		}
+
+		nb_busy = 0;
+		list_for_each_entry_safe(local, next,
+						&globalinfo.thread_data, node) {
+			running = PROF_STATE_RUNNING;
+			if (!__atomic_compare_exchange_n(&local->state, &running,
+							PROF_STATE_STOP, false,
+							__ATOMIC_SEQ_CST, __ATOMIC_RELAXED)) {
+				nb_busy++;
+				continue;
+			}
+			list_del(&local->node);
+			__destroy_thread(local);
+		}
+	} while (nb_busy && waited < PROF_EXIT_WAIT_MAX);
+
+	list_for_each_entry(local, &globalinfo.thread_data, node)
+		LOG_WARN("Thread %d is still in a probe, keep its data",
+						local->pid);
+
+	// the exiting threads find nothing to destroy from now on
+	if (globalinfo.has_key) {
+		pthread_key_delete(globalinfo.key);
+		globalinfo.has_key = false;
+	}
+
+	// no thread refers to the event list anymore
+	if (list_empty(&globalinfo.thread_data) && !globalinfo.nb_init &&
+			globalinfo.evlist) {
+		prof_evlist__delete(globalinfo.evlist);
+		globalinfo.evlist = NULL;
+	} else if (globalinfo.evlist)
+		LOG_WARN("Keep the event list for the threads left");
+	pthread_mutex_unlock(&globalinfo.lock);
 }
 
 void prof_exit(void)
@@ -313,88 +698,327 @@ void prof_exit(void)
 	LOG_INFO("Profile exit.");
 
 	prof_thread_exit();
-	__destroy_evlist();
+	prof_sampler_stop();
+	__destroy_threads();
 
+	prof_writer_stop();
+	prof_log_stop();
 	if (globalinfo.flog) {
 		fclose(globalinfo.flog);
 		globalinfo.flog = NULL;
 	}
 }
 
+/* Keep the counts of a probed call of the calibration, since its
+ * entry at its exit, and since the previous entry at its entry */
+static void __calib_hit(struct prof_tinfo *local, int nb_event,
+				const uint64_t *counts, unsigned int exit)
+{
+	// the counts of the last entry come first
+	uint64_t *entry = local->calib, *val = local->calib + nb_event;
+	int i = 0;
+
+	if (local->nb_calib >= PROF_CALIB_LOOPS)
+		return;
+	if (!exit) {
+		// the first entry has no previous one
+		if (local->nb_calib) {
+			val += (2 * local->nb_calib - 1) * nb_event;
+			for (i = 0; i < nb_event; i++)
+				val[i] = counts[i] - entry[i];
+		}
+		memcpy(entry, counts, sizeof(uint64_t) * nb_event);
+		return;
+	}
+
+	val += 2 * local->nb_calib * nb_event;
+	for (i = 0; i < nb_event; i++)
+		val[i] = counts[i] - entry[i];
+	local->nb_calib++;
+}
+
 #if 1
+/* Encode one hit of 'func_index' with all events, see data.h, or
+ * aggregate it */
 static void __read_count(struct prof_evlist *evlist,
-				unsigned int func_index, struct prof_tinfo *local)
+				unsigned int func_index, struct prof_tinfo *local,
+				unsigned int exit)
 {
-	struct prof_evsel *evsel = NULL;
-	uint8_t i = 0;
+	uint32_t size = PROF_HIT_MAX(evlist->nr_entries);
+	uint8_t *start = NULL, *ptr = NULL;
+	uint64_t counts[PROF_EVENT_MAX];
+	int i = 0;
 
-	evlist__for_each(evlist, evsel) {
-//		prof_evsel__rdpmc(evsel, local->tid);
-		local->records[local->nb_record].func_idx = func_index;
-		local->records[local->nb_record].ev_idx = i;
-		local->records[local->nb_record].count = prof_evsel__rdpmc(evsel, local->tid);
-//		local->records[local->nb_record].count = prof_evsel__read(evsel, local->tid);
-		i++;
-		local->nb_record ++;
-//		if (local->nb_record == PROF_RECORD_MAX) {
-//			local->state = PROF_STATE_STOP;
-//			break;
-//		}
-		if (local->nb_record == PROF_RECORD_CACHE) {
-//			fwrite(local->records, sizeof(struct prof_record),
-//							local->nb_record, local->output_file);
-			local->nb_record = 0;
-		}
+	if (unlikely(prof_evlist__read(evlist, local->events, -1, counts) < 0))
+		return;
+
+	// the backend of the calibration is discarded, but runs as the
+	// real one
+	if (unlikely(local->calib))
+		__calib_hit(local, evlist->nr_entries, counts, exit);
+
+	if (local->aggr) {
+		if (exit)
+			prof_aggr_exit(local->aggr, func_index - globalinfo.min_index,
+							counts);
+		else
+			prof_aggr_enter(local->aggr, func_index - globalinfo.min_index,
+							counts);
+		return;
+	}
+
+	if (local->seglog)
+		start = prof_seglog_reserve(local->seglog, size);
+	else if (likely(local->writer))
+		start = prof_writer_reserve(local->writer, size);
+	else
+		return;
+
+	ptr = prof_varint_put(start,
+			PROF_HIT_TAG(func_index - globalinfo.min_index, exit));
+	for (i = 0; i < evlist->nr_entries; i++) {
+		ptr = prof_varint_put(ptr,
+				prof_zigzag((int64_t)(counts[i] - local->last[i])));
+		local->last[i] = counts[i];
 	}
+
+	// the hit survives a crash from now on with the mmap log
+	if (local->seglog)
+		prof_seglog_commit(local->seglog, ptr - start);
+	else if (likely(local->writer))
+		prof_writer_commit(local->writer, ptr - start);
 }
 #endif
 
+/* Enter a probe of the current thread. Its data is not destroyed by
+ * 'prof_exit()' until '__probe_leave()'. Return false if the thread
+ * is not running, or the profile is stopped. */
+static inline bool __probe_enter(struct prof_tinfo *local)
+{
+	uint8_t running = PROF_STATE_RUNNING;
+
+	if (!__atomic_compare_exchange_n(&local->state, &running,
+					PROF_STATE_BUSY, false,
+					__ATOMIC_SEQ_CST, __ATOMIC_RELAXED))
+		return false;
+
+	// 'prof_exit()' sets it before its state exchanges
+	if (unlikely(__atomic_load_n(&globalinfo.stopped, __ATOMIC_SEQ_CST))) {
+		__atomic_store_n(&local->state, PROF_STATE_RUNNING,
+						__ATOMIC_RELEASE);
+		return false;
+	}
+	return true;
+}
+
+static inline void __probe_leave(struct prof_tinfo *local)
+{
+	__atomic_store_n(&local->state, PROF_STATE_RUNNING, __ATOMIC_RELEASE);
+}
+
+/* Decide if this entry of 'idx' is sampled, and push the decision */
+static inline int __sample_push(struct prof_tinfo *local, unsigned int idx)
+{
+	uint32_t depth = local->depth++;
+	int sampled = 0;
+
+	if (local->countdown[idx] == 0) {
+		local->countdown[idx] = globalinfo.sample_freq - 1;
+		sampled = 1;
+	} else
+		local->countdown[idx]--;
+
+	// too deep calls are never sampled
+	if (depth >= PROF_SAMPLE_STACK_MAX)
+		return 0;
+	if (sampled)
+		local->sampled[depth / 64] |= (1UL << (depth % 64));
+	else
+		local->sampled[depth / 64] &= ~(1UL << (depth % 64));
+	return sampled;
+}
+
+/* Pop the decision of the matching entry */
+static inline int __sample_pop(struct prof_tinfo *local)
+{
+	uint32_t depth;
+
+	// exit without entry
+	if (local->depth == 0)
+		return 0;
+
+	depth = --local->depth;
+	if (depth >= PROF_SAMPLE_STACK_MAX)
+		return 0;
+	return (local->sampled[depth / 64] >> (depth % 64)) & 1;
+}
+
 void prof_count_pre(unsigned int func_index)
 {
 	struct prof_info *global = &globalinfo;
 	struct prof_tinfo *local = &tinfo;
-//	struct prof_func *func = NULL;
+	unsigned int idx = func_index - global->min_index;
 
 	if (local->state == PROF_STATE_UNINIT)
-		__init_thread();
+		__init_thread(0);
 
-	if (local->state != PROF_STATE_RUNNING)
+	if (!__probe_enter(local))
 		return;
 
-//	func = &local->func_counters[func_index - global->min_index];
-//	if (func->depth < PROF_FUNC_STACK_MAX) {
-//		func->stack[func->depth] = func->counter;
-//		func->counter ++;
+	if (__sample_self(global) && !__sample_push(local, idx))
+		goto out;
 
-		__read_count(global->evlist, func_index, local);
-//	}
-//	func->depth ++;
+	local->func_counters[idx].counter++;
+	__read_count(global->evlist, func_index, local, 0);
+out:
+	__probe_leave(local);
 }
 
 void prof_count_post(unsigned int func_index)
 {
 	struct prof_info *global = &globalinfo;
 	struct prof_tinfo *local = &tinfo;
-//	struct prof_func *func = NULL;
-//	unsigned int cnt = 0;
 
-	if (local->state != PROF_STATE_RUNNING)
+	if (!__probe_enter(local))
 		return;
 
-//	func = &local->func_counters[func_index - global->min_index];
-//	func->depth --;
-//	if (func->depth < PROF_FUNC_STACK_MAX) {
-//		cnt = func->counter[func->deep];
-		__read_count(global->evlist, func_index, local);
-//	}
+	if (__sample_self(global) && !__sample_pop(local))
+		goto out;
+
+	__read_count(global->evlist, func_index, local, 1);
+out:
+	__probe_leave(local);
 }
 
-void prof_dump_records(void) {
-	struct prof_tinfo *local = &tinfo;
-	unsigned int i = 0;
+/* Empty function of the calibration, probed as the traced ones */
+static void __attribute__((noinline)) __calib_func(unsigned int func_index)
+{
+	prof_count_pre(func_index);
+	barrier();
+	prof_count_post(func_index);
+}
 
-	for (i = 0; i < local->nb_record; i++) {
-		fprintf(stdout, "%u,%lu\n",
-				local->records[i].func_idx, local->records[i].count);
+static int __u64_cmp(const void *a, const void *b)
+{
+	uint64_t va = *(const uint64_t *)a, vb = *(const uint64_t *)b;
+
+	return va < vb ? -1 : va > vb;
+}
+
+/* Median of 'nb' counts, sorting them */
+static uint64_t __median(uint64_t *val, unsigned int nb)
+{
+	qsort(val, nb, sizeof(uint64_t), __u64_cmp);
+	return val[nb / 2];
+}
+
+/* Measure the counts of the probes of a call on an empty function,
+ * before the data file of the thread is opened, so the probed calls
+ * are only kept in 'local->calib'. The overhead of each event is the
+ * median count from the entry to the exit, and its noise the median
+ * absolute deviation. The rest of the probes is the median count
+ * from an entry to the next one, without the overhead. */
+static void __calibrate(struct prof_tinfo *local)
+{
+	struct prof_info *global = &globalinfo;
+	struct prof_evsel *evsel = NULL;
+	unsigned int nb = global->evlist->nr_entries, n = 0, i = 0, j = 0;
+	uint64_t calls = 0, max_calls = PROF_CALIB_LOOPS, *val = NULL;
+	uint64_t *calib = NULL, med = 0;
+	char buf[PROF_DATA_NAME_MAX] = {'\0'};
+	int fd = -1;
+
+	// only the sampled calls are measured
+	if (__sample_self(global))
+		max_calls *= global->sample_freq;
+
+	// the probes write into a backend as the real one, whose file
+	// is removed at once
+	snprintf(buf, PROF_DATA_NAME_MAX, PROF_CALIB_NAME, local->pid);
+	fd = open(buf, O_RDWR | O_CREAT | O_TRUNC, 0600);
+	if (fd < 0) {
+		LOG_WARN("Failed to open calibration file %s, err %d, "
+				"the probe overhead is unknown", buf, errno);
+		return;
 	}
+	unlink(buf);
+	if (__open_backend(local, fd) < 0) {
+		LOG_WARN("Failed to open the calibration backend, "
+				"the probe overhead is unknown");
+		close(fd);
+		return;
+	}
+
+	local->calib = (uint64_t *)malloc(sizeof(uint64_t) * nb
+					* (2 * PROF_CALIB_LOOPS + 1));
+	if (!local->calib) {
+		LOG_WARN("Failed to allocate memory for the calibration, "
+				"the probe overhead is unknown");
+		goto out;
+	}
+
+	local->nb_calib = 0;
+	local->state = PROF_STATE_RUNNING;
+	for (calls = 0; calls < max_calls && local->nb_calib < PROF_CALIB_LOOPS;
+					calls++)
+		__calib_func(global->min_index);
+	local->state = PROF_STATE_UNINIT;
+	calib = local->calib + nb;
+
+	// the last entry to entry is not complete
+	n = local->nb_calib;
+	val = (uint64_t *)malloc(sizeof(uint64_t) * n);
+	evlist__for_each(global->evlist, evsel) {
+		if (!val || n < 2 || i >= nb)
+			break;
+
+		for (j = 0; j < n; j++)
+			val[j] = calib[2 * j * nb + i];
+		global->overhead[i] = __median(val, n);
+
+		for (j = 0; j < n; j++)
+			val[j] = (val[j] > global->overhead[i] ?
+							val[j] - global->overhead[i] :
+							global->overhead[i] - val[j]);
+		global->noise[i] = __median(val, n);
+
+		for (j = 0; j < n - 1; j++)
+			val[j] = calib[(2 * j + 1) * nb + i];
+		med = __median(val, n - 1);
+		global->outer[i] = (med > global->overhead[i] ?
+						med - global->overhead[i] : 0);
+
+		LOG_INFO("Probe overhead of %s: %lu, outer %lu, noise %lu, "
+						"%u calls", evsel->name,
+						(unsigned long)global->overhead[i],
+						(unsigned long)global->outer[i],
+						(unsigned long)global->noise[i], n);
+		i++;
+	}
+	free(val);
+
+	// the calibration is not a part of the profile
+	free(local->calib);
+	local->calib = NULL;
+	local->nb_calib = 0;
+	local->depth = 0;
+out:
+	if (local->writer) {
+		prof_writer_put(local->writer);
+		local->writer = NULL;
+	}
+	if (local->seglog) {
+		prof_seglog_close(local->seglog);
+		local->seglog = NULL;
+	}
+	if (local->aggr) {
+		prof_aggr_close(local->aggr, NULL);
+		local->aggr = NULL;
+	}
+
+	memset(local->func_counters, 0, sizeof(struct prof_func)
+					* (global->max_index - global->min_index + 1));
+	if (local->countdown)
+		memset(local->countdown, 0, sizeof(uint32_t)
+						* (global->max_index - global->min_index + 1));
 }
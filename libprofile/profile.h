@@ -1,9 +1,16 @@
 #ifndef __PROFILE_H__
 #define __PROFILE_H__
 
-#define PROF_EVENT_MAX	10
+#define PROF_EVENT_MAX	32
+
+#include <pthread.h>
 
 #include "list.h"
+#include "data.h"
+
+struct prof_writer;
+struct prof_seglog;
+struct prof_aggr;
 
 struct prof_info {
 	/* List of events */
@@ -12,58 +19,112 @@ struct prof_info {
 	unsigned min_index;
 	/* Max index of traced function */
 	unsigned max_index;
-	/* Sample frequency */
+	/* Sample frequency
+	 * One call in 'sample_freq' of each function is recorded.
+	 * 0 or 1 means that every call is recorded.
+	 * With PROF_FLAG_PRESAMPLED, the caller samples instead.
+	 */
 	unsigned sample_freq;
+	/* Samples per second of the sampler, PROF_FLAG_SAMPLING */
+	unsigned sample_hz;
+	/* PROF_FLAG_*, see data.h */
+	unsigned flags;
+	/* TSC ticks per second */
+	uint64_t tsc_hz;
+	/* TSC conversion of perf, 'time_mult' is 0 if unknown */
+	uint64_t time_zero;
+	uint32_t time_mult;
+	uint16_t time_shift;
+	/* Probe overhead of each event, see data.h */
+	uint64_t overhead[PROF_EVENT_MAX];
+	uint64_t outer[PROF_EVENT_MAX];
+	uint64_t noise[PROF_EVENT_MAX];
 	/* log file */
 	FILE *flog;
-	/* list of per-thread data.
-	 * It's used for safely termination.
+	/* list of per-thread data, and its lock.
+	 * It's used for safely termination, the threads still alive
+	 * are destroyed by 'prof_exit()'. The event list is only freed
+	 * once no thread is in the list or initializing.
 	 */
-//	struct list_head thread_data;
+	struct list_head thread_data;
+	pthread_mutex_t lock;
+	uint32_t nb_init;
+	/* Set by 'prof_exit()', the probes count nothing from now on */
+	bool stopped;
+	/* The key whose destructor destroys the per-thread data when
+	 * a thread exits, valid if 'has_key' */
+	pthread_key_t key;
+	bool has_key;
 };
 
 enum {
 	PROF_STATE_UNINIT = 0,
 	PROF_STATE_RUNNING,
+	/* in a probe, its data is not destroyed by other threads */
+	PROF_STATE_BUSY,
 	PROF_STATE_STOP,
 	PROF_STATE_ERROR,
 };
 
-#define PROF_FUNC_STACK_MAX	14
-
 struct prof_func {
-	uint32_t depth;
 	uint32_t counter;
-	uint32_t stack[PROF_FUNC_STACK_MAX];
 };
 
-#define PROF_RECORD_MAX	(1 << 22)
-struct prof_record {
-	uint16_t func_idx;
-	uint8_t ev_idx;
-	uint64_t count;
-};
+/* Max depth of sampled calls. Deeper calls are never sampled. */
+#define PROF_SAMPLE_STACK_MAX	256
+
+/* Probed calls of the overhead calibration, and its data file,
+ * removed once opened */
+#define PROF_CALIB_LOOPS	4096
+#define PROF_CALIB_NAME	"profile_%d.calib"
 
-#define PROF_RECORD_CACHE (1 << 16)
+/* Polling period, and max wait, of 'prof_exit()' for the threads
+ * in a probe, in microseconds */
+#define PROF_EXIT_WAIT 1000
+#define PROF_EXIT_WAIT_MAX 100000
+
+/* Bytes per buffer of the record writer */
+#define PROF_RECORD_CACHE (1 << 20)
 
 // per-thread data
 struct prof_tinfo {
-//	struct list_head node;
+	/* node of 'thread_data' of 'struct prof_info', from the
+	 * initialization to the destruction of the thread */
+	struct list_head node;
 
 	int pid;
-	int tid;
 	uint8_t state;
 
-	FILE *output_file;
-
 	/* Per-function counters
 	 * Its length is (max_index + 1)
 	 */
 	struct prof_func *func_counters;
 
-	uint32_t nb_record;
-	struct prof_record records[PROF_RECORD_CACHE];
-//	struct prof_record *records;
+	/* Sampling
+	 * Per-function calls to skip before the next sampled one, and
+	 * a bit stack of the calls in progress, telling whether each
+	 * of them is sampled. Its exit is recorded only if its entry
+	 * is.
+	 */
+	uint32_t *countdown;
+	uint32_t depth;
+	uint64_t sampled[PROF_SAMPLE_STACK_MAX / 64];
+
+	/* Record writer, see writer.h, or segmented mmap log with
+	 * PROF_FLAG_MMAP, see seglog.h, or per-function aggregation
+	 * with PROF_FLAG_AGGR, see aggr.h */
+	struct prof_writer *writer;
+	struct prof_seglog *seglog;
+	struct prof_aggr *aggr;
+	/* Counts of the last entry of the calibration, then the counts
+	 * of its probed calls, from entry to exit then from entry to
+	 * entry, by call, see '__calibrate()' */
+	uint64_t *calib;
+	uint32_t nb_calib;
+	/* Events of the thread, opened at its first probe, and the
+	 * last count of each of them, the records hold the deltas */
+	struct thread_data events[PROF_EVENT_MAX];
+	uint64_t last[PROF_EVENT_MAX];
 };
 
 enum {
@@ -87,7 +148,10 @@ void prof_log(uint8_t level, const char *format, ...);
 #endif
 
 void *prof_init(char *evlist_str, char *logfile,
-				unsigned min_id, unsigned max_id, unsigned freq);
+				unsigned min_id, unsigned max_id, unsigned freq,
+				unsigned flags, const char *id_table);
+
+int prof_check_evlist(const char *evlist_str);
 
 void prof_exit(void);
 void prof_thread_exit(void);
@@ -95,6 +159,4 @@ void prof_thread_exit(void);
 void prof_count_pre(unsigned int func_index);
 void prof_count_post(unsigned int func_index);
 
-void prof_dump_records(void);
-
 #endif	// __PROFILE_H__
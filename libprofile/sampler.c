@@ -0,0 +1,567 @@
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE
+#endif
+
+#include <pthread.h>
+#include <link.h>
+#include <limits.h>
+#include <dirent.h>
+#include <sched.h>
+
+#include "sampler.h"
+#include "evsel.h"
+#include "aggr.h"
+#include "profile.h"
+#include "../libprobe/funcid.h"
+
+static struct prof_sampler sampler;
+
+static pthread_t sampler_thread;
+static bool sampler_running = false;
+static bool sampler_stop = false;
+/* system thread ID of the reader, which is never sampled */
+static int sampler_tid = 0;
+
+#define SAMPLER_RING_SIZE (PROF_SAMPLER_PAGES * PAGE_SIZE)
+#define SAMPLER_RING_MASK (SAMPLER_RING_SIZE - 1)
+
+/* Layout of the samples, in the order of PERF_SAMPLE_* bits */
+#define SAMPLER_SAMPLE_TYPE (PERF_SAMPLE_IP | PERF_SAMPLE_TID | \
+				PERF_SAMPLE_PERIOD | PERF_SAMPLE_CALLCHAIN)
+
+struct sampler_sample {
+	struct perf_event_header header;
+	uint64_t ip;
+	uint32_t pid;
+	uint32_t tid;
+	uint64_t period;
+	uint64_t nr;
+	uint64_t ips[];
+};
+
+struct sampler_lost {
+	struct perf_event_header header;
+	uint64_t id;
+	uint64_t lost;
+};
+
+/* Load address of the objects of the process */
+struct sampler_object {
+	char name[PATH_MAX];
+	uint64_t base;
+};
+
+struct sampler_objects {
+	struct sampler_object *objs;
+	int nb;
+};
+
+static const char *__basename(const char *path)
+{
+	const char *p = strrchr(path, '/');
+
+	return p ? p + 1 : path;
+}
+
+static int __object_cb(struct dl_phdr_info *info, size_t size __maybe_unused,
+				void *arg)
+{
+	struct sampler_objects *list = (struct sampler_objects *)arg;
+	struct sampler_object *obj = NULL;
+	ssize_t len;
+
+	obj = (struct sampler_object *)realloc(list->objs,
+					(list->nb + 1) * sizeof(struct sampler_object));
+	if (!obj)
+		return 1;
+	list->objs = obj;
+	obj = &list->objs[list->nb++];
+
+	// the executable comes first, without name
+	if (info->dlpi_name && info->dlpi_name[0] != '\0')
+		snprintf(obj->name, PATH_MAX, "%s", info->dlpi_name);
+	else {
+		len = readlink("/proc/self/exe", obj->name, PATH_MAX - 1);
+		obj->name[len > 0 ? len : 0] = '\0';
+	}
+	obj->base = info->dlpi_addr;
+	return 0;
+}
+
+/* Load address of the object 'path' of the ID table. The instrumented
+ * executable may be renamed, so object 0 falls back to the running
+ * one. Return false if it's not loaded. */
+static bool __object_base(struct sampler_objects *list, const char *path,
+				uint32_t obj_id, uint64_t *base)
+{
+	int i;
+
+	for (i = 0; i < list->nb; i++) {
+		if (!strcmp(__basename(list->objs[i].name), __basename(path))) {
+			*base = list->objs[i].base;
+			return true;
+		}
+	}
+	if (obj_id == 0 && list->nb > 0) {
+		*base = list->objs[0].base;
+		return true;
+	}
+	return false;
+}
+
+static int __range_cmp(const void *a, const void *b)
+{
+	const struct prof_sampler_range *ra = (const struct prof_sampler_range *)a;
+	const struct prof_sampler_range *rb = (const struct prof_sampler_range *)b;
+
+	return ra->start < rb->start ? -1 : ra->start > rb->start;
+}
+
+/* Load the ranges of the functions [min, max] from the ID table */
+static int __sampler_load_ranges(const char *path, uint32_t min, uint32_t max)
+{
+	struct sampler_objects list = {NULL, 0};
+	char line[FUNCID_LINE_MAX], str[FUNCID_LINE_MAX];
+	char **objects = NULL;
+	uint32_t *gids = NULL, nb_obj = 0, idx, id, nb_func = max - min + 1;
+	struct prof_sampler_range *range = NULL;
+	unsigned long start, end;
+	uint64_t base;
+	FILE *file = NULL;
+	int ret = -1;
+
+	if (path == NULL || path[0] == '\0') {
+		LOG_ERROR("No ID table to map the samples");
+		return -1;
+	}
+
+	file = fopen(path, "r");
+	if (!file) {
+		LOG_ERROR("Failed to open ID table %s, err %d", path, errno);
+		return -1;
+	}
+	if (!fgets(line, FUNCID_LINE_MAX, file) ||
+			strncmp(line, FUNCID_TABLE_HEADER,
+					strlen(FUNCID_TABLE_HEADER))) {
+		LOG_ERROR("Wrong ID table %s", path);
+		goto out;
+	}
+
+	gids = (uint32_t *)calloc(nb_func, sizeof(uint32_t));
+	sampler.ranges = (struct prof_sampler_range *)calloc(nb_func,
+					sizeof(struct prof_sampler_range));
+	if (!gids || !sampler.ranges) {
+		LOG_ERROR("Failed to allocate the ranges of %u functions", nb_func);
+		goto out;
+	}
+
+	// the objects and functions come before the ranges
+	while (fgets(line, FUNCID_LINE_MAX, file)) {
+		if (sscanf(line, "object %u %[^\n]", &idx, str) == 2) {
+			if (idx != nb_obj)
+				continue;
+			objects = (char **)realloc(objects, (nb_obj + 1) * sizeof(char *));
+			if (!objects)
+				goto out;
+			objects[nb_obj++] = strdup(str);
+		} else if (sscanf(line, "func %u %x", &idx, &id) == 2) {
+			if (idx >= min && idx <= max)
+				gids[idx - min] = id;
+		} else if (sscanf(line, "range %u %lx %lx", &idx, &start, &end) == 3) {
+			if (idx < min || idx > max || start >= end ||
+					sampler.nb_range >= nb_func)
+				continue;
+			range = &sampler.ranges[sampler.nb_range++];
+			range->start = start;
+			range->end = end;
+			range->idx = idx - min;
+		}
+	}
+
+	dl_iterate_phdr(__object_cb, &list);
+
+	// relocate the link-time addresses
+	for (idx = 0; idx < sampler.nb_range; idx++) {
+		range = &sampler.ranges[idx];
+		id = FUNCID_OBJ(gids[range->idx]);
+		if (id >= nb_obj || !__object_base(&list, objects[id], id, &base)) {
+			range->start = range->end = 0;
+			continue;
+		}
+		range->start += base;
+		range->end += base;
+	}
+	qsort(sampler.ranges, sampler.nb_range,
+					sizeof(struct prof_sampler_range), __range_cmp);
+
+	LOG_INFO("Load %u function ranges of %u objects from %s",
+					sampler.nb_range, nb_obj, path);
+	ret = sampler.nb_range > 0 ? 0 : -1;
+	if (ret < 0)
+		LOG_ERROR("No function range in %s", path);
+
+out:
+	while (nb_obj > 0)
+		free(objects[--nb_obj]);
+	free(objects);
+	free(list.objs);
+	free(gids);
+	fclose(file);
+	return ret;
+}
+
+/* Function of 'addr', or -1 */
+static inline int64_t __sampler_find(uint64_t addr)
+{
+	uint32_t lo = 0, hi = sampler.nb_range, mid;
+
+	while (lo < hi) {
+		mid = (lo + hi) / 2;
+		if (addr < sampler.ranges[mid].start)
+			hi = mid;
+		else if (addr >= sampler.ranges[mid].end)
+			lo = mid + 1;
+		else
+			return sampler.ranges[mid].idx;
+	}
+	return -1;
+}
+
+static void __sampler_sample(const struct sampler_sample *sample)
+{
+	uint32_t stack[PROF_SAMPLER_STACK_MAX + 1];
+	uint32_t depth = 0;
+	int64_t idx;
+	uint64_t i, addr;
+	bool self = false, first = true;
+
+	sampler.samples++;
+
+	// the user call chain starts with the IP, and goes on with
+	// return addresses, which are after their call
+	for (i = 0; i < sample->nr && depth <= PROF_SAMPLER_STACK_MAX; i++) {
+		addr = sample->ips[i];
+		if (addr >= PERF_CONTEXT_MAX)
+			continue;
+		idx = __sampler_find(first ? addr : addr - 1);
+		if (idx >= 0) {
+			self |= first;
+			stack[depth++] = idx;
+		}
+		first = false;
+	}
+
+	// without user call chain, e.g. a sample in the kernel
+	if (first && (idx = __sampler_find(sample->ip)) >= 0) {
+		self = true;
+		stack[depth++] = idx;
+	}
+
+	if (!self)
+		sampler.unknown++;
+	prof_aggr_sample(sampler.aggr, stack, depth, self, sample->period);
+}
+
+/* Read the records of a ring, return their number */
+static uint64_t __sampler_drain_ring(struct prof_sampler_ring *ring)
+{
+	static uint8_t copy[1 << 16];
+	struct perf_event_header *header = NULL;
+	uint64_t head, tail, off, nb = 0;
+	size_t len;
+
+	head = __atomic_load_n(&ring->page->data_head, __ATOMIC_ACQUIRE);
+	tail = ring->page->data_tail;
+
+	while (tail < head) {
+		off = tail & SAMPLER_RING_MASK;
+		header = (struct perf_event_header *)(ring->data + off);
+
+		// a record wrapping around the end is copied whole, its
+		// header never wraps as records are 8-byte aligned
+		if (off + header->size > SAMPLER_RING_SIZE) {
+			len = SAMPLER_RING_SIZE - off;
+			memcpy(copy, ring->data + off, len);
+			memcpy(copy + len, ring->data, header->size - len);
+			header = (struct perf_event_header *)copy;
+		}
+		if (header->size == 0)
+			break;
+
+		if (header->type == PERF_RECORD_SAMPLE)
+			__sampler_sample((struct sampler_sample *)header);
+		else if (header->type == PERF_RECORD_LOST)
+			sampler.lost += ((struct sampler_lost *)header)->lost;
+
+		tail += header->size;
+		nb++;
+	}
+
+	__atomic_store_n(&ring->page->data_tail, tail, __ATOMIC_RELEASE);
+	return nb;
+}
+
+static uint64_t __sampler_drain(void)
+{
+	uint64_t nb = 0;
+	int i, nb_ring = __atomic_load_n(&sampler.nb_ring, __ATOMIC_ACQUIRE);
+
+	for (i = 0; i < nb_ring; i++)
+		nb += __sampler_drain_ring(&sampler.rings[i]);
+	return nb;
+}
+
+static void *__sampler_main(void *arg __maybe_unused)
+{
+	struct timespec delay = {
+		.tv_sec = 0,
+		.tv_nsec = PROF_SAMPLER_INTERVAL * 1000L,
+	};
+
+	__atomic_store_n(&sampler_tid, syscall(__NR_gettid), __ATOMIC_RELEASE);
+	while (!__atomic_load_n(&sampler_stop, __ATOMIC_ACQUIRE)) {
+		nanosleep(&delay, NULL);
+		__sampler_drain();
+	}
+	return NULL;
+}
+
+static void __sampler_close_rings(void)
+{
+	struct prof_sampler_ring *ring = NULL;
+	int i;
+
+	for (i = 0; i < sampler.nb_task_fd; i++)
+		close(sampler.task_fds[i]);
+	free(sampler.task_fds);
+	sampler.task_fds = NULL;
+	sampler.nb_task_fd = 0;
+
+	for (i = 0; i < sampler.nb_ring; i++) {
+		ring = &sampler.rings[i];
+		munmap(ring->page, SAMPLER_RING_SIZE + PAGE_SIZE);
+		close(ring->fd);
+	}
+	free(sampler.rings);
+	sampler.rings = NULL;
+	sampler.nb_ring = 0;
+}
+
+/* Open the event on each CPU for the process, with a ring buffer */
+static int __sampler_open_rings(struct perf_event_attr *attr)
+{
+	struct prof_sampler_ring *ring = NULL;
+	int cpu, nb_cpu = sysconf(_SC_NPROCESSORS_CONF);
+	void *ptr = NULL;
+
+	sampler.rings = (struct prof_sampler_ring *)zalloc(
+					nb_cpu * sizeof(struct prof_sampler_ring));
+	if (!sampler.rings)
+		return -1;
+
+	for (cpu = 0; cpu < nb_cpu; cpu++) {
+		ring = &sampler.rings[sampler.nb_ring];
+		ring->cpu = cpu;
+		ring->fd = syscall(__NR_perf_event_open, attr, getpid(), cpu, -1, 0);
+		if (ring->fd < 0) {
+			// e.g. an offline CPU
+			LOG_WARN("Failed to open sampling event on CPU %d, errno %d",
+							cpu, errno);
+			continue;
+		}
+
+		ptr = mmap(NULL, SAMPLER_RING_SIZE + PAGE_SIZE,
+						PROT_READ | PROT_WRITE, MAP_SHARED, ring->fd, 0);
+		if (ptr == MAP_FAILED) {
+			LOG_WARN("Failed to map ring buffer of CPU %d, err %d",
+							cpu, errno);
+			close(ring->fd);
+			continue;
+		}
+		ring->page = (struct perf_event_mmap_page *)ptr;
+		ring->data = (uint8_t *)ptr + PAGE_SIZE;
+		// the reader drains the ring from now on
+		__atomic_store_n(&sampler.nb_ring, sampler.nb_ring + 1,
+						__ATOMIC_RELEASE);
+	}
+
+	if (sampler.nb_ring == 0) {
+		LOG_ERROR("Failed to open the sampling event on any CPU");
+		__sampler_close_rings();
+		return -1;
+	}
+	return 0;
+}
+
+/* Open the event on each CPU for the threads already running, but the
+ * main one and the reader, into the ring of the CPU */
+static int __sampler_open_tasks(struct perf_event_attr *attr)
+{
+	struct prof_sampler_ring *ring = NULL;
+	struct dirent *ent = NULL;
+	DIR *dir = NULL;
+	int *fds = NULL;
+	int tid, fd, i, nb_task = 0, pid = getpid();
+
+	dir = opendir("/proc/self/task");
+	if (!dir) {
+		LOG_WARN("Failed to list the threads, err %d, only the new "
+				"ones are sampled", errno);
+		return -1;
+	}
+
+	while ((ent = readdir(dir)) != NULL) {
+		tid = atoi(ent->d_name);
+		if (tid <= 0 || tid == pid ||
+				tid == __atomic_load_n(&sampler_tid, __ATOMIC_ACQUIRE))
+			continue;
+
+		for (i = 0; i < sampler.nb_ring; i++) {
+			ring = &sampler.rings[i];
+			fd = syscall(__NR_perf_event_open, attr, tid, ring->cpu, -1, 0);
+			if (fd < 0) {
+				// the thread exited since the listing
+				if (errno != ESRCH)
+					LOG_WARN("Failed to open sampling event of thread "
+									"%d on CPU %d, errno %d",
+									tid, ring->cpu, errno);
+				break;
+			}
+			if (ioctl(fd, PERF_EVENT_IOC_SET_OUTPUT, ring->fd) < 0) {
+				LOG_WARN("Failed to redirect sampling event of thread "
+								"%d on CPU %d, errno %d",
+								tid, ring->cpu, errno);
+				close(fd);
+				continue;
+			}
+
+			fds = (int *)realloc(sampler.task_fds,
+							(sampler.nb_task_fd + 1) * sizeof(int));
+			if (!fds) {
+				close(fd);
+				break;
+			}
+			fds[sampler.nb_task_fd++] = fd;
+			sampler.task_fds = fds;
+		}
+		nb_task++;
+	}
+
+	closedir(dir);
+	if (nb_task)
+		LOG_INFO("Sample %d threads already running", nb_task);
+	return 0;
+}
+
+int prof_sampler_start(struct prof_evsel *evsel, unsigned freq,
+				const char *id_table, int fd,
+				const struct prof_data_header *hdr)
+{
+	struct perf_event_attr attr = evsel->attr;
+	int i;
+
+	if (sampler_running)
+		return 0;
+
+	if (prof_evsel__is_pseudo(evsel)) {
+		LOG_ERROR("Pseudo-event %s cannot sample", evsel->name);
+		goto fail_close;
+	}
+
+	if (__sampler_load_ranges(id_table, hdr->min_index, hdr->max_index) < 0)
+		goto fail_free;
+
+	sampler.aggr = prof_aggr_open(fd, hdr);
+	if (!sampler.aggr)
+		goto fail_free;
+
+	// a 'period' of the event wins over the frequency
+	if (!attr.sample_period) {
+		attr.freq = 1;
+		attr.sample_freq = freq ? freq : PROF_SAMPLER_FREQ_DEF;
+	}
+	attr.sample_type = SAMPLER_SAMPLE_TYPE;
+	attr.read_format = 0;
+	attr.inherit = 1;
+	attr.disabled = 1;
+	attr.exclude_callchain_kernel = 1;
+	attr.sample_max_stack = PROF_SAMPLER_STACK_MAX;
+	attr.watermark = 0;
+	attr.wakeup_events = 0;
+
+	// the reader is created first, so that it doesn't inherit the
+	// events, and finds no ring until they are open. Its ID keeps
+	// it out of the running threads.
+	sampler_stop = false;
+	sampler_tid = 0;
+	if (pthread_create(&sampler_thread, NULL, __sampler_main, NULL) != 0) {
+		LOG_ERROR("Failed to create the sampler thread");
+		goto fail_aggr;
+	}
+	while (!__atomic_load_n(&sampler_tid, __ATOMIC_ACQUIRE))
+		sched_yield();
+
+	if (__sampler_open_rings(&attr) < 0)
+		goto fail_join;
+	__sampler_open_tasks(&attr);
+	for (i = 0; i < sampler.nb_ring; i++)
+		ioctl(sampler.rings[i].fd, PERF_EVENT_IOC_ENABLE, 0);
+	for (i = 0; i < sampler.nb_task_fd; i++)
+		ioctl(sampler.task_fds[i], PERF_EVENT_IOC_ENABLE, 0);
+
+	__atomic_store_n(&sampler_running, true, __ATOMIC_RELEASE);
+	LOG_INFO("Sample %s on %d CPUs, %s %lu", evsel->name, sampler.nb_ring,
+					attr.freq ? "frequency" : "period",
+					(unsigned long)attr.sample_period);
+	return 0;
+
+fail_join:
+	__atomic_store_n(&sampler_stop, true, __ATOMIC_RELEASE);
+	pthread_join(sampler_thread, NULL);
+fail_aggr:
+	// the aggregation owns the file
+	prof_aggr_close(sampler.aggr, NULL);
+	sampler.aggr = NULL;
+	free(sampler.ranges);
+	sampler.ranges = NULL;
+	return -1;
+fail_free:
+	free(sampler.ranges);
+	sampler.ranges = NULL;
+	sampler.nb_range = 0;
+fail_close:
+	close(fd);
+	return -1;
+}
+
+void prof_sampler_stop(void)
+{
+	int i;
+
+	if (!sampler_running)
+		return;
+	__atomic_store_n(&sampler_running, false, __ATOMIC_RELEASE);
+
+	for (i = 0; i < sampler.nb_ring; i++)
+		ioctl(sampler.rings[i].fd, PERF_EVENT_IOC_DISABLE, 0);
+	for (i = 0; i < sampler.nb_task_fd; i++)
+		ioctl(sampler.task_fds[i], PERF_EVENT_IOC_DISABLE, 0);
+
+	__atomic_store_n(&sampler_stop, true, __ATOMIC_RELEASE);
+	pthread_join(sampler_thread, NULL);
+
+	// the samples since the last period
+	__sampler_drain();
+	__sampler_close_rings();
+
+	LOG_INFO("Sampler: %lu samples, %lu outside the functions, %lu lost",
+					(unsigned long)sampler.samples,
+					(unsigned long)sampler.unknown,
+					(unsigned long)sampler.lost);
+
+	prof_aggr_close(sampler.aggr, NULL);
+	sampler.aggr = NULL;
+	free(sampler.ranges);
+	sampler.ranges = NULL;
+	sampler.nb_range = 0;
+}
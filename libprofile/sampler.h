@@ -0,0 +1,85 @@
+#ifndef _PROFILE_SAMPLER_H_
+#define _PROFILE_SAMPLER_H_
+
+#include "util.h"
+#include "data.h"
+
+/* Sampling backend, PROF_FLAG_SAMPLING
+ * The probes read no event. The first event of the evlist samples
+ * the process instead, at a frequency or with the 'period' of the
+ * event. It is opened on each CPU for the process with 'inherit', so
+ * the threads created later are sampled too, and each sample holds
+ * its IP, TID, period and user call chain. The kernel writes the
+ * samples into one ring buffer per CPU, drained by a reader thread
+ * every PROF_SAMPLER_INTERVAL.
+ * The addresses are mapped to the function indices with the 'range'
+ * lines of the ID table, relocated by the load address of their
+ * object. The period of a sample is exclusive to the function of its
+ * IP, and inclusive to each function of its call chain, see
+ * 'prof_aggr_sample()'. The table of the process is written when the
+ * sampler stops, see data.h.
+ * 'inherit' only follows the threads created by a sampled one, so
+ * the event is also opened on each CPU for each thread existing at
+ * the start, but the reader, and redirected into the ring of the CPU.
+ * A thread created by one of them while they are being opened may
+ * be missed.
+ */
+
+/* Data pages of each ring buffer, a power of 2 */
+#define PROF_SAMPLER_PAGES 64
+/* Period of the reader thread, in microseconds */
+#define PROF_SAMPLER_INTERVAL 10000
+/* Samples per second if the event has no 'period' */
+#define PROF_SAMPLER_FREQ_DEF 1000
+/* Max user frames of a call chain */
+#define PROF_SAMPLER_STACK_MAX 127
+
+/* Address range of a function, once relocated */
+struct prof_sampler_range {
+	uint64_t start;
+	uint64_t end;
+	/* function index, from 0 */
+	uint32_t idx;
+};
+
+struct prof_sampler_ring {
+	int fd;
+	int cpu;
+	struct perf_event_mmap_page *page;
+	uint8_t *data;
+};
+
+struct prof_sampler {
+	/* one ring per CPU the event could be opened on, 'nb_ring' is
+	 * published once each ring is mapped, while the reader runs */
+	struct prof_sampler_ring *rings;
+	int nb_ring;
+	/* events of the threads existing at the start, redirected
+	 * into the rings */
+	int *task_fds;
+	int nb_task_fd;
+	/* sorted function ranges */
+	struct prof_sampler_range *ranges;
+	uint32_t nb_range;
+	/* table of the process */
+	struct prof_aggr *aggr;
+	/* samples read, outside the functions, and lost by the
+	 * kernel */
+	uint64_t samples;
+	uint64_t unknown;
+	uint64_t lost;
+};
+
+struct prof_evsel;
+
+/* Start sampling the process with 'evsel' at 'freq' samples per
+ * second, into the table of 'hdr' in 'fd'. The ranges are loaded
+ * from 'id_table'. The sampler owns 'fd' from now on. Return 0 on
+ * success. */
+int prof_sampler_start(struct prof_evsel *evsel, unsigned freq,
+				const char *id_table, int fd,
+				const struct prof_data_header *hdr);
+/* Drain the rings, stop sampling and write the table */
+void prof_sampler_stop(void);
+
+#endif /* _PROFILE_SAMPLER_H_ */
@@ -0,0 +1,107 @@
+#include "seglog.h"
+#include "profile.h"
+
+/* Map the segment at 'off' after 'data_offset', growing the file.
+ * The current segment is unmapped in any case. */
+static int __seglog_map(struct prof_seglog *log, uint64_t off)
+{
+	uint64_t base = log->hdr->data_offset;
+	void *seg = NULL;
+
+	if (log->seg) {
+		munmap(log->seg, PROF_SEGLOG_SEG_SIZE);
+		log->seg = NULL;
+	}
+
+	if (ftruncate(log->fd, base + off + PROF_SEGLOG_SEG_SIZE) < 0) {
+		LOG_ERROR("Failed to grow data file to %lu bytes, err %d",
+						(unsigned long)(base + off + PROF_SEGLOG_SEG_SIZE),
+						errno);
+		return -1;
+	}
+
+	seg = mmap(NULL, PROF_SEGLOG_SEG_SIZE, PROT_READ | PROT_WRITE,
+					MAP_SHARED, log->fd, base + off);
+	if (seg == MAP_FAILED) {
+		LOG_ERROR("Failed to map data segment at %lu, err %d",
+						(unsigned long)(base + off), errno);
+		return -1;
+	}
+
+	log->seg = (char *)seg;
+	log->seg_off = off;
+	log->pos = 0;
+	return 0;
+}
+
+struct prof_seglog *prof_seglog_open(int fd,
+				const struct prof_data_header *hdr)
+{
+	struct prof_seglog *log = NULL;
+	uint64_t size = hdr->data_offset;
+	void *ptr = NULL;
+
+	log = (struct prof_seglog *)zalloc(sizeof(struct prof_seglog));
+	if (!log)
+		return NULL;
+	log->fd = fd;
+
+	if (ftruncate(fd, size) < 0) {
+		LOG_ERROR("Failed to resize data file, err %d", errno);
+		goto fail_free;
+	}
+
+	ptr = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+	if (ptr == MAP_FAILED) {
+		LOG_ERROR("Failed to map data header, err %d", errno);
+		goto fail_free;
+	}
+	log->hdr = (struct prof_data_header *)ptr;
+	memcpy(log->hdr, hdr, sizeof(struct prof_data_header)
+					+ hdr->nb_event * sizeof(struct prof_data_event));
+	log->hdr->committed = 0;
+
+	if (__seglog_map(log, 0) < 0)
+		goto fail_unmap;
+
+	return log;
+
+fail_unmap:
+	munmap(log->hdr, size);
+fail_free:
+	free(log);
+	return NULL;
+}
+
+uint8_t *prof_seglog_grow(struct prof_seglog *log)
+{
+	/* the file failed to grow before, the commit drops the record */
+	if (!log->seg)
+		return log->scratch;
+
+	/* the rest of the segment is left as zero padding, and the
+	 * committed length skips it with the next record */
+	if (__seglog_map(log, log->seg_off + PROF_SEGLOG_SEG_SIZE) < 0)
+		return log->scratch;
+
+	return (uint8_t *)log->seg;
+}
+
+void prof_seglog_close(struct prof_seglog *log)
+{
+	uint64_t committed = log->hdr->committed;
+
+	if (log->seg)
+		munmap(log->seg, PROF_SEGLOG_SEG_SIZE);
+	/* drop the unused end of the last segment */
+	if (ftruncate(log->fd, log->hdr->data_offset + committed) < 0)
+		LOG_WARN("Failed to trim data file, err %d", errno);
+
+	LOG_INFO("Thread %d: %lu bytes of records, %lu dropped",
+					log->hdr->tid, (unsigned long)committed,
+					(unsigned long)log->dropped);
+
+	munmap(log->hdr, log->hdr->data_offset);
+	close(log->fd);
+	free(log);
+}
@@ -0,0 +1,73 @@
+#ifndef _PROFILE_SEGLOG_H_
+#define _PROFILE_SEGLOG_H_
+
+#include "util.h"
+#include "data.h"
+
+/* Segmented mmap record log
+ * It replaces the record writer (writer.h) with PROF_FLAG_MMAP. The
+ * data file is mapped, and the probes write the records straight
+ * into it, without any copy or writer thread. The file grows by
+ * segments of PROF_SEGLOG_SEG_SIZE. When a segment is full, it is
+ * unmapped and the next one is mapped.
+ * The committed length in the mapped header is advanced after each
+ * probe, and the kernel writes the dirty pages back even if the
+ * process is killed, so the records survive a crash.
+ * A record never spans two segments: if it doesn't fit in the rest
+ * of the segment, the rest is left zeroed, which readers skip as
+ * padding.
+ * If the file cannot grow, the records are dropped and counted.
+ */
+
+/* Bytes per segment, a multiple of the page size */
+#define PROF_SEGLOG_SEG_SIZE (4UL << 20)
+
+struct prof_seglog {
+	int fd;
+	/* mapped header */
+	struct prof_data_header *hdr;
+	/* current segment, NULL if the file failed to grow */
+	char *seg;
+	/* offset of the segment after 'data_offset' */
+	uint64_t seg_off;
+	/* bytes used in the segment */
+	uint64_t pos;
+	/* records dropped */
+	uint64_t dropped;
+	/* space of the dropped records */
+	uint8_t scratch[PROF_HIT_MAX(PROF_EVENT_MAX)];
+};
+
+/* Create the log in 'fd' with the header 'hdr'. The log owns 'fd'
+ * from now on. Return NULL on failure. */
+struct prof_seglog *prof_seglog_open(int fd,
+				const struct prof_data_header *hdr);
+/* Commit the records, trim the file and close it */
+void prof_seglog_close(struct prof_seglog *log);
+
+/* Map the next segment, and return its start */
+uint8_t *prof_seglog_grow(struct prof_seglog *log);
+
+/* Get the space of the next record of at most 'size' bytes */
+static inline uint8_t *prof_seglog_reserve(struct prof_seglog *log,
+				uint32_t size)
+{
+	if (unlikely(!log->seg || log->pos + size > PROF_SEGLOG_SEG_SIZE))
+		return prof_seglog_grow(log);
+	return (uint8_t *)log->seg + log->pos;
+}
+
+/* Make the record of 'len' bytes in the reserved space visible to
+ * readers */
+static inline void prof_seglog_commit(struct prof_seglog *log, uint32_t len)
+{
+	if (unlikely(!log->seg)) {
+		log->dropped++;
+		return;
+	}
+	log->pos += len;
+	__atomic_store_n(&log->hdr->committed, log->seg_off + log->pos,
+					__ATOMIC_RELEASE);
+}
+
+#endif /* _PROFILE_SEGLOG_H_ */
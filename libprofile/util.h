@@ -23,7 +23,8 @@
 #include "profile.h"
 
 #define PAGE_SIZE 4096
-#define PROF_EVENT_MAX	10
+#define CACHELINE_SIZE 64
+#define PROF_EVENT_MAX	32
 
 #ifndef __maybe_unused
 #define __maybe_unused __attribute__((unused))
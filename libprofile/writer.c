@@ -0,0 +1,275 @@
+#include <pthread.h>
+#include <sched.h>
+
+#include "writer.h"
+#include "profile.h"
+
+/* Registry of writers, a lock-free list only growing at the head */
+static struct prof_writer *writers = NULL;
+
+static pthread_t writer_thread;
+static bool writer_running = false;
+static bool writer_stop = false;
+/* Producers queuing a buffer, the stop waits for them */
+static uint32_t writer_queuing = 0;
+
+/* Append the records of 'buf', and commit them. Return the number
+ * of records lost. */
+static uint32_t __writer_write(struct prof_writer *writer,
+				struct prof_writer_buf *buf)
+{
+	uint8_t *ptr = buf->data;
+	size_t size = buf->len, done = 0;
+	ssize_t ret;
+
+	if (writer->fd < 0)
+		return buf->nb;
+
+	while (done < size) {
+		ret = write(writer->fd, ptr + done, size - done);
+		if (ret < 0) {
+			if (errno == EINTR)
+				continue;
+			/* drop the whole buffer, to keep records whole */
+			lseek(writer->fd, -(off_t)done, SEEK_CUR);
+			return buf->nb;
+		}
+		done += ret;
+	}
+
+	writer->committed += size;
+	if (pwrite(writer->fd, &writer->committed, sizeof(uint64_t),
+					offsetof(struct prof_data_header, committed))
+			!= sizeof(uint64_t))
+		LOG_WARN("Failed to commit records of thread %d, err %d",
+						writer->pid, errno);
+	return 0;
+}
+
+/* Wait until at most 'nb' buffers of 'writer' are queued. Return
+ * false on timeout. */
+static bool __writer_wait(struct prof_writer *writer, uint64_t nb)
+{
+	struct timespec delay = {
+		.tv_sec = 0,
+		.tv_nsec = PROF_WRITER_WAIT * 1000L,
+	};
+	unsigned waited = 0;
+
+	while (writer->filled - __atomic_load_n(&writer->written,
+							__ATOMIC_ACQUIRE) > nb) {
+		if (waited == 0)
+			writer->stalls++;
+		if (waited >= PROF_WRITER_WAIT_MAX)
+			return false;
+		nanosleep(&delay, NULL);
+		waited += PROF_WRITER_WAIT;
+	}
+	return true;
+}
+
+struct prof_writer_buf *prof_writer_swap(struct prof_writer *writer)
+{
+	struct prof_writer_buf *buf = writer->cur;
+	uint32_t lost;
+
+	writer->nb_record += buf->nb;
+
+	/* Once the stop sees no producer queuing, the running state
+	 * is false for all of them, and no buffer is queued after its
+	 * last drain */
+	__atomic_fetch_add(&writer_queuing, 1, __ATOMIC_SEQ_CST);
+	if (!__atomic_load_n(&writer_running, __ATOMIC_SEQ_CST)) {
+		__atomic_fetch_sub(&writer_queuing, 1, __ATOMIC_RELEASE);
+
+		/* write it after the buffers queued before */
+		if (__writer_wait(writer, 0)) {
+			lost = __writer_write(writer, buf);
+			__atomic_fetch_add(&writer->errors, lost, __ATOMIC_RELAXED);
+		} else
+			writer->dropped += buf->nb;
+		goto out;
+	}
+
+	/* the next buffer must be free before this one is queued */
+	if (!__writer_wait(writer, PROF_WRITER_NB_BUF - 2)) {
+		writer->dropped += buf->nb;
+		__atomic_fetch_sub(&writer_queuing, 1, __ATOMIC_RELEASE);
+		goto out;
+	}
+
+	__atomic_store_n(&writer->filled, writer->filled + 1,
+					__ATOMIC_RELEASE);
+	__atomic_fetch_sub(&writer_queuing, 1, __ATOMIC_RELEASE);
+	buf = writer->bufs[writer->filled & PROF_WRITER_BUF_MASK];
+	writer->cur = buf;
+out:
+	buf->len = 0;
+	buf->nb = 0;
+	return buf;
+}
+
+static struct prof_writer *__writer_alloc(void)
+{
+	struct prof_writer *writer = NULL;
+	int i;
+
+	writer = (struct prof_writer *)zalloc(sizeof(struct prof_writer));
+	if (!writer)
+		return NULL;
+
+	for (i = 0; i < PROF_WRITER_NB_BUF; i++) {
+		writer->bufs[i] = (struct prof_writer_buf *)malloc(
+						sizeof(struct prof_writer_buf));
+		if (!writer->bufs[i])
+			goto fail_free;
+	}
+	return writer;
+
+fail_free:
+	for (i = 0; i < PROF_WRITER_NB_BUF; i++)
+		free(writer->bufs[i]);
+	free(writer);
+	return NULL;
+}
+
+struct prof_writer *prof_writer_get(int pid, int fd)
+{
+	struct prof_writer *writer = NULL;
+	uint32_t inactive;
+
+	/* take a writer released by an exited thread */
+	for (writer = __atomic_load_n(&writers, __ATOMIC_ACQUIRE);
+			writer; writer = writer->next) {
+		inactive = 0;
+		if (__atomic_compare_exchange_n(&writer->active, &inactive, 1,
+						false, __ATOMIC_ACQUIRE, __ATOMIC_RELAXED))
+			goto out;
+	}
+
+	writer = __writer_alloc();
+	if (!writer)
+		return NULL;
+	writer->active = 1;
+
+	writer->next = __atomic_load_n(&writers, __ATOMIC_RELAXED);
+	while (!__atomic_compare_exchange_n(&writers, &writer->next, writer,
+						true, __ATOMIC_RELEASE, __ATOMIC_RELAXED))
+		;
+
+out:
+	writer->pid = pid;
+	writer->fd = fd;
+	writer->committed = 0;
+	writer->nb_record = 0;
+	writer->stalls = 0;
+	writer->dropped = 0;
+	__atomic_store_n(&writer->errors, 0, __ATOMIC_RELAXED);
+	writer->cur = writer->bufs[writer->filled & PROF_WRITER_BUF_MASK];
+	writer->cur->len = 0;
+	writer->cur->nb = 0;
+	return writer;
+}
+
+void prof_writer_put(struct prof_writer *writer)
+{
+	/* queue the last records, and wait for all of them */
+	if (writer->cur->nb)
+		prof_writer_swap(writer);
+
+	if (!__writer_wait(writer, 0)) {
+		/* the writer thread still uses the file, keep both */
+		LOG_WARN("%lu buffers of thread %d are not written",
+						(unsigned long)(writer->filled - writer->written),
+						writer->pid);
+		return;
+	}
+
+	LOG_INFO("Thread %d: %lu records, %lu stalls, %lu dropped, "
+					"%lu not written", writer->pid,
+					(unsigned long)writer->nb_record,
+					(unsigned long)writer->stalls,
+					(unsigned long)writer->dropped,
+					(unsigned long)__atomic_load_n(&writer->errors,
+							__ATOMIC_RELAXED));
+
+	close(writer->fd);
+	writer->fd = -1;
+	__atomic_store_n(&writer->active, 0, __ATOMIC_RELEASE);
+}
+
+/* Write the queued buffers of all writers. Return the number of
+ * buffers written. */
+static unsigned __writer_drain(void)
+{
+	struct prof_writer *writer = NULL;
+	uint64_t filled, written;
+	unsigned nb = 0;
+	uint32_t lost;
+
+	for (writer = __atomic_load_n(&writers, __ATOMIC_ACQUIRE);
+			writer; writer = writer->next) {
+		filled = __atomic_load_n(&writer->filled, __ATOMIC_ACQUIRE);
+
+		for (written = writer->written; written != filled; written++) {
+			lost = __writer_write(writer,
+					writer->bufs[written & PROF_WRITER_BUF_MASK]);
+			if (lost)
+				__atomic_fetch_add(&writer->errors, lost,
+								__ATOMIC_RELAXED);
+			/* give the buffer back */
+			__atomic_store_n(&writer->written, written + 1,
+							__ATOMIC_RELEASE);
+			nb++;
+		}
+	}
+	return nb;
+}
+
+static void *__writer_main(void *arg __maybe_unused)
+{
+	struct timespec delay = {
+		.tv_sec = 0,
+		.tv_nsec = PROF_WRITER_INTERVAL * 1000L,
+	};
+
+	while (!__atomic_load_n(&writer_stop, __ATOMIC_ACQUIRE)) {
+		/* keep writing as long as buffers come */
+		if (__writer_drain() == 0)
+			nanosleep(&delay, NULL);
+	}
+
+	/* buffers queued before the stop */
+	__writer_drain();
+	return NULL;
+}
+
+int prof_writer_start(void)
+{
+	if (writer_running)
+		return 0;
+
+	writer_stop = false;
+	if (pthread_create(&writer_thread, NULL, __writer_main, NULL) != 0)
+		return -1;
+
+	__atomic_store_n(&writer_running, true, __ATOMIC_RELEASE);
+	return 0;
+}
+
+void prof_writer_stop(void)
+{
+	if (!writer_running)
+		return;
+
+	/* Full buffers are written synchronously from now on, after
+	 * the ones already queued. The buffers being queued are waited
+	 * for, and written by the last drain. */
+	__atomic_store_n(&writer_running, false, __ATOMIC_SEQ_CST);
+	while (__atomic_load_n(&writer_queuing, __ATOMIC_SEQ_CST))
+		sched_yield();
+
+	__atomic_store_n(&writer_stop, true, __ATOMIC_RELEASE);
+	pthread_join(writer_thread, NULL);
+	__writer_drain();
+}
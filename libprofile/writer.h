@@ -0,0 +1,110 @@
+#ifndef _PROFILE_WRITER_H_
+#define _PROFILE_WRITER_H_
+
+#include "util.h"
+#include "data.h"
+
+/* Record writer
+ * Each thread owns a writer with PROF_WRITER_NB_BUF record buffers
+ * of PROF_WRITER_BUF_SIZE bytes.
+ * The probes fill the current buffer. When it is full, it is queued
+ * to a background writer thread, and the next buffer is taken. The
+ * writer thread persists the queued buffers into the data file of
+ * the thread, and gives them back. Buffers are queued in order, so
+ * the records of a thread are written in order. The file starts
+ * with a 'struct prof_data_header', and its committed length is
+ * updated after each buffer.
+ * Backpressure: if no buffer is free, the probe waits for the writer
+ * thread, and counts a stall. After PROF_WRITER_WAIT_MAX, the records
+ * of the current buffer are dropped and counted instead, so that a
+ * stuck disk cannot hang the application. The statistics are logged
+ * when the writer is released.
+ * Before 'prof_writer_start()' and after 'prof_writer_stop()', full
+ * buffers are written synchronously by the probe. The stop waits for
+ * the probes queuing a buffer, so each queued buffer is written.
+ */
+
+/* Buffers per thread, a power of 2 */
+#define PROF_WRITER_NB_BUF 4
+#define PROF_WRITER_BUF_MASK (PROF_WRITER_NB_BUF - 1)
+/* Bytes per buffer */
+#define PROF_WRITER_BUF_SIZE PROF_RECORD_CACHE
+/* Period of the writer thread when it is idle, in microseconds */
+#define PROF_WRITER_INTERVAL 1000
+/* Polling period of a waiting probe, and the max wait, in
+ * microseconds */
+#define PROF_WRITER_WAIT 100
+#define PROF_WRITER_WAIT_MAX 1000000
+
+struct prof_writer_buf {
+	/* Bytes and records in 'data' */
+	uint32_t len;
+	uint32_t nb;
+	uint8_t data[PROF_WRITER_BUF_SIZE];
+};
+
+struct prof_writer {
+	/* Next writer in the registry, writers are never removed */
+	struct prof_writer *next;
+	/* 1 if a thread owns the writer */
+	uint32_t active;
+	/* system thread ID of the owner */
+	int32_t pid;
+	/* data file of the owner */
+	int fd;
+	/* Bytes of records written into the file */
+	uint64_t committed;
+
+	/* Owned by the producer */
+	struct prof_writer_buf *cur;
+	/* Records filled, waits for a free buffer, and records
+	 * dropped after a timeout */
+	uint64_t nb_record;
+	uint64_t stalls;
+	uint64_t dropped;
+	/* Records failed to be written */
+	uint64_t errors;
+
+	/* Number of buffers queued, written by the producer */
+	uint64_t filled __attribute__((aligned(CACHELINE_SIZE)));
+	/* Number of buffers written, written by the writer thread */
+	uint64_t written __attribute__((aligned(CACHELINE_SIZE)));
+
+	struct prof_writer_buf *bufs[PROF_WRITER_NB_BUF];
+};
+
+/* Start the writer thread. Return 0 on success. */
+int prof_writer_start(void);
+/* Write all queued buffers and stop the writer thread */
+void prof_writer_stop(void);
+
+/* Take a writer for the current thread, appending records into
+ * 'fd' after its header. The writer owns 'fd' from now on. Return
+ * NULL on failure. */
+struct prof_writer *prof_writer_get(int pid, int fd);
+/* Write the remaining records, and release the writer */
+void prof_writer_put(struct prof_writer *writer);
+
+/* Queue the current buffer, and return the next one */
+struct prof_writer_buf *prof_writer_swap(struct prof_writer *writer);
+
+/* Get the space of the next record of at most 'size' bytes */
+static inline uint8_t *prof_writer_reserve(struct prof_writer *writer,
+				uint32_t size)
+{
+	struct prof_writer_buf *buf = writer->cur;
+
+	if (unlikely(buf->len + size > PROF_WRITER_BUF_SIZE))
+		buf = prof_writer_swap(writer);
+	return buf->data + buf->len;
+}
+
+/* Add the record of 'len' bytes in the reserved space */
+static inline void prof_writer_commit(struct prof_writer *writer,
+				uint32_t len)
+{
+	writer->cur->len += len;
+	writer->cur->nb++;
+}
+
+#endif /* _PROFILE_WRITER_H_ */
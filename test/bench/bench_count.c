@@ -0,0 +1,54 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <time.h>
+
+/* Benchmark target of the instrumentation modes of funccnt
+ * 'bench_func' is the only function to be instrumented. It is tiny,
+ * so the measured time per call is dominated by the probe.
+ * Usage: bench_count [nb_call]
+ */
+
+#define NB_CALL_DEF 100000000UL
+#define NB_ROUND 5
+
+static volatile uint64_t sink = 0;
+
+__attribute__((noinline)) void bench_func(uint64_t i)
+{
+	sink += i;
+}
+
+static inline uint64_t __now_ns(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000000000UL + ts.tv_nsec;
+}
+
+int main(int argc, char **argv)
+{
+	uint64_t nb_call = NB_CALL_DEF, i, start, end, best = UINT64_MAX;
+	int round;
+
+	if (argc > 1)
+		nb_call = strtoul(argv[1], NULL, 0);
+	if (nb_call == 0)
+		nb_call = NB_CALL_DEF;
+
+	for (round = 0; round < NB_ROUND; round++) {
+		start = __now_ns();
+		for (i = 0; i < nb_call; i++)
+			bench_func(i);
+		end = __now_ns();
+
+		if (end - start < best)
+			best = end - start;
+	}
+
+	fprintf(stdout, "%lu calls, best of %d rounds: %.2f ns/call\n",
+					nb_call, NB_ROUND, (double)best / nb_call);
+	return 0;
+}
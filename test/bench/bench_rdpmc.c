@@ -0,0 +1,83 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+
+#include "util.h"
+#include "evlist.h"
+#include "evsel.h"
+#include "inst.h"
+
+/* Cost of reading a counter of the calling thread with libprofile
+ * It opens one event for the calling thread, and reports the cycles (TSC)
+ * per read with 'prof_evsel__rdpmc()' and with 'prof_evsel__read()'.
+ * The rdpmc path falls back to read() when user rdpmc is disabled,
+ * which is reported.
+ * Usage: bench_rdpmc [event] [nb_read]
+ */
+
+#define EVENT_DEF "cycles"
+#define NB_READ_DEF 1000000UL
+#define NB_ROUND 5
+
+typedef uint64_t (*read_fn)(struct prof_evsel *evsel,
+				struct thread_data *data);
+
+static volatile uint64_t sink = 0;
+
+static double __bench(read_fn fn, struct prof_evsel *evsel,
+				struct thread_data *data, uint64_t nb_read)
+{
+	uint64_t i, start, end, best = UINT64_MAX;
+	int round;
+
+	for (round = 0; round < NB_ROUND; round++) {
+		start = rdtsc();
+		for (i = 0; i < nb_read; i++)
+			sink += fn(evsel, data);
+		end = rdtsc();
+
+		if (end - start < best)
+			best = end - start;
+	}
+	return (double)best / nb_read;
+}
+
+int main(int argc, char **argv)
+{
+	const char *event = EVENT_DEF;
+	uint64_t nb_read = NB_READ_DEF;
+	struct prof_evlist *evlist = NULL;
+	struct prof_evsel *evsel = NULL;
+	struct perf_event_mmap_page *pc = NULL;
+	struct thread_data data;
+
+	if (argc > 1)
+		event = argv[1];
+	if (argc > 2)
+		nb_read = strtoul(argv[2], NULL, 0);
+	if (nb_read == 0)
+		nb_read = NB_READ_DEF;
+
+	evlist = prof_evlist__new();
+	if (!evlist || prof_evlist__add_from_str(evlist, event) <= 0
+			|| prof_evlist__open_self(evlist, &data) < 0) {
+		fprintf(stderr, "Failed to open event %s\n", event);
+		return 1;
+	}
+
+	evsel = prof_evlist__first(evlist);
+	pc = (struct perf_event_mmap_page *)data.mm_page;
+
+	fprintf(stdout, "%s, %lu reads, best of %d rounds, user rdpmc %s\n",
+					event, nb_read, NB_ROUND,
+					(pc && pc->cap_user_rdpmc) ? "on" : "off");
+	fprintf(stdout, "%-8s %.1f cycles/read\n", "rdpmc",
+					__bench(prof_evsel__rdpmc, evsel, &data, nb_read));
+	fprintf(stdout, "%-8s %.1f cycles/read\n", "read",
+					__bench(prof_evsel__read, evsel, &data, nb_read));
+
+	prof_evlist__close_self(evlist, &data);
+	prof_evlist__delete(evlist);
+	return 0;
+}
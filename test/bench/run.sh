@@ -0,0 +1,22 @@
+#!/bin/sh
+# Compare the ns/call of 'bench_func' without instrumentation, with
+# the function-call mode and with the inline mode of funccnt.
+# Usage: run.sh <path_to_stubprofile> [nb_call]
+
+STUBPROFILE=${1:-../../build/stubprofile}
+NB_CALL=${2:-100000000}
+TARGET=./bench_count
+
+if [ ! -x "$STUBPROFILE" ]; then
+	echo "stubprofile is not found at $STUBPROFILE"
+	exit 1
+fi
+
+for mode in call inline; do
+	$STUBPROFILE edit -i $TARGET -o ${TARGET}_$mode \
+			-f bench_func -m $mode > /dev/null || exit 1
+done
+
+printf "%-8s " "none";   $TARGET $NB_CALL
+printf "%-8s " "call";   ${TARGET}_call $NB_CALL
+printf "%-8s " "inline"; ${TARGET}_inline $NB_CALL
@@ -0,0 +1,126 @@
+#include <stdio.h>
+#include <stdint.h>
+
+#include "data.h"
+
+/* Self-check of the hit records of the data file
+ * Encode and decode boundary values with the varint, zigzag and tag
+ * helpers of data.h, the way libprofile writes the hits and the
+ * readers of stubprofile decode them.
+ * Usage: check_data
+ */
+
+static int failed = 0;
+
+#define CHECK(cond, ...) do {					\
+	if (!(cond)) {						\
+		fprintf(stderr, "FAIL %s:%d: ", __FILE__, __LINE__);	\
+		fprintf(stderr, __VA_ARGS__);			\
+		fprintf(stderr, "\n");				\
+		failed++;					\
+	}							\
+} while (0)
+
+/* Round-trip 'val', which takes 'len' bytes */
+static void __check_varint(uint64_t val, int len)
+{
+	uint8_t buf[PROF_VARINT64_MAX + 1];
+	const uint8_t *next = NULL;
+	uint8_t *end = prof_varint_put(buf, val);
+	uint64_t res = 0;
+
+	CHECK(end - buf == len, "varint %#lx: %d bytes, expected %d",
+			(unsigned long)val, (int)(end - buf), len);
+
+	next = prof_varint_get(buf, end, &res);
+	CHECK(next == end && res == val, "varint %#lx: decoded %#lx",
+			(unsigned long)val, (unsigned long)res);
+
+	/* one byte short */
+	CHECK(prof_varint_get(buf, end - 1, &res) == NULL,
+			"varint %#lx: truncated one is decoded", (unsigned long)val);
+}
+
+/* Round-trip the delta from 'prev' to 'cur', as a hit count */
+static void __check_delta(uint64_t prev, uint64_t cur)
+{
+	uint8_t buf[PROF_VARINT64_MAX];
+	uint64_t delta = 0;
+	uint8_t *end = prof_varint_put(buf,
+			prof_zigzag((int64_t)(cur - prev)));
+
+	CHECK(end - buf <= PROF_VARINT64_MAX, "delta %#lx -> %#lx: %d bytes",
+			(unsigned long)prev, (unsigned long)cur, (int)(end - buf));
+	CHECK(prof_varint_get(buf, end, &delta) == end &&
+			prev + prof_unzigzag(delta) == cur,
+			"delta %#lx -> %#lx: decoded %#lx", (unsigned long)prev,
+			(unsigned long)cur, (unsigned long)(prev + prof_unzigzag(delta)));
+}
+
+/* Round-trip the tag of 'idx' */
+static void __check_tag(uint32_t idx, unsigned exit)
+{
+	uint8_t buf[PROF_VARINT64_MAX];
+	uint64_t tag = PROF_HIT_TAG(idx, exit);
+	uint8_t *end = prof_varint_put(buf, tag);
+
+	CHECK(tag != 0, "tag of %u/%u is 0", idx, exit);
+	CHECK(end - buf <= PROF_VARINT32_MAX, "tag of %u/%u: %d bytes",
+			idx, exit, (int)(end - buf));
+	CHECK(prof_varint_get(buf, end, &tag) == end &&
+			PROF_HIT_IDX(tag) == idx && PROF_HIT_EXIT(tag) == exit,
+			"tag of %u/%u: decoded %lu/%lu", idx, exit,
+			(unsigned long)PROF_HIT_IDX(tag),
+			(unsigned long)PROF_HIT_EXIT(tag));
+}
+
+int main(void)
+{
+	static const int64_t deltas[] = {
+		0, 1, -1, 0x3f, -0x40, 0x40, -0x41, INT64_MAX, INT64_MIN,
+		INT64_MAX - 1, INT64_MIN + 1,
+	};
+	unsigned i;
+	unsigned exit;
+
+	__check_varint(0, 1);
+	__check_varint(0x7f, 1);
+	__check_varint(0x80, 2);
+	__check_varint(0x3fff, 2);
+	__check_varint(0x4000, 3);
+	__check_varint(UINT32_MAX, PROF_VARINT32_MAX);
+	__check_varint(UINT64_MAX, PROF_VARINT64_MAX);
+
+	/* small deltas of both signs take one byte */
+	CHECK(prof_zigzag(0) == 0 && prof_zigzag(-1) == 1 &&
+			prof_zigzag(1) == 2, "zigzag of 0, -1, 1");
+	CHECK(prof_zigzag(INT64_MAX) == UINT64_MAX - 1 &&
+			prof_zigzag(INT64_MIN) == UINT64_MAX,
+			"zigzag of INT64_MAX, INT64_MIN");
+	for (i = 0; i < sizeof(deltas) / sizeof(deltas[0]); i++)
+		CHECK(prof_unzigzag(prof_zigzag(deltas[i])) == deltas[i],
+				"zigzag of %ld", (long)deltas[i]);
+
+	/* counts from 0, and wrapping counters */
+	for (i = 0; i < sizeof(deltas) / sizeof(deltas[0]); i++) {
+		__check_delta(0, (uint64_t)deltas[i]);
+		__check_delta(UINT64_MAX, UINT64_MAX + (uint64_t)deltas[i]);
+	}
+	__check_delta(0, UINT64_MAX);
+	__check_delta(UINT64_MAX, 0);
+
+	/* 'index - min_index' up to the largest index */
+	for (exit = 0; exit <= 1; exit++) {
+		__check_tag(0, exit);
+		__check_tag(0x3f, exit);
+		__check_tag(0x40, exit);
+		__check_tag(UINT32_MAX, exit);
+	}
+
+	if (failed) {
+		fprintf(stderr, "%d checks failed\n", failed);
+		return 1;
+	}
+	printf("data.h: all checks passed\n");
+	return 0;
+}
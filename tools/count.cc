@@ -12,6 +12,7 @@
 #include "count.h"
 #include "funcmap.h"
 #include "util.h"
+#include "../libprobe/mode.h"
 
 using namespace std;
 using namespace Dyninst;
@@ -34,6 +35,7 @@ bool CountUtil::getTargetFuncs(void)
 
 	for (unsigned i = 0; i < objs.size(); i++) {
 		FuncMap fmap(objs[i]);
+		unsigned obj_id = UINT_MAX;
 
 		LOG_INFO("Load function map for %s",
 						objs[i]->pathName().c_str());
@@ -42,7 +44,11 @@ bool CountUtil::getTargetFuncs(void)
 							objs[i]->pathName().c_str());
 			return false;
 		}
-		matchFuncs(objs[i], &fmap, pattern);
+
+		obj_id = idspace.addObject(objs[i]->pathName());
+		if (obj_id == UINT_MAX)
+			return false;
+		matchFuncs(objs[i], obj_id, &fmap, pattern);
 	}
 
 	if (target_funcs.size() == 0) {
@@ -60,7 +66,7 @@ void CountUtil::addTargetFunc(BPatch_function *func, unsigned idx)
 	target_funcs.push_back(TargetFunc(func, idx));
 }
 
-void CountUtil::matchFuncs(BPatch_object *obj,
+void CountUtil::matchFuncs(BPatch_object *obj, unsigned obj_id,
 				FuncMap *fmap, string pattern)
 {
 	BPatch_Vector<BPatch_function *> tfuncs;
@@ -69,20 +75,30 @@ void CountUtil::matchFuncs(BPatch_object *obj,
 
 	obj->findFunction(pattern.c_str(), tfuncs, false);
 	for (unsigned j = 0; j < tfuncs.size(); j++) {
-		unsigned int index = UINT_MAX;
+		unsigned int local = UINT_MAX, index = UINT_MAX;
 
-		index = fmap->getFunctionID(tfuncs[j]->getName());
-		if (index == UINT_MAX) {
+		local = fmap->getFunctionID(tfuncs[j]->getName());
+		if (local == UINT_MAX) {
 			LOG_ERROR("Cannot find %s in map %s",
 							tfuncs[j]->getName().c_str(),
 							obj->name().c_str());
 			continue;
 		}
 
+		index = idspace.addFunction(obj_id, local, tfuncs[j]->getName());
+		if (index == UINT_MAX)
+			continue;
+
+		// the sampler maps the samples to functions by address
+		Dyninst::Address start = 0, end = 0;
+		if (tfuncs[j]->getAddressRange(start, end))
+			idspace.setRange(index, start, end);
+
 		target_funcs.push_back(TargetFunc(tfuncs[j], index));
-		LOG_INFO("Edit function %s:%s, ID %u",
+		LOG_INFO("Edit function %s:%s, ID 0x%08x, index %u",
 						obj->name().c_str(),
-						tfuncs[j]->getName().c_str(), index);
+						tfuncs[j]->getName().c_str(),
+						idspace.getID(index), index);
 	}
 }
 
@@ -111,9 +127,114 @@ void CountUtil::getUserObjs(BPatch_Vector<BPatch_object *> &objs)
 	}
 }
 
+/* Each target function owns two adjacent counters in 'counters',
+ * the same layout as struct funcc_counter in libprobe:
+ *   counters[2 * (index - min)]		entry count
+ *   counters[2 * (index - min) + 1]	exit count
+ */
+bool CountUtil::insertInlineCount(void)
+{
+	BPatch_type *elem_type = NULL, *array_type = NULL;
+	unsigned int nb_counter = 0;
+
+	calculateRange();
+	if (func_id_range.min > func_id_range.max) {
+		LOG_ERROR("No target function");
+		return false;
+	}
+	nb_counter = (func_id_range.max - func_id_range.min + 1) * 2;
+
+	// allocate the counter array in the mutatee
+	elem_type = as->getImage()->findType("long");
+	if (!elem_type) {
+		LOG_ERROR("Failed to find type long");
+		return false;
+	}
+
+	array_type = bpatch.createArray("funcc_inline_array", elem_type,
+					0, nb_counter - 1);
+	if (!array_type) {
+		LOG_ERROR("Failed to create array type");
+		return false;
+	}
+
+	counters = as->malloc(*array_type, "funcc_inline_counters");
+	if (!counters) {
+		LOG_ERROR("Failed to allocate %u counters", nb_counter);
+		return false;
+	}
+	LOG_INFO("Allocate %u inline counters", nb_counter);
+
+	for (unsigned i = 0; i < target_funcs.size(); i++) {
+		TargetFunc *tf = &target_funcs[i];
+		vector<BPatch_point *> *pentry = NULL, *pexit = NULL;
+		BPatchSnippetHandle *handle = NULL;
+		unsigned int off = 0;
+
+		if (tf->index == UINT_MAX)
+			continue;
+
+		pentry = tf->func->findPoint(BPatch_entry);
+		pexit = tf->func->findPoint(BPatch_exit);
+		if (!pentry || !pexit) {
+			LOG_ERROR("Failed to find entry/exit point of func %s",
+							tf->func->getName().c_str());
+			continue;
+		}
+
+		// counters[off] = counters[off] + 1
+		off = (tf->index - func_id_range.min) * 2;
+		BPatch_arithExpr pre_cnt(BPatch_ref, *counters,
+						BPatch_constExpr(off));
+		BPatch_arithExpr pre_expr(BPatch_assign, pre_cnt,
+						BPatch_arithExpr(BPatch_plus, pre_cnt,
+								BPatch_constExpr(1)));
+		BPatch_arithExpr post_cnt(BPatch_ref, *counters,
+						BPatch_constExpr(off + 1));
+		BPatch_arithExpr post_expr(BPatch_assign, post_cnt,
+						BPatch_arithExpr(BPatch_plus, post_cnt,
+								BPatch_constExpr(1)));
+
+		LOG_INFO("Insert inline counters into %s",
+						tf->func->getName().c_str());
+		handle = as->insertSnippet(
+						pre_expr, *pentry, BPatch_callBefore);
+		if (!handle) {
+			LOG_ERROR("Failed to insert entry counter to %s",
+							tf->func->getName().c_str());
+			return false;
+		}
+
+		handle = as->insertSnippet(
+						post_expr, *pexit, BPatch_callAfter);
+		if (!handle) {
+			LOG_ERROR("Failed to insert exit counter to %s",
+							tf->func->getName().c_str());
+			return false;
+		}
+	}
+
+	return true;
+}
+
+/* Mode of the probes called, as 'probe_init()' chooses it */
+unsigned int CountUtil::probeMode(void)
+{
+	if (flags & PROBE_FLAG_SAMPLING)
+		return flags & PROBE_MODE_MASK & ~PROBE_MODE_PMU;
+	return probe_mode_sampled(flags & PROBE_MODE_MASK, freq, flags);
+}
+
 bool CountUtil::insertCount(void)
 {
-	unsigned int fun_id = 0;
+	if (inline_count)
+		return insertInlineCount();
+
+	// the sampler alone needs no probe
+	if (!probeMode()) {
+		LOG_INFO("Sample the events, no probe to insert");
+		return true;
+	}
 
 	for (unsigned i = 0; i < target_funcs.size(); i++) {
 		TargetFunc *tf = &target_funcs[i];
@@ -176,6 +297,7 @@ bool CountUtil::insertCount(void)
 bool CountUtil::loadFunctions(void)
 {
 	BPatch_object *libcnt = NULL;
+	char suffix[PROBE_SUFFIX_MAX] = {'\0'};
 
 	// load lib
 	LOG_INFO("Load %s", LIBCNT);
@@ -185,17 +307,29 @@ bool CountUtil::loadFunctions(void)
 		return false;
 	}
 
-	// load functions
-	LOG_INFO("Load counting functions");
-	func_pre = findFunction(libcnt, FUNC_PRE);
-	func_post = findFunction(libcnt, FUNC_POST);
+	/* the counters are increased by snippets directly */
+	if (inline_count) {
+		LOG_INFO("Load init function");
+		func_init = findFunction(libcnt, FUNC_INLINE_INIT);
+		goto check_init;
+	}
+
+	// load the probes of the mode
+	if (!probeMode())
+		goto load_init;
+	probe_mode_suffix(probeMode(), suffix);
+	LOG_INFO("Load counting functions of mode %s", suffix);
+	func_pre = findFunction(libcnt, string(PROBE_PRE_PREFIX) + suffix);
+	func_post = findFunction(libcnt, string(PROBE_POST_PREFIX) + suffix);
 	if (!func_pre || !func_post) {
 		LOG_ERROR("Failed to load counting functions");
 		return false;
 	}
 
+load_init:
 	LOG_INFO("Load init function");
 	func_init = findFunction(libcnt, FUNC_INIT);
+check_init:
 	if (!func_init) {
 		LOG_ERROR("Failed to load init function");
 		return false;
@@ -300,6 +434,15 @@ void CountUtil::calculateRange(void)
 	func_id_range.max = max;
 }
 
+bool CountUtil::saveIDTable(string path)
+{
+	if (!idspace.save(path))
+		return false;
+
+	id_table = path;
+	return true;
+}
+
 string CountUtil::getOptStr(void)
 {
 	return string(FUNCC_ARG);
@@ -313,29 +456,74 @@ string CountUtil::getUsageStr(void)
 			"\t\tDefine the matching pattern (regex) for\n"
 			"\t\tmonitored functions. Default is \"(.*)\",\n"
 			"\t\tmatching all functions.\n"
-#ifndef USE_FUNCCNT
-			"\t-o <output_data_file>\n"
-			"\t\tDefine the prefix of the name of the output\n"
-			"\t\tdata file. The actual data file is per-thread,\n"
-			"\t\tnamed as the form of <output_data_file>.<pid>.\n"
-			"\t\tDefault is 'profile.data'\n"
-			"\t-e <event_list>\n"
-			"\t\tDefine a list of performance events to be\n"
-			"\t\tmonitored. It follows the same syntax as Perf.\n"
-			"\t\tYou can use the command 'perf list' of Perf to\n"
-			"\t\tcheck supported events in your environment.\n"
-			"\t\tDefault is 'cpu-cycles'\n".
-			"\t-l <log_file>\n"
-			"\t\tDefine the prefix of the log file. The actual\n"
-			"\t\tlog file is per-thread, named as the form of\n"
-			"\t\t<log_file>.<pid>. Default is 'profile.log'\n"
 			"\t-F <sample_frequency>\n"
 			"\t\tDefine the sample frequency of the monitoring.\n"
 			"\t\tThe value must be an integer. For each monitored\n"
 			"\t\tfunction, the tool records one execution per\n"
 			"\t\t<sample_frequency> executions. Default is zero,\n"
-			"\t\tthat means no sampling.\n"
-#endif /* ifndef USE_FUNCCNT */
+			"\t\tthat means no sampling. Reported counts are\n"
+			"\t\tmultiplied by <sample_frequency>.\n"
+			"\t-c\n"
+			"\t\tCount the entries and exits of functions. It is\n"
+			"\t\tthe default if neither -e nor -L is given.\n"
+			"\t-e <event_list>\n"
+			"\t\tRead a list of performance events at each\n"
+			"\t\tentry and exit. It follows the same syntax as\n"
+			"\t\tPerf, see 'perf list' for the supported events:\n"
+			"\t\ta generic event like 'cpu-cycles', a raw event\n"
+			"\t\tlike 'r01c2', a sysfs PMU event like 'msr/tsc/'\n"
+			"\t\tor 'cpu/event=0xc2,umask=0x1/', or an alias of a\n"
+			"\t\tsysfs PMU. Modifiers follow a ':', or the ending\n"
+			"\t\t'/': 'u' user, 'k' kernel, 'p' precise up to 'ppp'.\n"
+			"\t\tSoftware events like 'task-clock' or 'page-faults'\n"
+			"\t\tand the pseudo-events 'tsc' and 'monotonic-raw',\n"
+			"\t\tread in user space, also work without hardware\n"
+			"\t\tPMU. Unsupported events are dropped at start.\n"
+			"\t-g\n"
+			"\t\tRead the events of -e as groups, so that they\n"
+			"\t\tare scheduled together and their ratios are\n"
+			"\t\tconsistent. Events beyond the counters of the\n"
+			"\t\tPMU go to the next group, and the kernel rotates\n"
+			"\t\tthe groups. Counts are scaled to the time each\n"
+			"\t\tgroup was enabled. It is implied if the events\n"
+			"\t\tneed more counters than the PMU has.\n"
+			"\t-a\n"
+			"\t\tAggregate the events of -e per function in the\n"
+			"\t\tprogram, into inclusive and exclusive counts, and\n"
+			"\t\twrite one table per thread instead of the\n"
+			"\t\trecords of each call. See 'stubprofile decode'.\n"
+			"\t-S <frequency>\n"
+			"\t\tSample the first event of -e <frequency> times\n"
+			"\t\tper second, or with its 'period' term, instead\n"
+			"\t\tof reading the events at each entry and exit.\n"
+			"\t\tThe samples are mapped to the monitored\n"
+			"\t\tfunctions by their call chain, into inclusive\n"
+			"\t\tand exclusive periods, and written as one table\n"
+			"\t\tfor the process. Only -e needs no probe. It\n"
+			"\t\tignores -F, -g, -a and -r.\n"
+			"\t-L\n"
+			"\t\tRecord the latency of calls into per-function\n"
+			"\t\thistograms, and report their percentiles\n"
+			"\t\t(p50/p99/p999) at exit.\n"
+			"\t\t-c, -e and -L can be combined, all of them are\n"
+			"\t\tdone by a single probe per entry and exit.\n"
+			"\t-r <record_mode>\n"
+			"\t\tDefine how the records of -e are stored. 'stream'\n"
+			"\t\tbuffers them and writes them with a background\n"
+			"\t\tthread. 'mmap' writes them straight into mapped\n"
+			"\t\tfiles, which keep the records when the program\n"
+			"\t\tcrashes. Default is 'stream'.\n"
+			"\t-s\n"
+			"\t\tPlace the counters in shared memory, so that\n"
+			"\t\tthey can be read by 'stubprofile snapshot'\n"
+			"\t\twhile the program is running.\n"
+			"\t-m <mode>\n"
+			"\t\tDefine the instrumentation mode. 'call' calls\n"
+			"\t\tthe probes of libprobe at each entry and exit.\n"
+			"\t\t'inline' increases counters in the trampoline\n"
+			"\t\twithout any call, it is faster, but only counts,\n"
+			"\t\tand the counters are shared by all threads, and\n"
+			"\t\tmay lose concurrent updates. Default is 'call'.\n"
 			;
 	return usage;
 }
@@ -348,57 +536,148 @@ bool CountUtil::parseOption(int opt, char *optarg)
 			pattern = optarg;
 			break;
 
-#ifndef USE_FUNCCNT
-		/* Output file */
-		case 'o':
-			output = optarg;
+		/* sample frequency */
+		case 'F':
+			freq = (unsigned)atoi(optarg);
+			if (!freq) {
+				LOG_ERROR("Failed to parse sample frequency %s",
+								optarg);
+				return false;
+			}
+			break;
+
+		/* counting */
+		case 'c':
+			flags |= PROBE_MODE_COUNT;
 			break;
 
 		/* event list */
 		case 'e':
 			evlist = optarg;
+			flags |= PROBE_MODE_PMU;
 			break;
 
-		case 'F':
-			freq = (unsigned)atoi(optarg);
-			if (!freq) {
-				LOG_ERROR("Failed to parse sample frequency %s",
+		/* grouped PMU events */
+		case 'g':
+			flags |= PROBE_FLAG_GROUP;
+			break;
+
+		/* per-function aggregation */
+		case 'a':
+			flags |= PROBE_FLAG_AGGR;
+			break;
+
+		/* sampled PMU events */
+		case 'S':
+			sample_hz = (unsigned)atoi(optarg);
+			if (!sample_hz) {
+				LOG_ERROR("Failed to parse sampling frequency %s",
 								optarg);
 				return false;
 			}
+			flags |= PROBE_FLAG_SAMPLING;
 			break;
 
-		case 'l':
-			logfile = optarg;
+		/* latency histograms */
+		case 'L':
+			flags |= PROBE_MODE_TIME;
 			break;
-#endif /* ifndef USE_FUNCCNT */
+
+		/* storage of PMU records */
+		case 'r':
+			if (!strcmp(optarg, RECORD_MMAP))
+				flags |= PROBE_FLAG_MMAP;
+			else if (!strcmp(optarg, RECORD_STREAM))
+				flags &= ~PROBE_FLAG_MMAP;
+			else {
+				LOG_ERROR("Unknown record mode %s", optarg);
+				return false;
+			}
+			break;
+
+		/* live snapshots */
+		case 's':
+			flags |= PROBE_FLAG_SHM;
+			break;
+
+		/* instrumentation mode */
+		case 'm':
+			if (!strcmp(optarg, MODE_INLINE))
+				inline_count = true;
+			else if (!strcmp(optarg, MODE_CALL))
+				inline_count = false;
+			else {
+				LOG_ERROR("Unknown mode %s", optarg);
+				return false;
+			}
+			break;
+
 		default:
 			return false;
 	}
 	return true;
 }
 
-void CountUtil::buildInitArgs(vector<BPatch_snippet *> &args)
+bool CountUtil::checkOptions(void)
 {
-#ifndef USE_FUNCCNT
-	if (evlist.size() == 0)
-		evlist = EVLIST_DEF;
-	args.push_back(new BPatch_constExpr(evlist));
+	if (!(flags & PROBE_MODE_MASK))
+		flags |= PROBE_MODE_COUNT;
+
+	if (inline_count && (flags & (PROBE_MODE_PMU | PROBE_MODE_TIME))) {
+		LOG_ERROR("The inline mode only counts, -e and -L need "
+						"the call mode");
+		return false;
+	}
 
-	if (logfile.size() == 0)
-		logfile = LOGFILE_DEF;
-	args.push_back(new BPatch_constExpr(logfile));
-#endif
+	if ((flags & PROBE_FLAG_SAMPLING) && !(flags & PROBE_MODE_PMU)) {
+		LOG_ERROR("Sampling needs the events of -e");
+		return false;
+	}
+	if ((flags & PROBE_FLAG_SAMPLING) && inline_count) {
+		LOG_ERROR("The inline mode cannot sample");
+		return false;
+	}
+	if (flags & PROBE_FLAG_SAMPLING) {
+		if (freq > 1)
+			LOG_INFO("Sample the events, ignore -F");
+		freq = sample_hz;
+		flags &= ~(PROBE_FLAG_GROUP | PROBE_FLAG_AGGR | PROBE_FLAG_MMAP);
+		return true;
+	}
+
+	if ((flags & PROBE_FLAG_MMAP) && !(flags & PROBE_MODE_PMU))
+		LOG_INFO("No PMU record without -e, ignore -r");
+	if ((flags & PROBE_FLAG_GROUP) && !(flags & PROBE_MODE_PMU))
+		LOG_INFO("No PMU event without -e, ignore -g");
+	if ((flags & PROBE_FLAG_AGGR) && !(flags & PROBE_MODE_PMU))
+		LOG_INFO("No PMU event without -e, ignore -a");
+	if ((flags & PROBE_FLAG_AGGR) && (flags & PROBE_FLAG_MMAP)
+			&& (flags & PROBE_MODE_PMU))
+		LOG_INFO("No record with -a, ignore -r");
+	return true;
+}
 
+void CountUtil::buildInitArgs(vector<BPatch_snippet *> &args)
+{
 	calculateRange();
 
+	if (inline_count) {
+		if (freq > 1)
+			LOG_INFO("No sampling in the inline mode, count all calls");
+		args.push_back(new BPatch_arithExpr(BPatch_addr, *counters));
+		args.push_back(new BPatch_constExpr(func_id_range.min));
+		args.push_back(new BPatch_constExpr(func_id_range.max));
+		args.push_back(new BPatch_constExpr(id_table.c_str()));
+		return;
+	}
+
 	LOG_DEBUG("min %u, max %u",
 					func_id_range.min, func_id_range.max);
 	args.push_back(new BPatch_constExpr(func_id_range.min));
 	args.push_back(new BPatch_constExpr(func_id_range.max));
 
-#ifndef USE_FUNCCNT
 	args.push_back(new BPatch_constExpr(freq));
-
-#endif
+	args.push_back(new BPatch_constExpr(flags));
+	args.push_back(new BPatch_constExpr(evlist.c_str()));
+	args.push_back(new BPatch_constExpr(id_table.c_str()));
 }
@@ -7,6 +7,8 @@
 
 #include "BPatch_Vector.h"
 
+#include "funcid.h"
+
 
 //#include "test.h"
 
@@ -14,28 +16,19 @@ class BPatch_addressSpace;
 class BPatch_function;
 class BPatch_object;
 class BPatch_snippet;
+class BPatch_variableExpr;
 
 class FuncMap;
 
-#define USE_FUNCCNT
-
 #define LIBCNT "/home/jr/stubprofile/build/lib/libprobe.so"
 
-#ifdef USE_FUNCCNT
-#define FUNC_PRE "funcc_count_pre"
-#define FUNC_POST "funcc_count_post"
-#define FUNC_INIT "funcc_count_init"
-#define FUNC_EXIT "funcc_count_exit"
-#define FUNC_TEXIT "funcc_count_thread_exit"
-#define FUNCC_ARG "f:"
-#else
-#define FUNC_PRE "prof_count_pre"
-#define FUNC_POST "prof_count_post"
-#define FUNC_INIT "prof_init"
-#define FUNC_EXIT "prof_exit"
-#define FUNC_TEXIT "prof_thread_exit"
-#define FUNCC_ARG "f:e:l:F:o:"
-#endif /* ifdef USE_FUNCCNT */
+/* The counting functions are specialized by mode, their names are
+ * built from PROBE_PRE_PREFIX/PROBE_POST_PREFIX in libprobe/mode.h */
+#define FUNC_INIT "probe_init"
+#define FUNC_EXIT "probe_exit"
+#define FUNC_TEXIT "probe_thread_exit"
+#define FUNC_INLINE_INIT "funcc_inline_init"
+#define FUNCC_ARG "f:F:ce:gasS:Lm:r:"
 
 #define PATTERN_ALL "(.*)"
 
@@ -57,16 +50,32 @@ class CountUtil {
 	private:
 		/* Command-line arguments */
 		std::string pattern;
-#ifndef USE_FUNCCNT
-		std::string output;
-#define OUTPUT_DEF "profile.data"
-#define EVLIST_DEF "cpu-cycles"
-		std::string evlist;
-#define LOGFILE_DEF "profile.log"
-		std::string logfile;
+		/* Count one call in 'freq' of each function */
 #define FREQ_DEF (0U)
 		unsigned int freq;
-#endif
+		/* Samples per second of PROBE_FLAG_SAMPLING */
+		unsigned int sample_hz;
+		/* PROBE_MODE_* and PROBE_FLAG_* of probe_init(), see
+		 * libprobe/mode.h */
+		unsigned int flags;
+		/* Event list of PROBE_MODE_PMU */
+		std::string evlist;
+		/* Storage of the PMU records, PROBE_FLAG_MMAP for mmap */
+#define RECORD_STREAM "stream"
+#define RECORD_MMAP "mmap"
+		/* Instrumentation mode
+		 * - call: call the probes of libprobe at each entry/exit
+		 * - inline: increase the counters in the trampoline with
+		 *   snippet arithmetic, without any function call. The
+		 *   counters are shared by all threads, so concurrent
+		 *   updates of the same function may be lost. Only the
+		 *   counting mode is supported.
+		 */
+#define MODE_CALL "call"
+#define MODE_INLINE "inline"
+		bool inline_count;
+		/* Counter array allocated in the mutatee (inline mode) */
+		BPatch_variableExpr *counters;
 
 		BPatch_addressSpace *as;
 
@@ -76,18 +85,32 @@ class CountUtil {
 
 		struct range func_id_range;
 
+		/* Mode of the probes, without the PMU reads when the
+		 * events are sampled, 0 if there is no probe */
+		unsigned int probeMode(void);
+
 		std::vector<TargetFunc> target_funcs;
 
+		/* Global IDs of target functions. The 'index' of each
+		 * target function is its dense index in the space. */
+		FuncIDSpace idspace;
+		/* Path of the saved ID table */
+		std::string id_table;
+
 	public:
 		/* Get option string for parsing */
 		static std::string getOptStr(void);
 		/* Get usage string */
 		static std::string getUsageStr(void);
 
-		CountUtil(void) : pattern(PATTERN_ALL) {};
+		CountUtil(void) : pattern(PATTERN_ALL), freq(FREQ_DEF),
+				sample_hz(0), flags(0), inline_count(false), counters(NULL) {};
 
 		/* Parse command-line options */
 		bool parseOption(int opt, char *optarg);
+		/* Check the options after parsing, and choose the
+		 * default mode */
+		bool checkOptions(void);
 
 		/* Set address space (for convenience) */
 		void setAS(BPatch_addressSpace *addr) { as = addr; };
@@ -111,6 +134,10 @@ class CountUtil {
 		/* Insert exit functions into target program */
 		bool insertExit(std::string filter);
 
+		/* Save the ID table of target functions to 'path',
+		 * which is passed to the init function */
+		bool saveIDTable(std::string path);
+
 		/* Construct the argument list for init function */
 		void buildInitArgs(std::vector<BPatch_snippet *> &args);
 	private:
@@ -118,9 +145,10 @@ class CountUtil {
 		 * dyninst libraries */
 		void getUserObjs(BPatch_Vector<BPatch_object *> &objs);
 
-		/* Match the 'pattern' and the functions in 'fmap'. */
-		void matchFuncs(BPatch_object *obj, FuncMap *fmap,
-						std::string pattern);
+		/* Match the 'pattern' and the functions in 'fmap'.
+		 * 'obj_id' is the ID of 'obj' in the ID space. */
+		void matchFuncs(BPatch_object *obj, unsigned obj_id,
+						FuncMap *fmap, std::string pattern);
 
 		/* Find a function in 'obj' based on its 'name' */
 		BPatch_function *findFunction(BPatch_object *obj,
@@ -128,6 +156,9 @@ class CountUtil {
 
 		/* Calculate range of target function indices */
 		void calculateRange(void);
+
+		/* Insert counter increments into target functions */
+		bool insertInlineCount(void);
 };
 
 
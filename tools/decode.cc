@@ -0,0 +1,289 @@
+#include <stdio.h>
+#include <getopt.h>
+#include <fcntl.h>
+#include <vector>
+
+#include "util.h"
+#include "decode.h"
+#include "../libprobe/funcid.h"
+#include "../libprofile/data.h"
+
+using namespace std;
+
+DecodeTest::DecodeTest(void) :
+		csv(false), hdr(NULL), size(0)
+{
+}
+
+DecodeTest::~DecodeTest(void)
+{
+}
+
+Test *DecodeTest::construct(void)
+{
+	return new DecodeTest();
+}
+
+void DecodeTest::staticUsage(void)
+{
+	fprintf(stdout, "stubprofile %s -i <data_file> [OPTIONS]\n",
+					DECODE_CMD);
+	fprintf(stdout, "  OPTIONS:\n"
+			"\t-o <format>\n"
+			"\t\tOutput format, 'text' or 'csv'. Default is\n"
+			"\t\t'text'.\n"
+			"\t-m <id_table>\n"
+			"\t\tResolve function names with the ID table written\n"
+			"\t\tby 'edit', '<output>%s'.\n", FUNCID_TABLE_SUFFIX);
+}
+
+bool DecodeTest::parseArgs(int argc, char **argv)
+{
+	int c;
+
+	while ((c = getopt(argc, argv, "i:o:m:")) != -1) {
+		switch(c) {
+			case 'i':
+				input = optarg;
+				break;
+
+			case 'o':
+				if (!strcmp(optarg, FORMAT_CSV))
+					csv = true;
+				else if (!strcmp(optarg, FORMAT_TEXT))
+					csv = false;
+				else {
+					LOG_ERROR("Unknown format %s", optarg);
+					return false;
+				}
+				break;
+
+			case 'm':
+				id_path = optarg;
+				break;
+
+			default:
+				LOG_ERROR("Unknown option %c, usage:", c);
+				staticUsage();
+				return false;
+		}
+	}
+
+	if (input.size() == 0) {
+		LOG_ERROR("No data file specified, usage:");
+		staticUsage();
+		return false;
+	}
+	return true;
+}
+
+bool DecodeTest::init(void)
+{
+	struct stat st;
+	void *ptr = NULL;
+	int fd = -1;
+
+	if (id_path.size() && !idspace.load(id_path)) {
+		LOG_ERROR("Failed to load ID table %s", id_path.c_str());
+		return false;
+	}
+
+	fd = open(input.c_str(), O_RDONLY);
+	if (fd < 0) {
+		LOG_ERROR("Failed to open %s, err %d", input.c_str(), errno);
+		return false;
+	}
+
+	if (fstat(fd, &st) < 0 ||
+			(size_t)st.st_size < sizeof(struct prof_data_header)) {
+		LOG_ERROR("Wrong data file %s", input.c_str());
+		close(fd);
+		return false;
+	}
+
+	ptr = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+	close(fd);
+	if (ptr == MAP_FAILED) {
+		LOG_ERROR("Failed to mmap %s, err %d", input.c_str(), errno);
+		return false;
+	}
+
+	hdr = (struct prof_data_header *)ptr;
+	size = st.st_size;
+	if (hdr->magic != PROF_DATA_MAGIC
+			|| hdr->version != PROF_DATA_VERSION
+			|| hdr->data_offset != prof_data_offset(hdr->nb_event)
+			|| hdr->data_offset > size
+			|| hdr->min_index > hdr->max_index) {
+		LOG_ERROR("%s is not a data file, or has a wrong version",
+						input.c_str());
+		return false;
+	}
+
+	// bytes beyond 'committed' are left by a crash
+	if (hdr->committed > size - hdr->data_offset) {
+		LOG_ERROR("Data file %s is truncated", input.c_str());
+		return false;
+	}
+
+	LOG_INFO("Data of thread %d of process %d: %u events, "
+					"%lu bytes, freq %u", hdr->tid, hdr->pid,
+					hdr->nb_event, (unsigned long)hdr->committed,
+					hdr->sample_freq);
+	return true;
+}
+
+void DecodeTest::printHeader(void)
+{
+	if (csv) {
+		fprintf(stdout, "hit,index,type");
+		for (unsigned i = 0; i < hdr->nb_event; i++)
+			fprintf(stdout, ",%.*s", PROF_DATA_EVENT_NAME_MAX,
+							hdr->events[i].name);
+		fprintf(stdout, ",function\n");
+	} else {
+		fprintf(stdout, "%10s %8s %5s", "hit", "index", "type");
+		for (unsigned i = 0; i < hdr->nb_event; i++)
+			fprintf(stdout, " %16.*s", PROF_DATA_EVENT_NAME_MAX,
+							hdr->events[i].name);
+		fprintf(stdout, "  function\n");
+	}
+}
+
+void DecodeTest::printHit(uint64_t nb, unsigned index, bool exit,
+				const uint64_t *counts)
+{
+	string name = idspace.getIndexName(index);
+
+	if (csv)
+		fprintf(stdout, "%lu,%u,%s", (unsigned long)nb, index,
+						exit ? "exit" : "entry");
+	else
+		fprintf(stdout, "%10lu %8u %5s", (unsigned long)nb, index,
+						exit ? "exit" : "entry");
+
+	for (unsigned i = 0; i < hdr->nb_event; i++)
+		fprintf(stdout, csv ? ",%lu" : " %16lu",
+						(unsigned long)counts[i]);
+	fprintf(stdout, csv ? ",%s\n" : "  %s\n", name.c_str());
+}
+
+void DecodeTest::printAggrHeader(void)
+{
+	const char *kind[2] = {"incl", "excl"};
+	// the sampler counts samples instead of calls
+	const char *calls = (hdr->flags & PROF_FLAG_SAMPLING) ?
+					"samples" : "calls";
+
+	if (csv)
+		fprintf(stdout, "index,%s", calls);
+	else
+		fprintf(stdout, "%8s %12s", "index", calls);
+
+	for (unsigned k = 0; k < 2; k++) {
+		for (unsigned i = 0; i < hdr->nb_event; i++) {
+			string col = string(kind[k]) + ":" + string(
+							hdr->events[i].name, strnlen(
+							hdr->events[i].name,
+							PROF_DATA_EVENT_NAME_MAX));
+
+			fprintf(stdout, csv ? ",%s" : " %20s", col.c_str());
+		}
+	}
+	fprintf(stdout, csv ? ",function\n" : "  function\n");
+}
+
+bool DecodeTest::processAggr(void)
+{
+	const uint8_t *ptr = (const uint8_t *)hdr + hdr->data_offset;
+	size_t entry_size = PROF_DATA_AGGR_SIZE(hdr->nb_event);
+	uint64_t nb = hdr->committed / entry_size;
+	uint64_t scale = (hdr->sample_freq > 1 ? hdr->sample_freq : 1);
+	const struct prof_data_aggr *entry = NULL;
+
+	if (hdr->committed % entry_size) {
+		LOG_ERROR("Wrong table size %lu", (unsigned long)hdr->committed);
+		return false;
+	}
+
+	printAggrHeader();
+
+	for (uint64_t n = 0; n < nb; n++) {
+		string name;
+
+		entry = (const struct prof_data_aggr *)(ptr + n * entry_size);
+		name = idspace.getIndexName(entry->index);
+
+		if (csv)
+			fprintf(stdout, "%u,%lu", entry->index,
+							(unsigned long)(entry->calls * scale));
+		else
+			fprintf(stdout, "%8u %12lu", entry->index,
+							(unsigned long)(entry->calls * scale));
+
+		// inclusive, then exclusive counts
+		for (unsigned i = 0; i < 2 * hdr->nb_event; i++)
+			fprintf(stdout, csv ? ",%lu" : " %20lu",
+							(unsigned long)(entry->counts[i] * scale));
+		fprintf(stdout, csv ? ",%s\n" : "  %s\n", name.c_str());
+	}
+
+	LOG_INFO("%lu functions", (unsigned long)nb);
+	fflush(stdout);
+	return true;
+}
+
+bool DecodeTest::process(void)
+{
+	const uint8_t *ptr = (const uint8_t *)hdr + hdr->data_offset;
+	const uint8_t *end = ptr + hdr->committed;
+	vector<uint64_t> counts(hdr->nb_event, 0);
+	unsigned nb_funcs = hdr->max_index - hdr->min_index + 1;
+	uint64_t tag, delta, nb = 0;
+
+	if (hdr->flags & PROF_FLAG_AGGR)
+		return processAggr();
+
+	printHeader();
+
+	while (ptr < end) {
+		// padding between records
+		if (*ptr == 0) {
+			ptr++;
+			continue;
+		}
+
+		ptr = prof_varint_get(ptr, end, &tag);
+		if (!ptr || PROF_HIT_IDX(tag) >= nb_funcs) {
+			LOG_ERROR("Hit %lu is corrupted, stop", (unsigned long)nb);
+			return false;
+		}
+
+		// counts are the sums of the deltas of the thread
+		for (unsigned i = 0; i < hdr->nb_event; i++) {
+			ptr = prof_varint_get(ptr, end, &delta);
+			if (!ptr) {
+				LOG_ERROR("Hit %lu is truncated, stop",
+								(unsigned long)nb);
+				return false;
+			}
+			counts[i] += prof_unzigzag(delta);
+		}
+
+		printHit(nb, hdr->min_index + PROF_HIT_IDX(tag),
+						PROF_HIT_EXIT(tag), counts.data());
+		nb++;
+	}
+
+	LOG_INFO("%lu hits decoded", (unsigned long)nb);
+	fflush(stdout);
+	return true;
+}
+
+void DecodeTest::destroy(void)
+{
+	if (hdr) {
+		munmap(hdr, size);
+		hdr = NULL;
+	}
+}
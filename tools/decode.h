@@ -0,0 +1,48 @@
+#ifndef __DECODE_H__
+#define __DECODE_H__
+
+#include <cstdint>
+#include <string>
+
+#include "test.h"
+#include "funcid.h"
+
+struct prof_data_header;
+
+#define DECODE_CMD "decode"
+
+/* Decode the varint records of a libprofile data file into text or
+ * CSV, one line per probe hit, or its per-function table with
+ * PROF_FLAG_AGGR */
+class DecodeTest: public Test {
+	private:
+		// path to the data file
+		std::string input;
+		// ID table for function names, optional
+		std::string id_path;
+		bool csv;
+
+		FuncIDSpace idspace;
+		struct prof_data_header *hdr;
+		size_t size;
+
+		void printHeader(void);
+		void printHit(uint64_t nb, unsigned index, bool exit,
+						const uint64_t *counts);
+		void printAggrHeader(void);
+		bool processAggr(void);
+
+	public:
+		DecodeTest(void);
+		~DecodeTest(void);
+
+		static void staticUsage(void);
+		static Test *construct(void);
+
+		bool parseArgs(int argc, char **argv);
+		bool init(void);
+		bool process(void);
+		void destroy(void);
+};
+
+#endif /* __DECODE_H__ */
@@ -0,0 +1,408 @@
+#include <stdio.h>
+#include <getopt.h>
+#include <cmath>
+#include <algorithm>
+
+#include "util.h"
+#include "diff.h"
+#include "../libprobe/funcid.h"
+#include "../libprofile/data.h"
+
+using namespace std;
+
+static const char *run_name[2] = {"base", "new"};
+
+DiffTest::DiffTest(void) :
+		csv(false), all(false), threshold(DIFF_THRESHOLD_DEF),
+		sigma(DIFF_SIGMA_DEF)
+{
+}
+
+DiffTest::~DiffTest(void)
+{
+}
+
+Test *DiffTest::construct(void)
+{
+	return new DiffTest();
+}
+
+void DiffTest::staticUsage(void)
+{
+	fprintf(stdout, "stubprofile %s -a <data_file|dir> -b <data_file|dir> "
+					"[OPTIONS]\n", DIFF_CMD);
+	fprintf(stdout, "  OPTIONS:\n"
+			"\t-a <data_file|dir>\n"
+			"\t-b <data_file|dir>\n"
+			"\t\tAdd a data file, or the 'profile_<tid>.data'\n"
+			"\t\tfiles of a directory, to the base (-a) or new\n"
+			"\t\t(-b) run. They can be repeated.\n"
+			"\t-m <id_table>\n"
+			"\t-M <id_table>\n"
+			"\t\tResolve function names of the base (-m) or new\n"
+			"\t\t(-M) run with the ID table written by 'edit',\n"
+			"\t\t'<output>%s'. The new run uses the table of\n"
+			"\t\tthe base run if -M is not given. Functions are\n"
+			"\t\taligned by name between the runs. Without the\n"
+			"\t\ttables, they are aligned by index, which is only\n"
+			"\t\tright for two runs of the same build.\n"
+			"\t-t <percent>\n"
+			"\t\tFlag the functions whose total changes by more\n"
+			"\t\tthan <percent>. Default is %.0f.\n"
+			"\t-k <sigma>\n"
+			"\t\tFlag the functions whose mean per thread changes\n"
+			"\t\tby more than <sigma> standard errors, from the\n"
+			"\t\tvariance between threads. Default is %.0f. It is\n"
+			"\t\tnot checked if a run has a single thread.\n"
+			"\t-A\n"
+			"\t\tPrint all functions, not only the flagged ones.\n"
+			"\t-o <format>\n"
+			"\t\tOutput format, 'text' or 'csv'. Default is\n"
+			"\t\t'text'.\n",
+			FUNCID_TABLE_SUFFIX, DIFF_THRESHOLD_DEF, DIFF_SIGMA_DEF);
+}
+
+bool DiffTest::parseArgs(int argc, char **argv)
+{
+	int c;
+
+	while ((c = getopt(argc, argv, "a:b:m:M:t:k:Ao:")) != -1) {
+		switch(c) {
+			case 'a':
+			case 'b':
+				if (!ProfData::addInput(runs[c == 'b'].inputs, optarg))
+					return false;
+				break;
+
+			case 'm':
+			case 'M':
+				runs[c == 'M'].id_path = optarg;
+				break;
+
+			case 't':
+				threshold = atof(optarg);
+				break;
+
+			case 'k':
+				sigma = atof(optarg);
+				break;
+
+			case 'A':
+				all = true;
+				break;
+
+			case 'o':
+				if (!strcmp(optarg, FORMAT_CSV))
+					csv = true;
+				else if (!strcmp(optarg, FORMAT_TEXT))
+					csv = false;
+				else {
+					LOG_ERROR("Unknown format %s", optarg);
+					return false;
+				}
+				break;
+
+			default:
+				LOG_ERROR("Unknown option %c, usage:", c);
+				staticUsage();
+				return false;
+		}
+	}
+
+	if (runs[0].inputs.size() == 0 || runs[1].inputs.size() == 0) {
+		LOG_ERROR("No data file of the base or new run, usage:");
+		staticUsage();
+		return false;
+	}
+
+	// same names in both builds by default
+	if (runs[1].id_path.size() == 0)
+		runs[1].id_path = runs[0].id_path;
+	if (runs[0].id_path.size() == 0 && runs[1].id_path.size()) {
+		LOG_ERROR("No ID table of the base run, the functions cannot "
+						"be aligned by name");
+		return false;
+	}
+	if (runs[0].id_path.size() == 0)
+		LOG_INFO("No ID table, align the functions by index");
+	return true;
+}
+
+bool DiffTest::initRun(DiffRun *run)
+{
+	if (run->id_path.size() && !run->idspace.load(run->id_path)) {
+		LOG_ERROR("Failed to load ID table %s", run->id_path.c_str());
+		return false;
+	}
+
+	// the first file gives the events and functions
+	return run->data.setRef(run->inputs[0]);
+}
+
+bool DiffTest::init(void)
+{
+	for (unsigned int i = 0; i < 2; i++) {
+		if (!initRun(&runs[i])) {
+			LOG_ERROR("Failed to init the %s run", run_name[i]);
+			return false;
+		}
+	}
+
+	if ((runs[0].data.getRef()->flags & PROF_FLAG_SAMPLING)
+			!= (runs[1].data.getRef()->flags & PROF_FLAG_SAMPLING)) {
+		LOG_ERROR("Cannot compare a sampled run with a probed one");
+		return false;
+	}
+	return true;
+}
+
+/* Scan the files of a run one at a time, into the sums of their
+ * values and of their squares */
+bool DiffTest::scanRun(DiffRun *run)
+{
+	struct prof_data_header *hdr = NULL;
+	uint64_t nb = (uint64_t)run->data.getNbFunc() * run->data.getNbCol();
+	vector<uint64_t> table;
+	size_t size = 0;
+
+	run->sum.assign(nb, 0);
+	run->sumsq.assign(nb, 0.0);
+
+	for (unsigned int i = 0; i < run->inputs.size(); i++) {
+		hdr = ProfData::map(run->inputs[i], &size);
+		if (!hdr)
+			continue;
+		if (!run->data.match(hdr, run->inputs[i])) {
+			munmap(hdr, size);
+			continue;
+		}
+
+		table.assign(nb, 0);
+		run->data.scan(hdr, table);
+		munmap(hdr, size);
+
+		for (uint64_t j = 0; j < nb; j++) {
+			run->sum[j] += table[j];
+			run->sumsq[j] += (double)table[j] * table[j];
+		}
+		run->nb_thread++;
+	}
+	return run->nb_thread > 0;
+}
+
+/* Compare the calls, and the events with the same name */
+void DiffTest::alignEvents(void)
+{
+	const struct prof_data_header *a = runs[0].data.getRef();
+	const struct prof_data_header *b = runs[1].data.getRef();
+	bool sampling = a->flags & PROF_FLAG_SAMPLING;
+	// the sampled calls have no exclusive counts, see ProfData
+	bool excl = !ProfData::sampled(a) && !ProfData::sampled(b);
+
+	metrics.push_back({sampling ? "samples" : "calls", 0, 0});
+	if (!excl)
+		LOG_INFO("A run only records 1 call in a few, only compare "
+						"the inclusive counts");
+
+	for (unsigned int i = 0; i < a->nb_event; i++) {
+		string name(a->events[i].name, strnlen(a->events[i].name,
+						PROF_DATA_EVENT_NAME_MAX));
+		unsigned int j;
+
+		for (j = 0; j < b->nb_event; j++) {
+			if (!strncmp(a->events[i].name, b->events[j].name,
+							PROF_DATA_EVENT_NAME_MAX))
+				break;
+		}
+		if (j == b->nb_event) {
+			LOG_INFO("No event %s in the new run, skip it",
+							name.c_str());
+			continue;
+		}
+
+		metrics.push_back({"incl:" + name, 1 + i, 1 + j});
+		if (!excl)
+			continue;
+		metrics.push_back({"excl:" + name,
+						1 + a->nb_event + i, 1 + b->nb_event + j});
+	}
+}
+
+/* Align the called functions of both runs by name. The names found
+ * more than once in a run, e.g. static functions of an object, can't
+ * be aligned, they are kept apart by their index. */
+void DiffTest::alignFuncs(void)
+{
+	for (unsigned int r = 0; r < 2; r++) {
+		DiffRun *run = &runs[r];
+		unsigned int min = run->data.getRef()->min_index;
+		unsigned int nb_col = run->data.getNbCol();
+		vector<string> names(run->data.getNbFunc());
+		map<string, unsigned int> seen;
+
+		for (uint32_t f = 0; f < run->data.getNbFunc(); f++) {
+			if (!run->sum[(uint64_t)f * nb_col])
+				continue;
+			// the same name may be in the executable and a library
+			names[f] = run->idspace.getIndexName(min + f, true);
+			if (seen[names[f]]++ == 1)
+				LOG_INFO("%s is more than once in the %s run, "
+								"don't align it", names[f].c_str(),
+								run_name[r]);
+		}
+
+		for (uint32_t f = 0; f < run->data.getNbFunc(); f++) {
+			if (!run->sum[(uint64_t)f * nb_col])
+				continue;
+			if (seen[names[f]] > 1)
+				names[f] += "#" + to_string(min + f);
+
+			auto it = funcs.insert(make_pair(names[f],
+							make_pair((int64_t)-1, (int64_t)-1))).first;
+			if (r == 0)
+				it->second.first = f;
+			else
+				it->second.second = f;
+		}
+	}
+}
+
+/* Mean and variance per thread of a value of a function */
+static void __thread_stats(const DiffRun *run, uint64_t idx,
+				double *mean, double *var)
+{
+	double n = run->nb_thread;
+
+	*mean = run->sum[idx] / n;
+	*var = 0.0;
+	if (run->nb_thread > 1)
+		*var = max(0.0, (run->sumsq[idx] - run->sum[idx] * *mean)
+						/ (n - 1));
+}
+
+struct DiffRow {
+	string name;
+	uint64_t base;
+	uint64_t now;
+	double delta;
+	double z;
+	bool flagged;
+};
+
+void DiffTest::printMetric(const DiffMetric &metric)
+{
+	unsigned int nb_col[2] = {runs[0].data.getNbCol(),
+					runs[1].data.getNbCol()};
+	bool variance = runs[0].nb_thread > 1 && runs[1].nb_thread > 1;
+	vector<DiffRow> rows;
+	unsigned int nb_flagged = 0;
+
+	for (auto it = funcs.begin(); it != funcs.end(); it++) {
+		int64_t fa = it->second.first, fb = it->second.second;
+		double mean[2] = {0.0, 0.0}, var[2] = {0.0, 0.0}, se;
+		DiffRow row;
+
+		row.name = it->first;
+		row.base = row.now = 0;
+		if (fa >= 0) {
+			uint64_t idx = (uint64_t)fa * nb_col[0] + metric.col_a;
+
+			row.base = runs[0].sum[idx];
+			__thread_stats(&runs[0], idx, &mean[0], &var[0]);
+		}
+		if (fb >= 0) {
+			uint64_t idx = (uint64_t)fb * nb_col[1] + metric.col_b;
+
+			row.now = runs[1].sum[idx];
+			__thread_stats(&runs[1], idx, &mean[1], &var[1]);
+		}
+		if (row.base == 0 && row.now == 0)
+			continue;
+
+		row.delta = (double)row.now - (double)row.base;
+		se = sqrt(var[0] / runs[0].nb_thread + var[1] / runs[1].nb_thread);
+		row.z = se > 0 ? (mean[1] - mean[0]) / se :
+				(mean[1] != mean[0] ? INFINITY : 0.0);
+
+		// beyond the threshold, and the noise between threads
+		row.flagged = (row.base == 0 ||
+					fabs(row.delta) * 100.0 / row.base >= threshold) &&
+				(!variance || fabs(row.z) >= sigma);
+		if (row.flagged)
+			nb_flagged++;
+		if (row.flagged || all)
+			rows.push_back(row);
+	}
+
+	sort(rows.begin(), rows.end(), [](const DiffRow &a, const DiffRow &b) {
+				return fabs(a.delta) > fabs(b.delta);
+			});
+
+	if (!csv) {
+		fprintf(stdout, "\n%s: %u functions changed beyond %.1f%%",
+						metric.name.c_str(), nb_flagged, threshold);
+		if (variance)
+			fprintf(stdout, " and %.1f sigma", sigma);
+		fprintf(stdout, "\n%1s %20s %20s %20s %9s %8s  function\n",
+						"", run_name[0], run_name[1], "delta",
+						"delta%", "z");
+	}
+
+	for (unsigned int i = 0; i < rows.size(); i++) {
+		DiffRow *row = &rows[i];
+		char rel[16];
+
+		if (row->base)
+			snprintf(rel, sizeof(rel), "%+.2f",
+							row->delta * 100.0 / row->base);
+		else
+			snprintf(rel, sizeof(rel), "new");
+
+		if (csv)
+			fprintf(stdout, "%s,%s,%lu,%lu,%.0f,%s,%.2f,%d\n",
+							metric.name.c_str(), row->name.c_str(),
+							(unsigned long)row->base,
+							(unsigned long)row->now, row->delta, rel,
+							row->z, row->flagged);
+		else
+			fprintf(stdout, "%1s %20lu %20lu %+20.0f %8s%% %8.2f  %s\n",
+							row->flagged ? (row->delta > 0 ? "+" : "-") : "",
+							(unsigned long)row->base,
+							(unsigned long)row->now, row->delta, rel,
+							row->z, row->name.c_str());
+	}
+}
+
+bool DiffTest::process(void)
+{
+	for (unsigned int i = 0; i < 2; i++) {
+		if (!scanRun(&runs[i])) {
+			LOG_ERROR("No data file of the %s run", run_name[i]);
+			return false;
+		}
+		LOG_INFO("%s run: %lu threads of process %d", run_name[i],
+						(unsigned long)runs[i].nb_thread,
+						runs[i].data.getRef()->pid);
+	}
+	if (runs[0].nb_thread < 2 || runs[1].nb_thread < 2)
+		LOG_INFO("A run has a single thread, only check the threshold");
+
+	alignEvents();
+	alignFuncs();
+
+	if (csv)
+		fprintf(stdout, "metric,function,%s,%s,delta,delta%%,z,flagged\n",
+						run_name[0], run_name[1]);
+	for (unsigned int i = 0; i < metrics.size(); i++)
+		printMetric(metrics[i]);
+	fflush(stdout);
+	return true;
+}
+
+void DiffTest::destroy(void)
+{
+	for (unsigned int i = 0; i < 2; i++) {
+		runs[i].sum.clear();
+		runs[i].sumsq.clear();
+	}
+}
@@ -0,0 +1,90 @@
+#ifndef __DIFF_H__
+#define __DIFF_H__
+
+#include <cstdint>
+#include <string>
+#include <vector>
+#include <map>
+
+#include "test.h"
+#include "funcid.h"
+#include "profdata.h"
+
+#define DIFF_CMD "diff"
+
+/* Min relative change of a flagged function, in percent */
+#define DIFF_THRESHOLD_DEF 5.0
+/* Min change of a flagged function, in standard errors */
+#define DIFF_SIGMA_DEF 3.0
+
+/* One of the compared runs */
+struct DiffRun {
+	// data files, or directories of data files
+	std::vector<std::string> inputs;
+	// ID table for function names
+	std::string id_path;
+	FuncIDSpace idspace;
+	ProfData data;
+	// threads, i.e. files scanned
+	uint64_t nb_thread;
+	// per function and value, the sum and the sum of squares of
+	// the values of the threads
+	std::vector<uint64_t> sum;
+	std::vector<double> sumsq;
+
+	DiffRun(void) : nb_thread(0) {};
+};
+
+/* Compared value, in both runs */
+struct DiffMetric {
+	std::string name;
+	unsigned int col_a;
+	unsigned int col_b;
+};
+
+/* Compare the profiles of two runs, e.g. two builds of a library.
+ * The functions are aligned by name, since their indices differ
+ * between builds, and so are the events. The data files of each
+ * run are scanned one at a time, see ProfData, and only the sums of
+ * the values of their threads and of their squares are kept.
+ * A function is flagged when the total of a value changes by more
+ * than a threshold, and its mean per thread by more than a number
+ * of standard errors, from the variance between the threads.
+ */
+class DiffTest: public Test {
+	private:
+		// base and new runs
+		DiffRun runs[2];
+		bool csv;
+		// print all functions, not only the flagged ones
+		bool all;
+		// min relative change, in percent
+		double threshold;
+		// min change, in standard errors
+		double sigma;
+
+		std::vector<DiffMetric> metrics;
+		// indices of each function name in both runs, -1 if
+		// missing
+		std::map<std::string, std::pair<int64_t, int64_t> > funcs;
+
+		bool initRun(DiffRun *run);
+		bool scanRun(DiffRun *run);
+		void alignEvents(void);
+		void alignFuncs(void);
+		void printMetric(const DiffMetric &metric);
+
+	public:
+		DiffTest(void);
+		~DiffTest(void);
+
+		static void staticUsage(void);
+		static Test *construct(void);
+
+		bool parseArgs(int argc, char **argv);
+		bool init(void);
+		bool process(void);
+		void destroy(void);
+};
+
+#endif /* __DIFF_H__ */
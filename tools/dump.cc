@@ -0,0 +1,267 @@
+#include <stdio.h>
+#include <getopt.h>
+#include <fcntl.h>
+
+#include "util.h"
+#include "funcmap.h"
+#include "dump.h"
+#include "../libprobe/dump.h"
+#include "../libprobe/funcid.h"
+
+using namespace std;
+
+DumpTest::DumpTest(void) :
+		csv(false), per_thread(false),
+		funcmap(NULL), hdr(NULL), size(0), nb_block(0)
+{
+}
+
+DumpTest::~DumpTest(void)
+{
+}
+
+Test *DumpTest::construct(void)
+{
+	return new DumpTest();
+}
+
+void DumpTest::staticUsage(void)
+{
+	fprintf(stdout, "stubprofile %s -i <dump_file> [OPTIONS]\n",
+					DUMP_CMD);
+	fprintf(stdout, "  OPTIONS:\n"
+			"\t-o <format>\n"
+			"\t\tOutput format, 'text' or 'csv'. Default is\n"
+			"\t\t'text'.\n"
+			"\t-t\n"
+			"\t\tPrint the counters of each thread, instead of\n"
+			"\t\tthe totals of all threads.\n"
+			"\t-e <path_to_elf>\n"
+			"\t\tResolve function names with the function map\n"
+			"\t\tof the ELF file.\n"
+			"\t-m <id_table>\n"
+			"\t\tResolve function names with the ID table written\n"
+			"\t\tby 'edit', '<output>%s'.\n", FUNCID_TABLE_SUFFIX);
+}
+
+bool DumpTest::parseArgs(int argc, char **argv)
+{
+	int c;
+
+	while ((c = getopt(argc, argv, "i:o:te:m:")) != -1) {
+		switch(c) {
+			case 'i':
+				input = optarg;
+				break;
+
+			case 'o':
+				if (!strcmp(optarg, FORMAT_CSV))
+					csv = true;
+				else if (!strcmp(optarg, FORMAT_TEXT))
+					csv = false;
+				else {
+					LOG_ERROR("Unknown format %s", optarg);
+					return false;
+				}
+				break;
+
+			case 't':
+				per_thread = true;
+				break;
+
+			case 'e':
+				if (access(optarg, F_OK) != 0) {
+					LOG_ERROR("File %s doesn't exist", optarg);
+					return false;
+				}
+				elf_path = optarg;
+				break;
+
+			case 'm':
+				id_path = optarg;
+				break;
+
+			default:
+				LOG_ERROR("Unknown option %c, usage:", c);
+				staticUsage();
+				return false;
+		}
+	}
+
+	if (input.size() == 0) {
+		LOG_ERROR("No dump file specified, usage:");
+		staticUsage();
+		return false;
+	}
+	return true;
+}
+
+bool DumpTest::init(void)
+{
+	struct stat st;
+	void *ptr = NULL;
+	int fd = -1;
+
+	if (elf_path.size()) {
+		funcmap = new FuncMap(elf_path);
+		if (!funcmap->load(false)) {
+			LOG_ERROR("Failed to load function map for %s",
+							elf_path.c_str());
+			delete funcmap;
+			funcmap = NULL;
+			return false;
+		}
+	}
+
+	if (id_path.size() && !idspace.load(id_path)) {
+		LOG_ERROR("Failed to load ID table %s", id_path.c_str());
+		return false;
+	}
+
+	fd = open(input.c_str(), O_RDONLY);
+	if (fd < 0) {
+		LOG_ERROR("Failed to open %s, err %d", input.c_str(), errno);
+		return false;
+	}
+
+	if (fstat(fd, &st) < 0 ||
+			(size_t)st.st_size < sizeof(struct probe_dump_header)) {
+		LOG_ERROR("Wrong dump file %s", input.c_str());
+		close(fd);
+		return false;
+	}
+
+	ptr = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+	close(fd);
+	if (ptr == MAP_FAILED) {
+		LOG_ERROR("Failed to mmap %s, err %d", input.c_str(), errno);
+		return false;
+	}
+
+	hdr = (struct probe_dump_header *)ptr;
+	size = st.st_size;
+	if (hdr->magic != PROBE_DUMP_MAGIC
+			|| hdr->version != PROBE_DUMP_VERSION
+			|| hdr->block_offset != probe_dump_block_offset(hdr->nb_counter)
+			|| hdr->block_size != probe_dump_block_size(hdr->nb_counter)
+			|| hdr->block_offset > size) {
+		LOG_ERROR("%s is not a dump file, or has a wrong version",
+						input.c_str());
+		return false;
+	}
+
+	// a truncated block is left by a crash while writing it
+	nb_block = (size - hdr->block_offset) / hdr->block_size;
+	if ((size - hdr->block_offset) % hdr->block_size)
+		LOG_INFO("Ignore the truncated last block");
+
+	LOG_INFO("Dump of process %d: %u counters, %lu threads, freq %u",
+					hdr->pid, hdr->nb_counter,
+					(unsigned long)nb_block, hdr->sample_freq);
+	return true;
+}
+
+struct probe_dump_block *DumpTest::getBlock(uint64_t idx)
+{
+	struct probe_dump_block *block = (struct probe_dump_block *)
+			((char *)hdr + hdr->block_offset + idx * hdr->block_size);
+
+	if (block->magic != PROBE_DUMP_BLOCK_MAGIC
+			|| block->nb_counter != hdr->nb_counter) {
+		LOG_ERROR("Block %lu is corrupted, skip it", (unsigned long)idx);
+		return NULL;
+	}
+	return block;
+}
+
+void DumpTest::printHeader(void)
+{
+	if (csv)
+		fprintf(stdout, "thread,id,pre,post,function\n");
+	else
+		fprintf(stdout, "%8s %8s %12s %12s  %s\n",
+						"thread", "ID", "pre", "post", "function");
+}
+
+void DumpTest::printCounters(const char *thread,
+				const vector<uint64_t> &pre, const vector<uint64_t> &post)
+{
+	for (unsigned i = 0; i < hdr->nb_counter; i++) {
+		string name;
+
+		if (pre[i] == 0 && post[i] == 0)
+			continue;
+
+		if (id_path.size())
+			name = idspace.getName(hdr->func_ids[i]);
+		else if (funcmap)
+			name = funcmap->getFunctionName(
+							FUNCID_LOCAL(hdr->func_ids[i]));
+
+		if (csv)
+			fprintf(stdout, "%s,0x%08x,%lu,%lu,%s\n",
+							thread, hdr->func_ids[i],
+							(unsigned long)pre[i], (unsigned long)post[i],
+							name.c_str());
+		else
+			fprintf(stdout, "%8s %08x %12lu %12lu  %s\n",
+							thread, hdr->func_ids[i],
+							(unsigned long)pre[i], (unsigned long)post[i],
+							name.c_str());
+	}
+}
+
+bool DumpTest::process(void)
+{
+	unsigned nb = hdr->nb_counter;
+	uint64_t scale = (hdr->sample_freq > 1 ? hdr->sample_freq : 1);
+	vector<uint64_t> pre(nb, 0), post(nb, 0);
+	struct probe_dump_block *block = NULL;
+	char thread[16] = {'\0'};
+
+	printHeader();
+
+	for (uint64_t idx = 0; idx < nb_block; idx++) {
+		block = getBlock(idx);
+		if (!block)
+			continue;
+
+		if (per_thread) {
+			pre.assign(nb, 0);
+			post.assign(nb, 0);
+		}
+
+		// scale sampled counters back up
+		for (unsigned i = 0; i < nb; i++) {
+			pre[i] += block->counters[i].pre_count * scale;
+			post[i] += block->counters[i].post_count * scale;
+		}
+
+		if (per_thread) {
+			if (block->tid == PROBE_DUMP_TID_SHARED)
+				snprintf(thread, sizeof(thread), "all");
+			else
+				snprintf(thread, sizeof(thread), "%d", block->pid);
+			printCounters(thread, pre, post);
+		}
+	}
+
+	if (!per_thread)
+		printCounters("all", pre, post);
+
+	fflush(stdout);
+	return true;
+}
+
+void DumpTest::destroy(void)
+{
+	if (hdr) {
+		munmap(hdr, size);
+		hdr = NULL;
+	}
+
+	if (funcmap) {
+		delete funcmap;
+		funcmap = NULL;
+	}
+}
@@ -0,0 +1,56 @@
+#ifndef __DUMP_H__
+#define __DUMP_H__
+
+#include <cstdint>
+#include <string>
+#include <vector>
+
+#include "test.h"
+#include "funcid.h"
+
+struct probe_dump_header;
+struct probe_dump_block;
+class FuncMap;
+
+#define DUMP_CMD "dump"
+
+/* Convert the binary counter dump of funccnt into text or CSV */
+class DumpTest: public Test {
+	private:
+		// path to the dump file
+		std::string input;
+		// ELF for function names, optional
+		std::string elf_path;
+		// ID table for function names, optional
+		std::string id_path;
+		bool csv;
+		// print each thread, instead of the totals
+		bool per_thread;
+
+		FuncMap *funcmap;
+		FuncIDSpace idspace;
+		struct probe_dump_header *hdr;
+		size_t size;
+		// number of complete blocks
+		uint64_t nb_block;
+
+		struct probe_dump_block *getBlock(uint64_t idx);
+		void printHeader(void);
+		void printCounters(const char *thread,
+						const std::vector<uint64_t> &pre,
+						const std::vector<uint64_t> &post);
+
+	public:
+		DumpTest(void);
+		~DumpTest(void);
+
+		static void staticUsage(void);
+		static Test *construct(void);
+
+		bool parseArgs(int argc, char **argv);
+		bool init(void);
+		bool process(void);
+		void destroy(void);
+};
+
+#endif /* __DUMP_H__ */
@@ -14,6 +14,7 @@
 #include "funcmap.h"
 #include "count.h"
 #include "util.h"
+#include "../libprobe/funcid.h"
 
 using namespace std;
 using namespace Dyninst;
@@ -108,7 +109,7 @@ bool EditTest::parseArgs(int argc, char **argv)
 		output = file + "_new";
 	}
 
-	return true;
+	return count.checkOptions();
 }
 
 bool EditTest::insertInit(void)
@@ -162,6 +163,19 @@ free_arg:
 	return ret;
 }
 
+/* The table is opened by the mutatee, whose working directory
+ * may differ. */
+static string getAbsPath(const string &path)
+{
+	char cwd[PATH_MAX] = {'\0'};
+
+	if (path.size() && path[0] == '/')
+		return path;
+	if (!getcwd(cwd, PATH_MAX))
+		return path;
+	return string(cwd) + "/" + path;
+}
+
 bool EditTest::process(void)
 {
 	// load counting functions
@@ -176,6 +190,12 @@ bool EditTest::process(void)
 		return false;
 	}
 
+	// save ID table next to the new file, it's loaded at runtime
+	if (!count.saveIDTable(getAbsPath(output) + FUNCID_TABLE_SUFFIX)) {
+		LOG_ERROR("Failed to save ID table");
+		return false;
+	}
+
 	// insert init function
 	if (!insertInit()) {
 		LOG_ERROR("Failed to insert init function");
@@ -0,0 +1,345 @@
+#include <stdio.h>
+#include <getopt.h>
+
+#include "util.h"
+#include "export.h"
+#include "../libprobe/funcid.h"
+#include "../libprofile/data.h"
+
+using namespace std;
+
+ExportTest::ExportTest(void) :
+		chrome(false), value(EXPORT_CALLS), out(NULL),
+		names_min(0), nb_written(0)
+{
+}
+
+ExportTest::~ExportTest(void)
+{
+}
+
+Test *ExportTest::construct(void)
+{
+	return new ExportTest();
+}
+
+void ExportTest::staticUsage(void)
+{
+	fprintf(stdout, "stubprofile %s -f <format> [OPTIONS] <data_file|dir>...\n",
+					EXPORT_CMD);
+	fprintf(stdout, "  OPTIONS:\n"
+			"\t-f <format>\n"
+			"\t\t'folded' writes the folded stacks of flamegraph.pl,\n"
+			"\t\twithout the files of sampled calls (-F).\n"
+			"\t\t'chrome' writes a timeline in the trace-event JSON\n"
+			"\t\tformat of chrome://tracing and Perfetto, which\n"
+			"\t\tneeds the event 'tsc' or 'monotonic-raw' in -e of\n"
+			"\t\t'edit'.\n"
+			"\t-i <data_file|dir>\n"
+			"\t\tAdd a data file with records, or the\n"
+			"\t\t'profile_<tid>.data' files of a directory. It can\n"
+			"\t\tbe repeated, and the arguments after the options\n"
+			"\t\tare added too.\n"
+			"\t-c <event>\n"
+			"\t\tValue of the folded stacks, the exclusive count of\n"
+			"\t\tan event, or '%s'. Default is '%s'.\n"
+			"\t-O <output>\n"
+			"\t\tOutput file. Default is the standard output.\n"
+			"\t-m <id_table>\n"
+			"\t\tResolve function names with the ID table written\n"
+			"\t\tby 'edit', '<output>%s'. The data files only\n"
+			"\t\thold the indices of the functions, without it\n"
+			"\t\tthey are named '#<index>'.\n",
+			EXPORT_CALLS, EXPORT_CALLS, FUNCID_TABLE_SUFFIX);
+}
+
+bool ExportTest::parseArgs(int argc, char **argv)
+{
+	bool format = false;
+	int c;
+
+	while ((c = getopt(argc, argv, "f:i:c:O:m:")) != -1) {
+		switch(c) {
+			case 'f':
+				if (!strcmp(optarg, FORMAT_CHROME))
+					chrome = true;
+				else if (!strcmp(optarg, FORMAT_FOLDED))
+					chrome = false;
+				else {
+					LOG_ERROR("Unknown format %s", optarg);
+					return false;
+				}
+				format = true;
+				break;
+
+			case 'i':
+				if (!ProfData::addInput(inputs, optarg))
+					return false;
+				break;
+
+			case 'c':
+				value = optarg;
+				break;
+
+			case 'O':
+				output = optarg;
+				break;
+
+			case 'm':
+				id_path = optarg;
+				break;
+
+			default:
+				LOG_ERROR("Unknown option %c, usage:", c);
+				staticUsage();
+				return false;
+		}
+	}
+
+	for (int i = optind; i < argc; i++) {
+		if (!ProfData::addInput(inputs, argv[i]))
+			return false;
+	}
+
+	if (!format || inputs.size() == 0) {
+		LOG_ERROR("No format or data file specified, usage:");
+		staticUsage();
+		return false;
+	}
+	return true;
+}
+
+bool ExportTest::init(void)
+{
+	if (id_path.size() && !idspace.load(id_path)) {
+		LOG_ERROR("Failed to load ID table %s", id_path.c_str());
+		return false;
+	}
+
+	out = stdout;
+	if (output.size()) {
+		out = fopen(output.c_str(), "w");
+		if (!out) {
+			LOG_ERROR("Failed to open %s, err %d", output.c_str(), errno);
+			return false;
+		}
+	}
+	return true;
+}
+
+/* Sum the exclusive value of each distinct stack */
+class FoldedHandler: public ProfDataHandler {
+	private:
+		ExportTest *test;
+		// event of the value, -1 for the calls
+		int event;
+		string key;
+
+	public:
+		FoldedHandler(ExportTest *t, int e) : test(t), event(e) {};
+
+		void exit(const ProfDataFrame *stack, uint32_t depth,
+						const uint64_t *counts)
+		{
+			const ProfDataFrame *top = &stack[depth - 1];
+			uint64_t val = 1;
+
+			if (event >= 0)
+				val = counts[event] - top->start[event]
+						- top->child[event];
+			if (!val)
+				return;
+
+			key.clear();
+			for (uint32_t d = 0; d < depth; d++) {
+				if (d)
+					key += ';';
+				key += test->names[stack[d].idx];
+			}
+			test->folded[key] += val;
+		}
+};
+
+/* Write a begin and an end event per call */
+class ChromeHandler: public ProfDataHandler {
+	private:
+		ExportTest *test;
+		const struct prof_data_header *hdr;
+		// event of the time, and if it's the TSC
+		unsigned int time;
+		bool tsc;
+
+		void write(const ProfDataFrame *frame, bool end,
+						const uint64_t *counts)
+		{
+			uint64_t ns = counts[time];
+			FILE *out = test->out;
+
+			if (tsc)
+				ns = prof_data_tsc_to_ns(hdr, ns);
+
+			// in microseconds, without the rounding of a double
+			fprintf(out, "%s\n{\"name\":\"%s\",\"ph\":\"%c\",\"ts\":%lu.%03lu,"
+							"\"pid\":%d,\"tid\":%d",
+							test->nb_written ? "," : "",
+							test->names[frame->idx].c_str(), end ? 'E' : 'B',
+							(unsigned long)(ns / 1000),
+							(unsigned long)(ns % 1000), hdr->pid, hdr->tid);
+			test->nb_written++;
+
+			if (!end) {
+				fprintf(out, "}");
+				return;
+			}
+
+			// inclusive counts of the other events
+			fprintf(out, ",\"args\":{");
+			for (unsigned int i = 0, n = 0; i < hdr->nb_event; i++) {
+				if (i == time)
+					continue;
+				fprintf(out, "%s\"%.*s\":%lu", n++ ? "," : "",
+								PROF_DATA_EVENT_NAME_MAX,
+								hdr->events[i].name,
+								(unsigned long)(counts[i] - frame->start[i]));
+			}
+			fprintf(out, "}}");
+		}
+
+	public:
+		ChromeHandler(ExportTest *t, const struct prof_data_header *h,
+						unsigned int e) :
+				test(t), hdr(h), time(e),
+				tsc(h->events[e].config == PROF_PSEUDO_TSC) {};
+
+		void enter(const ProfDataFrame *stack, uint32_t depth,
+						const uint64_t *counts)
+		{
+			write(&stack[depth - 1], false, counts);
+		}
+
+		void exit(const ProfDataFrame *stack, uint32_t depth,
+						const uint64_t *counts)
+		{
+			write(&stack[depth - 1], true, counts);
+		}
+};
+
+/* Escape a name for JSON */
+static string __json_escape(const string &str)
+{
+	string ret;
+
+	for (unsigned int i = 0; i < str.size(); i++) {
+		if (str[i] == '"' || str[i] == '\\')
+			ret += '\\';
+		if ((unsigned char)str[i] >= 0x20)
+			ret += str[i];
+	}
+	return ret;
+}
+
+bool ExportTest::exportFile(const struct prof_data_header *hdr,
+				const string &path)
+{
+	uint32_t nb_func = hdr->max_index - hdr->min_index + 1;
+	int event = -1;
+
+	if (hdr->flags & PROF_FLAG_AGGR) {
+		LOG_ERROR("%s has no record, skip it", path.c_str());
+		return false;
+	}
+
+	// the callees of a sampled call are mostly not sampled
+	if (ProfData::sampled(hdr)) {
+		if (!chrome) {
+			LOG_ERROR("%s only records 1 call in %u, its stacks are "
+							"incomplete, skip it",
+							path.c_str(), hdr->sample_freq);
+			return false;
+		}
+		LOG_ERROR("%s only records 1 call in %u, the others are missing",
+						path.c_str(), hdr->sample_freq);
+	}
+
+	// names of the functions of the file
+	if (names.size() != nb_func || names_min != hdr->min_index) {
+		names.resize(nb_func);
+		names_min = hdr->min_index;
+		for (uint32_t i = 0; i < nb_func; i++) {
+			names[i] = idspace.getIndexName(hdr->min_index + i);
+			if (chrome)
+				names[i] = __json_escape(names[i]);
+		}
+	}
+
+	for (unsigned int i = 0; i < hdr->nb_event; i++) {
+		const struct prof_data_event *ev = &hdr->events[i];
+
+		if (chrome ? (ev->type == PROF_PMU_TYPE_PSEUDO) :
+				!strncmp(ev->name, value.c_str(),
+						PROF_DATA_EVENT_NAME_MAX)) {
+			event = i;
+			break;
+		}
+	}
+
+	if (chrome) {
+		if (event < 0) {
+			LOG_ERROR("%s has no 'tsc' or 'monotonic-raw' event, "
+							"skip it", path.c_str());
+			return false;
+		}
+		ChromeHandler handler(this, hdr, event);
+		return ProfData::replay(hdr, handler);
+	}
+
+	if (event < 0 && value != EXPORT_CALLS) {
+		LOG_ERROR("%s has no event %s, skip it",
+						path.c_str(), value.c_str());
+		return false;
+	}
+	FoldedHandler handler(this, event);
+	return ProfData::replay(hdr, handler);
+}
+
+bool ExportTest::process(void)
+{
+	struct prof_data_header *hdr = NULL;
+	uint64_t nb_exported = 0;
+	size_t size = 0;
+
+	if (chrome)
+		fprintf(out, "{\"traceEvents\":[");
+
+	// one file at a time, the events are written while replayed
+	for (unsigned int i = 0; i < inputs.size(); i++) {
+		hdr = ProfData::map(inputs[i], &size);
+		if (!hdr)
+			continue;
+		if (exportFile(hdr, inputs[i]))
+			nb_exported++;
+		munmap(hdr, size);
+	}
+
+	if (chrome)
+		fprintf(out, "\n],\"displayTimeUnit\":\"ns\"}\n");
+	else {
+		for (auto it = folded.begin(); it != folded.end(); it++)
+			fprintf(out, "%s %lu\n", it->first.c_str(),
+							(unsigned long)it->second);
+	}
+	fflush(out);
+
+	LOG_INFO("%lu of %lu files exported, %s",
+					(unsigned long)nb_exported, inputs.size(),
+					chrome ? (to_string(nb_written) + " trace events").c_str() :
+					(to_string(folded.size()) + " stacks").c_str());
+	return nb_exported > 0;
+}
+
+void ExportTest::destroy(void)
+{
+	if (out && out != stdout)
+		fclose(out);
+	out = NULL;
+}
@@ -0,0 +1,75 @@
+#ifndef __EXPORT_H__
+#define __EXPORT_H__
+
+#include <cstdint>
+#include <cstdio>
+#include <string>
+#include <vector>
+#include <map>
+
+#include "test.h"
+#include "funcid.h"
+#include "profdata.h"
+
+#define EXPORT_CMD "export"
+
+/* Value of the folded stacks which is not an event */
+#define EXPORT_CALLS "calls"
+
+/* Convert the records of libprofile data files for other viewers
+ * - folded: one line per distinct call stack, its functions from
+ *   the outermost separated by ';', and the exclusive count of an
+ *   event, or its calls. It is the input of flamegraph.pl. Only the
+ *   distinct stacks are kept in memory.
+ * - chrome: a trace-event JSON timeline, with a begin and an end
+ *   event per call, and the inclusive counts of the events in the
+ *   arguments of the end. The time is taken from the pseudo-event
+ *   'tsc', converted to ns with the conversion of perf saved in the
+ *   header, or from 'monotonic-raw'. The events are written while
+ *   the records are replayed, in constant memory.
+ * The records are replayed by ProfData, one file at a time.
+ */
+class ExportTest: public Test {
+	private:
+		// data files, or directories of data files
+		std::vector<std::string> inputs;
+		// output file, stdout if empty
+		std::string output;
+		// ID table for function names, optional
+		std::string id_path;
+#define FORMAT_FOLDED "folded"
+#define FORMAT_CHROME "chrome"
+		bool chrome;
+		// value of the folded stacks
+		std::string value;
+
+		FuncIDSpace idspace;
+		FILE *out;
+		// names of the functions of [names_min, names_min + size)
+		std::vector<std::string> names;
+		uint32_t names_min;
+		// folded stacks and their values
+		std::map<std::string, uint64_t> folded;
+		// trace events written, for the separators
+		uint64_t nb_written;
+
+		bool exportFile(const struct prof_data_header *hdr,
+						const std::string &path);
+
+		friend class FoldedHandler;
+		friend class ChromeHandler;
+
+	public:
+		ExportTest(void);
+		~ExportTest(void);
+
+		static void staticUsage(void);
+		static Test *construct(void);
+
+		bool parseArgs(int argc, char **argv);
+		bool init(void);
+		bool process(void);
+		void destroy(void);
+};
+
+#endif /* __EXPORT_H__ */
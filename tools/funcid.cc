@@ -0,0 +1,179 @@
+#include <cstdio>
+#include <cstring>
+#include <climits>
+
+#include "util.h"
+#include "funcid.h"
+#include "../libprobe/funcid.h"
+
+using namespace std;
+
+unsigned int FuncIDSpace::addObject(const string &path)
+{
+	if (objects.size() >= FUNCID_OBJ_MAX) {
+		LOG_ERROR("Too many objects, skip %s", path.c_str());
+		return UINT_MAX;
+	}
+
+	objects.push_back(path);
+	return objects.size() - 1;
+}
+
+unsigned int FuncIDSpace::addFunction(unsigned int obj, unsigned int local,
+				const string &name)
+{
+	uint32_t id;
+	map<uint32_t, unsigned int>::iterator it;
+
+	if (obj >= objects.size() || local >= FUNCID_LOCAL_MAX) {
+		LOG_ERROR("Wrong function %s, object %u, local ID %u",
+						name.c_str(), obj, local);
+		return UINT_MAX;
+	}
+
+	id = FUNCID_MAKE(obj, local);
+	it = indices.find(id);
+	if (it != indices.end())
+		return it->second;
+
+	ids.push_back(id);
+	names.push_back(name);
+	starts.push_back(0);
+	ends.push_back(0);
+	indices.insert(pair<uint32_t, unsigned int>(id, ids.size() - 1));
+	return ids.size() - 1;
+}
+
+void FuncIDSpace::setRange(unsigned int index, uint64_t start, uint64_t end)
+{
+	if (index >= ids.size() || start >= end)
+		return;
+	starts[index] = start;
+	ends[index] = end;
+}
+
+uint32_t FuncIDSpace::getID(unsigned int index)
+{
+	if (index >= ids.size())
+		return UINT_MAX;
+	return ids[index];
+}
+
+string FuncIDSpace::getName(uint32_t id)
+{
+	map<uint32_t, unsigned int>::iterator it = indices.find(id);
+
+	if (it == indices.end())
+		return string();
+	return names[it->second];
+}
+
+string FuncIDSpace::getIndexName(unsigned int index, bool qualified)
+{
+	uint32_t id = getID(index);
+	string name = getName(id), obj;
+
+	if (name.size() == 0)
+		return "#" + to_string(index);
+	if (qualified) {
+		obj = getObject(id);
+		if (obj.size())
+			name = obj.substr(obj.find_last_of('/') + 1) + ":" + name;
+	}
+	return name;
+}
+
+string FuncIDSpace::getObject(uint32_t id)
+{
+	if (FUNCID_OBJ(id) >= objects.size())
+		return string();
+	return objects[FUNCID_OBJ(id)];
+}
+
+bool FuncIDSpace::save(const string &path)
+{
+	FILE *file = NULL;
+
+	file = fopen(path.c_str(), "w");
+	if (file == NULL) {
+		LOG_ERROR("Failed to open ID table %s, err %d",
+						path.c_str(), errno);
+		return false;
+	}
+
+	fprintf(file, "%s\n", FUNCID_TABLE_HEADER);
+	for (unsigned i = 0; i < objects.size(); i++)
+		fprintf(file, "object %u %s\n", i, objects[i].c_str());
+	for (unsigned i = 0; i < ids.size(); i++)
+		fprintf(file, "func %u 0x%08x %s\n", i, ids[i], names[i].c_str());
+	for (unsigned i = 0; i < ids.size(); i++) {
+		if (starts[i] < ends[i])
+			fprintf(file, "range %u 0x%lx 0x%lx\n", i,
+							(unsigned long)starts[i],
+							(unsigned long)ends[i]);
+	}
+
+	fclose(file);
+	LOG_INFO("Save %lu functions of %lu objects into %s",
+					ids.size(), objects.size(), path.c_str());
+	return true;
+}
+
+bool FuncIDSpace::load(const string &path)
+{
+	FILE *file = NULL;
+	char line[FUNCID_LINE_MAX] = {'\0'};
+	char str[FUNCID_LINE_MAX] = {'\0'};
+	unsigned int idx, id;
+	unsigned long start, end;
+
+	file = fopen(path.c_str(), "r");
+	if (file == NULL) {
+		LOG_ERROR("Failed to open ID table %s, err %d",
+						path.c_str(), errno);
+		return false;
+	}
+
+	if (!fgets(line, FUNCID_LINE_MAX, file) ||
+			strncmp(line, FUNCID_TABLE_HEADER,
+					strlen(FUNCID_TABLE_HEADER))) {
+		LOG_ERROR("%s is not an ID table", path.c_str());
+		fclose(file);
+		return false;
+	}
+
+	objects.clear();
+	ids.clear();
+	names.clear();
+	starts.clear();
+	ends.clear();
+	indices.clear();
+
+	while (fgets(line, FUNCID_LINE_MAX, file)) {
+		if (sscanf(line, "object %u %[^\n]", &idx, str) == 2) {
+			if (idx != objects.size()) {
+				LOG_ERROR("Unordered object %u in %s",
+								idx, path.c_str());
+				continue;
+			}
+			objects.push_back(str);
+		}
+		else if (sscanf(line, "func %u %x %[^\n]", &idx, &id, str) == 3) {
+			if (idx != ids.size()) {
+				LOG_ERROR("Unordered function %u in %s",
+								idx, path.c_str());
+				continue;
+			}
+			ids.push_back(id);
+			names.push_back(str);
+			starts.push_back(0);
+			ends.push_back(0);
+			indices.insert(pair<uint32_t, unsigned int>(id, idx));
+		}
+		else if (sscanf(line, "range %u %lx %lx", &idx, &start, &end) == 3)
+			setRange(idx, start, end);
+	}
+
+	fclose(file);
+	return true;
+}
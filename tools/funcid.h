@@ -0,0 +1,67 @@
+#ifndef __FUNC_ID_H__
+#define __FUNC_ID_H__
+
+#include <cstdint>
+#include <string>
+#include <map>
+#include <vector>
+
+/* Global function-ID space
+ * Objects are numbered in the order they are added, and a function
+ * is identified by its object ID and its local ID in the function
+ * map of the object (see libprobe/funcid.h). Each added function
+ * also gets a dense index from 0, which is passed to the probes, so
+ * that the counters only cover the instrumented functions.
+ * The space is saved as the ID table, which is loaded by libprobe
+ * and by the readers of its output.
+ */
+class FuncIDSpace {
+	private:
+		// path of each object, indexed by object ID
+		std::vector<std::string> objects;
+		// global ID and name of each function, indexed by index
+		std::vector<uint32_t> ids;
+		std::vector<std::string> names;
+		// link-time address range of each function, empty if
+		// unknown
+		std::vector<uint64_t> starts;
+		std::vector<uint64_t> ends;
+		// map between global IDs and indices
+		std::map<uint32_t, unsigned int> indices;
+
+	public:
+		FuncIDSpace(void) {};
+
+		/* Add an object, return its ID, or UINT_MAX if the
+		 * space is full */
+		unsigned int addObject(const std::string &path);
+		/* Add a function, return its dense index. A function
+		 * added twice keeps its first index. */
+		unsigned int addFunction(unsigned int obj, unsigned int local,
+						const std::string &name);
+
+		/* Set the address range [start, end) of an index, in
+		 * its object before relocation */
+		void setRange(unsigned int index, uint64_t start, uint64_t end);
+
+		/* Number of functions */
+		unsigned int size(void) { return ids.size(); };
+		/* Get the global ID of an index, UINT_MAX on failure */
+		uint32_t getID(unsigned int index);
+		/* Get the name of a global ID, empty on failure */
+		std::string getName(uint32_t id);
+		/* Get the name of an index, as found in the data files,
+		 * prefixed by the file name of its object if 'qualified'.
+		 * It's '#<index>' if the index is unknown, e.g. when no
+		 * table is loaded. */
+		std::string getIndexName(unsigned int index,
+						bool qualified = false);
+		/* Get the path of the object of a global ID */
+		std::string getObject(uint32_t id);
+
+		/* Save/load the ID table */
+		bool save(const std::string &path);
+		bool load(const std::string &path);
+};
+
+#endif /* __FUNC_ID_H__ */
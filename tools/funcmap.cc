@@ -286,6 +286,13 @@ unsigned FuncMap::getFunctionID(const char *func)
 	return getFunctionID(string(func));
 }
 
+string FuncMap::getFunctionName(unsigned int id)
+{
+	if (id >= funcs.size())
+		return string();
+	return funcs[id];
+}
+
 void FuncMap::printAll(void)
 {
 	map<string, unsigned>::iterator iter;
@@ -74,6 +74,10 @@ class FuncMap {
 		unsigned int getFunctionID(std::string func);
 		unsigned int getFunctionID(const char *func);
 
+		// get function name by ID
+		// return an empty string on failure
+		std::string getFunctionName(unsigned int id);
+
 		// print all functions
 		void printAll(void);
 };
@@ -0,0 +1,383 @@
+#include <stdio.h>
+#include <fcntl.h>
+#include <dirent.h>
+
+#include "util.h"
+#include "profdata.h"
+#include "../libprofile/data.h"
+
+using namespace std;
+
+ProfData::~ProfData(void)
+{
+	free(ref);
+}
+
+/* Add a data file, or the data files of a directory */
+bool ProfData::addInput(vector<string> &inputs, const string &path)
+{
+	struct stat st;
+	struct dirent *ent = NULL;
+	DIR *dir = NULL;
+	int pid, len;
+
+	if (stat(path.c_str(), &st) < 0) {
+		LOG_ERROR("File %s doesn't exist", path.c_str());
+		return false;
+	}
+
+	if (!S_ISDIR(st.st_mode)) {
+		inputs.push_back(path);
+		return true;
+	}
+
+	dir = opendir(path.c_str());
+	if (!dir) {
+		LOG_ERROR("Failed to open directory %s, err %d",
+						path.c_str(), errno);
+		return false;
+	}
+	while ((ent = readdir(dir)) != NULL) {
+		len = 0;
+		if (sscanf(ent->d_name, PROF_DATA_NAME "%n", &pid, &len) == 1
+				&& len == (int)strlen(ent->d_name))
+			inputs.push_back(path + "/" + ent->d_name);
+	}
+	closedir(dir);
+	return true;
+}
+
+/* Map a data file and check its header, return NULL on failure */
+struct prof_data_header *ProfData::map(const string &path,
+				size_t *size)
+{
+	struct prof_data_header *hdr = NULL;
+	struct stat st;
+	void *ptr = NULL;
+	int fd = -1;
+
+	fd = open(path.c_str(), O_RDONLY);
+	if (fd < 0) {
+		LOG_ERROR("Failed to open %s, err %d", path.c_str(), errno);
+		return NULL;
+	}
+
+	if (fstat(fd, &st) < 0 ||
+			(size_t)st.st_size < sizeof(struct prof_data_header)) {
+		LOG_ERROR("Wrong data file %s", path.c_str());
+		close(fd);
+		return NULL;
+	}
+
+	ptr = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+	close(fd);
+	if (ptr == MAP_FAILED) {
+		LOG_ERROR("Failed to mmap %s, err %d", path.c_str(), errno);
+		return NULL;
+	}
+	// the records are read once, in order
+	madvise(ptr, st.st_size, MADV_SEQUENTIAL);
+
+	hdr = (struct prof_data_header *)ptr;
+	if (hdr->magic != PROF_DATA_MAGIC
+			|| hdr->version != PROF_DATA_VERSION
+			|| hdr->data_offset != prof_data_offset(hdr->nb_event)
+			|| hdr->data_offset > (size_t)st.st_size
+			|| hdr->min_index > hdr->max_index
+			|| hdr->committed > st.st_size - hdr->data_offset) {
+		LOG_ERROR("%s is not a data file, has a wrong version, "
+						"or is truncated", path.c_str());
+		munmap(ptr, st.st_size);
+		return NULL;
+	}
+
+	*size = st.st_size;
+	return hdr;
+}
+
+/* Check that a file has the events and functions of the first one */
+bool ProfData::match(const struct prof_data_header *hdr,
+				const string &path)
+{
+	if (hdr->nb_event != ref->nb_event
+			|| hdr->min_index != ref->min_index
+			|| hdr->max_index != ref->max_index
+			|| (hdr->flags & PROF_FLAG_SAMPLING)
+					!= (ref->flags & PROF_FLAG_SAMPLING)
+			|| sampled(hdr) != sampled(ref)) {
+		LOG_ERROR("%s is not from the same run, skip it", path.c_str());
+		return false;
+	}
+
+	for (unsigned i = 0; i < hdr->nb_event; i++) {
+		if (hdr->events[i].type != ref->events[i].type
+				|| hdr->events[i].config != ref->events[i].config) {
+			LOG_ERROR("%s has other events, skip it", path.c_str());
+			return false;
+		}
+	}
+	return true;
+}
+
+bool ProfData::sampled(const struct prof_data_header *hdr)
+{
+	return hdr->sample_freq > 1;
+}
+
+/* Add the entry of a function of a file, without the probe overhead
+ * of its calls, unless raw */
+void ProfData::addEntry(const struct prof_data_header *hdr,
+				const struct prof_data_aggr *entry,
+				vector<uint64_t> &table)
+{
+	uint64_t scale = (hdr->sample_freq > 1 ? hdr->sample_freq : 1);
+	uint64_t *val = NULL, incl, excl;
+
+	val = &table[(uint64_t)(entry->index - hdr->min_index) * nb_col];
+	val[0] += entry->calls * scale;
+	for (unsigned i = 0; i < hdr->nb_event; i++) {
+		incl = entry->counts[i];
+		excl = entry->counts[hdr->nb_event + i];
+		// the callees count their probes, but the caller the
+		// rest of them
+		if (!raw) {
+			incl = prof_data_correct(&hdr->events[i], incl,
+							entry->incl_calls + entry->below,
+							entry->below);
+			excl = prof_data_correct(&hdr->events[i], excl,
+							entry->calls, entry->callees);
+		}
+		val[1 + i] += incl * scale;
+		// the unsampled callees are in the exclusive counts
+		if (!sampled(hdr))
+			val[1 + hdr->nb_event + i] += excl * scale;
+	}
+}
+
+/* Add the per-function table of a file */
+void ProfData::scanAggr(const struct prof_data_header *hdr,
+				vector<uint64_t> &table)
+{
+	const uint8_t *ptr = (const uint8_t *)hdr + hdr->data_offset;
+	size_t entry_size = PROF_DATA_AGGR_SIZE(hdr->nb_event);
+	uint64_t nb = hdr->committed / entry_size;
+	const struct prof_data_aggr *entry = NULL;
+
+	for (uint64_t n = 0; n < nb; n++) {
+		entry = (const struct prof_data_aggr *)(ptr + n * entry_size);
+		if (entry->index < hdr->min_index || entry->index > hdr->max_index)
+			continue;
+		addEntry(hdr, entry, table);
+	}
+}
+
+/* Aggregate the replayed calls into the table of 'struct
+ * prof_data_aggr' that 'prof_aggr_close()' would have written */
+class AggrHandler: public ProfDataHandler {
+	private:
+		uint32_t nb_event;
+		size_t entry_size;
+		std::vector<uint8_t> entries;
+		// instances of each function on the stack
+		std::vector<uint32_t> active;
+		// calls made by each frame, and all calls below it
+		std::vector<uint64_t> callees;
+		std::vector<uint64_t> below;
+
+	public:
+		AggrHandler(const struct prof_data_header *hdr) :
+				nb_event(hdr->nb_event),
+				entry_size(PROF_DATA_AGGR_SIZE(hdr->nb_event)),
+				entries((hdr->max_index - hdr->min_index + 1)
+								* entry_size, 0),
+				active(hdr->max_index - hdr->min_index + 1, 0),
+				callees(PROFDATA_STACK_MAX, 0),
+				below(PROFDATA_STACK_MAX, 0)
+		{
+			for (uint32_t idx = 0; idx < active.size(); idx++)
+				getEntry(idx)->index = hdr->min_index + idx;
+		};
+
+		struct prof_data_aggr *getEntry(uint32_t idx)
+		{
+			return (struct prof_data_aggr *)&entries[idx * entry_size];
+		}
+
+		void call(uint32_t idx)
+		{
+			getEntry(idx)->calls++;
+		}
+
+		void enter(const ProfDataFrame *stack, uint32_t depth,
+						const uint64_t *counts __maybe_unused)
+		{
+			active[stack[depth - 1].idx]++;
+			callees[depth - 1] = 0;
+			below[depth - 1] = 0;
+		}
+
+		void exit(const ProfDataFrame *stack, uint32_t depth,
+						const uint64_t *counts)
+		{
+			const ProfDataFrame *top = &stack[depth - 1];
+			struct prof_data_aggr *entry = getEntry(top->idx);
+			uint64_t total;
+
+			// only the outermost instance of a recursion is
+			// inclusive
+			active[top->idx]--;
+			if (!active[top->idx]) {
+				entry->incl_calls++;
+				entry->below += below[depth - 1];
+			}
+			entry->callees += callees[depth - 1];
+			if (depth > 1) {
+				callees[depth - 2]++;
+				below[depth - 2] += 1 + below[depth - 1];
+			}
+
+			for (unsigned i = 0; i < nb_event; i++) {
+				total = counts[i] - top->start[i];
+				if (!active[top->idx])
+					entry->counts[i] += total;
+				entry->counts[nb_event + i] += total - top->child[i];
+			}
+		}
+};
+
+/* Replay the records of a file, as 'prof_aggr_enter()' and
+ * 'prof_aggr_exit()' would have aggregated them, so its functions
+ * are corrected as a table of PROF_FLAG_AGGR */
+bool ProfData::scanRecords(const struct prof_data_header *hdr,
+				vector<uint64_t> &table)
+{
+	AggrHandler handler(hdr);
+	bool ret = replay(hdr, handler);
+
+	for (uint32_t idx = 0; idx <= hdr->max_index - hdr->min_index; idx++) {
+		if (handler.getEntry(idx)->calls)
+			addEntry(hdr, handler.getEntry(idx), table);
+	}
+	return ret;
+}
+
+bool ProfData::replay(const struct prof_data_header *hdr,
+				ProfDataHandler &handler)
+{
+	const uint8_t *ptr = (const uint8_t *)hdr + hdr->data_offset;
+	const uint8_t *end = ptr + hdr->committed;
+	const uint8_t *dropped = (const uint8_t *)hdr;
+	uint32_t nb_event = hdr->nb_event;
+	uint32_t nb = hdr->max_index - hdr->min_index + 1;
+	uint64_t tag, delta, nb_hit = 0, lost = 0;
+	// counts at the entry, then inclusive counts of the callees,
+	// of each frame of the shadow stack
+	vector<uint64_t> frames(PROFDATA_STACK_MAX * 2 * nb_event, 0);
+	vector<ProfDataFrame> stack(PROFDATA_STACK_MAX);
+	vector<uint64_t> counts(nb_event, 0);
+	uint32_t depth = 0, idx, d;
+	bool ret = true;
+
+	for (uint32_t i = 0; i < PROFDATA_STACK_MAX; i++) {
+		stack[i].start = &frames[(uint64_t)i * 2 * nb_event];
+		stack[i].child = stack[i].start + nb_event;
+	}
+
+	// pop the top frame at the current counts
+	auto pop = [&](void) {
+		handler.exit(stack.data(), depth, counts.data());
+		depth--;
+		for (unsigned i = 0; depth && i < nb_event; i++)
+			stack[depth - 1].child[i] += counts[i] - stack[depth].start[i];
+	};
+
+	while (ptr < end) {
+		// padding between records
+		if (*ptr == 0) {
+			ptr++;
+			continue;
+		}
+
+		ptr = prof_varint_get(ptr, end, &tag);
+		for (unsigned i = 0; ptr && i < nb_event; i++) {
+			ptr = prof_varint_get(ptr, end, &delta);
+			if (ptr)
+				counts[i] += prof_unzigzag(delta);
+		}
+		if (!ptr || PROF_HIT_IDX(tag) >= nb) {
+			LOG_ERROR("Hit %lu of thread %d is corrupted, stop",
+							(unsigned long)nb_hit, hdr->tid);
+			ret = false;
+			break;
+		}
+		nb_hit++;
+		idx = PROF_HIT_IDX(tag);
+
+		if (!PROF_HIT_EXIT(tag)) {
+			handler.call(idx);
+			if (depth >= PROFDATA_STACK_MAX || lost) {
+				lost++;
+				continue;
+			}
+			stack[depth].idx = idx;
+			memcpy(stack[depth].start, counts.data(),
+							nb_event * sizeof(uint64_t));
+			memset(stack[depth].child, 0, nb_event * sizeof(uint64_t));
+			depth++;
+			handler.enter(stack.data(), depth, counts.data());
+		} else if (lost)
+			lost--;
+		else {
+			// the frame of 'idx', from the top, the frames above
+			// were left without exit
+			for (d = depth; d > 0 && stack[d - 1].idx != idx; d--)
+				;
+			while (d > 0 && depth >= d)
+				pop();
+		}
+
+		// the scanned records are not read again
+		if (ptr - dropped >= (ptrdiff_t)(2 * PROFDATA_WINDOW)) {
+			madvise((void *)dropped, PROFDATA_WINDOW, MADV_DONTNEED);
+			dropped += PROFDATA_WINDOW;
+		}
+	}
+
+	// the functions still running at the last hit, e.g. main()
+	while (depth)
+		pop();
+	return ret;
+}
+
+bool ProfData::setRef(const string &path)
+{
+	struct prof_data_header *hdr = NULL;
+	size_t size = 0;
+
+	hdr = map(path, &size);
+	if (!hdr)
+		return false;
+
+	free(ref);
+	ref = (struct prof_data_header *)malloc(hdr->data_offset);
+	if (!ref) {
+		munmap(hdr, size);
+		return false;
+	}
+	memcpy(ref, hdr, hdr->data_offset);
+	munmap(hdr, size);
+
+	nb_func = ref->max_index - ref->min_index + 1;
+	nb_col = PROFDATA_COLS(ref->nb_event);
+	return true;
+}
+
+bool ProfData::scan(const struct prof_data_header *hdr,
+				vector<uint64_t> &table)
+{
+	if (hdr->flags & PROF_FLAG_AGGR) {
+		scanAggr(hdr, table);
+		return true;
+	}
+	return scanRecords(hdr, table);
+}
@@ -0,0 +1,118 @@
+#ifndef __PROF_DATA_H__
+#define __PROF_DATA_H__
+
+#include <cstdint>
+#include <string>
+#include <vector>
+
+struct prof_data_header;
+struct prof_data_aggr;
+
+/* Bytes of records scanned before they are dropped from memory */
+#define PROFDATA_WINDOW (64UL << 20)
+/* Max depth of the replayed calls, as PROF_AGGR_STACK_MAX */
+#define PROFDATA_STACK_MAX 256
+
+/* Values of a function in a table: calls, the inclusive counts of
+ * the events, then their exclusive counts */
+#define PROFDATA_COLS(nb_event) (1 + 2 * (nb_event))
+
+/* A call on the shadow stack of the replayed records */
+struct ProfDataFrame {
+	/* function index, from 0 */
+	uint32_t idx;
+	/* counts at the entry, and inclusive counts of the callees */
+	uint64_t *start;
+	uint64_t *child;
+};
+
+/* Receive the calls replayed from the records of a thread */
+class ProfDataHandler {
+	public:
+		virtual ~ProfDataHandler(void) = default;
+
+		/* Entry of the function 'idx', even beyond the stack */
+		virtual void call(uint32_t idx) {};
+		/* Entry of the frame 'stack[depth - 1]', and its exit
+		 * before it's popped, with the counts at that time. The
+		 * frames above the exited one are exited first. */
+		virtual void enter(const ProfDataFrame *stack, uint32_t depth,
+						const uint64_t *counts) {};
+		virtual void exit(const ProfDataFrame *stack, uint32_t depth,
+						const uint64_t *counts) = 0;
+};
+
+/* Per-function tables of the data files of libprofile
+ * The files are mapped, and scanned into a table of PROFDATA_COLS
+ * values per function. The per-function tables of PROF_FLAG_AGGR
+ * are summed. The records are replayed on a shadow stack into
+ * inclusive and exclusive counts, as libprofile aggregates them,
+ * and dropped from memory once scanned, so the memory only depends
+ * on the number of functions. The probe overhead measured by
+ * libprofile is subtracted from the counts of each call, and of its
+ * callees, unless the raw counts are asked for.
+ * When only 1 call in 'sample_freq' of each function is recorded,
+ * the callees of a sampled call are mostly not, so their counts are
+ * in its exclusive counts. Only the calls and the inclusive counts
+ * are scaled up, the exclusive counts are left to 0.
+ * The files scanned together must have the events, functions and
+ * sample frequency of a reference file, the first one of a run.
+ */
+class ProfData {
+	private:
+		// header of the reference file
+		struct prof_data_header *ref;
+		uint32_t nb_func;
+		uint32_t nb_col;
+		// keep the probe overhead in the counts
+		bool raw;
+
+		void addEntry(const struct prof_data_header *hdr,
+						const struct prof_data_aggr *entry,
+						std::vector<uint64_t> &table);
+		void scanAggr(const struct prof_data_header *hdr,
+						std::vector<uint64_t> &table);
+		bool scanRecords(const struct prof_data_header *hdr,
+						std::vector<uint64_t> &table);
+
+	public:
+		ProfData(void) : ref(NULL), nb_func(0), nb_col(0), raw(false) {};
+		~ProfData(void);
+
+		/* Add a data file, or the data files of a directory */
+		static bool addInput(std::vector<std::string> &inputs,
+						const std::string &path);
+		/* Map a data file and check its header, return NULL on
+		 * failure */
+		static struct prof_data_header *map(const std::string &path,
+						size_t *size);
+		/* True if a file only records 1 call in 'sample_freq', so
+		 * it has no exclusive counts */
+		static bool sampled(const struct prof_data_header *hdr);
+
+		/* Take the events and functions of a file */
+		bool setRef(const std::string &path);
+		const struct prof_data_header *getRef(void) { return ref; };
+		uint32_t getNbFunc(void) { return nb_func; };
+		uint32_t getNbCol(void) { return nb_col; };
+		void setRaw(bool r) { raw = r; };
+
+		/* Check that a file has the events and functions of the
+		 * reference */
+		bool match(const struct prof_data_header *hdr,
+						const std::string &path);
+		/* Add a matching file into 'table', which has 'getNbCol()'
+		 * values per function. The values before a corruption
+		 * are still added, but it returns false. */
+		bool scan(const struct prof_data_header *hdr,
+						std::vector<uint64_t> &table);
+
+		/* Replay the records of a file on a shadow stack of
+		 * PROFDATA_STACK_MAX frames, as libprofile aggregates
+		 * them. The calls still running at the end exit at the
+		 * last counts. Return false on a corruption. */
+		static bool replay(const struct prof_data_header *hdr,
+						ProfDataHandler &handler);
+};
+
+#endif /* __PROF_DATA_H__ */
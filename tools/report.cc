@@ -0,0 +1,302 @@
+#include <stdio.h>
+#include <getopt.h>
+#include <thread>
+#include <algorithm>
+
+#include "util.h"
+#include "report.h"
+#include "../libprobe/funcid.h"
+#include "../libprofile/data.h"
+
+using namespace std;
+
+ReportTest::ReportTest(void) :
+		csv(false), by_incl(false), top(REPORT_TOP_DEF), nb_worker(0),
+		ref(NULL), nb_func(0), nb_col(0),
+		next(0), nb_scanned(0), nb_skipped(0)
+{
+}
+
+ReportTest::~ReportTest(void)
+{
+}
+
+Test *ReportTest::construct(void)
+{
+	return new ReportTest();
+}
+
+void ReportTest::staticUsage(void)
+{
+	fprintf(stdout, "stubprofile %s [OPTIONS] <data_file|dir>...\n",
+					REPORT_CMD);
+	fprintf(stdout, "  OPTIONS:\n"
+			"\t-i <data_file|dir>\n"
+			"\t\tAdd a data file, or the 'profile_<tid>.data'\n"
+			"\t\tfiles of a directory. It can be repeated, and\n"
+			"\t\tthe arguments after the options are added too.\n"
+			"\t-n <number>\n"
+			"\t\tPrint the top <number> functions of each event.\n"
+			"\t\tDefault is %u, 0 prints all functions.\n"
+			"\t-s <key>\n"
+			"\t\tSort by 'excl' or 'incl' counts. Default is\n"
+			"\t\t'excl'. The files of sampled calls (-F) have\n"
+			"\t\tno exclusive counts, and are sorted by 'incl'.\n"
+			"\t-j <threads>\n"
+			"\t\tScan the files with <threads> threads. Default\n"
+			"\t\tis the number of CPUs.\n"
+			"\t-o <format>\n"
+			"\t\tOutput format, 'text' or 'csv'. Default is\n"
+			"\t\t'text'.\n"
+			"\t-R\n"
+			"\t\tPrint the raw counts, with the probe overhead\n"
+			"\t\tmeasured by libprofile.\n"
+			"\t-m <id_table>\n"
+			"\t\tResolve function names with the ID table written\n"
+			"\t\tby 'edit', '<output>%s'. The data files only\n"
+			"\t\thold the indices of the functions, which it\n"
+			"\t\tmaps to their global IDs.\n",
+			REPORT_TOP_DEF, FUNCID_TABLE_SUFFIX);
+}
+
+
+bool ReportTest::parseArgs(int argc, char **argv)
+{
+	int c;
+
+	while ((c = getopt(argc, argv, "i:n:s:j:o:Rm:")) != -1) {
+		switch(c) {
+			case 'i':
+				if (!ProfData::addInput(inputs, optarg))
+					return false;
+				break;
+
+			case 'n':
+				top = (unsigned)atoi(optarg);
+				break;
+
+			case 's':
+				if (!strcmp(optarg, "incl"))
+					by_incl = true;
+				else if (!strcmp(optarg, "excl"))
+					by_incl = false;
+				else {
+					LOG_ERROR("Unknown sort key %s", optarg);
+					return false;
+				}
+				break;
+
+			case 'j':
+				nb_worker = (unsigned)atoi(optarg);
+				break;
+
+			case 'o':
+				if (!strcmp(optarg, FORMAT_CSV))
+					csv = true;
+				else if (!strcmp(optarg, FORMAT_TEXT))
+					csv = false;
+				else {
+					LOG_ERROR("Unknown format %s", optarg);
+					return false;
+				}
+				break;
+
+			case 'R':
+				data.setRaw(true);
+				break;
+
+			case 'm':
+				id_path = optarg;
+				break;
+
+			default:
+				LOG_ERROR("Unknown option %c, usage:", c);
+				staticUsage();
+				return false;
+		}
+	}
+
+	for (int i = optind; i < argc; i++) {
+		if (!ProfData::addInput(inputs, argv[i]))
+			return false;
+	}
+
+	if (inputs.size() == 0) {
+		LOG_ERROR("No data file specified, usage:");
+		staticUsage();
+		return false;
+	}
+	return true;
+}
+
+
+bool ReportTest::init(void)
+{
+	if (id_path.size() && !idspace.load(id_path)) {
+		LOG_ERROR("Failed to load ID table %s", id_path.c_str());
+		return false;
+	}
+
+	// the first file gives the events and functions
+	if (!data.setRef(inputs[0]))
+		return false;
+	ref = data.getRef();
+	nb_func = data.getNbFunc();
+	nb_col = data.getNbCol();
+
+	if (ProfData::sampled(ref) && !by_incl) {
+		LOG_INFO("Only 1 call in %u is recorded, the exclusive counts "
+						"are unknown, sort by incl", ref->sample_freq);
+		by_incl = true;
+	}
+
+	if (nb_worker == 0)
+		nb_worker = thread::hardware_concurrency();
+	if (nb_worker == 0)
+		nb_worker = 1;
+	if (nb_worker > inputs.size())
+		nb_worker = inputs.size();
+
+	LOG_INFO("Report %lu files of process %d: %u events, "
+					"%u functions, %u threads",
+					inputs.size(), ref->pid, ref->nb_event,
+					nb_func, nb_worker);
+	return true;
+}
+
+
+void ReportTest::work(vector<uint64_t> *table)
+{
+	struct prof_data_header *hdr = NULL;
+	size_t size = 0;
+	unsigned int i;
+
+	table->assign((uint64_t)nb_func * nb_col, 0);
+
+	while ((i = next++) < inputs.size()) {
+		hdr = ProfData::map(inputs[i], &size);
+		if (!hdr) {
+			nb_skipped++;
+			continue;
+		}
+
+		if (!data.match(hdr, inputs[i]))
+			nb_skipped++;
+		else {
+			// the hits before a corruption are still counted
+			data.scan(hdr, *table);
+			nb_scanned++;
+		}
+		munmap(hdr, size);
+	}
+}
+
+/* Print the top functions of an event */
+void ReportTest::printTop(unsigned int event)
+{
+	unsigned int nb_event = ref->nb_event;
+	unsigned int key = 1 + (by_incl ? 0 : nb_event) + event;
+	uint64_t sum = 0, *val = NULL;
+	vector<uint32_t> funcs;
+	unsigned int nb;
+	string name(ref->events[event].name, strnlen(ref->events[event].name,
+					PROF_DATA_EVENT_NAME_MAX));
+	const char *calls = (ref->flags & PROF_FLAG_SAMPLING) ?
+					"samples" : "calls";
+	bool sampled = ProfData::sampled(ref);
+
+	// the exclusive counts add up to the event, without them the
+	// outermost function, e.g. main(), holds it
+	for (uint32_t f = 0; f < nb_func; f++) {
+		val = &totals[(uint64_t)f * nb_col];
+		if (sampled)
+			sum = max(sum, val[1 + event]);
+		else
+			sum += val[1 + nb_event + event];
+		if (val[0])
+			funcs.push_back(f);
+	}
+
+	nb = (top && top < funcs.size()) ? top : funcs.size();
+	partial_sort(funcs.begin(), funcs.begin() + nb, funcs.end(),
+			[this, key](uint32_t a, uint32_t b) {
+				return totals[(uint64_t)a * nb_col + key] >
+						totals[(uint64_t)b * nb_col + key];
+			});
+
+	// one CSV table for all events
+	if (csv && event == 0)
+		fprintf(stdout, "event,rank,index,%s,incl,incl%%,excl,excl%%,"
+						"function\n", calls);
+	else if (!csv) {
+		fprintf(stdout, "\n%s: %lu, top %u of %lu functions by %s\n",
+						name.c_str(), (unsigned long)sum, nb,
+						funcs.size(), by_incl ? "incl" : "excl");
+		fprintf(stdout, "%5s %8s %12s %20s %7s %20s %7s  function\n",
+						"rank", "index", calls, "incl", "incl%",
+						"excl", "excl%");
+	}
+
+	for (unsigned int r = 0; r < nb; r++) {
+		uint64_t incl, excl;
+
+		val = &totals[(uint64_t)funcs[r] * nb_col];
+		incl = val[1 + event];
+		excl = val[1 + nb_event + event];
+		if (csv)
+			fprintf(stdout, "%s,", name.c_str());
+		if (sampled) {
+			fprintf(stdout, csv ? "%u,%u,%lu,%lu,%.2f,%s,%s,%s\n" :
+							"%5u %8u %12lu %20lu %6.2f%% %20s %7s  %s\n",
+							r + 1, ref->min_index + funcs[r],
+							(unsigned long)val[0], (unsigned long)incl,
+							sum ? 100.0 * incl / sum : 0.0,
+							csv ? "" : "-", csv ? "" : "-",
+							idspace.getIndexName(ref->min_index + funcs[r]).c_str());
+			continue;
+		}
+		fprintf(stdout, csv ? "%u,%u,%lu,%lu,%.2f,%lu,%.2f,%s\n" :
+						"%5u %8u %12lu %20lu %6.2f%% %20lu %6.2f%%  %s\n",
+						r + 1, ref->min_index + funcs[r],
+						(unsigned long)val[0], (unsigned long)incl,
+						sum ? 100.0 * incl / sum : 0.0,
+						(unsigned long)excl,
+						sum ? 100.0 * excl / sum : 0.0,
+						idspace.getIndexName(ref->min_index + funcs[r]).c_str());
+	}
+}
+
+bool ReportTest::process(void)
+{
+	vector<vector<uint64_t> > tables(nb_worker);
+	vector<thread> workers;
+
+	for (unsigned int i = 0; i < nb_worker; i++)
+		workers.push_back(thread(&ReportTest::work, this, &tables[i]));
+	for (unsigned int i = 0; i < nb_worker; i++)
+		workers[i].join();
+
+	// merge the totals of the workers
+	totals.assign((uint64_t)nb_func * nb_col, 0);
+	for (unsigned int i = 0; i < nb_worker; i++) {
+		for (uint64_t j = 0; j < totals.size(); j++)
+			totals[j] += tables[i][j];
+		vector<uint64_t>().swap(tables[i]);
+	}
+
+	LOG_INFO("%lu files scanned, %lu skipped",
+					(unsigned long)nb_scanned,
+					(unsigned long)nb_skipped);
+	if (nb_scanned == 0)
+		return false;
+
+	for (unsigned int i = 0; i < ref->nb_event; i++)
+		printTop(i);
+	fflush(stdout);
+	return true;
+}
+
+void ReportTest::destroy(void)
+{
+	ref = NULL;
+}
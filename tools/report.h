@@ -1,12 +1,56 @@
 #ifndef __REPORT_H__
 #define __REPORT_H__
 
+#include <cstdint>
+#include <string>
+#include <vector>
+#include <atomic>
+
 #include "test.h"
+#include "funcid.h"
+#include "profdata.h"
 
 #define REPORT_CMD "report"
 
+/* Functions printed per event by default */
+#define REPORT_TOP_DEF 20
+
+/* Aggregate the data files of libprofile into the top functions of
+ * each event.
+ * The files are scanned in parallel by worker threads, each into its
+ * own totals, which are merged at the end, see ProfData. All files
+ * must have the events and functions of the first one.
+ */
 class ReportTest: public Test {
 	private:
+		// data files, or directories of data files
+		std::vector<std::string> inputs;
+		// ID table for function names, optional
+		std::string id_path;
+		bool csv;
+		// sort by inclusive counts, instead of exclusive
+		bool by_incl;
+		// functions printed per event
+		unsigned int top;
+		// worker threads
+		unsigned int nb_worker;
+
+		FuncIDSpace idspace;
+		// tables of the files, and the header of the first one
+		ProfData data;
+		const struct prof_data_header *ref;
+		uint32_t nb_func;
+		uint32_t nb_col;
+
+		// next file to scan by the workers
+		std::atomic<unsigned int> next;
+		std::atomic<uint64_t> nb_scanned;
+		std::atomic<uint64_t> nb_skipped;
+		std::vector<uint64_t> totals;
+
+		void work(std::vector<uint64_t> *table);
+
+		void printTop(unsigned int event);
 
 	public:
 		ReportTest(void);
@@ -15,13 +59,10 @@ class ReportTest: public Test {
 		static void staticUsage(void);
 		static Test *construct(void);
 
-		void usage(void);
 		bool parseArgs(int argc, char **argv);
-		bool init(void) {};
+		bool init(void);
 		bool process(void);
-		void destroy(void) {};
+		void destroy(void);
 };
 
-
-
 #endif /* __REPORT_H__ */
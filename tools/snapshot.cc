@@ -0,0 +1,316 @@
+#include <stdio.h>
+#include <getopt.h>
+#include <fcntl.h>
+#include <time.h>
+#include <signal.h>
+
+#include "util.h"
+#include "funcmap.h"
+#include "snapshot.h"
+#include "../libprobe/shm.h"
+#include "../libprobe/funcid.h"
+
+using namespace std;
+
+// max retries for reading a block under update
+#define SNAPSHOT_RETRY_MAX 1000
+
+SnapshotTest::SnapshotTest(void) :
+		pid(-1), interval(1000), count(0),
+		funcmap(NULL), hdr(NULL), size(0), nb_private(0)
+{
+}
+
+SnapshotTest::~SnapshotTest(void)
+{
+}
+
+Test *SnapshotTest::construct(void)
+{
+	return new SnapshotTest();
+}
+
+void SnapshotTest::staticUsage(void)
+{
+	fprintf(stdout, "stubprofile %s -p <pid> [OPTIONS]\n",
+					SNAPSHOT_CMD);
+	fprintf(stdout, "  OPTIONS:\n"
+			"\t-i <interval>\n"
+			"\t\tInterval between snapshots, in milliseconds.\n"
+			"\t\tDefault is 1000.\n"
+			"\t-n <count>\n"
+			"\t\tNumber of snapshots. Default is 0, taking\n"
+			"\t\tsnapshots until the process exits.\n"
+			"\t-e <path_to_elf>\n"
+			"\t\tResolve function names with the function map\n"
+			"\t\tof the ELF file.\n"
+			"\t-m <id_table>\n"
+			"\t\tResolve function names with the ID table written\n"
+			"\t\tby 'edit', '<output>%s'.\n", FUNCID_TABLE_SUFFIX);
+}
+
+bool SnapshotTest::parseArgs(int argc, char **argv)
+{
+	int c;
+
+	while ((c = getopt(argc, argv, "p:i:n:e:m:")) != -1) {
+		switch(c) {
+			case 'p':
+				pid = atoi(optarg);
+				break;
+
+			case 'i':
+				interval = (unsigned)atoi(optarg);
+				if (!interval) {
+					LOG_ERROR("Wrong interval %s", optarg);
+					return false;
+				}
+				break;
+
+			case 'n':
+				count = (unsigned)atoi(optarg);
+				break;
+
+			case 'e':
+				if (access(optarg, F_OK) != 0) {
+					LOG_ERROR("File %s doesn't exist", optarg);
+					return false;
+				}
+				elf_path = optarg;
+				break;
+
+			case 'm':
+				id_path = optarg;
+				break;
+
+			default:
+				LOG_ERROR("Unknown option %c, usage:", c);
+				staticUsage();
+				return false;
+		}
+	}
+
+	if (pid <= 0) {
+		LOG_ERROR("No process specified, usage:");
+		staticUsage();
+		return false;
+	}
+	return true;
+}
+
+bool SnapshotTest::init(void)
+{
+	char name[PROBE_SHM_NAME_MAX] = {'\0'};
+	struct stat st;
+	void *ptr = NULL;
+	int fd = -1;
+
+	if (elf_path.size()) {
+		funcmap = new FuncMap(elf_path);
+		if (!funcmap->load(false)) {
+			LOG_ERROR("Failed to load function map for %s",
+							elf_path.c_str());
+			delete funcmap;
+			funcmap = NULL;
+			return false;
+		}
+	}
+
+	if (id_path.size() && !idspace.load(id_path)) {
+		LOG_ERROR("Failed to load ID table %s", id_path.c_str());
+		return false;
+	}
+
+	snprintf(name, PROBE_SHM_NAME_MAX, PROBE_SHM_NAME, pid);
+	fd = shm_open(name, O_RDONLY, 0);
+	if (fd < 0) {
+		LOG_ERROR("Failed to open shm %s, err %d. Is the process "
+				  "instrumented with live snapshots?", name, errno);
+		return false;
+	}
+
+	if (fstat(fd, &st) < 0 ||
+			(size_t)st.st_size < sizeof(struct probe_shm_header)) {
+		LOG_ERROR("Wrong shm %s", name);
+		close(fd);
+		return false;
+	}
+
+	ptr = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+	close(fd);
+	if (ptr == MAP_FAILED) {
+		LOG_ERROR("Failed to mmap shm %s, err %d", name, errno);
+		return false;
+	}
+
+	hdr = (struct probe_shm_header *)ptr;
+	size = st.st_size;
+	if (__atomic_load_n(&hdr->magic, __ATOMIC_ACQUIRE) != PROBE_SHM_MAGIC
+			|| hdr->version != PROBE_SHM_VERSION
+			|| hdr->size > size
+			|| hdr->table_offset + hdr->nb_counter * sizeof(uint32_t)
+				> hdr->retired_offset
+			|| hdr->retired_offset + hdr->block_size
+				> hdr->block_offset) {
+		LOG_ERROR("Shm %s is not initialized or has a wrong version",
+						name);
+		return false;
+	}
+
+	LOG_INFO("Open shm %s: %u counters, %u blocks, freq %u",
+					name, hdr->nb_counter,
+					hdr->nb_block_max, hdr->sample_freq);
+	return true;
+}
+
+/* Read 'block' consistently, and add it to 'pre'/'post'.
+ * Return false if the block is free.
+ */
+bool SnapshotTest::readBlock(struct funcc_thread *block,
+				vector<uint64_t> &pre, vector<uint64_t> &post)
+{
+	unsigned nb = hdr->nb_counter;
+	vector<struct funcc_counter> copy(nb);
+	uint64_t seq1, seq2;
+	uint64_t scale = (hdr->sample_freq > 1 ? hdr->sample_freq : 1);
+	unsigned retry = 0;
+
+	do {
+		if (retry++ >= SNAPSHOT_RETRY_MAX) {
+			LOG_ERROR("Block of thread %u keeps changing, skip it",
+							block->tid);
+			return false;
+		}
+
+		seq1 = __atomic_load_n(&block->seq, __ATOMIC_ACQUIRE);
+		if (seq1 & 1)
+			continue;
+		if (__atomic_load_n(&block->pid, __ATOMIC_RELAXED) == 0)
+			return false;
+		memcpy(copy.data(), block->counters,
+						nb * sizeof(struct funcc_counter));
+		__atomic_thread_fence(__ATOMIC_ACQUIRE);
+		seq2 = __atomic_load_n(&block->seq, __ATOMIC_RELAXED);
+	} while ((seq1 & 1) || seq1 != seq2);
+
+	// scale sampled counters back up
+	for (unsigned i = 0; i < nb; i++) {
+		pre[i] += copy[i].pre_count * scale;
+		post[i] += copy[i].post_count * scale;
+	}
+	return true;
+}
+
+/* Sum the counters of all threads, with the totals of the exited
+ * ones. Return the number of threads alive */
+unsigned SnapshotTest::takeSnapshot(vector<uint64_t> &pre,
+				vector<uint64_t> &post)
+{
+	struct funcc_thread *retired = probe_shm_retired(hdr);
+	unsigned nb_block, nb_thread = 0, retry = 0;
+	uint64_t seq1, seq2;
+
+	// again if a thread exited meanwhile, its counters moved to the
+	// retired block, and may be counted twice or missed
+	do {
+		if (retry++ >= SNAPSHOT_RETRY_MAX) {
+			LOG_ERROR("Threads keep exiting, the totals may be wrong");
+			break;
+		}
+
+		seq1 = __atomic_load_n(&retired->seq, __ATOMIC_ACQUIRE);
+		if (seq1 & 1)
+			continue;
+
+		pre.assign(hdr->nb_counter, 0);
+		post.assign(hdr->nb_counter, 0);
+		nb_thread = 0;
+
+		nb_block = __atomic_load_n(&hdr->nb_block, __ATOMIC_ACQUIRE);
+		for (unsigned i = 0; i < nb_block && i < hdr->nb_block_max; i++) {
+			if (readBlock(probe_shm_block(hdr, i), pre, post))
+				nb_thread++;
+		}
+		readBlock(retired, pre, post);
+		nb_private = __atomic_load_n(&hdr->nb_private, __ATOMIC_RELAXED);
+
+		__atomic_thread_fence(__ATOMIC_ACQUIRE);
+		seq2 = __atomic_load_n(&retired->seq, __ATOMIC_RELAXED);
+	} while ((seq1 & 1) || seq1 != seq2);
+
+	return nb_thread;
+}
+
+void SnapshotTest::printSnapshot(unsigned seq, unsigned nb_thread,
+				vector<uint64_t> &pre, vector<uint64_t> &post)
+{
+	fprintf(stdout, "Snapshot %u: %u threads\n", seq, nb_thread);
+	// their counters are only added at their exit
+	if (nb_private)
+		fprintf(stdout, "Partial totals: %u threads have no block\n",
+						nb_private);
+	fprintf(stdout, "%8s %12s %12s %12s  %s\n",
+					"ID", "pre", "post", "delta", "function");
+
+	for (unsigned i = 0; i < hdr->nb_counter; i++) {
+		uint32_t id = probe_shm_table(hdr)[i];
+		uint64_t delta = 0;
+		string name;
+
+		if (pre[i] == 0 && post[i] == 0)
+			continue;
+
+		if (i < last_pre.size() && pre[i] >= last_pre[i])
+			delta = pre[i] - last_pre[i];
+		if (id_path.size())
+			name = idspace.getName(id);
+		else if (funcmap)
+			name = funcmap->getFunctionName(FUNCID_LOCAL(id));
+
+		fprintf(stdout, "%08x %12lu %12lu %12lu  %s\n", id,
+						(unsigned long)pre[i], (unsigned long)post[i],
+						(unsigned long)delta, name.c_str());
+	}
+	fflush(stdout);
+}
+
+bool SnapshotTest::process(void)
+{
+	vector<uint64_t> pre, post;
+	struct timespec ts;
+	unsigned seq = 0, nb_thread;
+
+	ts.tv_sec = interval / 1000;
+	ts.tv_nsec = (interval % 1000) * 1000000L;
+
+	while (count == 0 || seq < count) {
+		// the segment is removed when the process exits
+		if (kill(pid, 0) != 0) {
+			LOG_INFO("Process %d exits", pid);
+			break;
+		}
+
+		nb_thread = takeSnapshot(pre, post);
+		printSnapshot(seq, nb_thread, pre, post);
+		last_pre.swap(pre);
+		last_post.swap(post);
+
+		seq++;
+		if (count == 0 || seq < count)
+			nanosleep(&ts, NULL);
+	}
+	return true;
+}
+
+void SnapshotTest::destroy(void)
+{
+	if (hdr) {
+		munmap(hdr, size);
+		hdr = NULL;
+	}
+
+	if (funcmap) {
+		delete funcmap;
+		funcmap = NULL;
+	}
+}
@@ -0,0 +1,65 @@
+#ifndef __SNAPSHOT_H__
+#define __SNAPSHOT_H__
+
+#include <cstdint>
+#include <string>
+#include <vector>
+
+#include "test.h"
+#include "funcid.h"
+
+struct probe_shm_header;
+struct funcc_thread;
+class FuncMap;
+
+#define SNAPSHOT_CMD "snapshot"
+
+/* Take snapshots of the funccnt counters of a running process,
+ * through the shared-memory segment created by libprobe. The
+ * target process is never stopped.
+ */
+class SnapshotTest: public Test {
+	private:
+		int pid;
+		// interval between snapshots, in milliseconds
+		unsigned interval;
+		// number of snapshots, 0 means infinite
+		unsigned count;
+		// ELF for function names, optional
+		std::string elf_path;
+		// ID table for function names, optional
+		std::string id_path;
+
+		FuncMap *funcmap;
+		FuncIDSpace idspace;
+		struct probe_shm_header *hdr;
+		size_t size;
+
+		// totals of the last snapshot
+		std::vector<uint64_t> last_pre, last_post;
+		// threads alive without block in the last snapshot
+		unsigned nb_private;
+
+		bool readBlock(struct funcc_thread *block,
+						std::vector<uint64_t> &pre,
+						std::vector<uint64_t> &post);
+		unsigned takeSnapshot(std::vector<uint64_t> &pre,
+						std::vector<uint64_t> &post);
+		void printSnapshot(unsigned seq, unsigned nb_thread,
+						std::vector<uint64_t> &pre,
+						std::vector<uint64_t> &post);
+
+	public:
+		SnapshotTest(void);
+		~SnapshotTest(void);
+
+		static void staticUsage(void);
+		static Test *construct(void);
+
+		bool parseArgs(int argc, char **argv);
+		bool init(void);
+		bool process(void);
+		void destroy(void);
+};
+
+#endif /* __SNAPSHOT_H__ */
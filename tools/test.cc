@@ -6,6 +6,12 @@
 #include "tracer.h"
 #include "funcmap.h"
 #include "edit.h"
+#include "snapshot.h"
+#include "dump.h"
+#include "decode.h"
+#include "report.h"
+#include "diff.h"
+#include "export.h"
 #include "test.h"
 
 #include "BPatch.h"
@@ -40,6 +46,36 @@ static struct testcmd cmds[TEST_MODE_NUM] = {
 		.construct = EditTest::construct,
 		.usage = EditTest::staticUsage,
 	},
+	[TEST_MODE_SNAPSHOT] = {
+		.cmd = SNAPSHOT_CMD,
+		.construct = SnapshotTest::construct,
+		.usage = SnapshotTest::staticUsage,
+	},
+	[TEST_MODE_DUMP] = {
+		.cmd = DUMP_CMD,
+		.construct = DumpTest::construct,
+		.usage = DumpTest::staticUsage,
+	},
+	[TEST_MODE_DECODE] = {
+		.cmd = DECODE_CMD,
+		.construct = DecodeTest::construct,
+		.usage = DecodeTest::staticUsage,
+	},
+	[TEST_MODE_REPORT] = {
+		.cmd = REPORT_CMD,
+		.construct = ReportTest::construct,
+		.usage = ReportTest::staticUsage,
+	},
+	[TEST_MODE_DIFF] = {
+		.cmd = DIFF_CMD,
+		.construct = DiffTest::construct,
+		.usage = DiffTest::staticUsage,
+	},
+	[TEST_MODE_EXPORT] = {
+		.cmd = EXPORT_CMD,
+		.construct = ExportTest::construct,
+		.usage = ExportTest::staticUsage,
+	},
 	[TEST_MODE_HELP] = {
 		.cmd = "help",
 		.construct = NULL,
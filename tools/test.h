@@ -7,10 +7,20 @@ enum {
 	TEST_MODE_ATTACH = 0,
 	TEST_MODE_FUNCMAP,
 	TEST_MODE_EDIT,
+	TEST_MODE_SNAPSHOT,
+	TEST_MODE_DUMP,
+	TEST_MODE_DECODE,
+	TEST_MODE_REPORT,
+	TEST_MODE_DIFF,
+	TEST_MODE_EXPORT,
 	TEST_MODE_HELP,
 	TEST_MODE_NUM,
 };
 
+/* Output formats of the commands printing tables */
+#define FORMAT_TEXT "text"
+#define FORMAT_CSV "csv"
+
 class Test {
 
 	public:
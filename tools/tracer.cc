@@ -134,12 +134,16 @@ bool TracerTest::callInit(BPatch_object *lib)
 	BPatch_constExpr min_id(range.min);
 	BPatch_constExpr max_id(range.max);
 	BPatch_constExpr freq((unsigned)0);
+	BPatch_constExpr flags((unsigned)0);
+	BPatch_constExpr id_table("");
 
 	init_arg.push_back(&evlist);
 	init_arg.push_back(&logfile);
 	init_arg.push_back(&min_id);
 	init_arg.push_back(&max_id);
 	init_arg.push_back(&freq);
+	init_arg.push_back(&flags);
+	init_arg.push_back(&id_table);
 
 	BPatch_funcCallExpr init_expr(*init_func, init_arg);
 